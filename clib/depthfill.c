@@ -0,0 +1,290 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "depthfill.h"
+#include "workerpool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEPTHFILL_X86_SIMD
+#endif
+
+// Rows per task:
+#define DEPTHFILL_BAND 16
+
+// Enough levels to halve any image down to a single cell:
+#define DEPTHFILL_MAX_LEVELS 32
+
+// Levels above the full image (which is level 0), each half the size of
+// the one below. value is the average of the valid pixels a cell covers,
+// weight how sure it is, up to 1:
+struct depthfill_level {
+    int w, h;
+    float *value;
+    float *weight;
+};
+
+struct depthfill {
+    int w, h;
+    struct workerpool *pool;
+    uint8_t *valid;
+    // Holes per band of rows of the full image:
+    int *band_holes;
+    int levels;
+    struct depthfill_level level[DEPTHFILL_MAX_LEVELS];
+};
+
+struct depthfill_pass {
+    struct depthfill *f;
+    uint8_t *depth;
+    // Level the pass writes:
+    int level;
+};
+
+static inline int depthfill_clamp(int v, int max) {
+    if (v < 0) return 0;
+    if (v > max) return max;
+    return v;
+}
+
+struct depthfill *depthfill_create(int w, int h,
+        struct workerpool *pool) {
+    struct depthfill *f = malloc(sizeof(*f));
+    if (!f)
+        return NULL;
+    memset(f, 0, sizeof(*f));
+    f->w = w;
+    f->h = h;
+    f->pool = pool;
+    f->valid = malloc((size_t)w * h);
+    f->band_holes = malloc(sizeof(int) *
+        ((h + DEPTHFILL_BAND - 1) / DEPTHFILL_BAND + 1));
+    int failed = (!f->valid || !f->band_holes);
+    int level_w = w, level_h = h;
+    f->levels = 1;
+    while ((level_w > 1 || level_h > 1) && f->levels < DEPTHFILL_MAX_LEVELS) {
+        level_w = (level_w + 1) / 2;
+        level_h = (level_h + 1) / 2;
+        struct depthfill_level *l = &f->level[f->levels++];
+        l->w = level_w;
+        l->h = level_h;
+        l->value = malloc(sizeof(float) * level_w * level_h);
+        l->weight = malloc(sizeof(float) * level_w * level_h);
+        if (!l->value || !l->weight) failed = 1;
+    }
+    if (failed) {
+        depthfill_destroy(f);
+        return NULL;
+    }
+    return f;
+}
+
+void depthfill_destroy(struct depthfill *f) {
+    if (!f)
+        return;
+    for (int i = 1; i < f->levels; i++) {
+        free(f->level[i].value);
+        free(f->level[i].weight);
+    }
+    free(f->valid);
+    free(f->band_holes);
+    free(f);
+}
+
+const uint8_t *depthfill_getValid(const struct depthfill *f) {
+    return f->valid;
+}
+
+static void depthfill_validRows(int task, void *userdata) {
+    const struct depthfill_pass *pass = userdata;
+    struct depthfill *f = pass->f;
+    int y0 = task * DEPTHFILL_BAND;
+    int y1 = y0 + DEPTHFILL_BAND;
+    if (y1 > f->h) y1 = f->h;
+    size_t start = (size_t)y0 * f->w;
+    size_t end = (size_t)y1 * f->w;
+    int holes = 0;
+    size_t i = start;
+#ifdef DEPTHFILL_X86_SIMD
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi8((char)255);
+    const __m128i one = _mm_set1_epi8(1);
+    for (; i + 16 <= end; i += 16) {
+        __m128i depth = _mm_loadu_si128((const __m128i *)(pass->depth + i));
+        __m128i hole = _mm_or_si128(_mm_cmpeq_epi8(depth, zero),
+            _mm_cmpeq_epi8(depth, full));
+        _mm_storeu_si128((__m128i *)(f->valid + i),
+            _mm_andnot_si128(hole, one));
+        holes += __builtin_popcount(_mm_movemask_epi8(hole));
+    }
+#endif
+    for (; i < end; i++) {
+        uint8_t valid = (pass->depth[i] != 0 && pass->depth[i] != 255);
+        f->valid[i] = valid;
+        holes += !valid;
+    }
+    f->band_holes[task] = holes;
+}
+
+static void depthfill_pushImageRows(int task, void *userdata) {
+    // Average the valid pixels of the full image, 2 x 2 per cell. Past
+    // the last row or column, the pixels before count once more, as
+    // holes if they were:
+    const struct depthfill_pass *pass = userdata;
+    const struct depthfill *f = pass->f;
+    const struct depthfill_level *l = &f->level[1];
+    static const float inverse[5] = { 0, 1.0f, 0.5f, 1.0f / 3, 0.25f };
+    int y0 = task * DEPTHFILL_BAND;
+    int y1 = y0 + DEPTHFILL_BAND;
+    if (y1 > l->h) y1 = l->h;
+    for (int y = y0; y < y1; y++) {
+        size_t row0 = (size_t)(2 * y) * f->w;
+        size_t row1 = (2 * y + 1 < f->h ? row0 + f->w : row0);
+        const uint8_t *depth0 = pass->depth + row0;
+        const uint8_t *depth1 = pass->depth + row1;
+        const uint8_t *valid0 = f->valid + row0;
+        const uint8_t *valid1 = f->valid + row1;
+        float *value = l->value + (size_t)y * l->w;
+        float *weight = l->weight + (size_t)y * l->w;
+        for (int x = 0; x < l->w; x++) {
+            int i0 = 2 * x;
+            int i1 = (i0 + 1 < f->w ? i0 + 1 : i0);
+            int sum = depth0[i0] * valid0[i0] + depth0[i1] * valid0[i1] +
+                depth1[i0] * valid1[i0] + depth1[i1] * valid1[i1];
+            int count = valid0[i0] + valid0[i1] + valid1[i0] + valid1[i1];
+            value[x] = sum * inverse[count];
+            weight[x] = (count > 0 ? 1 : 0);
+        }
+    }
+}
+
+static void depthfill_pushRows(int task, void *userdata) {
+    // Average the valid pixels of the level below, 2 x 2 per cell:
+    const struct depthfill_pass *pass = userdata;
+    const struct depthfill *f = pass->f;
+    const struct depthfill_level *l = &f->level[pass->level];
+    const struct depthfill_level *below = &f->level[pass->level - 1];
+    int y0 = task * DEPTHFILL_BAND;
+    int y1 = y0 + DEPTHFILL_BAND;
+    if (y1 > l->h) y1 = l->h;
+    for (int y = y0; y < y1; y++) {
+        for (int x = 0; x < l->w; x++) {
+            float sum = 0;
+            float weight = 0;
+            for (int j = 2 * y; j < 2 * y + 2 && j < below->h; j++) {
+                for (int i = 2 * x; i < 2 * x + 2 && i < below->w; i++) {
+                    size_t index = i + (size_t)j * below->w;
+                    sum += below->value[index] * below->weight[index];
+                    weight += below->weight[index];
+                }
+            }
+            size_t index = x + (size_t)y * l->w;
+            l->value[index] = (weight > 0 ? sum / weight : 0);
+            l->weight[index] = (weight < 1 ? weight : 1);
+        }
+    }
+}
+
+static inline float depthfill_sample(const struct depthfill_level *l,
+        int x, int y) {
+    // Bilinear from the level above at the center of pixel x, y of the
+    // level below, which sits a quarter cell off the nearest centers:
+    int x0 = (x & 1 ? (x - 1) / 2 : x / 2 - 1);
+    int y0 = (y & 1 ? (y - 1) / 2 : y / 2 - 1);
+    float tx = (x & 1 ? 0.25f : 0.75f);
+    float ty = (y & 1 ? 0.25f : 0.75f);
+    int x1 = depthfill_clamp(x0 + 1, l->w - 1);
+    int y1 = depthfill_clamp(y0 + 1, l->h - 1);
+    x0 = depthfill_clamp(x0, l->w - 1);
+    y0 = depthfill_clamp(y0, l->h - 1);
+    const float *row0 = l->value + (size_t)y0 * l->w;
+    const float *row1 = l->value + (size_t)y1 * l->w;
+    float top = row0[x0] + (row0[x1] - row0[x0]) * tx;
+    float bottom = row1[x0] + (row1[x1] - row1[x0]) * tx;
+    return top + (bottom - top) * ty;
+}
+
+static void depthfill_pullRows(int task, void *userdata) {
+    // Fill in from the level above where this one isn't sure:
+    const struct depthfill_pass *pass = userdata;
+    const struct depthfill *f = pass->f;
+    const struct depthfill_level *above = &f->level[pass->level + 1];
+    int y0 = task * DEPTHFILL_BAND;
+    if (pass->level == 0) {
+        int y1 = y0 + DEPTHFILL_BAND;
+        if (y1 > f->h) y1 = f->h;
+        if (f->band_holes[task] == 0)
+            return;
+        for (int y = y0; y < y1; y++) {
+            size_t row = (size_t)y * f->w;
+            for (int x = 0; x < f->w; x++) {
+                // Skip over runs of valid pixels quickly:
+                uint64_t run;
+                if (x + 8 <= f->w) {
+                    memcpy(&run, f->valid + row + x, 8);
+                    if (run == 0x0101010101010101ULL) {
+                        x += 7;
+                        continue;
+                    }
+                }
+                if (f->valid[row + x])
+                    continue;
+                int value = (int)(depthfill_sample(above, x, y) + 0.5f);
+                pass->depth[row + x] = depthfill_clamp(value, 255);
+            }
+        }
+        return;
+    }
+    const struct depthfill_level *l = &f->level[pass->level];
+    int y1 = y0 + DEPTHFILL_BAND;
+    if (y1 > l->h) y1 = l->h;
+    for (int y = y0; y < y1; y++) {
+        for (int x = 0; x < l->w; x++) {
+            size_t index = x + (size_t)y * l->w;
+            float weight = l->weight[index];
+            if (weight >= 1)
+                continue;
+            l->value[index] = l->value[index] * weight +
+                depthfill_sample(above, x, y) * (1 - weight);
+            l->weight[index] = 1;
+        }
+    }
+}
+
+static void depthfill_runPass(struct depthfill *f,
+        struct depthfill_pass *pass, int rows,
+        void (*func)(int task, void *userdata)) {
+    int tasks = (rows + DEPTHFILL_BAND - 1) / DEPTHFILL_BAND;
+    workerpool_run(f->pool, tasks, func, pass);
+}
+
+int depthfill_run(struct depthfill *f, uint8_t *depth) {
+    struct depthfill_pass pass;
+    pass.f = f;
+    pass.depth = depth;
+    pass.level = 0;
+    depthfill_runPass(f, &pass, f->h, depthfill_validRows);
+    int holes = 0;
+    int bands = (f->h + DEPTHFILL_BAND - 1) / DEPTHFILL_BAND;
+    for (int i = 0; i < bands; i++)
+        holes += f->band_holes[i];
+    if (holes == 0 || f->levels < 2)
+        return holes;
+
+    pass.level = 1;
+    depthfill_runPass(f, &pass, f->level[1].h, depthfill_pushImageRows);
+    for (int i = 2; i < f->levels; i++) {
+        pass.level = i;
+        depthfill_runPass(f, &pass, f->level[i].h, depthfill_pushRows);
+    }
+    const struct depthfill_level *top = &f->level[f->levels - 1];
+    if (top->weight[0] <= 0)
+        return holes;  // nothing valid to fill from
+    for (int i = f->levels - 2; i >= 0; i--) {
+        pass.level = i;
+        depthfill_runPass(f, &pass, (i == 0 ? f->h : f->level[i].h),
+            depthfill_pullRows);
+    }
+    return holes;
+}
@@ -0,0 +1,32 @@
+
+#ifndef _SANDBOX_DEPTHFILL_H_
+#define _SANDBOX_DEPTHFILL_H_
+
+#include <stdint.h>
+
+// Fills the holes of a depth image. The sensors give no depth in shadows
+// and along edges, which arrives as 0 or 255 (0 or 2047 before scaling
+// down) and would become pits and peaks in the ground. Holes are filled
+// by push-pull: the valid pixels are averaged down an image pyramid
+// until every cell has some, then the holes take the value of the level
+// above, interpolated. Small holes get the average of their rim, large
+// ones a smooth blend across. Valid pixels are left as they are.
+
+struct depthfill;
+struct workerpool;
+
+// Fills images of w * h depth values on the given pool, which it doesn't
+// own (NULL fills on the calling thread). Returns NULL if out of memory:
+struct depthfill *depthfill_create(int w, int h, struct workerpool *pool);
+void depthfill_destroy(struct depthfill *f);
+
+// Fill the holes of a frame (w * h values, row by row) in place, and
+// return how many pixels were holes. If no pixel is valid, the frame
+// stays as it is. Spread over threads by rows:
+int depthfill_run(struct depthfill *f, uint8_t *depth);
+
+// Which pixels of the last frame were valid (1) or filled (0), w * h
+// values:
+const uint8_t *depthfill_getValid(const struct depthfill *f);
+
+#endif  // _SANDBOX_DEPTHFILL_H_
@@ -0,0 +1,349 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "depthfilter.h"
+#include "workerpool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEPTHFILTER_X86_SIMD
+#endif
+
+// Rows per task:
+#define DEPTHFILTER_BAND 16
+
+struct depthfilter {
+    int w, h;
+    struct workerpool *pool;
+    int median_frames;
+    float keep;  // smoothing
+    float hysteresis;
+    int radius;
+    // Last frames as they came in, the latest at history_next - 1:
+    uint8_t *history[DEPTHFILTER_MAX_FRAMES];
+    int history_next;
+    int history_count;
+    uint8_t *median;
+    float *average;
+    uint8_t *shown;
+    // Sums of shown along x for the blur:
+    uint16_t *blur_x;
+};
+
+struct depthfilter_pass {
+    struct depthfilter *f;
+    uint8_t *depth;
+    const uint8_t *valid;
+    // Frames in history to take the median over, 1 for none:
+    int frames;
+    // Set on the first frame after a reset, which starts the average:
+    int first;
+};
+
+static inline int depthfilter_clamp(int v, int max) {
+    if (v < 0) return 0;
+    if (v > max) return max;
+    return v;
+}
+
+struct depthfilter *depthfilter_create(int w, int h,
+        struct workerpool *pool) {
+    struct depthfilter *f = malloc(sizeof(*f));
+    if (!f)
+        return NULL;
+    memset(f, 0, sizeof(*f));
+    size_t cells = (size_t)w * h;
+    f->w = w;
+    f->h = h;
+    f->median_frames = 1;
+    f->pool = pool;
+    int failed = 0;
+    for (int i = 0; i < DEPTHFILTER_MAX_FRAMES; i++) {
+        f->history[i] = malloc(cells);
+        if (!f->history[i]) failed = 1;
+    }
+    f->median = malloc(cells);
+    f->average = malloc(sizeof(float) * cells);
+    f->shown = malloc(cells);
+    f->blur_x = malloc(sizeof(uint16_t) * cells);
+    if (failed || !f->median || !f->average || !f->shown || !f->blur_x) {
+        depthfilter_destroy(f);
+        return NULL;
+    }
+    return f;
+}
+
+void depthfilter_destroy(struct depthfilter *f) {
+    if (!f)
+        return;
+    for (int i = 0; i < DEPTHFILTER_MAX_FRAMES; i++)
+        free(f->history[i]);
+    free(f->median);
+    free(f->average);
+    free(f->shown);
+    free(f->blur_x);
+    free(f);
+}
+
+void depthfilter_setMedianFrames(struct depthfilter *f, int frames) {
+    if (frames >= 5) frames = 5;
+    else if (frames >= 3) frames = 3;
+    else frames = 1;
+    f->median_frames = frames;
+}
+
+void depthfilter_setSmoothing(struct depthfilter *f, double smoothing,
+        double hysteresis) {
+    if (smoothing < 0) smoothing = 0;
+    if (smoothing > 0.99) smoothing = 0.99;
+    if (hysteresis < 0) hysteresis = 0;
+    f->keep = smoothing;
+    f->hysteresis = hysteresis;
+}
+
+void depthfilter_setBlurRadius(struct depthfilter *f, int radius) {
+    f->radius = depthfilter_clamp(radius, DEPTHFILTER_MAX_RADIUS);
+}
+
+void depthfilter_reset(struct depthfilter *f) {
+    f->history_count = 0;
+}
+
+static void depthfilter_medianRows(const struct depthfilter *f,
+        const struct depthfilter_pass *pass, int y0, int y1) {
+    // The latest frame was already put into history. Median of three
+    // is the highest of the lower two; for five, the lowest and highest
+    // of four can't be it, which leaves three:
+    size_t start = (size_t)y0 * f->w;
+    size_t end = (size_t)y1 * f->w;
+    const uint8_t *frames[DEPTHFILTER_MAX_FRAMES];
+    for (int k = 0; k < pass->frames; k++) {
+        int slot = (f->history_next - 1 - k + 2 * DEPTHFILTER_MAX_FRAMES) %
+            DEPTHFILTER_MAX_FRAMES;
+        frames[k] = f->history[slot];
+    }
+    if (pass->frames == 1) {
+        memcpy(f->median + start, frames[0] + start, end - start);
+        return;
+    }
+    size_t i = start;
+#ifdef DEPTHFILTER_X86_SIMD
+    for (; i + 16 <= end; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(frames[0] + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(frames[1] + i));
+        __m128i c = _mm_loadu_si128((const __m128i *)(frames[2] + i));
+        if (pass->frames == 5) {
+            __m128i d = _mm_loadu_si128((const __m128i *)(frames[3] + i));
+            __m128i e = _mm_loadu_si128((const __m128i *)(frames[4] + i));
+            __m128i low = _mm_max_epu8(_mm_min_epu8(a, b),
+                _mm_min_epu8(d, e));
+            __m128i high = _mm_min_epu8(_mm_max_epu8(a, b),
+                _mm_max_epu8(d, e));
+            a = low;
+            b = high;
+        }
+        __m128i m = _mm_max_epu8(_mm_min_epu8(a, b),
+            _mm_min_epu8(_mm_max_epu8(a, b), c));
+        _mm_storeu_si128((__m128i *)(f->median + i), m);
+    }
+#endif
+    for (; i < end; i++) {
+        int a = frames[0][i];
+        int b = frames[1][i];
+        int c = frames[2][i];
+        if (pass->frames == 5) {
+            int d = frames[3][i];
+            int e = frames[4][i];
+            int low_ab = (a < b ? a : b), low_de = (d < e ? d : e);
+            int high_ab = (a < b ? b : a), high_de = (d < e ? e : d);
+            a = (low_ab > low_de ? low_ab : low_de);
+            b = (high_ab < high_de ? high_ab : high_de);
+        }
+        int low = (a < b ? a : b);
+        int high = (a < b ? b : a);
+        int m = (high < c ? high : c);
+        f->median[i] = (low > m ? low : m);
+    }
+}
+
+static void depthfilter_averageRows(const struct depthfilter *f,
+        const struct depthfilter_pass *pass, int y0, int y1) {
+    size_t start = (size_t)y0 * f->w;
+    size_t end = (size_t)y1 * f->w;
+    if (pass->first) {
+        for (size_t i = start; i < end; i++) {
+            f->average[i] = f->median[i];
+            f->shown[i] = f->median[i];
+        }
+        return;
+    }
+    const float follow = 1.0f - f->keep;
+    size_t i = start;
+#ifdef DEPTHFILTER_X86_SIMD
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 vfollow = _mm_set1_ps(follow);
+    const __m128 vhysteresis = _mm_set1_ps(f->hysteresis);
+    const __m128 half = _mm_set1_ps(0.5f);
+    __m128i valid = _mm_set1_epi32(-1);
+    for (; i + 4 <= end; i += 4) {
+        int32_t median_bytes, shown_bytes;
+        memcpy(&median_bytes, f->median + i, 4);
+        memcpy(&shown_bytes, f->shown + i, 4);
+        if (pass->valid) {
+            int32_t valid_bytes;
+            memcpy(&valid_bytes, pass->valid + i, 4);
+            valid = _mm_cmpgt_epi32(_mm_unpacklo_epi16(_mm_unpacklo_epi8(
+                _mm_cvtsi32_si128(valid_bytes), zero), zero), zero);
+        }
+        __m128i median = _mm_unpacklo_epi16(_mm_unpacklo_epi8(
+            _mm_cvtsi32_si128(median_bytes), zero), zero);
+        __m128i shown = _mm_unpacklo_epi16(_mm_unpacklo_epi8(
+            _mm_cvtsi32_si128(shown_bytes), zero), zero);
+        __m128 former = _mm_loadu_ps(f->average + i);
+        __m128 average = _mm_add_ps(former, _mm_mul_ps(
+            _mm_sub_ps(_mm_cvtepi32_ps(median), former), vfollow));
+        average = _mm_or_ps(_mm_and_ps(_mm_castsi128_ps(valid), average),
+            _mm_andnot_ps(_mm_castsi128_ps(valid), former));
+        _mm_storeu_ps(f->average + i, average);
+        __m128 distance = _mm_andnot_ps(sign,
+            _mm_sub_ps(average, _mm_cvtepi32_ps(shown)));
+        __m128i moved = _mm_and_si128(valid, _mm_castps_si128(
+            _mm_cmpgt_ps(distance, vhysteresis)));
+        __m128i rounded = _mm_cvttps_epi32(_mm_add_ps(average, half));
+        shown = _mm_or_si128(_mm_and_si128(moved, rounded),
+            _mm_andnot_si128(moved, shown));
+        shown = _mm_packus_epi16(_mm_packs_epi32(shown, zero), zero);
+        shown_bytes = _mm_cvtsi128_si32(shown);
+        memcpy(f->shown + i, &shown_bytes, 4);
+    }
+#endif
+    for (; i < end; i++) {
+        if (pass->valid && !pass->valid[i])
+            continue;
+        float average = f->average[i];
+        average += (f->median[i] - average) * follow;
+        f->average[i] = average;
+        float distance = average - f->shown[i];
+        if (distance < 0) distance = -distance;
+        if (distance > f->hysteresis)
+            f->shown[i] = (int)(average + 0.5f);
+    }
+}
+
+static void depthfilter_temporalRows(int task, void *userdata) {
+    const struct depthfilter_pass *pass = userdata;
+    struct depthfilter *f = pass->f;
+    int y0 = task * DEPTHFILTER_BAND;
+    int y1 = y0 + DEPTHFILTER_BAND;
+    if (y1 > f->h) y1 = f->h;
+    depthfilter_medianRows(f, pass, y0, y1);
+    depthfilter_averageRows(f, pass, y0, y1);
+    if (f->radius == 0) {
+        memcpy(pass->depth + (size_t)y0 * f->w,
+            f->shown + (size_t)y0 * f->w, (size_t)(y1 - y0) * f->w);
+    }
+}
+
+static void depthfilter_blurRowsX(int task, void *userdata) {
+    const struct depthfilter_pass *pass = userdata;
+    struct depthfilter *f = pass->f;
+    const int r = f->radius;
+    int y0 = task * DEPTHFILTER_BAND;
+    int y1 = y0 + DEPTHFILTER_BAND;
+    if (y1 > f->h) y1 = f->h;
+    for (int y = y0; y < y1; y++) {
+        const uint8_t *row = f->shown + (size_t)y * f->w;
+        uint16_t *out = f->blur_x + (size_t)y * f->w;
+        int sum = 0;
+        for (int x = -r; x <= r; x++) {
+            sum += row[depthfilter_clamp(x, f->w - 1)];
+        }
+        // Only near the ends, values past them repeat the end value:
+        int x = 0;
+        for (; x < f->w && x < r; x++) {
+            out[x] = sum;
+            sum += row[depthfilter_clamp(x + r + 1, f->w - 1)] -
+                row[depthfilter_clamp(x - r, f->w - 1)];
+        }
+        for (; x + r + 1 <= f->w - 1; x++) {
+            out[x] = sum;
+            sum += row[x + r + 1] - row[x - r];
+        }
+        for (; x < f->w; x++) {
+            out[x] = sum;
+            sum += row[depthfilter_clamp(x + r + 1, f->w - 1)] -
+                row[depthfilter_clamp(x - r, f->w - 1)];
+        }
+    }
+}
+
+static void depthfilter_blurRowsY(int task, void *userdata) {
+    // Sums of up to 15 x 15 values of 255 still fit 16 bits, and get
+    // divided by multiplying with the inverse of the count:
+    const struct depthfilter_pass *pass = userdata;
+    const struct depthfilter *f = pass->f;
+    const int r = f->radius;
+    const int count = (2 * r + 1) * (2 * r + 1);
+    const uint32_t inverse = (65536 + count / 2) / count;
+    int y0 = task * DEPTHFILTER_BAND;
+    int y1 = y0 + DEPTHFILTER_BAND;
+    if (y1 > f->h) y1 = f->h;
+    for (int y = y0; y < y1; y++) {
+        // Rows past the border repeat the border row:
+        const uint16_t *rows[2 * DEPTHFILTER_MAX_RADIUS + 1];
+        for (int j = -r; j <= r; j++) {
+            rows[j + r] = f->blur_x +
+                (size_t)depthfilter_clamp(y + j, f->h - 1) * f->w;
+        }
+        uint8_t *out = pass->depth + (size_t)y * f->w;
+        int x = 0;
+#ifdef DEPTHFILTER_X86_SIMD
+        const __m128i vhalf = _mm_set1_epi16(count / 2);
+        const __m128i vinverse = _mm_set1_epi16((uint16_t)inverse);
+        for (; x + 8 <= f->w; x += 8) {
+            __m128i sum = vhalf;
+            for (int j = 0; j < 2 * r + 1; j++) {
+                sum = _mm_add_epi16(sum,
+                    _mm_loadu_si128((const __m128i *)(rows[j] + x)));
+            }
+            __m128i value = _mm_mulhi_epu16(sum, vinverse);
+            value = _mm_packus_epi16(value, value);
+            _mm_storel_epi64((__m128i *)(out + x), value);
+        }
+#endif
+        for (; x < f->w; x++) {
+            uint32_t sum = count / 2;
+            for (int j = 0; j < 2 * r + 1; j++) {
+                sum += rows[j][x];
+            }
+            uint32_t value = (sum * inverse) >> 16;
+            out[x] = (value > 255 ? 255 : value);
+        }
+    }
+}
+
+void depthfilter_run(struct depthfilter *f, uint8_t *depth,
+        const uint8_t *valid) {
+    struct depthfilter_pass pass;
+    pass.f = f;
+    pass.depth = depth;
+    pass.valid = valid;
+    pass.first = (f->history_count == 0);
+    memcpy(f->history[f->history_next], depth, (size_t)f->w * f->h);
+    f->history_next = (f->history_next + 1) % DEPTHFILTER_MAX_FRAMES;
+    if (f->history_count < DEPTHFILTER_MAX_FRAMES)
+        f->history_count++;
+    // Until enough frames came in, the median is over fewer of them:
+    pass.frames = f->median_frames;
+    while (pass.frames > f->history_count)
+        pass.frames -= 2;
+
+    int tasks = (f->h + DEPTHFILTER_BAND - 1) / DEPTHFILTER_BAND;
+    workerpool_run(f->pool, tasks, depthfilter_temporalRows, &pass);
+    if (f->radius > 0) {
+        workerpool_run(f->pool, tasks, depthfilter_blurRowsX, &pass);
+        workerpool_run(f->pool, tasks, depthfilter_blurRowsY, &pass);
+    }
+}
@@ -0,0 +1,46 @@
+
+#ifndef _SANDBOX_DEPTHFILTER_H_
+#define _SANDBOX_DEPTHFILTER_H_
+
+#include <stdint.h>
+
+// Calms down the depth image before the topology is drawn from it. Each
+// pixel goes through the median of the last few frames, which drops
+// single frame spikes, and a moving average. What is passed on only
+// follows the average once it moved more than a few depth steps away
+// (hysteresis), so sensor noise stops making the ground flicker and
+// the maps derived from it change only where the sand did. Last comes
+// an optional box blur. All of it is off unless configured, and the
+// more of it is on, the later changes of the sand show up.
+
+// Most frames the median can be taken over, and largest blur radius:
+#define DEPTHFILTER_MAX_FRAMES 5
+#define DEPTHFILTER_MAX_RADIUS 7
+
+struct depthfilter;
+struct workerpool;
+
+// Filters images of w * h depth values on the given pool, which it doesn't
+// own (NULL filters on the calling thread). Returns NULL if out of memory:
+struct depthfilter *depthfilter_create(int w, int h,
+    struct workerpool *pool);
+void depthfilter_destroy(struct depthfilter *f);
+
+// Median over 1 (off), 3 or 5 frames, delaying changes by half of that:
+void depthfilter_setMedianFrames(struct depthfilter *f, int frames);
+// smoothing is the share of the average kept each frame, from 0 (off) to
+// below 1. hysteresis is in depth steps, 0 passes on every change:
+void depthfilter_setSmoothing(struct depthfilter *f, double smoothing,
+    double hysteresis);
+// Pixels to each side averaged over, 0 (off) to DEPTHFILTER_MAX_RADIUS:
+void depthfilter_setBlurRadius(struct depthfilter *f, int radius);
+
+// Filter the next frame (w * h values, row by row) in place. Pixels not
+// marked in valid (if not NULL) keep what was shown of them before
+// instead of going into the average. Spread over threads by rows:
+void depthfilter_run(struct depthfilter *f, uint8_t *depth,
+    const uint8_t *valid);
+// Forget all former frames, the averages start over with the next one:
+void depthfilter_reset(struct depthfilter *f);
+
+#endif  // _SANDBOX_DEPTHFILTER_H_
@@ -3,186 +3,298 @@
 #include <pthread.h>
 
 #include "fluid.h"
+#include "fluidemitter.h"
+#include "fluidpipes.h"
+#include "fluidsettle.h"
+#include "fluidstencil.h"
+#include "fluidtexture.h"
 #include "images.h"
 #include "random.h"
+#include "simclock.h"
 #include "simulation.h"
+#include "sparsegrid.h"
 #include "topology.h"
+#include "workerpool.h"
 
+// Size of the simulated world in pixels, the screen shows a part of it
+// (see simulation_getViewport()):
+static int fluid_world_x = 0;
+static int fluid_world_y = 0;
 static int fluid_map_x = 0;
 static int fluid_map_y = 0;
-double *fluid_map[FLUID_COUNT] = { 0 };
+// All fluids of a map row are stored next to each other, as FLUID_COUNT
+// rows of fluid_map_x amounts (see fluid_cell()). That way one pass over
+// the map handles every fluid, instead of one pass per fluid:
+fluid_amount *fluid_map = NULL;
+fluid_amount *fluid_map_back = NULL;
+static fluid_amount *fluid_terrain = NULL;
+
+// State of the shallow-water (pipes) engine, in the same layout:
+static fluid_amount *fluid_flux = NULL;
+fluid_amount *fluid_velocity_x = NULL;
+fluid_amount *fluid_velocity_y = NULL;
+static double fluid_max_speed = 0;
+static double *fluid_tile_max_speed = NULL;
+// Set for tiles the pipes engine wrote its state to. Only those need it
+// cleared, so the planes of all other tiles stay without memory:
+static unsigned char *fluid_tile_piped = NULL;
+
+// Per fluid: how sluggish it flows, from 0 (like water) to 1 (not at all),
+// and the colour it is tinted with. The tint share goes from 0 (just the
+// water texture) to 256 (just the tint colour):
+static double fluid_viscosity[FLUID_COUNT] = { 0.0, 0.9, 0.6 };
+static uint8_t fluid_tint[FLUID_COUNT][3] = {
+    { 0, 0, 0 }, { 255, 80, 0 }, { 105, 75, 40 }
+};
+static int fluid_tint_share[FLUID_COUNT] = { 0, 200, 220 };
+
+static int fluid_engine = FLUID_ENGINE_LEGACY;
+
+// How fast the stencil engine levels out a single fluid. Scaled down per
+// step while several fluids are around (see fluid_updateAllStencil()):
+#define FLUID_STENCIL_RATE 0.8
+static double fluid_stencil_rate = FLUID_STENCIL_RATE;
+
+// Fluid cells per tile edge:
+#define FLUID_TILE_SIZE 32
+static int fluid_tiles_x = 0;
+static int fluid_tiles_y = 0;
+// The shared pool, unless a thread count was set (see
+// fluid_setThreadCount()), in which case fluid_own_pool is used:
+static struct workerpool *fluid_pool = NULL;
+static struct workerpool *fluid_own_pool = NULL;
+static int fluid_thread_count = 0;
+
+// Ground the current update runs on, taken once per fluid_updateAll():
+static const struct topology_snapshot *fluid_ground = NULL;
+
+// Tiles without any noteworthy amount of fluid are inactive. They contain
+// only zeros (in both the front and back buffer) and are skipped entirely:
+#define FLUID_TILE_MIN_AMOUNT 0.001
+static unsigned char *fluid_tile_active = NULL;
+static fluid_amount *fluid_tile_max = NULL;
+
+// Per tile and fluid: total amount, and cells holding at least
+// FLUID_WET_AMOUNT. Recomputed for every visited tile after each step and
+// kept up to date in between by spawning and draining:
+#define FLUID_WET_AMOUNT 1.0
+static double *fluid_tile_volume[FLUID_COUNT] = { 0 };
+static int *fluid_tile_wet[FLUID_COUNT] = { 0 };
+static int *fluid_tile_list = NULL;
+static int fluid_tile_list_count = 0;
+// Bit k is set if fluid k is in the tile or next to it, the other fluids
+// are skipped when updating the tile:
+static unsigned char *fluid_tile_present = NULL;
+// Ground heights are sampled once per update, for the visited tiles only:
+static unsigned int *fluid_tile_terrain_stamp = NULL;
+static unsigned int fluid_terrain_stamp = 1;
+
+// Level of detail of the stencil engine: a tile whose fluid barely
+// changed during a full step, and whose neighbours' didn't either, falls
+// asleep. Asleep tiles are only stepped every FLUID_LOD_INTERVAL updates
+// and hold still in between, with walls towards their awake neighbours:
+#define FLUID_LOD_INTERVAL 8
+#define FLUID_LOD_SETTLED_CHANGE 0.01
+static int fluid_lod_enabled = 0;
+static unsigned int fluid_lod_step = 0;
+static unsigned char *fluid_tile_settled = NULL;
+static unsigned char *fluid_tile_asleep = NULL;
+
+// Settling moves the fluid straight to where it comes to rest (see
+// fluidsettle.h), when requested and every fluid_settle_interval
+// nanoseconds. The basins are kept until the ground changes:
+static struct fluidsettle *fluid_settler = NULL;
+static int fluid_settle_requested = 0;
+static int64_t fluid_settle_interval = 0;
+static int64_t fluid_settle_last = 0;
+
+// Sources and sinks, applied at the start of every update:
+static double fluid_emitter_seconds = 0;
+static int fluid_default_emitter = -1;
 
 pthread_mutex_t *fluid_access = NULL;
 pthread_t *fluid_thread = NULL;
 
-double reduce_factor = 5;
+double reduce_factor = FLUID_DEFAULT_REDUCE_FACTOR;
 
 static int water_scroll_offset_x = 0;
 static int water_scroll_offset_y = 0;
-static unsigned char *raw_water_image_data = NULL;
-void fluid_waterColorAt(int x, int y,
-        int *r, int *g, int *b) {
-    double scale_w = 0.5;
-    double scale_h = 0.5;
-
-    if (raw_water_image_data == NULL) {
-        raw_water_image_data = malloc(
-            3 * water->w * water->h);
-        if (!raw_water_image_data) {
-            *r = 0;
-            *g = 0;
-            *b = 0;
-            return;
-        }
-        SDL_LockSurface(water);
-        memcpy(raw_water_image_data, water->pixels,
-            3 * water->w * water->h);
-        SDL_UnlockSurface(water);
-    }
+static struct fluidtexture *fluid_water_texture = NULL;
 
-    int sampleX = ((int)((double)x * scale_w));
-    if (sampleX < 0) {
-        sampleX = water->w - ((-sampleX) % water->w);
-    } else {
-        sampleX = sampleX % water->w;
+// Drawing works on one alpha value per fluid cell, which is upsampled to
+// screen pixels. The alpha values are derived from the blurred fluid
+// amount through a lookup table:
+#define FLUID_ALPHA_LUT_SIZE 256
+#define FLUID_ALPHA_MAX_AMOUNT 2.0
+static float fluid_alpha_lut[FLUID_ALPHA_LUT_SIZE];
+
+// Everything fluid_drawAll() needs of a finished simulation step. Frames
+// are filled by the simulation thread and handed over to drawing without
+// any lock (see fluid_publishFrame()), so neither waits for the other:
+struct fluid_frame {
+    int map_x, map_y;
+    int tiles_x, tiles_y;
+    double reduce_factor;
+    int scroll_x, scroll_y;
+    // Simulation time it was published at (see simclock_now()):
+    int64_t time;
+    uint8_t tint[FLUID_COUNT][3];
+    int tint_share[FLUID_COUNT];
+    // Tiles to draw, with the fluids present in and around each of them:
+    int tile_count;
+    int *tiles;
+    unsigned char *present;
+    // Alpha values in the same layout as fluid_map. alpha_set marks the
+    // tiles holding any, so they can be cleared once they aren't drawn:
+    float *alpha;
+    unsigned char *alpha_set;
+};
+
+// Quadruple buffering: the simulation fills the back frame, then swaps
+// it with the shared one. Whenever FLUID_FRAME_FRESH says the shared frame
+// wasn't picked up yet, drawing takes it as its front frame, keeps the old
+// front one as the previous frame and hands back the one before:
+#define FLUID_FRAME_FRESH 4
+static struct fluid_frame fluid_frames[4];
+static int fluid_frame_back = 0;
+static int fluid_frame_shared = 1;
+static int fluid_frame_front = 2;
+static int fluid_frame_previous = 3;
+
+// The fluid only steps a few times per second. Drawing fades from the
+// previous to the front frame over one step, so the display runs smoothly
+// at any frame rate, one step behind the simulation:
+static int fluid_interpolate = 1;
+
+// Requests from other threads, carried out by the simulation thread:
+static int fluid_reset_requested = 0;
+static int fluid_spawns_requested = 0;
+
+// Per screen column: left fluid cell and weight of the right one:
+static int *fluid_draw_cell_x = NULL;
+static float *fluid_draw_weight_x = NULL;
+static int fluid_draw_xsize = 0;
+static int fluid_draw_view_x = 0;
+static int fluid_draw_view_y = 0;
+static int fluid_draw_map_x = 0;
+static double fluid_draw_reduce_factor = 0;
+static uint8_t *fluid_row_colors = NULL;
+static uint8_t *fluid_row_tinted = NULL;
+static float *fluid_row_alpha = NULL;
+static float *fluid_column_alpha = NULL;
+// Per tile: the fluids to draw in it, from both frames faded between:
+static unsigned char *fluid_draw_present = NULL;
+static int fluid_draw_map_y = 0;
+
+// Jitter for drawing, each frame starts at a random spot in the table:
+#define FLUID_JITTER_TABLE_SIZE 65536
+static struct random_jittertable *fluid_jitter = NULL;
+static unsigned int fluid_jitter_index = 0;
+
+static int fluid_loadWaterTexture() {
+    if (fluid_water_texture)
+        return 1;
+    if (!water)
+        return 0;
+    SDL_LockSurface(water);
+    fluid_water_texture = fluidtexture_create(water->pixels,
+        water->w, water->h, 0.5);
+    SDL_UnlockSurface(water);
+    if (!fluid_water_texture) {
+        fprintf(stderr, "clib/fluid.c: error: "
+            "failed to create water texture\n");
+        return 0;
     }
-    assert(sampleX >= 0 && sampleX <= water->w);
-    int sampleY = ((int)((double)y * scale_h)); 
-    if (sampleY < 0) { 
-        sampleY = water->h - ((-sampleY) % water->h);
-    } else {
-        sampleY = sampleY % water->h;
+    return 1;
+}
+
+void fluid_waterColorAt(int x, int y,
+        int *r, int *g, int *b) {
+    if (!fluid_loadWaterTexture()) {
+        *r = 0;
+        *g = 0;
+        *b = 0;
+        return;
     }
-    assert(sampleY >= 0 && sampleY <= water->h);
-    int baseindex = (sampleX + sampleY * water->h) * 3;
-    
-    *r = (int)raw_water_image_data[baseindex + 0];
-    *g = (int)raw_water_image_data[baseindex + 1];
-    *b = (int)raw_water_image_data[baseindex + 2];
+    fluidtexture_sample(fluid_water_texture, x, y,
+        water_scroll_offset_x, water_scroll_offset_y, r, g, b);
 }
 
-double fluid_getCoverage(int type) {
-    int detail_steps = 20;
-    double coverage_raw = 0.0;
-    double coverage_max = (detail_steps * detail_steps);
-    double step_x_width = (fluid_map_x / detail_steps);
-    double step_y_width = (fluid_map_y / detail_steps);
-    int x_step = 0;
-    while (x_step < detail_steps) {
-        int y_step = 0;
-        while (y_step < detail_steps) {
-            int x = step_x_width * x_step;
-            if (x >= fluid_map_x)
-                x = fluid_map_x - 1;
-            int y = step_y_width * y_step;
-            if (y >= fluid_map_y)
-                y = fluid_map_y - 1;
+static inline int fluid_cell(int type, int x, int y) {
+    return (y * FLUID_COUNT + type) * fluid_map_x + x;
+}
 
-            double fluid_amount = fluid_map[type][x + y * fluid_map_x];
-            if (fluid_amount > 2.0)
-                fluid_amount = 2.0;
-            coverage_raw += fluid_amount / 2.0;
+static int fluid_tileAt(int x, int y) {
+    return (x / FLUID_TILE_SIZE) + (y / FLUID_TILE_SIZE) * fluid_tiles_x;
+}
 
-            y_step++;
-        }
-        x_step++;
-    }
+static void fluid_markActive(int x, int y) {
+    // Legacy tasks of the same phase may push into the same tile:
+    __atomic_store_n(&fluid_tile_active[fluid_tileAt(x, y)], 1,
+        __ATOMIC_RELAXED);
+}
 
-    return (coverage_raw / coverage_max);
+static void fluid_setAmount(int type, int x, int y, fluid_amount amount) {
+    // Change a cell and keep the tile totals up to date:
+    int tile = fluid_tileAt(x, y);
+    fluid_tile_asleep[tile] = 0;
+    fluid_amount *cell = &fluid_map[fluid_cell(type, x, y)];
+    fluid_tile_volume[type][tile] += amount - *cell;
+    fluid_tile_wet[type][tile] += (amount >= FLUID_WET_AMOUNT) -
+        (*cell >= FLUID_WET_AMOUNT);
+    if (amount > fluid_tile_max[tile])
+        fluid_tile_max[tile] = amount;
+    *cell = amount;
 }
 
 void _fluid_spawn(int type, int x, int y, double amount) {
-    if (x < 0 || x >= fluid_map_x || y < 0 || y > fluid_map_y) return;
+    if (x < 0 || x >= fluid_map_x || y < 0 || y >= fluid_map_y) return;
     assert(type >= 0 && type < FLUID_COUNT);
-    fluid_map[type][x + y * fluid_map_x] += amount;
+    fluid_setAmount(type, x, y, fluid_map[fluid_cell(type, x, y)] + amount);
+    fluid_markActive(x, y);
 }
 
 void fluid_spawn(int type, int x, int y, double amount) {
-    int mapX = (double)(((double)x / (double)images_simulation_image->w) * (double)fluid_map_x);
-    int mapY = (double)(((double)y / (double)images_simulation_image->h) * (double)fluid_map_y);
+    // From screen pixels to the world behind them:
+    if (fluid_world_x <= 0 || fluid_world_y <= 0)
+        return;
+    int view_x, view_y;
+    simulation_getViewport(&view_x, &view_y);
+    int mapX = (double)(((double)(x + view_x) / (double)fluid_world_x) * (double)fluid_map_x);
+    int mapY = (double)(((double)(y + view_y) / (double)fluid_world_y) * (double)fluid_map_y);
     _fluid_spawn(type, mapX, mapY, amount);
 }
 
-double fluid_check(int type, int x, int y) {
-    if (x < 0 || x >= fluid_map_x || y < 0 || y >= fluid_map_y) {
-        return 0.0;
-    }
-    if (fluid_map[type][x + y * fluid_map_x] < 5.0) {
-        return fluid_map[type][x + y * fluid_map_x] / 5.0;
-    }
-    return 5.0;
-}
-
-double fluid_checkWorld(int type, int x, int y) {
-    int x2 = (int)((double)x / reduce_factor);
-    int y2 = (int)((double)y / reduce_factor);
-    return fluid_check(type, x2, y2);
-}
-
-void fluid_drawIfThere(int type, int worldX, int worldY,
-        int xsize) {
-    int x = worldX;
-    int y = worldY;
-    int drawx = x;
-    int drawy = y;
-    int jitterx = (int)(rand0to1() * 4) - 2;
-    int jittery = (int)(rand0to1() * 4) - 2;
-    x += jitterx;
-    y += jittery;
-    double alpha = fluid_checkWorld(type, x, y) +
-        fluid_checkWorld(type, x - 1, y - 1) * 0.5 +
-        fluid_checkWorld(type, x - 1, y) * 0.5 +
-        fluid_checkWorld(type, x - 1, y + 1) * 0.5 +
-        fluid_checkWorld(type, x + 1, y) * 0.5 +
-        fluid_checkWorld(type, x + 1, y) * 0.5 +
-        fluid_checkWorld(type, x + 1, y + 1) * 0.5;
-    alpha = alpha * alpha;
-    if (alpha > 0.7) alpha = 0.7;
-    if (type == FLUID_WATER || 1) {
-        int r, g, b;
-        int r2, g2, b2;
-        fluid_waterColorAt(drawx + water_scroll_offset_x,
-            drawy + water_scroll_offset_y, &r, &g, &b);
-        fluid_waterColorAt(-drawx + water_scroll_offset_x,
-            drawy + water_scroll_offset_y, &r2, &g2, &b2);
-        r = (int)((double)r + r + r2) / 3.0;
-        g = (int)((double)g + g + g2) / 3.0;
-        b = (int)((double)b + b + b2) / 3.0;
-        simulation_addPixel(drawx + drawy * xsize,
-            r, g, b, sqrt(alpha) * 255); 
-    } else {
-        simulation_addPixel(drawx + drawy * xsize,
-            255, 0, 0, sqrt(alpha) * 255);
-    }
-}
-
-void fluid_drawAllIfThere(int x, int y, int xsize) {
-    for (int i = 0; i < FLUID_COUNT; i++) {
-        fluid_drawIfThere(i, x, y, xsize);
-    }
-}
-
 double fluid_tryTransfer(int type, int target_x, int target_y,
         double amount, double max, double hard_max) {
     if (target_x < 0 || target_x >= fluid_map_x ||
             target_y < 0 || target_y >= fluid_map_y) {
         return 0;
     }
-    if (fluid_map[type][target_x + target_y * fluid_map_x] + amount >
+    if (fluid_map[fluid_cell(type, target_x, target_y)] + amount >
             hard_max) {
-        amount = hard_max - fluid_map[type][target_x + target_y *
-            fluid_map_x];
+        amount = hard_max - fluid_map[fluid_cell(type, target_x, target_y)];
         if (amount < 0) {
             amount = 0;
         }
     }
-    if (fluid_map[type][target_x + target_y * fluid_map_x] + amount > max) {
+    if (fluid_map[fluid_cell(type, target_x, target_y)] + amount > max) {
         amount = amount * 0.5;
     }
-    fluid_map[type][target_x + target_y * fluid_map_x] += amount;
+    fluid_map[fluid_cell(type, target_x, target_y)] += amount;
+    if (amount > 0)
+        fluid_markActive(target_x, target_y);
     return amount;
 }
 
+static int fluid_isWall(int x, int y) {
+    // Ground that was never seen: the legacy engine moves no fluid into it.
+    if (fluid_ground->map_x <= 0 || fluid_ground->map_y <= 0)
+        return 0;
+    return (topology_snapshotHeightAt(fluid_ground, x * reduce_factor,
+        y * reduce_factor) >= TOPOLOGY_WALL_HEIGHT);
+}
+
 void fluid_update(int type, int x, int y) {
     /* Do one update step of the physics simulation of the fluid located in
        this spot, possibly making it spread to neighboring points.
@@ -190,7 +302,7 @@ void fluid_update(int type, int x, int y) {
     */
     if (x < 0 || x >= fluid_map_x || y < 0 || y >= fluid_map_y) return;
 
-    if (fluid_map[type][x + y * fluid_map_x] <= 0.01) {
+    if (fluid_map[fluid_cell(type, x, y)] <= 0.01) {
         return;
     }
 
@@ -202,14 +314,14 @@ void fluid_update(int type, int x, int y) {
     double velocity_y = 0;
 
     // Get basic velocity from ground:
-    topology_calculate_drift(worldX, worldY,
+    topology_snapshotDriftAt(fluid_ground, worldX, worldY,
         &velocity_x, &velocity_y);
 
     // Scale velocity:
     velocity_x /= 2.0;
     velocity_y /= 2.0;
-    velocity_x += rand0to1() * 5.0 - 10.0;   
-    velocity_y += rand0to1() * 5.0 - 10.0; 
+    velocity_x += random_float() * 5.0 - 10.0;
+    velocity_y += random_float() * 5.0 - 10.0;
 
     // Limit to jump length:
     if (velocity_x > jumpLength) {
@@ -246,49 +358,60 @@ void fluid_update(int type, int x, int y) {
 
     double miss_factor = 1.0f;
 
+    // Fluid that already sits in a wall may still spread out inside it:
+    int own_wall = fluid_isWall(x, y);
+
     // Transfer along the slope of the ground:
-    double ownAmount = fluid_map[type][x + y * fluid_map_x];
+    double ownAmount = fluid_map[fluid_cell(type, x, y)];
     if ((target_x != x || target_y != y) && ownAmount > 0.01) {
         if (target_x >= 0 && target_x < fluid_map_x && target_y >= 0 &&
                 target_y < fluid_map_y &&
                 x >= 0 && x < fluid_map_x && y >= 0 &&
-                y < fluid_map_y) {
+                y < fluid_map_y &&
+                (own_wall || !fluid_isWall(target_x, target_y))) {
             double sMapX = ((double)x) * reduce_factor;
             double sMapY = ((double)y) * reduce_factor;
             double tMapX = ((double)target_x) * reduce_factor;
             double tMapY = ((double)target_y) * reduce_factor;
-            double heightDiff = topology_heightAt(sMapX + 0.5, sMapY + 0.5) -
-                topology_heightAt(tMapX + 0.5, tMapY + 0.5);
+            double heightDiff = topology_snapshotHeightAt(fluid_ground,
+                sMapX + 0.5, sMapY + 0.5) -
+                topology_snapshotHeightAt(fluid_ground,
+                tMapX + 0.5, tMapY + 0.5);
 
             double fac = fmax(0, fmin(1.0, heightDiff / 40.0)) * 0.4 + 0.6;
 
             double transfer = 0.9 * ownAmount * fac;
-            if (transfer > fluid_map[type][x + y * fluid_map_x] * 0.5) {
-                transfer = fluid_map[type][x + y * fluid_map_x] * 0.5;
+            if (transfer > fluid_map[fluid_cell(type, x, y)] * 0.5) {
+                transfer = fluid_map[fluid_cell(type, x, y)] * 0.5;
             }
             double amount = fmax(0.01 * ownAmount * fac,
                 fmin((10.0 * reduce_factor) -
-                fluid_map[type][target_x + target_y * fluid_map_x],
+                fluid_map[fluid_cell(type, target_x, target_y)],
                 transfer));
-            fluid_map[type][target_x + target_y * fluid_map_x] += amount;
-            fluid_map[type][x + y * fluid_map_x] -= amount * miss_factor;
-            ownAmount = fluid_map[type][x + y * fluid_map_x];
+            fluid_map[fluid_cell(type, target_x, target_y)] += amount;
+            fluid_markActive(target_x, target_y);
+            fluid_map[fluid_cell(type, x, y)] -= amount * miss_factor;
+            ownAmount = fluid_map[fluid_cell(type, x, y)];
         }
     }
 
     // Transfer evenly to all neighboring pixels:
     int range = (double)30.0 / reduce_factor;
     if (range < 1) range = 1;
+    if (fluid_map[fluid_cell(type, x, y)] < 0.5)
+        return;
+    float rnd[3 * 10];
+    random_fillFloats(rnd, 3 * 10);
     for (int k = 0; k < 10; k++) {
-        double fneighbor_x = (double)(rand0to1() * 2.0 - 1.0);
-        double fneighbor_y = (double)(rand0to1() * 2.0 - 1.0);
-        if (fluid_map[type][x + y * fluid_map_x]  < 0.5)
+        double fneighbor_x = (double)(rnd[k * 3] * 2.0 - 1.0);
+        double fneighbor_y = (double)(rnd[k * 3 + 1] * 2.0 - 1.0);
+        if (fluid_map[fluid_cell(type, x, y)]  < 0.5)
             continue;
 
         // Scale in a circle:
         double vecLength = sqrt(fneighbor_x * fneighbor_x +
             fneighbor_y * fneighbor_y);
-        double targetVecLength = (double)(rand0to1() * range);
+        double targetVecLength = (double)(rnd[k * 3 + 2] * range);
         double scale_fac = targetVecLength / vecLength;
         fneighbor_x *= scale_fac;
         fneighbor_y *= scale_fac;
@@ -296,6 +419,8 @@ void fluid_update(int type, int x, int y) {
         int neighbor_y = (int)(fneighbor_y + 0.5);
         if (neighbor_x == 0 && neighbor_y == 0)
             continue;
+        if (!own_wall && fluid_isWall(x + neighbor_x, y + neighbor_y))
+            continue;
 
         // Transfer to around 1% of own amount:
         double transfer = 0.2 * ownAmount / fmin(10.0 / reduce_factor,
@@ -304,111 +429,1206 @@ void fluid_update(int type, int x, int y) {
 
         // Transfer target limit should be fmax(ownAmount, 10.0):
         double limit = fmin(fmin(ownAmount, 100.0 * reduce_factor),
-            fluid_map[type][x + y * fluid_map_x]);
+            fluid_map[fluid_cell(type, x, y)]);
 
         // Do transfer and see how much we managed to transfer:
         double gone = fluid_tryTransfer(type, x + neighbor_x,
-            y + neighbor_y, transfer, limit, fluid_map[type][x + y *
-            fluid_map_x]);
+            y + neighbor_y, transfer, limit, fluid_map[fluid_cell(type, x, y)]);
 
         // Reduce transferred fluid from ourselves:
-        fluid_map[type][x + y * fluid_map_x] -= gone * miss_factor;
+        fluid_map[fluid_cell(type, x, y)] -= gone * miss_factor;
     } 
 }
 
-void fluid_randomSpawns() {
+static void fluid_spawnRandomly() {
     for (int i = 0; i < 500; i++) {
-        double x = rand0to1();
-        double y = rand0to1();
+        double x = random_double();
+        double y = random_double();
         int fluid_x = x * fluid_map_x;
         int fluid_y = y * fluid_map_y;
         _fluid_spawn(FLUID_WATER, fluid_x, fluid_y, (60.0 +
-            rand0to1() * 10.0) / reduce_factor);
+            random_double() * 10.0) / reduce_factor);
     }
 }
 
-uint64_t last_fluid_update = 0;
-uint64_t last_water_scroll = 0;
+void fluid_randomSpawns() {
+    // Done by the simulation thread before its next update:
+    __atomic_add_fetch(&fluid_spawns_requested, 1, __ATOMIC_ACQ_REL);
+}
 
-void fluid_updateAll() {
-    while (last_water_scroll < SDL_GetTicks()) {
-        water_scroll_offset_x += 1;
-        water_scroll_offset_y += 1;
-        last_water_scroll += 150;
+static void fluid_clearPipes() {
+    // Water has no momentum when switching over to the pipes engine:
+    size_t size = sizeof(fluid_amount) * FLUID_COUNT *
+        fluid_map_x * fluid_map_y;
+    sparsegrid_clear(fluid_flux, 0, 4 * size);
+    sparsegrid_clear(fluid_velocity_x, 0, size);
+    sparsegrid_clear(fluid_velocity_y, 0, size);
+    if (fluid_tile_piped)
+        memset(fluid_tile_piped, 0, fluid_tiles_x * fluid_tiles_y);
+    fluid_max_speed = 0;
+}
 
-        // Make sure we catch up:
-        if (last_water_scroll + 2000 < SDL_GetTicks()) {
-            last_water_scroll = SDL_GetTicks();
-        }
-    }
-
-    // Spawn new water when something is above a certain height:
-    if (last_fluid_update + 350 < SDL_GetTicks()) {
-        last_fluid_update = SDL_GetTicks() + 200;
-        const int spawn_scan_width = 5;
-        const int spawn_scan_height = 5;
-        const int border_w = (int)(((double)topology_map_x) * 0.1);
-        const int border_h = (int)(((double)topology_map_y) * 0.1);
-        int x = border_w;
-        int y = border_h;
-        while (x < topology_map_x - border_w) {
-            y = border_h;
-            while (y < topology_map_y - border_h) {
-                double height = topology_heightAt(x, y);
-                
-                if (height > topology_getMaxPossibleHeight() * 0.95) {
-                    fluid_spawn(FLUID_WATER, x, y, 0.5);
+void fluid_setEngine(int engine) {
+    if (engine != FLUID_ENGINE_LEGACY && engine != FLUID_ENGINE_STENCIL &&
+            engine != FLUID_ENGINE_PIPES)
+        return;
+    if (!fluid_access) {
+        fluid_engine = engine;
+        return;
+    }
+    pthread_mutex_lock(fluid_access);
+    if (engine == FLUID_ENGINE_PIPES && fluid_engine != engine)
+        fluid_clearPipes();
+    if (fluid_engine == FLUID_ENGINE_LEGACY && fluid_engine != engine) {
+        // The legacy engine doesn't keep the back buffer up to date:
+        sparsegrid_clear(fluid_map_back, 0, sizeof(fluid_amount) *
+            FLUID_COUNT * fluid_map_x * fluid_map_y);
+    }
+    // Tiles only fall asleep again after a full stencil step:
+    memset(fluid_tile_asleep, 0, fluid_tiles_x * fluid_tiles_y);
+    fluid_engine = engine;
+    pthread_mutex_unlock(fluid_access);
+}
+
+void fluid_setLOD(int enabled) {
+    if (!fluid_access) {
+        fluid_lod_enabled = (enabled != 0);
+        return;
+    }
+    pthread_mutex_lock(fluid_access);
+    fluid_lod_enabled = (enabled != 0);
+    memset(fluid_tile_asleep, 0, fluid_tiles_x * fluid_tiles_y);
+    pthread_mutex_unlock(fluid_access);
+}
+
+void fluid_setInterpolation(int enabled) {
+    // Only read by drawing, a change shows up with the next frame:
+    __atomic_store_n(&fluid_interpolate, (enabled != 0), __ATOMIC_RELAXED);
+}
+
+void fluid_setProperties(int type, double viscosity, int r, int g, int b,
+        double tint) {
+    if (type < 0 || type >= FLUID_COUNT)
+        return;
+    if (fluid_access)
+        pthread_mutex_lock(fluid_access);
+    fluid_viscosity[type] = fmax(0.0, fmin(1.0, viscosity));
+    fluid_tint[type][0] = (r < 0 ? 0 : (r > 255 ? 255 : r));
+    fluid_tint[type][1] = (g < 0 ? 0 : (g > 255 ? 255 : g));
+    fluid_tint[type][2] = (b < 0 ? 0 : (b > 255 ? 255 : b));
+    fluid_tint_share[type] = (int)(fmax(0.0, fmin(1.0, tint)) * 256.0);
+    if (fluid_access)
+        pthread_mutex_unlock(fluid_access);
+}
+
+// Tiles are the unit of work for the worker pool:
+struct fluid_tilejob {
+    int tile_size;
+    int tiles_x;
+    int phase_x, phase_y, phase_tiles_x;
+    double dt;
+    uint64_t step;
+};
+
+// Steps of the legacy engine so far. Each tile draws its random numbers
+// from a stream picked by tile and step:
+static uint64_t fluid_legacy_step = 0;
+
+static void fluid_getTileRegion(int tile, int *x0, int *y0,
+        int *x1, int *y1) {
+    *x0 = (tile % fluid_tiles_x) * FLUID_TILE_SIZE;
+    *y0 = (tile / fluid_tiles_x) * FLUID_TILE_SIZE;
+    *x1 = *x0 + FLUID_TILE_SIZE;
+    *y1 = *y0 + FLUID_TILE_SIZE;
+    if (*x1 > fluid_map_x) *x1 = fluid_map_x;
+    if (*y1 > fluid_map_y) *y1 = fluid_map_y;
+}
+
+static void fluid_buildTileList(int with_neighbors) {
+    // Collect the active tiles, and optionally all tiles next to them
+    // which the water might flow into during the next step:
+    fluid_tile_list_count = 0;
+    for (int ty = 0; ty < fluid_tiles_y; ty++) {
+        for (int tx = 0; tx < fluid_tiles_x; tx++) {
+            int visit = fluid_tile_active[tx + ty * fluid_tiles_x];
+            for (int ny = ty - 1; ny <= ty + 1 && with_neighbors &&
+                    !visit; ny++) {
+                if (ny < 0 || ny >= fluid_tiles_y) continue;
+                for (int nx = tx - 1; nx <= tx + 1; nx++) {
+                    if (nx < 0 || nx >= fluid_tiles_x) continue;
+                    if (fluid_tile_active[nx + ny * fluid_tiles_x]) {
+                        visit = 1;
+                        break;
+                    }
                 }
+            }
+            if (visit) {
+                fluid_tile_list[fluid_tile_list_count] =
+                    tx + ty * fluid_tiles_x;
+                fluid_tile_list_count++;
+            }
+        }
+    }
+}
 
-                y += spawn_scan_height;
+static void fluid_updateTilePresence() {
+    for (int i = 0; i < fluid_tile_list_count; i++) {
+        int tile = fluid_tile_list[i];
+        int tx = tile % fluid_tiles_x;
+        int ty = tile / fluid_tiles_x;
+        unsigned char present = 0;
+        for (int ny = ty - 1; ny <= ty + 1; ny++) {
+            if (ny < 0 || ny >= fluid_tiles_y) continue;
+            for (int nx = tx - 1; nx <= tx + 1; nx++) {
+                if (nx < 0 || nx >= fluid_tiles_x) continue;
+                for (int k = 0; k < FLUID_COUNT; k++) {
+                    if (fluid_tile_volume[k][nx + ny * fluid_tiles_x] > 0)
+                        present |= (1 << k);
+                }
             }
-            x += spawn_scan_width;
         }
+        fluid_tile_present[tile] = present;
     }
+}
 
-    // Check how many fluid updates we want to do:
-	int fluidUpdates = simulation_getFluidUpdateCount();
-    if (fluidUpdates <= 0)
+static void fluid_updateTileStats(int tile) {
+    // Find the largest amount of any fluid in this tile, and the totals:
+    int x0, y0, x1, y1;
+    fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+    fluid_amount max = 0;
+    double volume[FLUID_COUNT] = { 0 };
+    int wet[FLUID_COUNT] = { 0 };
+    for (int y = y0; y < y1; y++) {
+        for (int k = 0; k < FLUID_COUNT; k++) {
+            const fluid_amount *row = &fluid_map[fluid_cell(k, 0, y)];
+            for (int x = x0; x < x1; x++) {
+                fluid_amount amount = row[x];
+                if (amount > max)
+                    max = amount;
+                volume[k] += amount;
+                wet[k] += (amount >= FLUID_WET_AMOUNT);
+            }
+        }
+    }
+    for (int k = 0; k < FLUID_COUNT; k++) {
+        fluid_tile_volume[k][tile] = volume[k];
+        fluid_tile_wet[k][tile] = wet[k];
+    }
+    fluid_tile_max[tile] = max;
+}
+
+static void fluid_clearTile(int tile) {
+    int x0, y0, x1, y1;
+    fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+    int plane = FLUID_COUNT * fluid_map_x * fluid_map_y;
+    size_t row_size = sizeof(fluid_amount) * (x1 - x0);
+    for (int y = y0; y < y1; y++) {
+        for (int k = 0; k < FLUID_COUNT; k++) {
+            int i = fluid_cell(k, x0, y);
+            memset(&fluid_map[i], 0, row_size);
+            memset(&fluid_map_back[i], 0, row_size);
+            if (!fluid_tile_piped[tile])
+                continue;
+            memset(&fluid_velocity_x[i], 0, row_size);
+            memset(&fluid_velocity_y[i], 0, row_size);
+            for (int d = 0; d < 4; d++) {
+                memset(&fluid_flux[i + d * plane], 0, row_size);
+            }
+        }
+    }
+    fluid_tile_piped[tile] = 0;
+    for (int k = 0; k < FLUID_COUNT; k++) {
+        fluid_tile_volume[k][tile] = 0;
+        fluid_tile_wet[k][tile] = 0;
+    }
+    fluid_tile_max[tile] = 0;
+}
+
+static void fluid_releaseTileRow(int ty) {
+    // Once a whole row of tiles is dry, its rows of all maps are in one
+    // piece and their memory can be given back:
+    for (int tx = 0; tx < fluid_tiles_x; tx++) {
+        int tile = tx + ty * fluid_tiles_x;
+        if (fluid_tile_active[tile] || fluid_tile_max[tile] > 0)
+            return;
+    }
+    int y0 = ty * FLUID_TILE_SIZE;
+    int y1 = y0 + FLUID_TILE_SIZE;
+    if (y1 > fluid_map_y) y1 = fluid_map_y;
+    size_t plane = sizeof(fluid_amount) * FLUID_COUNT *
+        fluid_map_x * fluid_map_y;
+    size_t offset = sizeof(fluid_amount) * fluid_cell(0, 0, y0);
+    size_t size = sizeof(fluid_amount) * FLUID_COUNT * fluid_map_x *
+        (y1 - y0);
+    sparsegrid_clear(fluid_map, offset, size);
+    sparsegrid_clear(fluid_map_back, offset, size);
+    sparsegrid_clear(fluid_velocity_x, offset, size);
+    sparsegrid_clear(fluid_velocity_y, offset, size);
+    for (int d = 0; d < 4; d++) {
+        sparsegrid_clear(fluid_flux, offset + d * plane, size);
+    }
+}
+
+static void fluid_updateTileActivity() {
+    // Tiles that ran dry are wiped, so leftover traces of fluid can't
+    // linger in tiles that nobody looks at anymore:
+    // The list is in order, so a row that had tiles wiped is checked once
+    // the list moves on to the next row:
+    int wiped_row = -1;
+    for (int i = 0; i < fluid_tile_list_count; i++) {
+        int tile = fluid_tile_list[i];
+        int row = tile / fluid_tiles_x;
+        if (wiped_row >= 0 && row != wiped_row) {
+            fluid_releaseTileRow(wiped_row);
+            wiped_row = -1;
+        }
+        int active = (fluid_tile_max[tile] >= FLUID_TILE_MIN_AMOUNT);
+        if (!active && (fluid_tile_active[tile] ||
+                fluid_tile_max[tile] > 0)) {
+            fluid_clearTile(tile);
+            wiped_row = row;
+        }
+        fluid_tile_active[tile] = active;
+    }
+    if (wiped_row >= 0)
+        fluid_releaseTileRow(wiped_row);
+}
+
+static void fluid_updateTerrain() {
+    // Sample the ground height below each fluid cell of the tiles that
+    // will be updated, unless already done during this update:
+    for (int i = 0; i < fluid_tile_list_count; i++) {
+        int tile = fluid_tile_list[i];
+        if (fluid_tile_terrain_stamp[tile] == fluid_terrain_stamp)
+            continue;
+        fluid_tile_terrain_stamp[tile] = fluid_terrain_stamp;
+        int x0, y0, x1, y1;
+        fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+        int changed = 0;
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                double height = 0;
+                if (fluid_ground->map_x > 0 && fluid_ground->map_y > 0) {
+                    height = topology_snapshotHeightAt(fluid_ground,
+                        x * reduce_factor, y * reduce_factor);
+                }
+                if (fluid_terrain[x + y * fluid_map_x] !=
+                        (fluid_amount)height) {
+                    fluid_terrain[x + y * fluid_map_x] = height;
+                    changed = 1;
+                }
+            }
+        }
+        // Moving ground wakes up the fluid on top of it, and changes the
+        // basins it settles in:
+        if (changed) {
+            fluid_tile_asleep[tile] = 0;
+            fluidsettle_invalidate(fluid_settler, x0, y0, x1, y1);
+        }
+    }
+}
+
+static int fluid_isAsleep(int tx, int ty) {
+    if (tx < 0 || ty < 0 || tx >= fluid_tiles_x || ty >= fluid_tiles_y)
+        return 0;
+    return fluid_tile_asleep[tx + ty * fluid_tiles_x];
+}
+
+static void fluid_stencilTileTask(int task, void *userdata) {
+    int x0, y0, x1, y1;
+    int tile = fluid_tile_list[task];
+    fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+    if (fluid_tile_asleep[tile]) {
+        // Holds still, just carry it over to the back buffer:
+        for (int y = y0; y < y1; y++) {
+            int i = fluid_cell(0, x0, y);
+            for (int k = 0; k < FLUID_COUNT; k++) {
+                memcpy(&fluid_map_back[i + k * fluid_map_x], &fluid_map[
+                    i + k * fluid_map_x], sizeof(fluid_amount) * (x1 - x0));
+            }
+        }
         return;
+    }
+    int tx = tile % fluid_tiles_x;
+    int ty = tile / fluid_tiles_x;
+    unsigned int walls = 0;
+    if (fluid_isAsleep(tx - 1, ty)) walls |= FLUIDSTENCIL_WALL_LEFT;
+    if (fluid_isAsleep(tx + 1, ty)) walls |= FLUIDSTENCIL_WALL_RIGHT;
+    if (fluid_isAsleep(tx, ty - 1)) walls |= FLUIDSTENCIL_WALL_UP;
+    if (fluid_isAsleep(tx, ty + 1)) walls |= FLUIDSTENCIL_WALL_DOWN;
+    fluidstencil_step(fluid_map, fluid_map_back, fluid_terrain,
+        fluid_map_x, fluid_map_y, FLUID_COUNT, fluid_tile_present[tile],
+        walls, x0, y0, x1, y1, fluid_stencil_rate, fluid_viscosity);
+}
 
-    // Update all fluids:
-    int x = 0;
-    int y = 0;
-	pthread_mutex_lock(fluid_access);
+static void fluid_tileStatsTask(int task, void *userdata) {
+    // Asleep tiles didn't change:
+    int tile = fluid_tile_list[task];
+    if (!fluid_tile_asleep[tile])
+        fluid_updateTileStats(tile);
+}
+
+static void fluid_tileSettledTask(int task, void *userdata) {
+    // Compare the new front buffer with the previous one, which is now
+    // the back buffer:
+    int x0, y0, x1, y1;
+    int tile = fluid_tile_list[task];
+    fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+    fluid_amount change = 0;
+    for (int y = y0; y < y1; y++) {
+        int i = fluid_cell(0, 0, y);
+        for (int j = i; j < i + FLUID_COUNT * fluid_map_x;
+                j += fluid_map_x) {
+            for (int x = x0; x < x1; x++) {
+                fluid_amount d = fluid_map[j + x] - fluid_map_back[j + x];
+                if (d < 0) d = -d;
+                if (d > change) change = d;
+            }
+        }
+    }
+    fluid_tile_settled[tile] = (change < FLUID_LOD_SETTLED_CHANGE);
+}
+
+static void fluid_updateTileSleep() {
+    // Tiles that aren't visited hold no fluid and count as settled:
+    memset(fluid_tile_settled, 1, fluid_tiles_x * fluid_tiles_y);
+    memset(fluid_tile_asleep, 0, fluid_tiles_x * fluid_tiles_y);
+    workerpool_run(fluid_pool, fluid_tile_list_count,
+        fluid_tileSettledTask, NULL);
+    for (int i = 0; i < fluid_tile_list_count; i++) {
+        int tile = fluid_tile_list[i];
+        int tx = tile % fluid_tiles_x;
+        int ty = tile / fluid_tiles_x;
+        int asleep = fluid_tile_settled[tile];
+        if (tx > 0 && !fluid_tile_settled[tile - 1]) asleep = 0;
+        if (tx < fluid_tiles_x - 1 && !fluid_tile_settled[tile + 1])
+            asleep = 0;
+        if (ty > 0 && !fluid_tile_settled[tile - fluid_tiles_x])
+            asleep = 0;
+        if (ty < fluid_tiles_y - 1 &&
+                !fluid_tile_settled[tile + fluid_tiles_x])
+            asleep = 0;
+        fluid_tile_asleep[tile] = asleep;
+    }
+}
+
+static void fluid_updateAllStencil(int fluidUpdates) {
     for (int j = 0; j < fluidUpdates; j++) {
-        x = 0;
-        y = 0;
-        for (int i = 0; i < fluid_map_x * fluid_map_y; ++i) {
-            // Update fluid simulation in this spot:
-            for (int k = 0; k < FLUID_COUNT; k++) {
-                fluid_update(k, x, y);
+        int full_step = (!fluid_lod_enabled ||
+            fluid_lod_step % FLUID_LOD_INTERVAL == 0);
+        fluid_lod_step++;
+        if (full_step)
+            memset(fluid_tile_asleep, 0, fluid_tiles_x * fluid_tiles_y);
+        fluid_buildTileList(1);
+        fluid_updateTerrain();
+        fluid_updateTilePresence();
+
+        // All fluids of a cell flow towards the same lower neighbour at
+        // once. Together they may not flow faster than a single fluid, or
+        // cells overshoot and start to oscillate:
+        unsigned char present = 0;
+        for (int i = 0; i < fluid_tile_list_count; i++) {
+            present |= fluid_tile_present[fluid_tile_list[i]];
+        }
+        double mobility = 0;
+        for (int k = 0; k < FLUID_COUNT; k++) {
+            if (present & (1 << k))
+                mobility += 1.0 - fluid_viscosity[k];
+        }
+        fluid_stencil_rate = FLUID_STENCIL_RATE / fmax(1.0, mobility);
+
+        // Every tile only writes its own cells of the back buffer, so all
+        // of them can run at once:
+        workerpool_run(fluid_pool, fluid_tile_list_count,
+            fluid_stencilTileTask, NULL);
+
+        // Back buffer becomes the new front buffer:
+        fluid_amount *swap = fluid_map;
+        fluid_map = fluid_map_back;
+        fluid_map_back = swap;
+        workerpool_run(fluid_pool, fluid_tile_list_count,
+            fluid_tileStatsTask, NULL);
+        if (fluid_lod_enabled && full_step)
+            fluid_updateTileSleep();
+        fluid_updateTileActivity();
+    }
+}
+
+static void fluid_pipesFluxTileTask(int task, void *userdata) {
+    struct fluid_tilejob *job = userdata;
+    int x0, y0, x1, y1;
+    int tile = fluid_tile_list[task];
+    fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+    fluid_tile_piped[tile] = 1;
+    fluidpipes_updateFlux(fluid_map, fluid_terrain, fluid_flux,
+        fluid_map_x, fluid_map_y, FLUID_COUNT, fluid_tile_present[tile],
+        x0, y0, x1, y1, job->dt, fluid_viscosity);
+}
+
+static void fluid_pipesDepthTileTask(int task, void *userdata) {
+    struct fluid_tilejob *job = userdata;
+    int x0, y0, x1, y1;
+    int tile = fluid_tile_list[task];
+    fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+    fluidpipes_updateDepth(fluid_map, fluid_flux, fluid_velocity_x,
+        fluid_velocity_y, fluid_map_x, fluid_map_y, FLUID_COUNT,
+        fluid_tile_present[tile], x0, y0, x1, y1, job->dt,
+        &fluid_tile_max_speed[task]);
+}
+
+static void fluid_updateAllPipes(int fluidUpdates) {
+    struct fluid_tilejob job;
+    memset(&job, 0, sizeof(job));
+    for (int j = 0; j < fluidUpdates; j++) {
+        fluid_buildTileList(1);
+        fluid_updateTerrain();
+        workerpool_run(fluid_pool, fluid_tile_list_count,
+            fluid_tileStatsTask, NULL);
+        fluid_updateTilePresence();
+
+        // Pick the substep length from the CFL condition. Water moves at
+        // most one cell per substep, which never gets it past the ring of
+        // neighbour tiles in the list:
+        double max_depth = 0;
+        for (int i = 0; i < fluid_tile_list_count; i++) {
+            if (fluid_tile_max[fluid_tile_list[i]] > max_depth)
+                max_depth = fluid_tile_max[fluid_tile_list[i]];
+        }
+        int substeps = fluidpipes_substeps(max_depth, fluid_max_speed,
+            &job.dt);
+        for (int s = 0; s < substeps; s++) {
+            // All fluxes need to be done before any depth changes:
+            workerpool_run(fluid_pool, fluid_tile_list_count,
+                fluid_pipesFluxTileTask, &job);
+            workerpool_run(fluid_pool, fluid_tile_list_count,
+                fluid_pipesDepthTileTask, &job);
+            fluid_max_speed = 0;
+            for (int i = 0; i < fluid_tile_list_count; i++) {
+                if (fluid_tile_max_speed[i] > fluid_max_speed)
+                    fluid_max_speed = fluid_tile_max_speed[i];
             }
+        }
+        workerpool_run(fluid_pool, fluid_tile_list_count,
+            fluid_tileStatsTask, NULL);
+        fluid_updateTileActivity();
+    }
+}
 
-            // Advance coordinates:
-            x++;
-            if (x >= fluid_map_x) {
-                x -= fluid_map_x;
-                y++;
+static void fluid_legacyTileTask(int task, void *userdata) {
+    struct fluid_tilejob *job = userdata;
+    int tx = job->phase_x + (task % job->phase_tiles_x) * 2;
+    int ty = job->phase_y + (task / job->phase_tiles_x) * 2;
+    // A phase tile consists of several regular tiles, skip the dry ones:
+    int sub_tiles = job->tile_size / FLUID_TILE_SIZE;
+    for (int sy = ty * sub_tiles; sy < (ty + 1) * sub_tiles; sy++) {
+        if (sy >= fluid_tiles_y) break;
+        for (int sx = tx * sub_tiles; sx < (tx + 1) * sub_tiles; sx++) {
+            if (sx >= fluid_tiles_x) break;
+            int tile = sx + sy * fluid_tiles_x;
+            if (!__atomic_load_n(&fluid_tile_active[tile], __ATOMIC_RELAXED))
+                continue;
+            random_seedStream(job->step * fluid_tiles_x * fluid_tiles_y +
+                tile);
+            int x0, y0, x1, y1;
+            fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    // Update fluid simulation in this spot:
+                    for (int k = 0; k < FLUID_COUNT; k++) {
+                        fluid_update(k, x, y);
+                    }
+                }
             }
         }
     }
-	pthread_mutex_unlock(fluid_access);
+}
+
+static void fluid_updateAllLegacy(int fluidUpdates) {
+    // fluid_update() writes up to this many cells away from its own:
+    int reach = (int)ceil(30.0 / reduce_factor) + 1;
+
+    // Tiles of the same phase are one tile apart, so their writes can't
+    // overlap as long as a tile is wider than twice the reach:
+    struct fluid_tilejob job;
+    memset(&job, 0, sizeof(job));
+    job.tile_size = FLUID_TILE_SIZE;
+    while (job.tile_size <= 2 * reach)
+        job.tile_size += FLUID_TILE_SIZE;
+    int tiles_x = (fluid_map_x + job.tile_size - 1) / job.tile_size;
+    int tiles_y = (fluid_map_y + job.tile_size - 1) / job.tile_size;
+
+    for (int j = 0; j < fluidUpdates; j++) {
+        // Water gets pushed into other tiles, which marks them active
+        // right away. So only tiles with water need to be visited:
+        fluid_buildTileList(0);
+        if (fluid_tile_list_count == 0)
+            break;
+        job.step = fluid_legacy_step++;
+
+        // Four phases in a 2x2 pattern, so neighbouring tiles never run
+        // at the same time:
+        for (int phase = 0; phase < 4; phase++) {
+            job.phase_x = phase % 2;
+            job.phase_y = phase / 2;
+            job.phase_tiles_x = (tiles_x - job.phase_x + 1) / 2;
+            int phase_tiles_y = (tiles_y - job.phase_y + 1) / 2;
+            workerpool_run(fluid_pool, job.phase_tiles_x * phase_tiles_y,
+                fluid_legacyTileTask, &job);
+        }
+        fluid_buildTileList(0);
+        workerpool_run(fluid_pool, fluid_tile_list_count,
+            fluid_tileStatsTask, NULL);
+        fluid_updateTileActivity();
+    }
+}
+
+static struct workerpool *fluid_pickPool() {
+    // Keep the pool in use if the new one can't be made:
+    if (fluid_thread_count <= 0)
+        return workerpool_shared();
+    struct workerpool *pool = workerpool_create(fluid_thread_count);
+    if (!pool) {
+        fprintf(stderr, "clib/fluid.c: error: "
+            "out of memory for %d threads, keeping the pool\n",
+            fluid_thread_count);
+        return fluid_pool;
+    }
+    return pool;
+}
+
+void fluid_setThreadCount(int threads) {
+    // 0 or less goes back to the shared pool:
+    fluid_thread_count = threads;
+    if (!fluid_access)
+        return;
+    pthread_mutex_lock(fluid_access);
+    struct workerpool *pool = fluid_pickPool();
+    if (pool != fluid_pool) {
+        if (fluid_own_pool && fluid_own_pool != pool) {
+            workerpool_destroy(fluid_own_pool);
+            fluid_own_pool = NULL;
+        }
+        if (pool != workerpool_shared())
+            fluid_own_pool = pool;
+        fluid_pool = pool;
+    }
+    pthread_mutex_unlock(fluid_access);
+}
+
+static void fluid_emitterTileTask(int task, void *userdata) {
+    const struct fluidemitter_index *index = userdata;
+    int tile = index->used_tiles[task];
+    double seconds = fluid_emitter_seconds;
+    for (int i = index->tile_start[tile]; i < index->tile_start[tile + 1];
+            i++) {
+        int x = index->cells[i] % fluid_map_x;
+        int y = index->cells[i] / fluid_map_x;
+        int type = index->types[i];
+        double amount = fluid_map[fluid_cell(type, x, y)] +
+            (index->once[i] ? index->rates[i] : index->rates[i] * seconds);
+        if (amount < 0)
+            amount = 0;
+        fluid_setAmount(type, x, y, amount);
+        if (amount > 0)
+            fluid_markActive(x, y);
+    }
+}
+
+static void fluid_applyEmitters(double seconds) {
+    // All emitters of a tile are applied by the same task, since they
+    // share the tile totals:
+    const struct fluidemitter_index *index = fluidemitter_getIndex(
+        fluid_map_x, fluid_map_y, reduce_factor, FLUID_TILE_SIZE);
+    if (!index || index->used_tile_count == 0)
+        return;
+    fluid_emitter_seconds = seconds;
+    workerpool_run(fluid_pool, index->used_tile_count,
+        fluid_emitterTileTask, (void *)index);
+    for (int i = 0; i < index->tile_start[index->tiles_x * index->tiles_y];
+            i++) {
+        if (index->once[i]) {
+            fluidemitter_finishOnce();
+            break;
+        }
+    }
+}
+
+static void fluid_initAlphaLut() {
+    // Same curve as the old per-pixel drawing: four times the clamped
+    // fluid level, squared, capped at 0.7 and back to linear alpha:
+    for (int i = 0; i < FLUID_ALPHA_LUT_SIZE; i++) {
+        double amount = (FLUID_ALPHA_MAX_AMOUNT * i) /
+            (FLUID_ALPHA_LUT_SIZE - 1);
+        double raw = 4.0 * fmin(amount / 5.0, 1.0);
+        double alpha = fmin(raw * raw, 0.7);
+        fluid_alpha_lut[i] = sqrt(alpha) * 255.0;
+    }
+}
+
+static void fluid_updateAlphaTile(struct fluid_frame *f, int i) {
+    int tile = f->tiles[i];
+    int x0, y0, x1, y1;
+    fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+    const double lut_scale = (FLUID_ALPHA_LUT_SIZE - 1) /
+        FLUID_ALPHA_MAX_AMOUNT;
+    // Rows of the tile plus one above and below it:
+    int hy0 = (y0 > 0 ? y0 - 1 : 0);
+    int hy1 = (y1 < fluid_map_y ? y1 + 1 : fluid_map_y);
+    double blurred_x[FLUID_TILE_SIZE + 2][FLUID_TILE_SIZE];
+    for (int k = 0; k < FLUID_COUNT; k++) {
+        if (!(f->present[i] & (1 << k))) {
+            // Nothing that could be blurred in:
+            for (int y = y0; y < y1; y++) {
+                memset(&f->alpha[fluid_cell(k, x0, y)], 0,
+                    sizeof(float) * (x1 - x0));
+            }
+            continue;
+        }
+
+        // Blur with a 3x3 binomial kernel, split into a horizontal and a
+        // vertical pass. The map border counts as dry:
+        for (int y = hy0; y < hy1; y++) {
+            const fluid_amount *row = &fluid_map[fluid_cell(k, 0, y)];
+            double *out = blurred_x[y - hy0];
+            for (int x = x0; x < x1; x++) {
+                double sum = 2 * fmin(row[x], FLUID_ALPHA_MAX_AMOUNT);
+                if (x > 0)
+                    sum += fmin(row[x - 1], FLUID_ALPHA_MAX_AMOUNT);
+                if (x < fluid_map_x - 1)
+                    sum += fmin(row[x + 1], FLUID_ALPHA_MAX_AMOUNT);
+                out[x - x0] = sum;
+            }
+        }
+        for (int y = y0; y < y1; y++) {
+            const double *mid = blurred_x[y - hy0];
+            const double *up = (y > 0 ? mid - FLUID_TILE_SIZE : NULL);
+            const double *down = (y < fluid_map_y - 1 ?
+                mid + FLUID_TILE_SIZE : NULL);
+            float *alpha = &f->alpha[fluid_cell(k, 0, y)];
+            for (int x = x0; x < x1; x++) {
+                double sum = 2 * mid[x - x0];
+                if (up) sum += up[x - x0];
+                if (down) sum += down[x - x0];
+                int index = (int)(sum * (1.0 / 16.0) * lut_scale + 0.5);
+                if (index < 0) index = 0;
+                if (index >= FLUID_ALPHA_LUT_SIZE)
+                    index = FLUID_ALPHA_LUT_SIZE - 1;
+                alpha[x] = fluid_alpha_lut[index];
+            }
+        }
+    }
+}
+
+static void fluid_alphaTileTask(int task, void *userdata) {
+    fluid_updateAlphaTile(userdata, task);
+}
+
+static void fluid_clearAlphaTile(struct fluid_frame *f, int tile) {
+    int x0, y0, x1, y1;
+    fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+    for (int y = y0; y < y1; y++) {
+        for (int k = 0; k < FLUID_COUNT; k++) {
+            memset(&f->alpha[fluid_cell(k, x0, y)], 0,
+                sizeof(float) * (x1 - x0));
+        }
+    }
+}
+
+static int fluid_prepareFrame(struct fluid_frame *f) {
+    // Frames are only resized by the simulation thread while it owns them:
+    int tiles = fluid_tiles_x * fluid_tiles_y;
+    if (f->map_x == fluid_map_x && f->map_y == fluid_map_y && f->alpha)
+        return 1;
+    free(f->tiles);
+    free(f->present);
+    free(f->alpha);
+    free(f->alpha_set);
+    f->tiles = malloc(sizeof(int) * tiles);
+    f->present = malloc(tiles);
+    f->alpha = calloc((size_t)FLUID_COUNT * fluid_map_x * fluid_map_y,
+        sizeof(float));
+    f->alpha_set = calloc(tiles, 1);
+    f->tile_count = 0;
+    if (!f->tiles || !f->present || !f->alpha || !f->alpha_set) {
+        free(f->tiles);
+        free(f->present);
+        free(f->alpha);
+        free(f->alpha_set);
+        memset(f, 0, sizeof(*f));
+        return 0;
+    }
+    f->map_x = fluid_map_x;
+    f->map_y = fluid_map_y;
+    f->tiles_x = fluid_tiles_x;
+    f->tiles_y = fluid_tiles_y;
+    return 1;
+}
+
+static void fluid_publishFrame() {
+    // Called with fluid_access held, after the fluid changed:
+    struct fluid_frame *f = &fluid_frames[fluid_frame_back];
+    if (fluid_map_x < 2 || fluid_map_y < 2 || !fluid_prepareFrame(f))
+        return;
+    f->reduce_factor = reduce_factor;
+    f->scroll_x = water_scroll_offset_x;
+    f->scroll_y = water_scroll_offset_y;
+    f->time = simclock_now();
+    memcpy(f->tint, fluid_tint, sizeof(f->tint));
+    memcpy(f->tint_share, fluid_tint_share, sizeof(f->tint_share));
+
+    // Only draw where there is fluid, or might be blurred into. Alpha
+    // values of tiles that dropped out of that are cleared:
+    fluid_buildTileList(1);
+    fluid_updateTilePresence();
+    f->tile_count = fluid_tile_list_count;
+    for (int i = 0; i < fluid_tile_list_count; i++) {
+        f->tiles[i] = fluid_tile_list[i];
+        f->present[i] = fluid_tile_present[fluid_tile_list[i]];
+    }
+    workerpool_run(fluid_pool, f->tile_count, fluid_alphaTileTask, f);
+    for (int i = 0; i < f->tile_count; i++) {
+        f->alpha_set[f->tiles[i]] = 2;
+    }
+    for (int tile = 0; tile < f->tiles_x * f->tiles_y; tile++) {
+        if (f->alpha_set[tile] == 1) {
+            fluid_clearAlphaTile(f, tile);
+            f->alpha_set[tile] = 0;
+        } else if (f->alpha_set[tile] == 2) {
+            f->alpha_set[tile] = 1;
+        }
+    }
+
+    fluid_frame_back = __atomic_exchange_n(&fluid_frame_shared,
+        fluid_frame_back | FLUID_FRAME_FRESH, __ATOMIC_ACQ_REL) & 3;
+}
+
+static const struct fluid_frame *fluid_pickUpFrame() {
+    if (__atomic_load_n(&fluid_frame_shared, __ATOMIC_ACQUIRE) &
+            FLUID_FRAME_FRESH) {
+        int fresh = __atomic_exchange_n(&fluid_frame_shared,
+            fluid_frame_previous, __ATOMIC_ACQ_REL) & 3;
+        fluid_frame_previous = fluid_frame_front;
+        fluid_frame_front = fresh;
+    }
+    return &fluid_frames[fluid_frame_front];
+}
+
+static float fluid_interpolationWeight(const struct fluid_frame *f,
+        const struct fluid_frame *previous) {
+    // Share of the front frame to draw, 1 if there is nothing to fade
+    // from. The fade takes as long as the step between both frames, but
+    // at most one regular step, so fluid that starts to move after a
+    // still period doesn't lag behind:
+    if (!__atomic_load_n(&fluid_interpolate, __ATOMIC_RELAXED) ||
+            previous->map_x != f->map_x ||
+            previous->map_y != f->map_y || !previous->alpha ||
+            previous->reduce_factor != f->reduce_factor ||
+            previous->time >= f->time)
+        return 1;
+    double step = fmin(f->time - previous->time,
+        1e9 / SIMULATION_FLUID_STEPS_PER_SECOND);
+    double weight = (simclock_now() - f->time) / step;
+    if (weight >= 1)
+        return 1;
+    return (weight > 0 ? weight : 0);
+}
+
+static int fluid_prepareDrawBuffers(const struct fluid_frame *f,
+        int xsize, int view_x) {
+    if (fluid_draw_xsize == xsize && fluid_draw_view_x == view_x &&
+            fluid_draw_map_x == f->map_x &&
+            fluid_draw_map_y == f->map_y &&
+            fluid_draw_reduce_factor == f->reduce_factor)
+        return 1;
+    free(fluid_draw_cell_x);
+    free(fluid_draw_weight_x);
+    free(fluid_row_colors);
+    free(fluid_row_tinted);
+    free(fluid_row_alpha);
+    free(fluid_column_alpha);
+    free(fluid_draw_present);
+    fluid_draw_xsize = 0;
+    fluid_draw_cell_x = malloc(sizeof(int) * xsize);
+    fluid_draw_weight_x = malloc(sizeof(float) * xsize);
+    fluid_row_colors = malloc(3 * xsize);
+    fluid_row_tinted = malloc(3 * xsize);
+    fluid_row_alpha = malloc(sizeof(float) * xsize);
+    fluid_column_alpha = malloc(sizeof(float) * f->map_x);
+    fluid_draw_present = calloc(f->tiles_x * f->tiles_y, 1);
+    if (!fluid_draw_cell_x || !fluid_draw_weight_x || !fluid_row_colors ||
+            !fluid_row_tinted || !fluid_row_alpha || !fluid_column_alpha ||
+            !fluid_draw_present)
+        return 0;
+
+    // Pixel centers relative to fluid cell centers:
+    for (int x = 0; x < xsize; x++) {
+        double u = (x + view_x + 0.5) / f->reduce_factor - 0.5;
+        int cell = (int)floor(u);
+        double weight = u - cell;
+        if (cell < 0) {
+            cell = 0;
+            weight = 0;
+        }
+        if (cell >= f->map_x - 1) {
+            cell = f->map_x - 2;
+            weight = 1;
+        }
+        fluid_draw_cell_x[x] = cell;
+        fluid_draw_weight_x[x] = weight;
+    }
+    fluid_draw_xsize = xsize;
+    fluid_draw_view_x = view_x;
+    fluid_draw_map_x = f->map_x;
+    fluid_draw_map_y = f->map_y;
+    fluid_draw_reduce_factor = f->reduce_factor;
+    return 1;
+}
+
+static const uint8_t *fluid_tintRow(const struct fluid_frame *f, int type,
+        int count) {
+    // Mix the tint colour of a fluid into the water texture:
+    int share = f->tint_share[type];
+    if (share <= 0)
+        return fluid_row_colors;
+    const uint8_t *tint = f->tint[type];
+    for (int i = 0; i < count; i++) {
+        for (int c = 0; c < 3; c++) {
+            fluid_row_tinted[i * 3 + c] = (fluid_row_colors[i * 3 + c] *
+                (256 - share) + tint[c] * share) >> 8;
+        }
+    }
+    return fluid_row_tinted;
+}
+
+static void fluid_drawRows(const struct fluid_frame *f,
+        const struct fluid_frame *previous, float weight, int x0, int x1,
+        int y0, int y1, int xsize, unsigned char present) {
+    assert(simulation_isSurfaceLocked());
+    uint8_t *pixels = images_simulation_image->pixels;
+    int pitch = images_simulation_image->pitch;
+    for (int y = y0; y < y1; y++) {
+        // Interpolate between the two closest rows of fluid cells:
+        double v = (y + fluid_draw_view_y + 0.5) / f->reduce_factor - 0.5;
+        int cell_y = (int)floor(v);
+        float weight_y = v - cell_y;
+        if (cell_y < 0) {
+            cell_y = 0;
+            weight_y = 0;
+        }
+        if (cell_y >= f->map_y - 1) {
+            cell_y = f->map_y - 2;
+            weight_y = 1;
+        }
+
+        // Shift the whole row by a few pixels, so the fluid edges
+        // shimmer a little:
+        int jitter = (fluid_jitter ?
+            random_jitter(fluid_jitter, fluid_jitter_index++) : 0);
+        int first = x0 + jitter - 1;
+        int last = x1 + jitter + 1;
+        if (first < 0) first = 0;
+        if (last > xsize - 1) last = xsize - 1;
+
+        // All fluids of the row, on top of each other:
+        int sampled = 0;
+        for (int k = 0; k < FLUID_COUNT; k++) {
+            if (!(present & (1 << k)))
+                continue;
+            const float *row0 = &f->alpha[(cell_y * FLUID_COUNT + k) *
+                f->map_x];
+            const float *row1 = row0 + FLUID_COUNT * f->map_x;
+            int cx0 = fluid_draw_cell_x[first];
+            int cx1 = fluid_draw_cell_x[last] + 1;
+            if (previous) {
+                // Fade over from the previous frame:
+                const float *prev0 = &previous->alpha[(cell_y *
+                    FLUID_COUNT + k) * f->map_x];
+                const float *prev1 = prev0 + FLUID_COUNT * f->map_x;
+                for (int cx = cx0; cx <= cx1; cx++) {
+                    float a = row0[cx] + (row1[cx] - row0[cx]) * weight_y;
+                    float p = prev0[cx] +
+                        (prev1[cx] - prev0[cx]) * weight_y;
+                    fluid_column_alpha[cx] = p + (a - p) * weight;
+                }
+            } else {
+                for (int cx = cx0; cx <= cx1; cx++) {
+                    fluid_column_alpha[cx] = row0[cx] +
+                        (row1[cx] - row0[cx]) * weight_y;
+                }
+            }
+
+            int any = 0;
+            for (int x = x0; x < x1; x++) {
+                int sx = x + jitter;
+                if (sx < 0) sx = 0;
+                if (sx > xsize - 1) sx = xsize - 1;
+                int cx = fluid_draw_cell_x[sx];
+                float a = fluid_column_alpha[cx] +
+                    (fluid_column_alpha[cx + 1] - fluid_column_alpha[cx]) *
+                    fluid_draw_weight_x[sx];
+                fluid_row_alpha[x - x0] = a;
+                any |= (a > 0);
+            }
+            if (!any)
+                continue;
+
+            // All fluids are shaded with the water texture:
+            if (!sampled) {
+                fluidtexture_sampleRow(fluid_water_texture,
+                    x0 + fluid_draw_view_x, y + fluid_draw_view_y, x1 - x0,
+                    f->scroll_x, f->scroll_y, fluid_row_colors);
+                sampled = 1;
+            }
+            fluidtexture_blendRow(pixels + y * pitch + 4 * x0,
+                fluid_tintRow(f, k, x1 - x0), fluid_row_alpha, x1 - x0);
+        }
+    }
 }
 
 void fluid_drawAll(int xsize, int ysize) {
-	int x = 0;
-    int y = 0; 
-	pthread_mutex_lock(fluid_access);
-    for (int i = 0; i < xsize * ysize; ++i) {
-		fluid_drawAllIfThere(x, y, xsize);
+    // Draws the latest published frame, never waits for the simulation.
+    // The screen shows the part of the world at the viewport:
+    const struct fluid_frame *f = fluid_pickUpFrame();
+    int view_x, view_y;
+    simulation_getViewport(&view_x, &view_y);
+    if (!fluid_loadWaterTexture() || f->map_x < 2 || f->map_y < 2 ||
+            !fluid_prepareDrawBuffers(f, xsize, view_x)) {
+        return;
+    }
+    fluid_draw_view_y = view_y;
+    fluid_jitter_index = (unsigned int)random_next();
 
-        // Advance coordinates:
-        x++;
-        if (x >= xsize) {
-            x -= xsize;
-            y++;
+    // Draw the tiles of both frames while fading, so fluid that is gone
+    // in the front frame fades out as well:
+    const struct fluid_frame *previous =
+        &fluid_frames[fluid_frame_previous];
+    float weight = fluid_interpolationWeight(f, previous);
+    for (int i = 0; i < f->tile_count; i++) {
+        fluid_draw_present[f->tiles[i]] |= f->present[i];
+    }
+    if (weight < 1) {
+        for (int i = 0; i < previous->tile_count; i++) {
+            fluid_draw_present[previous->tiles[i]] |= previous->present[i];
         }
+    } else {
+        previous = NULL;
     }
+
+    double tile_pixels = FLUID_TILE_SIZE * f->reduce_factor;
+    for (int tile = 0; tile < f->tiles_x * f->tiles_y; tile++) {
+        unsigned char present = fluid_draw_present[tile];
+        if (!present)
+            continue;
+        fluid_draw_present[tile] = 0;
+        int x0 = (int)((tile % f->tiles_x) * tile_pixels) - view_x;
+        int y0 = (int)((tile / f->tiles_x) * tile_pixels) - view_y;
+        int x1 = (int)((tile % f->tiles_x + 1) * tile_pixels) - view_x;
+        int y1 = (int)((tile / f->tiles_x + 1) * tile_pixels) - view_y;
+
+        // The last row/column of tiles covers the rest of the screen,
+        // tiles outside of it are skipped:
+        if (x1 > xsize || tile % f->tiles_x == f->tiles_x - 1)
+            x1 = xsize;
+        if (y1 > ysize || tile / f->tiles_x == f->tiles_y - 1)
+            y1 = ysize;
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+        fluid_drawRows(f, previous, weight, x0, x1, y0, y1, xsize,
+            present);
+    }
+}
+
+static void fluid_clearAll() {
+    sparsegrid_clear(fluid_map, 0, sizeof(fluid_amount) * FLUID_COUNT *
+        fluid_map_x * fluid_map_y);
+    sparsegrid_clear(fluid_map_back, 0, sizeof(fluid_amount) *
+        FLUID_COUNT * fluid_map_x * fluid_map_y);
+    memset(fluid_tile_active, 0, fluid_tiles_x * fluid_tiles_y);
+    memset(fluid_tile_asleep, 0, fluid_tiles_x * fluid_tiles_y);
+    memset(fluid_tile_max, 0, sizeof(fluid_amount) *
+        fluid_tiles_x * fluid_tiles_y);
+    for (int i = 0; i < FLUID_COUNT; i++) {
+        memset(fluid_tile_volume[i], 0, sizeof(double) *
+            fluid_tiles_x * fluid_tiles_y);
+        memset(fluid_tile_wet[i], 0, sizeof(int) *
+            fluid_tiles_x * fluid_tiles_y);
+    }
+    fluid_clearPipes();
+}
+
+static double fluid_coverage(int type) {
+    // Share of the map that is wet, with the maps locked by the caller:
+    if (!fluid_tile_wet[type] || fluid_map_x <= 0 || fluid_map_y <= 0)
+        return 0;
+    int wet = 0;
+    for (int tile = 0; tile < fluid_tiles_x * fluid_tiles_y; tile++) {
+        wet += fluid_tile_wet[type][tile];
+    }
+    return (double)wet / ((double)fluid_map_x * fluid_map_y);
+}
+
+static void fluid_drainTile(int type, int tile, double fraction) {
+    int x0, y0, x1, y1;
+    fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            fluid_setAmount(type, x, y,
+                fluid_map[fluid_cell(type, x, y)] * (1.0 - fraction));
+        }
+    }
+}
+
+// Every drain step takes this share of the water in the fullest tile:
+#define FLUID_DRAIN_FRACTION 0.02
+
+uint64_t autodrain_ts = 0;
+static void fluid_autoDrain() {
+    // Make sure timestamp doesn't fall too far behind:
+    uint64_t now = simclock_ms();
+    if (autodrain_ts + 5000 < now)
+        autodrain_ts = now;
+
+    // Drain the fluids where necessary:
+    size_t steps = (now - autodrain_ts) / 200;
+    autodrain_ts += steps * 200;
+    if (steps > 0) {
+        for (int type = 0; type < FLUID_COUNT; type++) {
+            double coverage = fluid_coverage(type);
+            if (coverage > 0.4) {
+                for (size_t i = 0; i < steps; i++) {
+                    int fullest = -1;
+                    for (int tile = 0; tile < fluid_tiles_x *
+                            fluid_tiles_y; tile++) {
+                        if (fullest < 0 || fluid_tile_volume[type][tile] >
+                                fluid_tile_volume[type][fullest])
+                            fullest = tile;
+                    }
+                    if (fullest >= 0)
+                        fluid_drainTile(type, fullest, FLUID_DRAIN_FRACTION);
+                }
+            }
+        }
+    }
+}
+
+static void fluid_settleFluids() {
+    // The basins span the whole map, so sample the ground of every tile:
+    if (!fluid_settler) {
+        fluid_settler = fluidsettle_create(fluid_map_x, fluid_map_y);
+        if (!fluid_settler) {
+            fprintf(stderr, "clib/fluid.c: error: out of memory "
+                "for settling\n");
+            return;
+        }
+    }
+    fluid_tile_list_count = fluid_tiles_x * fluid_tiles_y;
+    for (int tile = 0; tile < fluid_tile_list_count; tile++) {
+        fluid_tile_list[tile] = tile;
+    }
+    fluid_terrain_stamp++;
+    fluid_updateTerrain();
+
+    for (int k = 0; k < FLUID_COUNT; k++) {
+        int present = 0;
+        for (int tile = 0; tile < fluid_tile_list_count; tile++) {
+            if (fluid_tile_volume[k][tile] > 0)
+                present = 1;
+        }
+        if (present) {
+            fluidsettle_run(fluid_settler, fluid_terrain, fluid_map,
+                FLUID_COUNT, k);
+        }
+    }
+
+    // Settled fluid holds still, nothing left over from before:
+    memset(fluid_tile_asleep, 0, fluid_tiles_x * fluid_tiles_y);
+    workerpool_run(fluid_pool, fluid_tile_list_count,
+        fluid_tileStatsTask, NULL);
+    fluid_updateTileActivity();
+    sparsegrid_clear(fluid_map_back, 0, sizeof(fluid_amount) *
+        FLUID_COUNT * fluid_map_x * fluid_map_y);
+    for (int tile = 0; tile < fluid_tile_list_count; tile++) {
+        if (!fluid_tile_active[tile])
+            continue;
+        int x0, y0, x1, y1;
+        fluid_getTileRegion(tile, &x0, &y0, &x1, &y1);
+        for (int y = y0; y < y1; y++) {
+            for (int k = 0; k < FLUID_COUNT; k++) {
+                int i = fluid_cell(k, x0, y);
+                memcpy(&fluid_map_back[i], &fluid_map[i],
+                    sizeof(fluid_amount) * (x1 - x0));
+            }
+        }
+    }
+    fluid_clearPipes();
+}
+
+static int fluid_settleIsDue() {
+    int requested = __atomic_exchange_n(&fluid_settle_requested, 0,
+        __ATOMIC_ACQ_REL);
+    int64_t interval = __atomic_load_n(&fluid_settle_interval,
+        __ATOMIC_RELAXED);
+    int64_t now = simclock_now();
+    if (interval > 0 && now - fluid_settle_last >= interval)
+        requested = 1;
+    if (requested)
+        fluid_settle_last = now;
+    return requested;
+}
+
+uint64_t last_water_scroll = 0;
+
+void fluid_updateAll() {
+    uint64_t now = simclock_ms();
+    while (last_water_scroll < now) {
+        water_scroll_offset_x += 1;
+        water_scroll_offset_y += 1;
+        last_water_scroll += 150;
+
+        // Make sure we catch up:
+        if (last_water_scroll + 2000 < now) {
+            last_water_scroll = now;
+        }
+    }
+
+    // Check how many fluid updates we want to do:
+	int fluidUpdates = simulation_getFluidUpdateCount();
+    int reset = __atomic_exchange_n(&fluid_reset_requested, 0,
+        __ATOMIC_ACQ_REL);
+    int spawns = __atomic_exchange_n(&fluid_spawns_requested, 0,
+        __ATOMIC_ACQ_REL);
+    int settle = fluid_settleIsDue();
+    if (fluidUpdates <= 0 && !reset && !spawns && !settle)
+        return;
+
+    // Update all fluids, looking at the ground as it was at the start:
+	pthread_mutex_lock(fluid_access);
+    fluid_ground = topology_acquireSnapshot();
+    if (reset)
+        fluid_clearAll();
+    for (int i = 0; i < spawns; i++) {
+        fluid_spawnRandomly();
+    }
+    if (fluidUpdates > 0) {
+        fluid_terrain_stamp++;
+        fluid_applyEmitters(fluidUpdates /
+            SIMULATION_FLUID_STEPS_PER_SECOND);
+        if (fluid_engine == FLUID_ENGINE_STENCIL) {
+            fluid_updateAllStencil(fluidUpdates);
+        } else if (fluid_engine == FLUID_ENGINE_PIPES) {
+            fluid_updateAllPipes(fluidUpdates);
+        } else {
+            fluid_updateAllLegacy(fluidUpdates);
+        }
+        fluid_autoDrain();
+    }
+    if (settle)
+        fluid_settleFluids();
+    fluid_publishFrame();
+    topology_releaseSnapshot(fluid_ground);
+    fluid_ground = NULL;
 	pthread_mutex_unlock(fluid_access);
 }
 
@@ -419,31 +1639,140 @@ static void *fluid_simulationThread(__attribute__((unused)) void *userdata) {
     return NULL;
 }
 
+static void fluid_freeMaps() {
+    size_t map_size = sizeof(fluid_amount) * FLUID_COUNT *
+        fluid_map_x * fluid_map_y;
+    sparsegrid_free(fluid_map, map_size);
+    sparsegrid_free(fluid_map_back, map_size);
+    sparsegrid_free(fluid_flux, 4 * map_size);
+    sparsegrid_free(fluid_velocity_x, map_size);
+    sparsegrid_free(fluid_velocity_y, map_size);
+    sparsegrid_free(fluid_terrain, sizeof(fluid_amount) *
+        fluid_map_x * fluid_map_y);
+    free(fluid_tile_max_speed);
+    free(fluid_tile_piped);
+    fluid_tile_piped = NULL;
+    free(fluid_tile_active);
+    free(fluid_tile_settled);
+    free(fluid_tile_asleep);
+    free(fluid_tile_max);
+    for (int i = 0; i < FLUID_COUNT; i++) {
+        free(fluid_tile_volume[i]);
+        free(fluid_tile_wet[i]);
+    }
+    free(fluid_tile_list);
+    free(fluid_tile_present);
+    free(fluid_tile_terrain_stamp);
+    fluidsettle_destroy(fluid_settler);
+    fluid_settler = NULL;
+}
+
+static void fluid_allocMaps() {
+    // Everything sized for fluid_map_x, fluid_map_y, starting out dry.
+    // The maps only take up memory where there is fluid (see
+    // fluid_releaseTileRow()), so the world can be large:
+    fluid_tiles_x = (fluid_map_x + FLUID_TILE_SIZE - 1) / FLUID_TILE_SIZE;
+    fluid_tiles_y = (fluid_map_y + FLUID_TILE_SIZE - 1) / FLUID_TILE_SIZE;
+    size_t map_size = sizeof(fluid_amount) * FLUID_COUNT *
+        fluid_map_x * fluid_map_y;
+    fluid_map = (fluid_amount *)sparsegrid_alloc(map_size);
+    fluid_map_back = (fluid_amount *)sparsegrid_alloc(map_size);
+    fluid_terrain = (fluid_amount *)sparsegrid_alloc(sizeof(fluid_amount) *
+        fluid_map_x * fluid_map_y);
+    fluid_flux = (fluid_amount *)sparsegrid_alloc(4 * map_size);
+    fluid_velocity_x = (fluid_amount *)sparsegrid_alloc(map_size);
+    fluid_velocity_y = (fluid_amount *)sparsegrid_alloc(map_size);
+    fluid_tile_max_speed = (double *)malloc(sizeof(double) *
+        fluid_tiles_x * fluid_tiles_y);
+    fluid_tile_piped = (unsigned char *)malloc(fluid_tiles_x *
+        fluid_tiles_y);
+    memset(fluid_tile_piped, 0, fluid_tiles_x * fluid_tiles_y);
+    fluid_tile_active = (unsigned char *)malloc(fluid_tiles_x *
+        fluid_tiles_y);
+    memset(fluid_tile_active, 0, fluid_tiles_x * fluid_tiles_y);
+    fluid_tile_settled = (unsigned char *)malloc(fluid_tiles_x *
+        fluid_tiles_y);
+    memset(fluid_tile_settled, 0, fluid_tiles_x * fluid_tiles_y);
+    fluid_tile_asleep = (unsigned char *)malloc(fluid_tiles_x *
+        fluid_tiles_y);
+    memset(fluid_tile_asleep, 0, fluid_tiles_x * fluid_tiles_y);
+    fluid_tile_max = (fluid_amount *)malloc(sizeof(fluid_amount) *
+        fluid_tiles_x * fluid_tiles_y);
+    memset(fluid_tile_max, 0, sizeof(fluid_amount) *
+        fluid_tiles_x * fluid_tiles_y);
+    for (int i = 0; i < FLUID_COUNT; i++) {
+        fluid_tile_volume[i] = (double *)malloc(sizeof(double) *
+            fluid_tiles_x * fluid_tiles_y);
+        memset(fluid_tile_volume[i], 0, sizeof(double) *
+            fluid_tiles_x * fluid_tiles_y);
+        fluid_tile_wet[i] = (int *)malloc(sizeof(int) *
+            fluid_tiles_x * fluid_tiles_y);
+        memset(fluid_tile_wet[i], 0, sizeof(int) *
+            fluid_tiles_x * fluid_tiles_y);
+    }
+    fluid_tile_list = (int *)malloc(sizeof(int) *
+        fluid_tiles_x * fluid_tiles_y);
+    fluid_tile_list_count = 0;
+    fluid_tile_present = (unsigned char *)malloc(fluid_tiles_x *
+        fluid_tiles_y);
+    memset(fluid_tile_present, 0, fluid_tiles_x * fluid_tiles_y);
+    fluid_tile_terrain_stamp = (unsigned int *)malloc(sizeof(unsigned int) *
+        fluid_tiles_x * fluid_tiles_y);
+    memset(fluid_tile_terrain_stamp, 0, sizeof(unsigned int) *
+        fluid_tiles_x * fluid_tiles_y);
+    fluid_clearPipes();
+}
+
 void fluid_init(int width, int height) {
     int new_fluid_map_x = (int)((double)width / reduce_factor);
     int new_fluid_map_y = (int)((double)height / reduce_factor);
-    if (fluid_map[0]) {
-        if (fluid_map_x == new_fluid_map_x &&
-                fluid_map_y == new_fluid_map_y) {
-            return;
-        }
-        for (int i = 0; i < FLUID_COUNT; i++) {
-            free(fluid_map[i]);
+    if (!fluid_jitter) {
+        fluid_jitter = random_createJitterTable(FLUID_JITTER_TABLE_SIZE,
+            -2, 1);
+        if (!fluid_jitter) {
+            fprintf(stderr, "clib/fluid.c: error: "
+                "out of memory, drawing water without jitter\n");
         }
     }
+    if (fluid_map && fluid_world_x == width && fluid_world_y == height &&
+            fluid_map_x == new_fluid_map_x &&
+            fluid_map_y == new_fluid_map_y) {
+        return;
+    }
     if (!fluid_access) {
         fluid_access = malloc(sizeof(*fluid_access));
         pthread_mutex_init(fluid_access, NULL);
     }
+
+    // Spawn new water where something is held up high, except at the
+    // border of the screen. This roughly matches the rate of the former
+    // periodic scan, which added 0.5 per cell every 550 ms:
+    if (fluid_default_emitter >= 0)
+        fluidemitter_remove(fluid_default_emitter);
+    struct fluidemitter e;
+    memset(&e, 0, sizeof(e));
+    e.kind = FLUIDEMITTER_HEIGHT;
+    e.type = FLUID_WATER;
+    e.x = width * 0.1;
+    e.y = height * 0.1;
+    e.w = width * 0.8;
+    e.h = height * 0.8;
+    e.min_height = 0.95;
+    e.rate = 0.5 / 0.55;
+    fluid_default_emitter = fluidemitter_add(&e);
+
     pthread_mutex_lock(fluid_access);
+    fluid_freeMaps();
+    fluid_world_x = width;
+    fluid_world_y = height;
     fluid_map_x = new_fluid_map_x;
     fluid_map_y = new_fluid_map_y;
-    for (int i = 0; i < FLUID_COUNT; i++) {
-        fluid_map[i] = (double *)malloc(sizeof(double) *
-            fluid_map_x * fluid_map_y);
-        memset(fluid_map[i], 0, sizeof(double) *
-            fluid_map_x * fluid_map_y);
-    }
+    if (!fluid_pool)
+        fluid_pool = fluid_pickPool();
+    if (fluid_pool && fluid_pool != workerpool_shared())
+        fluid_own_pool = fluid_pool;
+    fluid_allocMaps();
+    fluid_initAlphaLut();
     pthread_mutex_unlock(fluid_access);
     if (!fluid_thread) {
         fluid_thread = malloc(sizeof(*fluid_thread));
@@ -451,45 +1780,270 @@ void fluid_init(int width, int height) {
     } 
 }
 
-void fluid_resetAll() {
-    pthread_mutex_lock(fluid_access);
-    for (int i = 0; i < FLUID_COUNT; i++) {
-        memset(fluid_map[i], 0, sizeof(double) *
-            fluid_map_x * fluid_map_y);
+static void fluid_rescanTiles() {
+    // Find out where the fluid is after replacing all of it:
+    fluid_tile_list_count = fluid_tiles_x * fluid_tiles_y;
+    for (int tile = 0; tile < fluid_tile_list_count; tile++) {
+        fluid_tile_list[tile] = tile;
+        fluid_updateTileStats(tile);
     }
-    pthread_mutex_unlock(fluid_access);
+    fluid_updateTileActivity();
 }
 
-uint64_t autodrain_ts = 0;
-void fluid_autoDrain() {
-    pthread_mutex_lock(fluid_access);
+static void fluid_resampleLine(const double *in, int in_count,
+        double in_size, double *out, int out_count, double out_size) {
+    // Average of the input cells overlapping each output cell. Cells are
+    // in_size and out_size screen pixels wide, starting at pixel 0:
+    for (int o = 0; o < out_count; o++) {
+        double a = o * out_size;
+        double b = a + out_size;
+        int first = (int)(a / in_size);
+        int last = (int)ceil(b / in_size);
+        if (last > in_count) last = in_count;
+        double sum = 0;
+        for (int i = first; i < last; i++) {
+            double overlap = fmin(b, (i + 1) * in_size) -
+                fmax(a, i * in_size);
+            if (overlap > 0)
+                sum += in[i] * overlap;
+        }
+        out[o] = sum / out_size;
+    }
+}
 
-    // Make sure timestamp doesn't fall too far behind:
-    if (autodrain_ts + 5000 < SDL_GetTicks())
-        autodrain_ts = SDL_GetTicks();
+static void fluid_resample(const fluid_amount *old_map, int old_x,
+        int old_y, double old_factor) {
+    // The amounts are depths, so the new cells get the average depth of
+    // the area they cover:
+    int line = (old_x > old_y ? old_x : old_y);
+    if (fluid_map_x > line) line = fluid_map_x;
+    if (fluid_map_y > line) line = fluid_map_y;
+    double *rows = malloc(sizeof(double) * old_y * fluid_map_x);
+    double *in = malloc(sizeof(double) * line);
+    double *out = malloc(sizeof(double) * line);
+    if (!rows || !in || !out) {
+        fprintf(stderr, "clib/fluid.c: error: "
+            "out of memory, fluid lost when changing resolution\n");
+        free(rows);
+        free(in);
+        free(out);
+        return;
+    }
+    for (int k = 0; k < FLUID_COUNT; k++) {
+        double old_volume = 0;
+        for (int y = 0; y < old_y; y++) {
+            const fluid_amount *row = old_map + (y * FLUID_COUNT + k) * old_x;
+            for (int x = 0; x < old_x; x++) {
+                in[x] = row[x];
+                old_volume += row[x];
+            }
+            fluid_resampleLine(in, old_x, old_factor,
+                rows + y * fluid_map_x, fluid_map_x, reduce_factor);
+        }
+        double new_volume = 0;
+        for (int x = 0; x < fluid_map_x; x++) {
+            for (int y = 0; y < old_y; y++) {
+                in[y] = rows[x + y * fluid_map_x];
+            }
+            fluid_resampleLine(in, old_y, old_factor,
+                out, fluid_map_y, reduce_factor);
+            for (int y = 0; y < fluid_map_y; y++) {
+                // The map starts out zero, leave dry parts untouched:
+                if (out[y] != 0)
+                    fluid_map[fluid_cell(k, x, y)] = out[y];
+                new_volume += out[y];
+            }
+        }
 
-    // Drain the fluids where necessary:
-    size_t steps = (SDL_GetTicks() - autodrain_ts) / 200;
-    if (steps > 0) {
-        for (int type = 0; type < FLUID_COUNT; type++) {
-            double coverage = fluid_getCoverage(type);
-            if (coverage > 0.4) {
-                for (size_t i = 0; i < steps; i++) {
-                    for (size_t k = 0; k < 10; k++) {
-                        int xpos = (rand0to1() * ((double)fluid_map_x));
-                        if (xpos >= fluid_map_x)
-                            xpos = fluid_map_x - 1;
-                        int ypos = (rand0to1() * ((double)fluid_map_y));
-                        if (ypos >= fluid_map_y)
-                            ypos = fluid_map_y - 1;
-                        fluid_map[type][xpos + ypos * fluid_map_x] = 0;
-                    }
+        // Cells cut off at the screen border don't line up exactly
+        // between resolutions, make up for what got lost there:
+        old_volume *= old_factor * old_factor;
+        new_volume *= reduce_factor * reduce_factor;
+        if (new_volume > 0) {
+            double scale = old_volume / new_volume;
+            for (int y = 0; y < fluid_map_y; y++) {
+                fluid_amount *row = &fluid_map[fluid_cell(k, 0, y)];
+                for (int x = 0; x < fluid_map_x; x++) {
+                    if (row[x] != 0)
+                        row[x] *= scale;
                 }
             }
         }
     }
+    free(rows);
+    free(in);
+    free(out);
+}
+
+void fluid_setResolution(double factor) {
+    if (factor < FLUID_MIN_REDUCE_FACTOR || factor > FLUID_MAX_REDUCE_FACTOR)
+        return;
+    if (!fluid_access || !fluid_map) {
+        reduce_factor = factor;
+        return;
+    }
+    pthread_mutex_lock(fluid_access);
+    int new_fluid_map_x = (int)((double)fluid_world_x / factor);
+    int new_fluid_map_y = (int)((double)fluid_world_y / factor);
+    if (factor == reduce_factor || new_fluid_map_x < 2 ||
+            new_fluid_map_y < 2) {
+        pthread_mutex_unlock(fluid_access);
+        return;
+    }
+
+    // Keep the fluid around while everything else is set up again:
+    fluid_amount *old_map = fluid_map;
+    int old_x = fluid_map_x;
+    int old_y = fluid_map_y;
+    double old_factor = reduce_factor;
+    fluid_map = NULL;
+    fluid_freeMaps();
+    reduce_factor = factor;
+    fluid_map_x = new_fluid_map_x;
+    fluid_map_y = new_fluid_map_y;
+    fluid_allocMaps();
+    fluid_resample(old_map, old_x, old_y, old_factor);
+    sparsegrid_free(old_map, sizeof(fluid_amount) * FLUID_COUNT *
+        old_x * old_y);
+    fluid_rescanTiles();
+    pthread_mutex_unlock(fluid_access);
+}
+
+double fluid_getResolution() {
+    return reduce_factor;
+}
+
+fluid_amount *fluid_copyState(int *map_x, int *map_y,
+        double *factor) {
+    if (!fluid_access || !fluid_map)
+        return NULL;
+    pthread_mutex_lock(fluid_access);
+    size_t size = sizeof(fluid_amount) * FLUID_COUNT *
+        fluid_map_x * fluid_map_y;
+    fluid_amount *copy = malloc(size);
+    if (copy) {
+        memcpy(copy, fluid_map, size);
+        *map_x = fluid_map_x;
+        *map_y = fluid_map_y;
+        *factor = reduce_factor;
+    }
+    pthread_mutex_unlock(fluid_access);
+    return copy;
+}
+
+int fluid_restoreState(const fluid_amount *map, int map_x, int map_y,
+        double factor) {
+    if (!fluid_access || !fluid_map || map_x <= 0 || map_y <= 0 ||
+            factor <= 0)
+        return 0;
+    fluid_setResolution(factor);
+    pthread_mutex_lock(fluid_access);
+    size_t size = sizeof(fluid_amount) * FLUID_COUNT *
+        fluid_map_x * fluid_map_y;
+    sparsegrid_clear(fluid_map_back, 0, size);
+    fluid_clearPipes();
+    memset(fluid_tile_asleep, 0, fluid_tiles_x * fluid_tiles_y);
+    sparsegrid_clear(fluid_map, 0, size);
+    if (map_x == fluid_map_x && map_y == fluid_map_y &&
+            factor == reduce_factor) {
+        // Only copy what holds fluid, so dry parts stay untouched:
+        for (size_t i = 0; i < size / sizeof(fluid_amount); i++) {
+            if (map[i] != 0)
+                fluid_map[i] = map[i];
+        }
+    } else {
+        // Saved with another screen size or resolution:
+        fluid_resample(map, map_x, map_y, factor);
+    }
+    fluid_rescanTiles();
+    pthread_mutex_unlock(fluid_access);
+    return 1;
+}
+
+void fluid_resetAll() {
+    // Done by the simulation thread before its next update:
+    __atomic_store_n(&fluid_reset_requested, 1, __ATOMIC_RELEASE);
+}
+
+void fluid_settleAll() {
+    // Done by the simulation thread before its next update:
+    __atomic_store_n(&fluid_settle_requested, 1, __ATOMIC_RELEASE);
+}
 
+void fluid_setSettleInterval(double seconds) {
+    int64_t interval = (seconds > 0 ? (int64_t)(seconds * 1e9) : 0);
+    __atomic_store_n(&fluid_settle_interval, interval, __ATOMIC_RELAXED);
+}
+
+double fluid_getCoverage(int type) {
+    if (!fluid_access || type < 0 || type >= FLUID_COUNT)
+        return 0;
+    pthread_mutex_lock(fluid_access);
+    double coverage = fluid_coverage(type);
     pthread_mutex_unlock(fluid_access);
+    return coverage;
+}
+
+static double fluid_volumeScale() {
+    // Amounts are fluid depths, so a cell holds more fluid when the grid
+    // is coarser. Volumes are given in cells of the default resolution:
+    double scale = reduce_factor / FLUID_DEFAULT_REDUCE_FACTOR;
+    return scale * scale;
 }
 
+size_t fluid_getMemoryUsage() {
+    if (!fluid_access)
+        return 0;
+    pthread_mutex_lock(fluid_access);
+    size_t map_size = sizeof(fluid_amount) * FLUID_COUNT *
+        fluid_map_x * fluid_map_y;
+    size_t usage = sparsegrid_residentSize(fluid_map, map_size) +
+        sparsegrid_residentSize(fluid_map_back, map_size) +
+        sparsegrid_residentSize(fluid_flux, 4 * map_size) +
+        sparsegrid_residentSize(fluid_velocity_x, map_size) +
+        sparsegrid_residentSize(fluid_velocity_y, map_size) +
+        sparsegrid_residentSize(fluid_terrain, sizeof(fluid_amount) *
+        fluid_map_x * fluid_map_y);
+    pthread_mutex_unlock(fluid_access);
+    return usage;
+}
 
+double fluid_getVolume(int type) {
+    if (!fluid_access || type < 0 || type >= FLUID_COUNT)
+        return 0;
+    pthread_mutex_lock(fluid_access);
+    double volume = 0;
+    for (int tile = 0; fluid_tile_volume[type] &&
+            tile < fluid_tiles_x * fluid_tiles_y; tile++) {
+        volume += fluid_tile_volume[type][tile];
+    }
+    volume *= fluid_volumeScale();
+    pthread_mutex_unlock(fluid_access);
+    return volume;
+}
+
+void fluid_getTileGrid(int *tiles_x, int *tiles_y) {
+    *tiles_x = fluid_tiles_x;
+    *tiles_y = fluid_tiles_y;
+}
+
+int fluid_getTileStats(int type, double *volumes, int *wet_cells,
+        int max_tiles) {
+    if (!fluid_access || type < 0 || type >= FLUID_COUNT)
+        return 0;
+    pthread_mutex_lock(fluid_access);
+    int count = fluid_tiles_x * fluid_tiles_y;
+    if (count > max_tiles)
+        count = max_tiles;
+    if (!fluid_tile_volume[type] || count < 0)
+        count = 0;
+    double scale = fluid_volumeScale();
+    for (int tile = 0; tile < count; tile++) {
+        if (volumes)
+            volumes[tile] = fluid_tile_volume[type][tile] * scale;
+        if (wet_cells)
+            wet_cells[tile] = fluid_tile_wet[type][tile];
+    }
+    pthread_mutex_unlock(fluid_access);
+    return count;
+}
@@ -1,14 +1,82 @@
 
+#ifndef _SANDBOX_FLUID_H_
+#define _SANDBOX_FLUID_H_
+
+#include <stddef.h>
+
+// Fluid amounts are stored as float to halve the memory traffic per step.
+// Build with -DFLUID_DOUBLE_PRECISION to store them as double instead:
+#ifdef FLUID_DOUBLE_PRECISION
+typedef double fluid_amount;
+#else
+typedef float fluid_amount;
+#endif
+
 #define FLUID_WATER 0
-#define FLUID_COUNT 1
+#define FLUID_LAVA 1
+#define FLUID_MUD 2
+#define FLUID_COUNT 3
+
+// Screen pixels per fluid cell edge:
+#define FLUID_DEFAULT_REDUCE_FACTOR 5.0
+#define FLUID_MIN_REDUCE_FACTOR 2.0
+#define FLUID_MAX_REDUCE_FACTOR 20.0
 
+#define FLUID_ENGINE_LEGACY 0
+#define FLUID_ENGINE_STENCIL 1
+#define FLUID_ENGINE_PIPES 2
+
+// The fluid covers a world of xsize * ysize pixels, which may be larger
+// than the screen. Spawning and drawing are in screen pixels, relative to
+// the viewport (see simulation_getViewport()):
 void fluid_init(int xsize, int ysize);
 void fluid_spawn(int type, int x, int y, double amount);
+// Spawning random water and resetting are only requested here, and
+// carried out by the simulation thread before its next update:
 void fluid_randomSpawns();
+// Draws the latest finished simulation step without waiting for the
+// simulation thread:
 void fluid_drawAll(int xsize, int ysize);
 void fluid_resetAll();
+// Move all fluid straight to where it would come to rest, filling up the
+// basins of the ground. Also a request, optionally repeated every given
+// amount of seconds (0 turns that off):
+void fluid_settleAll();
+void fluid_setSettleInterval(double seconds);
 void fluid_waterColorAt(int x, int y,
         int *r, int *g, int *b);
 double fluid_getCoverage(int type);
-void fluid_autoDrain();
 
+// Totals that are kept up to date per tile, so they are cheap to query:
+double fluid_getVolume(int type);
+// Bytes of memory the fluid maps take up, which depends on how much of
+// the world is wet rather than on its size:
+size_t fluid_getMemoryUsage();
+void fluid_getTileGrid(int *tiles_x, int *tiles_y);
+int fluid_getTileStats(int type, double *volumes, int *wet_cells,
+    int max_tiles);
+void fluid_setEngine(int engine);
+// viscosity goes from 0 (flows like water) to 1 (doesn't flow at all),
+// tint from 0 (shaded like water) to 1 (just the r, g, b colour):
+void fluid_setProperties(int type, double viscosity, int r, int g, int b,
+    double tint);
+void fluid_setThreadCount(int threads);
+// Change the size of the fluid cells at runtime. The fluid is resampled
+// to the new grid, keeping the volume of every fluid:
+void fluid_setResolution(double reduce_factor);
+double fluid_getResolution();
+// Let still regions of the stencil engine update less often:
+void fluid_setLOD(int enabled);
+// Fade drawing between the last two simulation steps, so the fluid moves
+// smoothly even though it only steps a few times per second:
+void fluid_setInterpolation(int enabled);
+
+// Copy of all fluid amounts (FLUID_COUNT fluids interleaved by row, the
+// amount of fluid t at x, y is at (y * FLUID_COUNT + t) * map_x + x), to
+// be freed by the caller. Restoring resamples the amounts if the grid
+// doesn't match the current one:
+fluid_amount *fluid_copyState(int *map_x, int *map_y, double *reduce_factor);
+int fluid_restoreState(const fluid_amount *map, int map_x, int map_y,
+    double reduce_factor);
+
+#endif  // _SANDBOX_FLUID_H_
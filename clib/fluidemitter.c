@@ -0,0 +1,436 @@
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fluid.h"
+#include "fluidemitter.h"
+#include "topology.h"
+
+struct fluidemitter_entry {
+    int id;
+    int in_index;
+    struct fluidemitter emitter;
+};
+
+static pthread_mutex_t fluidemitter_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fluidemitter_entry *fluidemitter_list = NULL;
+static int fluidemitter_count = 0;
+static int fluidemitter_alloc = 0;
+static int fluidemitter_next_id = 1;
+static unsigned int fluidemitter_version = 1;
+
+// The index and what it was built for:
+static struct fluidemitter_index fluidemitter_index = { 0 };
+static unsigned int fluidemitter_index_version = 0;
+static int fluidemitter_index_map_x = 0;
+static int fluidemitter_index_map_y = 0;
+static double fluidemitter_index_reduce_factor = 0;
+static int fluidemitter_index_tile_size = 0;
+static int fluidemitter_index_uses_height = 0;
+// Ground under the cells, for height emitters, and what it was sampled
+// for:
+static double *fluidemitter_heights = NULL;
+static int fluidemitter_heights_map_x = 0;
+static int fluidemitter_heights_map_y = 0;
+static double fluidemitter_heights_reduce_factor = 0;
+static unsigned int fluidemitter_heights_topology = 0;
+
+int fluidemitter_add(const struct fluidemitter *e) {
+    if (e->kind < FLUIDEMITTER_POINT || e->kind > FLUIDEMITTER_HEIGHT) {
+        fprintf(stderr, "clib/fluidemitter.c: error: "
+            "invalid emitter kind %d\n", e->kind);
+        return -1;
+    }
+    if (e->type < 0 || e->type >= FLUID_COUNT) {
+        fprintf(stderr, "clib/fluidemitter.c: error: "
+            "invalid fluid type %d\n", e->type);
+        return -1;
+    }
+    pthread_mutex_lock(&fluidemitter_lock);
+    if (fluidemitter_count >= fluidemitter_alloc) {
+        int new_alloc = (fluidemitter_alloc > 0 ?
+            fluidemitter_alloc * 2 : 16);
+        struct fluidemitter_entry *new_list = realloc(fluidemitter_list,
+            sizeof(*new_list) * new_alloc);
+        if (!new_list) {
+            pthread_mutex_unlock(&fluidemitter_lock);
+            return -1;
+        }
+        fluidemitter_list = new_list;
+        fluidemitter_alloc = new_alloc;
+    }
+    struct fluidemitter_entry *entry = &fluidemitter_list[fluidemitter_count];
+    entry->id = fluidemitter_next_id++;
+    entry->in_index = 0;
+    entry->emitter = *e;
+    fluidemitter_count++;
+    fluidemitter_version++;
+    int id = entry->id;
+    pthread_mutex_unlock(&fluidemitter_lock);
+    return id;
+}
+
+void fluidemitter_remove(int id) {
+    pthread_mutex_lock(&fluidemitter_lock);
+    for (int i = 0; i < fluidemitter_count; i++) {
+        if (fluidemitter_list[i].id == id) {
+            fluidemitter_list[i] = fluidemitter_list[fluidemitter_count - 1];
+            fluidemitter_count--;
+            fluidemitter_version++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fluidemitter_lock);
+}
+
+void fluidemitter_clear() {
+    pthread_mutex_lock(&fluidemitter_lock);
+    fluidemitter_count = 0;
+    fluidemitter_version++;
+    pthread_mutex_unlock(&fluidemitter_lock);
+}
+
+void fluidemitter_finishOnce() {
+    pthread_mutex_lock(&fluidemitter_lock);
+    int i = 0;
+    while (i < fluidemitter_count) {
+        if (fluidemitter_list[i].emitter.once &&
+                fluidemitter_list[i].in_index) {
+            fluidemitter_list[i] = fluidemitter_list[fluidemitter_count - 1];
+            fluidemitter_count--;
+            fluidemitter_version++;
+            continue;
+        }
+        i++;
+    }
+    pthread_mutex_unlock(&fluidemitter_lock);
+}
+
+static void fluidemitter_cellRange(double pos, double size,
+        double reduce_factor, int map_size, int *first, int *last) {
+    // All cells with their center inside, but always at least one:
+    *first = (int)(pos / reduce_factor);
+    *last = (int)((pos + size) / reduce_factor - 0.5);
+    if (*last < *first)
+        *last = *first;
+    if (*first < 0) *first = 0;
+    if (*last > map_size - 1) *last = map_size - 1;
+}
+
+// Visit the cells an emitter covers within the cells clip[0] .. clip[2] - 1,
+// clip[1] .. clip[3] - 1. Counts the entries per tile into counts if not
+// NULL, fills them in at fill[tile] if not NULL. Returns how many cells it
+// covers there:
+static int fluidemitter_resolve(const struct fluidemitter *e,
+        int map_x, int map_y, double reduce_factor, int tile_size,
+        const int *clip, int *counts, int *fill) {
+    struct fluidemitter_index *index = &fluidemitter_index;
+    if (e->x >= map_x * reduce_factor || e->y >= map_y * reduce_factor ||
+            (e->kind == FLUIDEMITTER_POINT && (e->x < 0 || e->y < 0)) ||
+            (e->kind != FLUIDEMITTER_POINT && e->w > 0 && e->x + e->w < 0) ||
+            (e->kind != FLUIDEMITTER_POINT && e->h > 0 && e->y + e->h < 0))
+        return 0;
+    int x0, y0, x1, y1;
+    if (e->kind == FLUIDEMITTER_POINT) {
+        fluidemitter_cellRange(e->x, 0, reduce_factor, map_x, &x0, &x1);
+        fluidemitter_cellRange(e->y, 0, reduce_factor, map_y, &y0, &y1);
+    } else if (e->kind == FLUIDEMITTER_HEIGHT && (e->w <= 0 || e->h <= 0)) {
+        x0 = 0;
+        y0 = 0;
+        x1 = map_x - 1;
+        y1 = map_y - 1;
+    } else {
+        fluidemitter_cellRange(e->x, e->w, reduce_factor, map_x, &x0, &x1);
+        fluidemitter_cellRange(e->y, e->h, reduce_factor, map_y, &y0, &y1);
+    }
+    if (x0 < clip[0]) x0 = clip[0];
+    if (y0 < clip[1]) y0 = clip[1];
+    if (x1 > clip[2] - 1) x1 = clip[2] - 1;
+    if (y1 > clip[3] - 1) y1 = clip[3] - 1;
+    double min_height = e->min_height * topology_getMaxPossibleHeight();
+
+    int covered = 0;
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            int cell = x + y * map_x;
+            if (e->kind == FLUIDEMITTER_HEIGHT &&
+                    fluidemitter_heights[cell] <= min_height)
+                continue;
+            covered++;
+            int tile = (x / tile_size) + (y / tile_size) * index->tiles_x;
+            if (counts)
+                counts[tile]++;
+            if (!fill)
+                continue;
+            int i = fill[tile]++;
+            index->cells[i] = cell;
+            index->types[i] = e->type;
+            index->once[i] = (e->once != 0);
+            index->rates[i] = e->rate;
+        }
+    }
+    return covered;
+}
+
+static void fluidemitter_freeIndex() {
+    struct fluidemitter_index *index = &fluidemitter_index;
+    free(index->tile_start);
+    free(index->cells);
+    free(index->types);
+    free(index->once);
+    free(index->rates);
+    free(index->used_tiles);
+    memset(index, 0, sizeof(*index));
+}
+
+static int fluidemitter_sampleHeights(int map_x, int map_y,
+        double reduce_factor, int *changed) {
+    // Keep the ground under the cells up to date, resampling only where
+    // it changed. changed gets the cells that did (x1, y1 exclusive):
+    unsigned int generation;
+    int x0, y0, x1, y1;
+    changed[0] = changed[1] = changed[2] = changed[3] = 0;
+    if (!fluidemitter_heights || fluidemitter_heights_map_x != map_x ||
+            fluidemitter_heights_map_y != map_y ||
+            fluidemitter_heights_reduce_factor != reduce_factor) {
+        free(fluidemitter_heights);
+        fluidemitter_heights = malloc(sizeof(double) * map_x * map_y);
+        if (!fluidemitter_heights)
+            return 0;
+        fluidemitter_heights_map_x = map_x;
+        fluidemitter_heights_map_y = map_y;
+        fluidemitter_heights_reduce_factor = reduce_factor;
+        generation = topology_getGeneration();
+        x0 = y0 = 0;
+        x1 = map_x;
+        y1 = map_y;
+    } else {
+        if (!topology_getChangedRegion(fluidemitter_heights_topology,
+                &generation, &x0, &y0, &x1, &y1)) {
+            return 1;
+        }
+        // From world pixels to the cells sampled in there:
+        x0 = (int)(x0 / reduce_factor) - 1;
+        y0 = (int)(y0 / reduce_factor) - 1;
+        x1 = (int)(x1 / reduce_factor) + 2;
+        y1 = (int)(y1 / reduce_factor) + 2;
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x1 > map_x) x1 = map_x;
+        if (y1 > map_y) y1 = map_y;
+    }
+    fluidemitter_heights_topology = generation;
+    if (x0 >= x1 || y0 >= y1)
+        return 1;
+    topology_sampleHeights(fluidemitter_heights, map_x, map_y,
+        reduce_factor, x0, y0, x1, y1);
+    changed[0] = x0;
+    changed[1] = y0;
+    changed[2] = x1;
+    changed[3] = y1;
+    return 1;
+}
+
+static void fluidemitter_dropEmptyOnce(int map_x, int map_y,
+        double reduce_factor, int tile_size, const int *all) {
+    // One-shot emitters are gone once applied. Those that cover no cell
+    // never are, so drop them right away:
+    int i = 0;
+    while (i < fluidemitter_count) {
+        if (fluidemitter_list[i].emitter.once &&
+                fluidemitter_resolve(&fluidemitter_list[i].emitter, map_x,
+                map_y, reduce_factor, tile_size, all, NULL, NULL) == 0) {
+            fluidemitter_list[i] = fluidemitter_list[fluidemitter_count - 1];
+            fluidemitter_count--;
+            fluidemitter_version++;
+            continue;
+        }
+        i++;
+    }
+}
+
+static int fluidemitter_build(int map_x, int map_y, double reduce_factor,
+        int tile_size) {
+    struct fluidemitter_index *index = &fluidemitter_index;
+    fluidemitter_freeIndex();
+    index->tiles_x = (map_x + tile_size - 1) / tile_size;
+    index->tiles_y = (map_y + tile_size - 1) / tile_size;
+    int tiles = index->tiles_x * index->tiles_y;
+    int all[4] = { 0, 0, map_x, map_y };
+    fluidemitter_dropEmptyOnce(map_x, map_y, reduce_factor, tile_size, all);
+
+    // Count entries per tile, then fill them in tile by tile:
+    int *counts = calloc(tiles + 1, sizeof(int));
+    index->tile_start = malloc(sizeof(int) * (tiles + 1));
+    index->used_tiles = malloc(sizeof(int) * tiles);
+    if (!counts || !index->tile_start || !index->used_tiles) {
+        free(counts);
+        return 0;
+    }
+    for (int i = 0; i < fluidemitter_count; i++) {
+        fluidemitter_resolve(&fluidemitter_list[i].emitter, map_x, map_y,
+            reduce_factor, tile_size, all, counts, NULL);
+    }
+    int total = 0;
+    for (int tile = 0; tile < tiles; tile++) {
+        index->tile_start[tile] = total;
+        if (counts[tile] > 0)
+            index->used_tiles[index->used_tile_count++] = tile;
+        total += counts[tile];
+        counts[tile] = index->tile_start[tile];
+    }
+    index->tile_start[tiles] = total;
+    index->cells = malloc(sizeof(int) * (total + 1));
+    index->types = malloc(total + 1);
+    index->once = malloc(total + 1);
+    index->rates = malloc(sizeof(double) * (total + 1));
+    if (!index->cells || !index->types || !index->once || !index->rates) {
+        free(counts);
+        return 0;
+    }
+    for (int i = 0; i < fluidemitter_count; i++) {
+        fluidemitter_resolve(&fluidemitter_list[i].emitter, map_x, map_y,
+            reduce_factor, tile_size, all, NULL, counts);
+        fluidemitter_list[i].in_index = 1;
+    }
+    free(counts);
+    return 1;
+}
+
+static int fluidemitter_rebuildTiles(int map_x, int map_y,
+        double reduce_factor, int tile_size, const int *changed) {
+    // Resolve the emitters again for the tiles touching the changed cells
+    // only, the entries of all other tiles are carried over:
+    struct fluidemitter_index *index = &fluidemitter_index;
+    struct fluidemitter_index old = *index;
+    int tiles = old.tiles_x * old.tiles_y;
+    int tx0 = changed[0] / tile_size;
+    int ty0 = changed[1] / tile_size;
+    int tx1 = (changed[2] + tile_size - 1) / tile_size;
+    int ty1 = (changed[3] + tile_size - 1) / tile_size;
+    int clip[4] = { tx0 * tile_size, ty0 * tile_size,
+        tx1 * tile_size, ty1 * tile_size };
+    if (clip[2] > map_x) clip[2] = map_x;
+    if (clip[3] > map_y) clip[3] = map_y;
+
+    memset(index, 0, sizeof(*index));
+    index->tiles_x = old.tiles_x;
+    index->tiles_y = old.tiles_y;
+    int *counts = calloc(tiles + 1, sizeof(int));
+    index->tile_start = malloc(sizeof(int) * (tiles + 1));
+    index->used_tiles = malloc(sizeof(int) * tiles);
+    if (!counts || !index->tile_start || !index->used_tiles) {
+        free(counts);
+        free(index->tile_start);
+        free(index->used_tiles);
+        *index = old;
+        return 0;
+    }
+    for (int i = 0; i < fluidemitter_count; i++) {
+        fluidemitter_resolve(&fluidemitter_list[i].emitter, map_x, map_y,
+            reduce_factor, tile_size, clip, counts, NULL);
+    }
+    int total = 0;
+    for (int tile = 0; tile < tiles; tile++) {
+        int tx = tile % old.tiles_x;
+        int ty = tile / old.tiles_x;
+        if (tx < tx0 || tx >= tx1 || ty < ty0 || ty >= ty1)
+            counts[tile] = old.tile_start[tile + 1] - old.tile_start[tile];
+        index->tile_start[tile] = total;
+        if (counts[tile] > 0)
+            index->used_tiles[index->used_tile_count++] = tile;
+        total += counts[tile];
+        counts[tile] = index->tile_start[tile];
+    }
+    index->tile_start[tiles] = total;
+    index->cells = malloc(sizeof(int) * (total + 1));
+    index->types = malloc(total + 1);
+    index->once = malloc(total + 1);
+    index->rates = malloc(sizeof(double) * (total + 1));
+    if (!index->cells || !index->types || !index->once || !index->rates) {
+        free(counts);
+        fluidemitter_freeIndex();
+        *index = old;
+        return 0;
+    }
+    for (int tile = 0; tile < tiles; tile++) {
+        int tx = tile % old.tiles_x;
+        int ty = tile / old.tiles_x;
+        if (tx >= tx0 && tx < tx1 && ty >= ty0 && ty < ty1)
+            continue;
+        int from = old.tile_start[tile];
+        int to = index->tile_start[tile];
+        int n = old.tile_start[tile + 1] - from;
+        memcpy(&index->cells[to], &old.cells[from], sizeof(int) * n);
+        memcpy(&index->types[to], &old.types[from], n);
+        memcpy(&index->once[to], &old.once[from], n);
+        memcpy(&index->rates[to], &old.rates[from], sizeof(double) * n);
+    }
+    for (int i = 0; i < fluidemitter_count; i++) {
+        fluidemitter_resolve(&fluidemitter_list[i].emitter, map_x, map_y,
+            reduce_factor, tile_size, clip, NULL, counts);
+    }
+    free(counts);
+    free(old.tile_start);
+    free(old.cells);
+    free(old.types);
+    free(old.once);
+    free(old.rates);
+    free(old.used_tiles);
+    return 1;
+}
+
+const struct fluidemitter_index *fluidemitter_getIndex(int map_x, int map_y,
+        double reduce_factor, int tile_size) {
+    pthread_mutex_lock(&fluidemitter_lock);
+    int uses_height = 0;
+    for (int i = 0; i < fluidemitter_count; i++) {
+        if (fluidemitter_list[i].emitter.kind == FLUIDEMITTER_HEIGHT)
+            uses_height = 1;
+    }
+    int rebuild = (fluidemitter_index_version != fluidemitter_version ||
+        fluidemitter_index_uses_height != uses_height ||
+        fluidemitter_index_map_x != map_x ||
+        fluidemitter_index_map_y != map_y ||
+        fluidemitter_index_reduce_factor != reduce_factor ||
+        fluidemitter_index_tile_size != tile_size);
+
+    // Height emitters depend on the ground. Where it changed, the tiles
+    // are resolved again, which is far less than the whole map as long
+    // as the sand is only moved here and there:
+    int changed[4] = { 0, 0, 0, 0 };
+    int ok = 1;
+    if (uses_height) {
+        ok = fluidemitter_sampleHeights(map_x, map_y, reduce_factor,
+            changed);
+    } else if (fluidemitter_heights) {
+        free(fluidemitter_heights);
+        fluidemitter_heights = NULL;
+    }
+    if (ok && rebuild) {
+        ok = fluidemitter_build(map_x, map_y, reduce_factor, tile_size);
+    } else if (ok && changed[0] < changed[2] && changed[1] < changed[3]) {
+        ok = fluidemitter_rebuildTiles(map_x, map_y, reduce_factor,
+            tile_size, changed);
+    }
+    if (!ok) {
+        fprintf(stderr, "clib/fluidemitter.c: error: "
+            "out of memory building emitter index\n");
+        fluidemitter_freeIndex();
+        free(fluidemitter_heights);
+        fluidemitter_heights = NULL;
+        fluidemitter_index_version = 0;
+        pthread_mutex_unlock(&fluidemitter_lock);
+        return NULL;
+    }
+    fluidemitter_index_version = fluidemitter_version;
+    fluidemitter_index_uses_height = uses_height;
+    fluidemitter_index_map_x = map_x;
+    fluidemitter_index_map_y = map_y;
+    fluidemitter_index_reduce_factor = reduce_factor;
+    fluidemitter_index_tile_size = tile_size;
+    pthread_mutex_unlock(&fluidemitter_lock);
+    return &fluidemitter_index;
+}
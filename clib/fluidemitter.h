@@ -0,0 +1,56 @@
+
+#ifndef _SANDBOX_FLUIDEMITTER_H_
+#define _SANDBOX_FLUIDEMITTER_H_
+
+// Sources and sinks of fluid. Emitters are resolved into a list of fluid
+// cells with their rates, bucketed by fluid tile. That index is only
+// rebuilt when emitters are added or removed. When the topology changed
+// and a height emitter depends on it, only the tiles where it changed are
+// resolved again.
+
+#define FLUIDEMITTER_POINT 0
+#define FLUIDEMITTER_AREA 1
+#define FLUIDEMITTER_HEIGHT 2
+
+struct fluidemitter {
+    int kind;
+    int type;  // FLUID_WATER, FLUID_LAVA, ...
+    // Position in world pixels. Area and height emitters cover the
+    // rectangle, height emitters cover the whole map if w or h is <= 0:
+    double x, y, w, h;
+    // Height emitters only emit where the ground is above this share of
+    // topology_getMaxPossibleHeight():
+    double min_height;
+    // Amount per second (per cell for area and height emitters), negative
+    // values drain. One-shot emitters emit this amount once and are gone:
+    double rate;
+    int once;
+};
+
+struct fluidemitter_index {
+    int tiles_x, tiles_y;
+    // Entries of tile t are tile_start[t] .. tile_start[t + 1] - 1:
+    int *tile_start;
+    int *cells;
+    unsigned char *types;
+    unsigned char *once;
+    double *rates;
+    // Tiles that have any entries at all:
+    int *used_tiles;
+    int used_tile_count;
+};
+
+// Returns an id for removing the emitter again, or -1 on error:
+int fluidemitter_add(const struct fluidemitter *e);
+void fluidemitter_remove(int id);
+void fluidemitter_clear();
+
+// Get the index for the given fluid grid, rebuilt if necessary. Must only
+// be used from the fluid simulation thread:
+const struct fluidemitter_index *fluidemitter_getIndex(int map_x, int map_y,
+    double reduce_factor, int tile_size);
+
+// Drop the one-shot emitters which have been applied from the index:
+void fluidemitter_finishOnce();
+
+#endif  // _SANDBOX_FLUIDEMITTER_H_
@@ -0,0 +1,179 @@
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "fluid.h"
+#include "fluidpipes.h"
+
+// Acceleration of the flux per unit of surface height difference. Higher
+// values make waves travel faster but require more substeps:
+#define FLUIDPIPES_GRAVITY 4.0
+// Share of the flux lost per tick, so waves die down and lakes settle:
+#define FLUIDPIPES_FRICTION 0.5
+// Additional friction of a fully viscous fluid:
+#define FLUIDPIPES_VISCOUS_FRICTION 8.0
+// Fraction of a cell a wave may travel per substep:
+#define FLUIDPIPES_CFL 0.5
+#define FLUIDPIPES_MAX_SUBSTEPS 16
+
+// Below this depth a cell is considered dry for the velocity field:
+#define FLUIDPIPES_MIN_DEPTH 0.0001
+// Thin films on slopes have large but meaningless velocities, so only
+// cells at least this deep count for the CFL condition:
+#define FLUIDPIPES_CFL_MIN_DEPTH 0.5
+// Cells per tick, to keep the velocity field of thin films sane:
+#define FLUIDPIPES_MAX_SPEED 8.0f
+
+void fluidpipes_updateFlux(const fluid_amount *depth,
+        const fluid_amount *terrain, fluid_amount *flux, int w, int h,
+        int types, unsigned int present, int x0, int y0, int x1, int y1,
+        double dt, const double *viscosity) {
+    int plane = types * w * h;
+    int stride = types * w;
+    fluid_amount *flux_left = flux + FLUIDPIPES_LEFT * plane;
+    fluid_amount *flux_right = flux + FLUIDPIPES_RIGHT * plane;
+    fluid_amount *flux_up = flux + FLUIDPIPES_UP * plane;
+    fluid_amount *flux_down = flux + FLUIDPIPES_DOWN * plane;
+    fluid_amount accel = dt * FLUIDPIPES_GRAVITY;
+
+    for (int y = y0; y < y1; y++) {
+        for (int t = 0; t < types; t++) {
+            if (!(present & (1u << t)))
+                continue;
+            fluid_amount keep = 1.0 - (FLUIDPIPES_FRICTION +
+                FLUIDPIPES_VISCOUS_FRICTION * viscosity[t]) * dt;
+            if (keep < 0) keep = 0;
+            const fluid_amount *ground = terrain + y * w;
+            int row = (y * types + t) * w;
+            for (int x = x0; x < x1; x++) {
+                int i = row + x;
+                fluid_amount surface = ground[x] + depth[i];
+                fluid_amount l = 0, r = 0, u = 0, d = 0;
+
+                // Accelerate the outflow towards lower neighbours. There
+                // is no outflow over the border of the map:
+                if (x > 0) {
+                    l = flux_left[i] * keep + accel *
+                        (surface - ground[x - 1] - depth[i - 1]);
+                    if (l < 0) l = 0;
+                }
+                if (x < w - 1) {
+                    r = flux_right[i] * keep + accel *
+                        (surface - ground[x + 1] - depth[i + 1]);
+                    if (r < 0) r = 0;
+                }
+                if (y > 0) {
+                    u = flux_up[i] * keep + accel *
+                        (surface - ground[x - w] - depth[i - stride]);
+                    if (u < 0) u = 0;
+                }
+                if (y < h - 1) {
+                    d = flux_down[i] * keep + accel *
+                        (surface - ground[x + w] - depth[i + stride]);
+                    if (d < 0) d = 0;
+                }
+
+                // Never let more flow out than the cell contains:
+                fluid_amount total = (l + r + u + d) * dt;
+                if (total > depth[i]) {
+                    fluid_amount scale = 0;
+                    if (total > 0)
+                        scale = depth[i] / total;
+                    l *= scale;
+                    r *= scale;
+                    u *= scale;
+                    d *= scale;
+                }
+                flux_left[i] = l;
+                flux_right[i] = r;
+                flux_up[i] = u;
+                flux_down[i] = d;
+            }
+        }
+    }
+}
+
+void fluidpipes_updateDepth(fluid_amount *depth, const fluid_amount *flux,
+        fluid_amount *vx, fluid_amount *vy, int w, int h, int types,
+        unsigned int present, int x0, int y0, int x1, int y1, double dt,
+        double *max_speed) {
+    int plane = types * w * h;
+    int stride = types * w;
+    const fluid_amount *flux_left = flux + FLUIDPIPES_LEFT * plane;
+    const fluid_amount *flux_right = flux + FLUIDPIPES_RIGHT * plane;
+    const fluid_amount *flux_up = flux + FLUIDPIPES_UP * plane;
+    const fluid_amount *flux_down = flux + FLUIDPIPES_DOWN * plane;
+    double speed = 0;
+
+    for (int y = y0; y < y1; y++) {
+        for (int t = 0; t < types; t++) {
+            if (!(present & (1u << t)))
+                continue;
+            int row = (y * types + t) * w;
+            for (int x = x0; x < x1; x++) {
+                int i = row + x;
+
+                // Inflow is the outflow of the neighbours pointing at us:
+                fluid_amount in_left = (x > 0 ? flux_right[i - 1] : 0);
+                fluid_amount in_right = (x < w - 1 ? flux_left[i + 1] : 0);
+                fluid_amount in_up = (y > 0 ? flux_down[i - stride] : 0);
+                fluid_amount in_down = (y < h - 1 ?
+                    flux_up[i + stride] : 0);
+                fluid_amount in = in_left + in_right + in_up + in_down;
+                fluid_amount out = flux_left[i] + flux_right[i] +
+                    flux_up[i] + flux_down[i];
+
+                fluid_amount old_depth = depth[i];
+                fluid_amount new_depth = old_depth + dt * (in - out);
+                if (new_depth < 0) new_depth = 0;
+                depth[i] = new_depth;
+
+                // Velocity from the average fluid flowing through the cell:
+                fluid_amount avg_depth = (old_depth + new_depth) * 0.5f;
+                if (avg_depth < FLUIDPIPES_MIN_DEPTH) {
+                    vx[i] = 0;
+                    vy[i] = 0;
+                    continue;
+                }
+                vx[i] = (in_left - flux_left[i] + flux_right[i] -
+                    in_right) * 0.5f / avg_depth;
+                vy[i] = (in_up - flux_up[i] + flux_down[i] - in_down) *
+                    0.5f / avg_depth;
+                if (vx[i] > FLUIDPIPES_MAX_SPEED)
+                    vx[i] = FLUIDPIPES_MAX_SPEED;
+                if (vx[i] < -FLUIDPIPES_MAX_SPEED)
+                    vx[i] = -FLUIDPIPES_MAX_SPEED;
+                if (vy[i] > FLUIDPIPES_MAX_SPEED)
+                    vy[i] = FLUIDPIPES_MAX_SPEED;
+                if (vy[i] < -FLUIDPIPES_MAX_SPEED)
+                    vy[i] = -FLUIDPIPES_MAX_SPEED;
+                if (avg_depth >= FLUIDPIPES_CFL_MIN_DEPTH) {
+                    if (fabs(vx[i]) > speed) speed = fabs(vx[i]);
+                    if (fabs(vy[i]) > speed) speed = fabs(vy[i]);
+                }
+            }
+        }
+    }
+    *max_speed = speed;
+}
+
+int fluidpipes_substeps(double max_depth, double max_speed, double *dt) {
+    // Fastest possible propagation: shallow water wave speed plus flow:
+    double speed = sqrt(FLUIDPIPES_GRAVITY * fmax(0, max_depth)) +
+        fabs(max_speed);
+    if (speed <= 0) {
+        *dt = 1.0;
+        return 1;
+    }
+    double max_dt = FLUIDPIPES_CFL / speed;
+    int steps = (int)ceil(1.0 / max_dt);
+    if (steps < 1)
+        steps = 1;
+    if (steps > FLUIDPIPES_MAX_SUBSTEPS) {
+        // Too expensive to keep up, let the simulation run slower:
+        *dt = max_dt;
+        return FLUIDPIPES_MAX_SUBSTEPS;
+    }
+    *dt = 1.0 / steps;
+    return steps;
+}
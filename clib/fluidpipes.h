@@ -0,0 +1,46 @@
+
+#ifndef _SANDBOX_FLUIDPIPES_H_
+#define _SANDBOX_FLUIDPIPES_H_
+
+#include "fluid.h"
+
+// Shallow-water solver using the virtual pipes model: every cell keeps an
+// outflow flux towards each of its four neighbours which is accelerated by
+// the difference of the water surface heights, so the water has momentum.
+//
+// depth holds types fluids interleaved by row: the depth of fluid t at
+// x, y is at (y * types + t) * w + x. The velocities use the same layout,
+// flux holds four planes of it in the order of the FLUIDPIPES_* directions
+// below. Each fluid flows on the bare terrain, slowed down by its
+// viscosity (0..1, one per fluid type). All fluids of a row are handled
+// in the same pass, except those without a bit in present, which must be
+// dry in the region and its neighbours.
+//
+// All functions only write cells in the region x0..x1-1, y0..y1-1, so
+// regions can be processed in parallel as long as all regions are done
+// with fluidpipes_updateFlux() before any of them runs
+// fluidpipes_updateDepth().
+
+#define FLUIDPIPES_LEFT 0
+#define FLUIDPIPES_RIGHT 1
+#define FLUIDPIPES_UP 2
+#define FLUIDPIPES_DOWN 3
+
+void fluidpipes_updateFlux(const fluid_amount *depth,
+    const fluid_amount *terrain, fluid_amount *flux, int w, int h,
+    int types, unsigned int present, int x0, int y0, int x1, int y1,
+    double dt, const double *viscosity);
+
+// Apply the fluxes to the depths and store the resulting velocity field
+// in vx, vy. The largest speed found in the region is returned in
+// max_speed:
+void fluidpipes_updateDepth(fluid_amount *depth, const fluid_amount *flux,
+    fluid_amount *vx, fluid_amount *vy, int w, int h, int types,
+    unsigned int present, int x0, int y0, int x1, int y1, double dt,
+    double *max_speed);
+
+// Pick the amount of substeps (and their length in dt) required to
+// advance by one tick without violating the CFL condition:
+int fluidpipes_substeps(double max_depth, double max_speed, double *dt);
+
+#endif  // _SANDBOX_FLUIDPIPES_H_
@@ -0,0 +1,440 @@
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fluid.h"
+#include "fluidsettle.h"
+
+// Cells are sorted into this many buckets between the lowest and highest
+// ground. Cells within a bucket count as equally high:
+#define FLUIDSETTLE_BUCKETS 65536
+// Changed regions that are remembered, beyond that all cells are sorted
+// in again:
+#define FLUIDSETTLE_MAX_REGIONS 64
+
+struct fluidsettle_region {
+    int x0, y0, x1, y1;
+};
+
+struct fluidsettle {
+    int w, h;
+
+    // Cells in order of ground height, as one linked list per bucket:
+    int *bucket_head;
+    int *cell_next;
+    int *cell_prev;
+    int *cell_bucket;
+    double bucket_low, bucket_scale;
+    int sorted;
+    int region_count;
+    struct fluidsettle_region regions[FLUIDSETTLE_MAX_REGIONS];
+    int basins_valid;
+
+    // Basins: each one is either a lowest point, or the union of the
+    // basins which meet at its first cell. That way children always have
+    // a lower index than their parent. A basin owns the cells that were
+    // added while it was the topmost one, in order of height:
+    int basin_count;
+    int *basin_parent;
+    int *basin_child;
+    int *basin_sibling;
+    int *basin_start;
+    int *basin_cells;
+    // All cells below the basin (in its children), and all cells up to
+    // its spill height (including its own):
+    int *below_count;
+    double *below_sum;
+    int *count;
+    double *sum;
+    // Fluid it takes to fill the basin up to its spill height:
+    double *capacity;
+    // Per cell: the basin owning it and the lowest basin it drains into:
+    int *cell_basin;
+    int *cell_drain;
+    // Used while finding the basins, then while placing fluid:
+    int *scratch;
+    double *total;
+    double *share;
+    double *level;
+    unsigned char *fixed;
+};
+
+struct fluidsettle *fluidsettle_create(int w, int h) {
+    struct fluidsettle *s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+    size_t n = (size_t)w * h;
+    s->w = w;
+    s->h = h;
+    s->bucket_head = malloc(sizeof(int) * FLUIDSETTLE_BUCKETS);
+    s->cell_next = malloc(sizeof(int) * n);
+    s->cell_prev = malloc(sizeof(int) * n);
+    s->cell_bucket = malloc(sizeof(int) * n);
+    s->basin_parent = malloc(sizeof(int) * n);
+    s->basin_child = malloc(sizeof(int) * n);
+    s->basin_sibling = malloc(sizeof(int) * n);
+    s->basin_start = malloc(sizeof(int) * (n + 1));
+    s->basin_cells = malloc(sizeof(int) * n);
+    s->below_count = malloc(sizeof(int) * n);
+    s->below_sum = malloc(sizeof(double) * n);
+    s->count = malloc(sizeof(int) * n);
+    s->sum = malloc(sizeof(double) * n);
+    s->capacity = malloc(sizeof(double) * n);
+    s->cell_basin = malloc(sizeof(int) * n);
+    s->cell_drain = malloc(sizeof(int) * n);
+    s->scratch = malloc(sizeof(int) * n);
+    s->total = malloc(sizeof(double) * n);
+    s->share = malloc(sizeof(double) * n);
+    s->level = malloc(sizeof(double) * n);
+    s->fixed = malloc(n);
+    if (!s->bucket_head || !s->cell_next || !s->cell_prev ||
+            !s->cell_bucket || !s->basin_parent || !s->basin_child ||
+            !s->basin_sibling || !s->basin_start || !s->basin_cells ||
+            !s->below_count || !s->below_sum || !s->count || !s->sum ||
+            !s->capacity || !s->cell_basin || !s->cell_drain ||
+            !s->scratch || !s->total || !s->share || !s->level ||
+            !s->fixed) {
+        fluidsettle_destroy(s);
+        return NULL;
+    }
+    return s;
+}
+
+void fluidsettle_destroy(struct fluidsettle *s) {
+    if (!s)
+        return;
+    free(s->bucket_head);
+    free(s->cell_next);
+    free(s->cell_prev);
+    free(s->cell_bucket);
+    free(s->basin_parent);
+    free(s->basin_child);
+    free(s->basin_sibling);
+    free(s->basin_start);
+    free(s->basin_cells);
+    free(s->below_count);
+    free(s->below_sum);
+    free(s->count);
+    free(s->sum);
+    free(s->capacity);
+    free(s->cell_basin);
+    free(s->cell_drain);
+    free(s->scratch);
+    free(s->total);
+    free(s->share);
+    free(s->level);
+    free(s->fixed);
+    free(s);
+}
+
+void fluidsettle_invalidate(struct fluidsettle *s, int x0, int y0,
+        int x1, int y1) {
+    if (!s)
+        return;
+    s->basins_valid = 0;
+    if (s->region_count >= FLUIDSETTLE_MAX_REGIONS) {
+        s->sorted = 0;
+        return;
+    }
+    struct fluidsettle_region *r = &s->regions[s->region_count++];
+    r->x0 = x0;
+    r->y0 = y0;
+    r->x1 = x1;
+    r->y1 = y1;
+}
+
+static void fluidsettle_link(struct fluidsettle *s, int cell, int bucket) {
+    s->cell_bucket[cell] = bucket;
+    s->cell_prev[cell] = -1;
+    s->cell_next[cell] = s->bucket_head[bucket];
+    if (s->cell_next[cell] >= 0)
+        s->cell_prev[s->cell_next[cell]] = cell;
+    s->bucket_head[bucket] = cell;
+}
+
+static void fluidsettle_unlink(struct fluidsettle *s, int cell) {
+    int prev = s->cell_prev[cell];
+    int next = s->cell_next[cell];
+    if (prev >= 0)
+        s->cell_next[prev] = next;
+    else
+        s->bucket_head[s->cell_bucket[cell]] = next;
+    if (next >= 0)
+        s->cell_prev[next] = prev;
+}
+
+static int fluidsettle_bucket(const struct fluidsettle *s, double height) {
+    // Returns -1 if the height lies outside of the buckets:
+    double b = (height - s->bucket_low) * s->bucket_scale;
+    if (height < s->bucket_low || b > FLUIDSETTLE_BUCKETS - 1 ||
+            (s->bucket_scale == 0 && height != s->bucket_low))
+        return -1;
+    return (int)b;
+}
+
+static void fluidsettle_sortAll(struct fluidsettle *s,
+        const fluid_amount *terrain) {
+    int n = s->w * s->h;
+    double low = terrain[0];
+    double high = terrain[0];
+    for (int i = 1; i < n; i++) {
+        if (terrain[i] < low) low = terrain[i];
+        if (terrain[i] > high) high = terrain[i];
+    }
+    s->bucket_low = low;
+    s->bucket_scale = (high > low ?
+        (FLUIDSETTLE_BUCKETS - 1) / (high - low) : 0);
+    for (int b = 0; b < FLUIDSETTLE_BUCKETS; b++) {
+        s->bucket_head[b] = -1;
+    }
+    // Linked in backwards, so every bucket lists its cells in map order:
+    for (int i = n - 1; i >= 0; i--) {
+        int b = fluidsettle_bucket(s, terrain[i]);
+        fluidsettle_link(s, i, (b >= 0 ? b : FLUIDSETTLE_BUCKETS - 1));
+    }
+    s->sorted = 1;
+    s->region_count = 0;
+}
+
+static void fluidsettle_sort(struct fluidsettle *s,
+        const fluid_amount *terrain) {
+    // Move the cells of the changed regions to their new buckets. Ground
+    // beyond the range of the buckets has them spread out anew:
+    if (!s->sorted) {
+        fluidsettle_sortAll(s, terrain);
+        return;
+    }
+    for (int r = 0; r < s->region_count; r++) {
+        const struct fluidsettle_region *region = &s->regions[r];
+        for (int y = region->y0; y < region->y1; y++) {
+            for (int x = region->x0; x < region->x1; x++) {
+                int i = x + y * s->w;
+                int b = fluidsettle_bucket(s, terrain[i]);
+                if (b < 0) {
+                    fluidsettle_sortAll(s, terrain);
+                    return;
+                }
+                if (b == s->cell_bucket[i])
+                    continue;
+                fluidsettle_unlink(s, i);
+                fluidsettle_link(s, i, b);
+            }
+        }
+    }
+    s->region_count = 0;
+}
+
+static int fluidsettle_top(struct fluidsettle *s, int basin) {
+    // Union-find on the basins (scratch holds the links), the root of a
+    // set is the basin all others have been merged into:
+    int *link = s->scratch;
+    while (link[basin] != basin) {
+        link[basin] = link[link[basin]];
+        basin = link[basin];
+    }
+    return basin;
+}
+
+static int fluidsettle_newBasin(struct fluidsettle *s) {
+    int b = s->basin_count++;
+    s->basin_parent[b] = -1;
+    s->basin_child[b] = -1;
+    s->basin_sibling[b] = -1;
+    s->below_count[b] = 0;
+    s->below_sum[b] = 0;
+    s->count[b] = 0;
+    s->sum[b] = 0;
+    s->capacity[b] = INFINITY;
+    s->scratch[b] = b;
+    return b;
+}
+
+static void fluidsettle_findBasins(struct fluidsettle *s,
+        const fluid_amount *terrain) {
+    // Flood the map from the lowest cell upwards. Every cell either
+    // starts a basin, grows the basin next to it or joins the basins
+    // meeting at it, whose spill height it then is:
+    int w = s->w;
+    int h = s->h;
+    s->basin_count = 0;
+    for (int i = 0; i < w * h; i++) {
+        s->cell_basin[i] = -1;
+    }
+    for (int b = 0; b < FLUIDSETTLE_BUCKETS; b++) {
+        for (int i = s->bucket_head[b]; i >= 0; i = s->cell_next[i]) {
+            int x = i % w;
+            int y = i / w;
+            int neighbors[4];
+            int neighbor_count = 0;
+            if (x > 0) neighbors[neighbor_count++] = i - 1;
+            if (x < w - 1) neighbors[neighbor_count++] = i + 1;
+            if (y > 0) neighbors[neighbor_count++] = i - w;
+            if (y < h - 1) neighbors[neighbor_count++] = i + w;
+
+            int tops[4];
+            int top_count = 0;
+            int lowest = -1;
+            for (int j = 0; j < neighbor_count; j++) {
+                int neighbor = neighbors[j];
+                if (s->cell_basin[neighbor] < 0)
+                    continue;
+                if (lowest < 0 || terrain[neighbor] < terrain[lowest])
+                    lowest = neighbor;
+                int top = fluidsettle_top(s, s->cell_basin[neighbor]);
+                int known = 0;
+                for (int k = 0; k < top_count; k++) {
+                    if (tops[k] == top)
+                        known = 1;
+                }
+                if (!known)
+                    tops[top_count++] = top;
+            }
+
+            int basin;
+            double height = terrain[i];
+            if (top_count == 0) {
+                basin = fluidsettle_newBasin(s);
+                s->cell_drain[i] = basin;
+            } else if (top_count == 1) {
+                basin = tops[0];
+                s->cell_drain[i] = s->cell_drain[lowest];
+            } else {
+                basin = fluidsettle_newBasin(s);
+                for (int k = 0; k < top_count; k++) {
+                    int child = tops[k];
+                    s->basin_parent[child] = basin;
+                    s->basin_sibling[child] = s->basin_child[basin];
+                    s->basin_child[basin] = child;
+                    s->capacity[child] = s->count[child] * height -
+                        s->sum[child];
+                    if (s->capacity[child] < 0)
+                        s->capacity[child] = 0;
+                    s->below_count[basin] += s->count[child];
+                    s->below_sum[basin] += s->sum[child];
+                    s->scratch[child] = basin;
+                }
+                s->count[basin] = s->below_count[basin];
+                s->sum[basin] = s->below_sum[basin];
+                s->cell_drain[i] = s->cell_drain[lowest];
+            }
+            s->cell_basin[i] = basin;
+            s->count[basin]++;
+            s->sum[basin] += height;
+        }
+    }
+
+    // Gather the cells of every basin, still in order of height:
+    int *fill = s->scratch;
+    memset(s->basin_start, 0, sizeof(int) * (s->basin_count + 1));
+    for (int i = 0; i < w * h; i++) {
+        s->basin_start[s->cell_basin[i] + 1]++;
+    }
+    for (int b = 0; b < s->basin_count; b++) {
+        s->basin_start[b + 1] += s->basin_start[b];
+        fill[b] = s->basin_start[b];
+    }
+    for (int b = 0; b < FLUIDSETTLE_BUCKETS; b++) {
+        for (int i = s->bucket_head[b]; i >= 0; i = s->cell_next[i]) {
+            s->basin_cells[fill[s->cell_basin[i]]++] = i;
+        }
+    }
+    s->basins_valid = 1;
+}
+
+static double fluidsettle_level(const struct fluidsettle *s,
+        const fluid_amount *terrain, int basin, double amount) {
+    // Surface height of the given amount poured into a basin whose
+    // children are all full. It rises over the basin's own cells until
+    // the next one would stay dry:
+    double count = s->below_count[basin];
+    double sum = s->below_sum[basin];
+    for (int j = s->basin_start[basin]; j < s->basin_start[basin + 1];
+            j++) {
+        double height = terrain[s->basin_cells[j]];
+        if (count > 0 && amount <= count * height - sum)
+            break;
+        count++;
+        sum += height;
+    }
+    return (amount + sum) / count;
+}
+
+void fluidsettle_run(struct fluidsettle *s, const fluid_amount *terrain,
+        fluid_amount *depth, int types, int type) {
+    int w = s->w;
+    int h = s->h;
+    if (!s->sorted || s->region_count > 0)
+        fluidsettle_sort(s, terrain);
+    if (!s->basins_valid)
+        fluidsettle_findBasins(s, terrain);
+
+    // Fluid runs downhill into the lowest basins. Whatever a basin can't
+    // hold below its spill height overflows into its parent:
+    for (int b = 0; b < s->basin_count; b++) {
+        s->total[b] = 0;
+    }
+    for (int y = 0; y < h; y++) {
+        const fluid_amount *row = &depth[(y * types + type) * w];
+        for (int x = 0; x < w; x++) {
+            s->total[s->cell_drain[x + y * w]] += row[x];
+        }
+    }
+    for (int b = 0; b < s->basin_count; b++) {
+        if (s->basin_parent[b] >= 0)
+            s->total[s->basin_parent[b]] += s->total[b];
+    }
+
+    // From the top down, split the fluid of a basin among its children.
+    // Each keeps what it holds itself, what others spill over goes to
+    // those with room left, in proportion to it. Once all children are
+    // full the rest forms a lake above them, which covers them entirely:
+    for (int b = s->basin_count - 1; b >= 0; b--) {
+        if (s->basin_parent[b] < 0) {
+            s->share[b] = s->total[b];
+            s->fixed[b] = 0;
+        }
+        if (s->fixed[b]) {
+            for (int c = s->basin_child[b]; c >= 0;
+                    c = s->basin_sibling[c]) {
+                s->fixed[c] = 1;
+                s->level[c] = s->level[b];
+            }
+            continue;
+        }
+        double held = 0;
+        double room = 0;
+        for (int c = s->basin_child[b]; c >= 0; c = s->basin_sibling[c]) {
+            s->share[c] = fmin(s->total[c], s->capacity[c]);
+            held += s->share[c];
+            room += s->capacity[c] - s->share[c];
+        }
+        double extra = s->share[b] - held;
+        if (extra >= room || room <= 0) {
+            s->level[b] = fluidsettle_level(s, terrain, b, s->share[b]);
+            for (int c = s->basin_child[b]; c >= 0;
+                    c = s->basin_sibling[c]) {
+                s->fixed[c] = 1;
+                s->level[c] = s->level[b];
+            }
+            continue;
+        }
+        s->level[b] = -INFINITY;
+        for (int c = s->basin_child[b]; c >= 0; c = s->basin_sibling[c]) {
+            s->share[c] += extra * (s->capacity[c] - s->share[c]) / room;
+            s->fixed[c] = 0;
+        }
+    }
+
+    for (int y = 0; y < h; y++) {
+        fluid_amount *row = &depth[(y * types + type) * w];
+        for (int x = 0; x < w; x++) {
+            int i = x + y * w;
+            double amount = s->level[s->cell_basin[i]] - terrain[i];
+            fluid_amount settled = (amount > 0 ? amount : 0);
+            // Dry cells stay untouched, which keeps sparse maps small:
+            if (row[x] != settled)
+                row[x] = settled;
+        }
+    }
+}
@@ -0,0 +1,33 @@
+
+#ifndef _SANDBOX_FLUIDSETTLE_H_
+#define _SANDBOX_FLUIDSETTLE_H_
+
+#include "fluid.h"
+
+// Moves fluid straight to where it would come to rest, instead of letting
+// it flow there over many steps. The map is flooded in order of ground
+// height, which finds every basin and the height at which it spills over
+// into its neighbours. Fluid then runs downhill into its basin, fills it
+// up to the spill height and the rest overflows. The map border holds the
+// fluid like a wall.
+//
+// terrain holds w * h ground heights, depth the same layout as for
+// fluidpipes (types fluids interleaved by row). The basins only depend on
+// the ground, so they are kept until parts of it change.
+
+struct fluidsettle;
+
+// Returns NULL if out of memory:
+struct fluidsettle *fluidsettle_create(int w, int h);
+void fluidsettle_destroy(struct fluidsettle *s);
+
+// Tell that the ground of the region x0..x1-1, y0..y1-1 changed. Only its
+// cells are sorted in again the next time the basins are needed:
+void fluidsettle_invalidate(struct fluidsettle *s, int x0, int y0,
+    int x1, int y1);
+
+// Move all of fluid type to its resting place, keeping its volume:
+void fluidsettle_run(struct fluidsettle *s, const fluid_amount *terrain,
+    fluid_amount *depth, int types, int type);
+
+#endif  // _SANDBOX_FLUIDSETTLE_H_
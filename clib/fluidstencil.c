@@ -0,0 +1,255 @@
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fluid.h"
+#include "fluidstencil.h"
+
+#if !defined(FLUID_DOUBLE_PRECISION) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FLUIDSTENCIL_X86_SIMD
+#endif
+
+// How much the surface rises per unit of fluid amount:
+#define FLUIDSTENCIL_DEPTH_SCALE 1.0f
+
+// Smaller fluxes are dropped, otherwise water spreading out endlessly
+// ends up as denormal numbers which are extremely slow to compute with:
+#define FLUIDSTENCIL_MIN_FLUX 1e-6f
+
+static inline fluid_amount fluidstencil_flux(fluid_amount surface_a,
+        fluid_amount amount_a, fluid_amount surface_b,
+        fluid_amount amount_b, fluid_amount k) {
+    // Flux from a to b. Each cell can give away at most a quarter of its
+    // contents per direction, so it never drops below zero:
+    fluid_amount flux = k * (surface_a - surface_b);
+    if (flux > amount_a * 0.25f)
+        flux = amount_a * 0.25f;
+    if (flux < -amount_b * 0.25f)
+        flux = -amount_b * 0.25f;
+    if (fabs(flux) < FLUIDSTENCIL_MIN_FLUX)
+        return 0;
+    return flux;
+}
+
+// One row of one fluid, with the rows above and below it (NULL at the
+// border of the map). All pointers are indexed with the map column:
+struct fluidstencil_row {
+    const fluid_amount *amount, *amount_up, *amount_down;
+    const fluid_amount *surface, *surface_up, *surface_down;
+    fluid_amount *back;
+};
+
+static void fluidstencil_surfaceRow(const fluid_amount *front,
+        const fluid_amount *terrain, int w, int types, int y,
+        int x0, int x1, fluid_amount *surface) {
+    // The surface is the ground plus everything that sits on top of it:
+    const fluid_amount *ground = terrain + y * w;
+    const fluid_amount *row = front + y * types * w;
+    for (int x = x0; x < x1; x++) {
+        fluid_amount height = ground[x];
+        for (int k = 0; k < types; k++) {
+            height += row[x + k * w] * FLUIDSTENCIL_DEPTH_SCALE;
+        }
+        surface[x] = height;
+    }
+}
+
+static void fluidstencil_rowScalar(const struct fluidstencil_row *r,
+        int lo, int hi, int x0, int x1, fluid_amount k) {
+    // Columns lo..hi-1 may exchange fluid, lo and hi-1 have no neighbour
+    // on their outer side:
+    for (int x = x0; x < x1; x++) {
+        fluid_amount amount = r->amount[x];
+        fluid_amount surface = r->surface[x];
+        fluid_amount out = 0;
+
+        // Exchange with the four direct neighbours:
+        if (x > lo) {
+            out += fluidstencil_flux(surface, amount,
+                r->surface[x - 1], r->amount[x - 1], k);
+        }
+        if (x < hi - 1) {
+            out += fluidstencil_flux(surface, amount,
+                r->surface[x + 1], r->amount[x + 1], k);
+        }
+        if (r->amount_up) {
+            out += fluidstencil_flux(surface, amount,
+                r->surface_up[x], r->amount_up[x], k);
+        }
+        if (r->amount_down) {
+            out += fluidstencil_flux(surface, amount,
+                r->surface_down[x], r->amount_down[x], k);
+        }
+        r->back[x] = amount - out;
+    }
+}
+
+#ifdef FLUIDSTENCIL_X86_SIMD
+// The vector kernels do the same float operations in the same order as
+// fluidstencil_rowScalar(), so a pair flux computed in a vector lane on
+// one side always matches the scalar one on the other side.
+
+static inline __m128 fluidstencil_flux4(__m128 surface_a, __m128 amount_a,
+        __m128 surface_b, __m128 amount_b, __m128 k) {
+    const __m128 quarter = _mm_set1_ps(0.25f);
+    const __m128 min_flux = _mm_set1_ps(FLUIDSTENCIL_MIN_FLUX);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 flux = _mm_mul_ps(k, _mm_sub_ps(surface_a, surface_b));
+    flux = _mm_min_ps(flux, _mm_mul_ps(amount_a, quarter));
+    flux = _mm_max_ps(flux, _mm_xor_ps(_mm_mul_ps(amount_b, quarter), sign));
+    __m128 tiny = _mm_cmplt_ps(_mm_andnot_ps(sign, flux), min_flux);
+    return _mm_andnot_ps(tiny, flux);
+}
+
+// Interior cells only (all four neighbours exist). Returns the first x
+// that wasn't processed:
+static int fluidstencil_rowSSE(const struct fluidstencil_row *r,
+        int x0, int x1, fluid_amount k) {
+    __m128 vk = _mm_set1_ps(k);
+    int x = x0;
+    for (; x + 4 <= x1; x += 4) {
+        __m128 amount = _mm_loadu_ps(r->amount + x);
+        __m128 surface = _mm_loadu_ps(r->surface + x);
+        __m128 out = _mm_setzero_ps();
+        out = _mm_add_ps(out, fluidstencil_flux4(surface, amount,
+            _mm_loadu_ps(r->surface + x - 1),
+            _mm_loadu_ps(r->amount + x - 1), vk));
+        out = _mm_add_ps(out, fluidstencil_flux4(surface, amount,
+            _mm_loadu_ps(r->surface + x + 1),
+            _mm_loadu_ps(r->amount + x + 1), vk));
+        out = _mm_add_ps(out, fluidstencil_flux4(surface, amount,
+            _mm_loadu_ps(r->surface_up + x),
+            _mm_loadu_ps(r->amount_up + x), vk));
+        out = _mm_add_ps(out, fluidstencil_flux4(surface, amount,
+            _mm_loadu_ps(r->surface_down + x),
+            _mm_loadu_ps(r->amount_down + x), vk));
+        _mm_storeu_ps(r->back + x, _mm_sub_ps(amount, out));
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static inline __m256 fluidstencil_flux8(__m256 surface_a, __m256 amount_a,
+        __m256 surface_b, __m256 amount_b, __m256 k) {
+    const __m256 quarter = _mm256_set1_ps(0.25f);
+    const __m256 min_flux = _mm256_set1_ps(FLUIDSTENCIL_MIN_FLUX);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 flux = _mm256_mul_ps(k, _mm256_sub_ps(surface_a, surface_b));
+    flux = _mm256_min_ps(flux, _mm256_mul_ps(amount_a, quarter));
+    flux = _mm256_max_ps(flux,
+        _mm256_xor_ps(_mm256_mul_ps(amount_b, quarter), sign));
+    __m256 tiny = _mm256_cmp_ps(_mm256_andnot_ps(sign, flux), min_flux,
+        _CMP_LT_OQ);
+    return _mm256_andnot_ps(tiny, flux);
+}
+
+__attribute__((target("avx2")))
+static int fluidstencil_rowAVX2(const struct fluidstencil_row *r,
+        int x0, int x1, fluid_amount k) {
+    __m256 vk = _mm256_set1_ps(k);
+    int x = x0;
+    for (; x + 8 <= x1; x += 8) {
+        __m256 amount = _mm256_loadu_ps(r->amount + x);
+        __m256 surface = _mm256_loadu_ps(r->surface + x);
+        __m256 out = _mm256_setzero_ps();
+        out = _mm256_add_ps(out, fluidstencil_flux8(surface, amount,
+            _mm256_loadu_ps(r->surface + x - 1),
+            _mm256_loadu_ps(r->amount + x - 1), vk));
+        out = _mm256_add_ps(out, fluidstencil_flux8(surface, amount,
+            _mm256_loadu_ps(r->surface + x + 1),
+            _mm256_loadu_ps(r->amount + x + 1), vk));
+        out = _mm256_add_ps(out, fluidstencil_flux8(surface, amount,
+            _mm256_loadu_ps(r->surface_up + x),
+            _mm256_loadu_ps(r->amount_up + x), vk));
+        out = _mm256_add_ps(out, fluidstencil_flux8(surface, amount,
+            _mm256_loadu_ps(r->surface_down + x),
+            _mm256_loadu_ps(r->amount_down + x), vk));
+        _mm256_storeu_ps(r->back + x, _mm256_sub_ps(amount, out));
+    }
+    return x;
+}
+
+static int fluidstencil_hasAVX2() {
+    static int result = -1;
+    if (result < 0) {
+        __builtin_cpu_init();
+        result = (__builtin_cpu_supports("avx2") != 0);
+    }
+    return result;
+}
+#endif  // FLUIDSTENCIL_X86_SIMD
+
+void fluidstencil_step(const fluid_amount *front, fluid_amount *back,
+        const fluid_amount *terrain, int w, int h, int types,
+        unsigned int present, unsigned int walls, int x0, int y0, int x1,
+        int y1, double rate, const double *viscosity) {
+    // Walled off sides behave like the border of the map:
+    int lo = ((walls & FLUIDSTENCIL_WALL_LEFT) ? x0 : 0);
+    int hi = ((walls & FLUIDSTENCIL_WALL_RIGHT) ? x1 : w);
+    int top = ((walls & FLUIDSTENCIL_WALL_UP) ? y0 : 0);
+    int bottom = ((walls & FLUIDSTENCIL_WALL_DOWN) ? y1 : h);
+
+    // Surfaces of the rows above, at and below the current one, for the
+    // region plus the neighbouring columns:
+    int sx0 = (x0 > 0 ? x0 - 1 : 0);
+    int sx1 = (x1 < w ? x1 + 1 : w);
+    fluid_amount surface_rows[3][w];
+    fluid_amount *surface_up = surface_rows[0];
+    fluid_amount *surface = surface_rows[1];
+    fluid_amount *surface_down = surface_rows[2];
+    if (y0 > 0) {
+        fluidstencil_surfaceRow(front, terrain, w, types, y0 - 1,
+            sx0, sx1, surface_up);
+    }
+    fluidstencil_surfaceRow(front, terrain, w, types, y0, sx0, sx1, surface);
+
+    for (int y = y0; y < y1; y++) {
+        if (y < h - 1) {
+            fluidstencil_surfaceRow(front, terrain, w, types, y + 1,
+                sx0, sx1, surface_down);
+        }
+
+        // All fluids of this row, while its surfaces are in the cache:
+        for (int t = 0; t < types; t++) {
+            int row = (y * types + t) * w;
+            if (!(present & (1u << t))) {
+                // Nothing that could flow, it stays all zero:
+                memcpy(back + row + x0, front + row + x0,
+                    sizeof(fluid_amount) * (x1 - x0));
+                continue;
+            }
+            fluid_amount k = rate * 0.25 * (1.0 - viscosity[t]);
+            struct fluidstencil_row r;
+            r.amount = front + row;
+            r.amount_up = (y > top ? r.amount - types * w : NULL);
+            r.amount_down = (y < bottom - 1 ? r.amount + types * w : NULL);
+            r.surface = surface;
+            r.surface_up = surface_up;
+            r.surface_down = surface_down;
+            r.back = back + row;
+
+            int x = x0;
+#ifdef FLUIDSTENCIL_X86_SIMD
+            // Border cells lack neighbours and go through the scalar path:
+            int inner_x0 = (x0 > lo + 1 ? x0 : lo + 1);
+            int inner_x1 = (x1 < hi - 1 ? x1 : hi - 1);
+            if (r.amount_up && r.amount_down && inner_x0 < inner_x1) {
+                fluidstencil_rowScalar(&r, lo, hi, x0, inner_x0, k);
+                x = inner_x0;
+                if (fluidstencil_hasAVX2())
+                    x = fluidstencil_rowAVX2(&r, x, inner_x1, k);
+                x = fluidstencil_rowSSE(&r, x, inner_x1, k);
+            }
+#endif
+            fluidstencil_rowScalar(&r, lo, hi, x, x1, k);
+        }
+
+        fluid_amount *swap = surface_up;
+        surface_up = surface;
+        surface = surface_down;
+        surface_down = swap;
+    }
+}
@@ -0,0 +1,44 @@
+
+#ifndef _SANDBOX_FLUIDSTENCIL_H_
+#define _SANDBOX_FLUIDSTENCIL_H_
+
+#include "fluid.h"
+
+#define FLUIDSTENCIL_WALL_LEFT 1
+#define FLUIDSTENCIL_WALL_RIGHT 2
+#define FLUIDSTENCIL_WALL_UP 4
+#define FLUIDSTENCIL_WALL_DOWN 8
+
+// Deterministic fluid kernel: reads the fluid amounts from front, writes
+// the result of one step to back. Each cell only exchanges fluid with its
+// four direct neighbours, driven by the difference of the surface heights
+// (terrain plus all fluids in the cell). Every pair flux is computed
+// identically from both sides, so the volume of each fluid is conserved
+// exactly.
+//
+// front and back hold types fluids interleaved by row: the amount of
+// fluid t at x, y is at (y * types + t) * w + x. All fluids are handled
+// in the same pass over the rows. terrain holds w * h heights. Fluid t
+// is only computed if bit t of present is set, otherwise it must be zero
+// in the region and its halo.
+//
+// Only cells in the region x0..x1-1, y0..y1-1 are written, while their
+// direct neighbours outside of it are read as a halo. Different regions
+// can therefore be processed in parallel.
+//
+// Interior rows are processed with AVX2 or SSE where the CPU supports it,
+// with a scalar fallback that gives identical results.
+//
+// Sides of the region with a bit in walls don't exchange any fluid with
+// the cells beyond them, like the border of the map. To conserve the
+// volume, the cells beyond a wall must not exchange fluid across it
+// either during the same step.
+//
+// rate is in (0, 1] and controls how fast surfaces level out. It is scaled
+// down by the viscosity (0..1) of each fluid, given per fluid type.
+void fluidstencil_step(const fluid_amount *front, fluid_amount *back,
+    const fluid_amount *terrain, int w, int h, int types,
+    unsigned int present, unsigned int walls, int x0, int y0, int x1,
+    int y1, double rate, const double *viscosity);
+
+#endif  // _SANDBOX_FLUIDSTENCIL_H_
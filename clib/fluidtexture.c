@@ -0,0 +1,166 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fluidtexture.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static int fluidtexture_powerOfTwo(int value) {
+    int result = 1;
+    while (result < value)
+        result *= 2;
+    return result;
+}
+
+struct fluidtexture *fluidtexture_create(const uint8_t *rgb, int w, int h,
+        double scale) {
+    if (!rgb || w <= 0 || h <= 0 || scale <= 0)
+        return NULL;
+    struct fluidtexture *t = malloc(sizeof(*t));
+    if (!t)
+        return NULL;
+    memset(t, 0, sizeof(*t));
+
+    // Period of the texture on screen, rounded to a power of two. Images
+    // that don't fit exactly get stretched slightly:
+    t->size_x = fluidtexture_powerOfTwo((int)(w / scale + 0.5));
+    t->size_y = fluidtexture_powerOfTwo((int)(h / scale + 0.5));
+    t->mask_x = t->size_x - 1;
+    t->mask_y = t->size_y - 1;
+    size_t size = (size_t)3 * 2 * t->size_x * t->size_y;
+    t->primary = malloc(size);
+    t->mirrored = malloc(size);
+    if (!t->primary || !t->mirrored) {
+        fluidtexture_destroy(t);
+        return NULL;
+    }
+
+    for (int v = 0; v < t->size_y; v++) {
+        int sy = (int)((double)v * h / t->size_y);
+        for (int u = 0; u < 2 * t->size_x; u++) {
+            // The mirrored layer is sampled at -u:
+            int sx = (int)((double)(u & t->mask_x) * w / t->size_x);
+            int msx = (int)((double)((-u) & t->mask_x) * w / t->size_x);
+            const uint8_t *src = rgb + 3 * (sx + sy * w);
+            const uint8_t *msrc = rgb + 3 * (msx + sy * w);
+            uint8_t *dst = t->primary + 3 * (u + v * 2 * t->size_x);
+            uint8_t *mdst = t->mirrored + 3 * (u + v * 2 * t->size_x);
+            for (int c = 0; c < 3; c++) {
+                // Weights add up to at most 170 + 85, so no overflow:
+                dst[c] = (src[c] * 2) / 3;
+                mdst[c] = msrc[c] / 3;
+            }
+        }
+    }
+    return t;
+}
+
+void fluidtexture_destroy(struct fluidtexture *t) {
+    if (!t)
+        return;
+    free(t->primary);
+    free(t->mirrored);
+    free(t);
+}
+
+static void fluidtexture_addSpan(const uint8_t *a, const uint8_t *b,
+        uint8_t *out, int bytes) {
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_adds_epu8(va, vb));
+    }
+#endif
+    for (; i < bytes; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+static inline void fluidtexture_blendPixel(uint8_t *pixel,
+        const uint8_t *rgb, float a) {
+    // The color gets scaled by alpha before blending, like
+    // simulation_addPixel() does:
+    float fa = a * (1.0f / 255.0f);
+    float values[4];
+    values[0] = pixel[0] + a;
+    for (int c = 1; c < 4; c++) {
+        values[c] = pixel[c] * (1.0f - fa) + rgb[c - 1] * fa * fa;
+    }
+    for (int c = 0; c < 4; c++) {
+        int v = (int)values[c];
+        if (v < 0) v = 0;
+        if (v > 255) v = 255;
+        pixel[c] = v;
+    }
+}
+
+#if defined(__SSE2__)
+static inline __m128i fluidtexture_blendPixelSSE(__m128i pixel,
+        const uint8_t *rgb, float a) {
+    // pixel holds the four channels as 32bit ints:
+    float fa = a * (1.0f / 255.0f);
+    __m128 keep = _mm_setr_ps(1.0f, 1.0f - fa, 1.0f - fa, 1.0f - fa);
+    __m128 add = _mm_setr_ps(a, rgb[0] * fa * fa, rgb[1] * fa * fa,
+        rgb[2] * fa * fa);
+    __m128 result = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(pixel), keep),
+        add);
+    return _mm_cvttps_epi32(result);
+}
+#endif
+
+void fluidtexture_blendRow(uint8_t *pixels, const uint8_t *rgb,
+        const float *alpha, int count) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+        if (alpha[i] <= 0 && alpha[i + 1] <= 0 &&
+                alpha[i + 2] <= 0 && alpha[i + 3] <= 0)
+            continue;
+
+        // Widen four pixels to 32bit per channel, blend, and saturate
+        // back down to bytes:
+        __m128i src = _mm_loadu_si128((const __m128i *)(pixels + 4 * i));
+        __m128i lo = _mm_unpacklo_epi8(src, zero);
+        __m128i hi = _mm_unpackhi_epi8(src, zero);
+        __m128i p0 = fluidtexture_blendPixelSSE(
+            _mm_unpacklo_epi16(lo, zero), rgb + 3 * i, alpha[i]);
+        __m128i p1 = fluidtexture_blendPixelSSE(
+            _mm_unpackhi_epi16(lo, zero), rgb + 3 * i + 3, alpha[i + 1]);
+        __m128i p2 = fluidtexture_blendPixelSSE(
+            _mm_unpacklo_epi16(hi, zero), rgb + 3 * i + 6, alpha[i + 2]);
+        __m128i p3 = fluidtexture_blendPixelSSE(
+            _mm_unpackhi_epi16(hi, zero), rgb + 3 * i + 9, alpha[i + 3]);
+        __m128i result = _mm_packus_epi16(_mm_packs_epi32(p0, p1),
+            _mm_packs_epi32(p2, p3));
+        _mm_storeu_si128((__m128i *)(pixels + 4 * i), result);
+    }
+#endif
+    for (; i < count; i++) {
+        if (alpha[i] > 0)
+            fluidtexture_blendPixel(pixels + 4 * i, rgb + 3 * i, alpha[i]);
+    }
+}
+
+void fluidtexture_sampleRow(const struct fluidtexture *t, int x, int y,
+        int count, int scroll_x, int scroll_y, uint8_t *rgb) {
+    int row = ((y + scroll_y) & t->mask_y) * t->size_x * 2;
+    const uint8_t *primary = t->primary + 3 * row;
+    const uint8_t *mirrored = t->mirrored + 3 * row;
+    while (count > 0) {
+        // Both layers are contiguous for up to size_x pixels:
+        int span = (count < t->size_x ? count : t->size_x);
+        int u = (x + scroll_x) & t->mask_x;
+        int mu = (x - scroll_x) & t->mask_x;
+        fluidtexture_addSpan(primary + 3 * u, mirrored + 3 * mu,
+            rgb, 3 * span);
+        rgb += 3 * span;
+        x += span;
+        count -= span;
+    }
+}
@@ -0,0 +1,48 @@
+
+#ifndef _SANDBOX_FLUIDTEXTURE_H_
+#define _SANDBOX_FLUIDTEXTURE_H_
+
+#include <stdint.h>
+
+// Render-ready water texture. The shade of a screen pixel is two thirds of
+// the texture scrolled one way plus one third of its mirror image scrolled
+// the other way. Both layers are stored pre-weighted, scaled to screen
+// pixels and resized to a power of two, so wrapping is a mask. Each row is
+// stored twice in a row, so any span of up to size_x pixels can be read
+// without wrapping at all.
+struct fluidtexture {
+    int size_x, size_y;
+    int mask_x, mask_y;
+    uint8_t *primary;  // RGB, 2 * size_x texels per row
+    uint8_t *mirrored;
+};
+
+// rgb holds w * h tightly packed RGB pixels. Every texture pixel covers
+// 1 / scale screen pixels:
+struct fluidtexture *fluidtexture_create(const uint8_t *rgb, int w, int h,
+    double scale);
+void fluidtexture_destroy(struct fluidtexture *t);
+
+// Shade count pixels of screen row y starting at x, writing RGB triples:
+void fluidtexture_sampleRow(const struct fluidtexture *t, int x, int y,
+    int count, int scroll_x, int scroll_y, uint8_t *rgb);
+
+// Blend count pixels onto a row of the simulation image (4 bytes per
+// pixel: alpha, red, green, blue) the same way simulation_addPixel() does.
+// alpha holds one value 0..255 per pixel, pixels without alpha are left
+// untouched. Uses SSE2 where available:
+void fluidtexture_blendRow(uint8_t *pixels, const uint8_t *rgb,
+    const float *alpha, int count);
+
+static inline void fluidtexture_sample(const struct fluidtexture *t,
+        int x, int y, int scroll_x, int scroll_y, int *r, int *g, int *b) {
+    int row = ((y + scroll_y) & t->mask_y) * t->size_x * 2;
+    const uint8_t *p = t->primary + 3 * (row + ((x + scroll_x) & t->mask_x));
+    const uint8_t *m = t->mirrored +
+        3 * (row + ((x - scroll_x) & t->mask_x));
+    *r = p[0] + m[0];
+    *g = p[1] + m[1];
+    *b = p[2] + m[2];
+}
+
+#endif  // _SANDBOX_FLUIDTEXTURE_H_
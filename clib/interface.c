@@ -7,12 +7,19 @@
 #include <SDL2/SDL_image.h>
 #include <unistd.h>
 
+#include "depthfill.h"
+#include "depthfilter.h"
 #include "fluid.h"
+#include "fluidemitter.h"
 #include "images.h"
 #include "interface.h"
 #include "multiimgrotator.h"
+#include "random.h"
+#include "simclock.h"
 #include "simulation.h"
+#include "snapshot.h"
 #include "topology.h"
+#include "workerpool.h"
 
 // Main compute thread communication variables:
 uint8_t *_depth_input_transfer_buf = NULL;
@@ -24,9 +31,140 @@ uint8_t *output_colors_final = NULL;
 uint8_t *depth_array_buf = NULL;
 static int xsize, ysize;
 
+// Size of the screen, and of the world shown on it starting at the
+// viewport. A world size of 0 means the same as the screen:
+static int screen_x = 1024;
+static int screen_y = 768;
+static int world_x = 0;
+static int world_y = 0;
+static int viewport_x = 0;
+static int viewport_y = 0;
+
 static pthread_mutex_t *main_compute_data_access = NULL;
 static pthread_t *main_compute_thread = NULL;
 
+// Snapshot requests, carried out by the main compute thread since it owns
+// the particles. Protected by snapshot_request_access:
+static pthread_mutex_t snapshot_request_access = PTHREAD_MUTEX_INITIALIZER;
+static char *snapshot_restore_path = NULL;
+static char *snapshot_save_path = NULL;
+static char *autosave_path = NULL;
+static uint64_t autosave_interval_ms = 0;
+static uint64_t autosave_ts = 0;
+
+// Depth hole filling and denoising settings (see depthfill.h and
+// depthfilter.h), taken over by the main compute thread each frame, and
+// a copy of which pixels of the last frame were valid. Protected by
+// depth_filter_access:
+static pthread_mutex_t depth_filter_access = PTHREAD_MUTEX_INITIALIZER;
+static int depth_fill_enabled = 1;
+static struct depthfill *depth_fill = NULL;
+static int depth_fill_failed = 0;
+static uint8_t *depth_valid_copy = NULL;
+static int depth_valid_size = 0;
+static int depth_median_frames = 1;
+static double depth_smoothing = 0;
+static double depth_hysteresis = 0;
+static int depth_blur_radius = 0;
+static struct depthfilter *depth_filter = NULL;
+static int depth_filter_failed = 0;
+
+static const uint8_t *interface_fillDepthHoles(uint8_t *depth) {
+    pthread_mutex_lock(&depth_filter_access);
+    int enabled = depth_fill_enabled;
+    if (!enabled)
+        depth_valid_size = 0;
+    pthread_mutex_unlock(&depth_filter_access);
+    if (!enabled)
+        return NULL;
+
+    if (!depth_fill && !depth_fill_failed) {
+        depth_fill = depthfill_create(xsize, ysize, workerpool_shared());
+        depth_valid_copy = malloc(xsize * ysize);
+        if (!depth_fill || !depth_valid_copy) {
+            fprintf(stderr, "clib/interface.c: error: "
+                "out of memory for filling depth holes\n");
+            depthfill_destroy(depth_fill);
+            depth_fill = NULL;
+            depth_fill_failed = 1;
+        }
+    }
+    if (!depth_fill)
+        return NULL;
+    depthfill_run(depth_fill, depth);
+    const uint8_t *valid = depthfill_getValid(depth_fill);
+    pthread_mutex_lock(&depth_filter_access);
+    memcpy(depth_valid_copy, valid, xsize * ysize);
+    depth_valid_size = xsize * ysize;
+    pthread_mutex_unlock(&depth_filter_access);
+    return valid;
+}
+
+static void interface_filterDepth(uint8_t *depth, const uint8_t *valid) {
+    pthread_mutex_lock(&depth_filter_access);
+    int median_frames = depth_median_frames;
+    double smoothing = depth_smoothing;
+    double hysteresis = depth_hysteresis;
+    int blur_radius = depth_blur_radius;
+    pthread_mutex_unlock(&depth_filter_access);
+
+    if (median_frames <= 1 && smoothing <= 0 && hysteresis <= 0 &&
+            blur_radius <= 0) {
+        // Off, so start over once turned on again:
+        if (depth_filter)
+            depthfilter_reset(depth_filter);
+        return;
+    }
+    if (!depth_filter && !depth_filter_failed) {
+        depth_filter = depthfilter_create(xsize, ysize,
+            workerpool_shared());
+        if (!depth_filter) {
+            fprintf(stderr, "clib/interface.c: error: "
+                "out of memory for the depth filter\n");
+            depth_filter_failed = 1;
+        }
+    }
+    if (!depth_filter)
+        return;
+    depthfilter_setMedianFrames(depth_filter, median_frames);
+    depthfilter_setSmoothing(depth_filter, smoothing, hysteresis);
+    depthfilter_setBlurRadius(depth_filter, blur_radius);
+    depthfilter_run(depth_filter, depth, valid);
+}
+
+static char *interface_copyString(const char *s) {
+    char *copy = malloc(strlen(s) + 1);
+    if (copy)
+        strcpy(copy, s);
+    return copy;
+}
+
+static void interface_handleSnapshots() {
+    pthread_mutex_lock(&snapshot_request_access);
+    char *restore_path = snapshot_restore_path;
+    snapshot_restore_path = NULL;
+    char *save_path = snapshot_save_path;
+    snapshot_save_path = NULL;
+    if (!save_path && autosave_path && autosave_interval_ms > 0 &&
+            simclock_ms() >= autosave_ts + autosave_interval_ms) {
+        autosave_ts = simclock_ms();
+        save_path = interface_copyString(autosave_path);
+    }
+    pthread_mutex_unlock(&snapshot_request_access);
+
+    if (restore_path) {
+        if (snapshot_restore(restore_path)) {
+            printf("clib/interface.c: info: restored %s\n", restore_path);
+            fflush(stdout);
+        }
+        free(restore_path);
+    }
+    if (save_path) {
+        snapshot_save(save_path);
+        free(save_path);
+    }
+}
+
 struct imginput {
     struct inputconfig config;
     void *pixels;
@@ -46,13 +184,19 @@ static void *interface_mainComputeThread(
         memcpy(depth_array_buf, _depth_input_transfer_buf,
             xsize * ysize * 1);
         pthread_mutex_unlock(main_compute_data_access);
+        // Fill sensor dropouts and calm down noise before anything is
+        // derived from the depth:
+        const uint8_t *depth_valid = interface_fillDepthHoles(
+            depth_array_buf);
+        interface_filterDepth(depth_array_buf, depth_valid);
 
         // Make sure everything is initialized:
         simulation_initialize(xsize, ysize);
         assert(gradient_x > 0);
         images_init_simulation_image(xsize, ysize);
-        fluid_init(xsize, ysize);
-        topology_init(xsize, ysize);
+        fluid_init(world_x, world_y);
+        topology_init(world_x, world_y);
+        interface_handleSnapshots();
 
         // Draw depth input data properly:
         multiimgrotator_Draw();
@@ -70,7 +214,6 @@ static void *interface_mainComputeThread(
         simulation_lockSurface();
         assert(simulation_isSurfaceLocked());
         fluid_drawAll(xsize, ysize);
-        fluid_autoDrain();
 
         simulation_updateMovingObjects();
         simulation_unlockSurface();
@@ -108,8 +251,8 @@ static void *interface_mainComputeThread(
 static SDL_Surface *transfer_srf = NULL;
 void interface_run(const void *depth_array_v, void *output_colors_v) {
 
-    int _xsize = 1024;
-    int _ysize = 768;
+    int _xsize = screen_x;
+    int _ysize = screen_y;
 
     // Initialize all the data buffers we need:
     if (!_depth_input_transfer_buf) {
@@ -138,8 +281,12 @@ void interface_run(const void *depth_array_v, void *output_colors_v) {
         main_compute_thread = malloc(sizeof(*main_compute_thread));
         xsize = _xsize;
         ysize = _ysize;
+        if (world_x < xsize) world_x = xsize;
+        if (world_y < ysize) world_y = ysize;
         printf("[clib/interface.c] SCREEN DIMENSIONS: %d, %d\n",
             xsize, ysize);
+        printf("[clib/interface.c] WORLD DIMENSIONS: %d, %d\n",
+            world_x, world_y);
         pthread_create(
             main_compute_thread, NULL,
             interface_mainComputeThread, NULL);
@@ -181,6 +328,58 @@ void interface_run(const void *depth_array_v, void *output_colors_v) {
     pthread_mutex_unlock(main_compute_data_access);
 }
 
+void interface_setScreenSize(int width, int height) {
+    if (main_compute_thread) {
+        fprintf(stderr, "clib/interface.c: error: "
+            "screen size can't be changed once running\n");
+        return;
+    }
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "clib/interface.c: error: "
+            "invalid screen size %d, %d\n", width, height);
+        return;
+    }
+    screen_x = width;
+    screen_y = height;
+}
+
+void interface_setWorldSize(int width, int height) {
+    if (main_compute_thread) {
+        fprintf(stderr, "clib/interface.c: error: "
+            "world size can't be changed once running\n");
+        return;
+    }
+    if (width < 0 || height < 0) {
+        fprintf(stderr, "clib/interface.c: error: "
+            "invalid world size %d, %d\n", width, height);
+        return;
+    }
+    // Smaller worlds than the screen are grown to it on start:
+    world_x = width;
+    world_y = height;
+}
+
+void interface_setViewport(int x, int y) {
+    int max_x = (world_x > screen_x ? world_x : screen_x) - screen_x;
+    int max_y = (world_y > screen_y ? world_y : screen_y) - screen_y;
+    if (x > max_x) x = max_x;
+    if (x < 0) x = 0;
+    if (y > max_y) y = max_y;
+    if (y < 0) y = 0;
+    viewport_x = x;
+    viewport_y = y;
+    simulation_setViewport(x, y);
+}
+
+void interface_getViewport(int *x, int *y) {
+    *x = viewport_x;
+    *y = viewport_y;
+}
+
+size_t interface_getMemoryUsage() {
+    return fluid_getMemoryUsage() + topology_getMemoryUsage();
+}
+
 void interface_stop() {
     shutdown_signal = 1;
     sleep(1);   
@@ -204,20 +403,195 @@ void interface_setMapZoom(double zoom) {
     simulation_setMapZoom(zoom);
 }
 
+static int interface_addEmitter(int kind, int type, double x, double y,
+        double w, double h, double min_height, double rate, int once) {
+    struct fluidemitter e;
+    memset(&e, 0, sizeof(e));
+    e.kind = kind;
+    e.type = type;
+    e.x = x;
+    e.y = y;
+    e.w = w;
+    e.h = h;
+    e.min_height = min_height;
+    e.rate = rate;
+    e.once = once;
+    return fluidemitter_add(&e);
+}
+
 void interface_spawnWater(double x, double y) {
-    int wX = (int)x;
-    int wY = (int)y;
-    if (wX < 0) wX = 0;
-    if (wX >= images_simulation_image->w) wX = images_simulation_image->w;
-    if (wY < 0) wY = 0;
-    if (wY >= images_simulation_image->h) wY = images_simulation_image->h; 
-    fluid_spawn(FLUID_WATER, wX, wY, 500);   
+    if (x < 0) x = 0;
+    if (x >= images_simulation_image->w) x = images_simulation_image->w - 1;
+    if (y < 0) y = 0;
+    if (y >= images_simulation_image->h) y = images_simulation_image->h - 1;
+    int view_x, view_y;
+    simulation_getViewport(&view_x, &view_y);
+    x += view_x;
+    y += view_y;
+    interface_addEmitter(FLUIDEMITTER_POINT, FLUID_WATER, x, y, 0, 0, 0,
+        500, 1);
+}
+
+int interface_addPointEmitter(int type, double x, double y, double rate) {
+    return interface_addEmitter(FLUIDEMITTER_POINT, type, x, y, 0, 0, 0,
+        rate, 0);
+}
+
+int interface_addAreaEmitter(int type, double x, double y, double w,
+        double h, double rate) {
+    return interface_addEmitter(FLUIDEMITTER_AREA, type, x, y, w, h, 0,
+        rate, 0);
+}
+
+int interface_addHeightEmitter(int type, double min_height, double rate) {
+    return interface_addEmitter(FLUIDEMITTER_HEIGHT, type, 0, 0, 0, 0,
+        min_height, rate, 0);
+}
+
+void interface_removeEmitter(int id) {
+    fluidemitter_remove(id);
 }
 
 void interface_resetWater() {
     fluid_resetAll();    
 }
 
+void interface_settleFluids() {
+    fluid_settleAll();
+}
+
+void interface_setFluidSettleInterval(double seconds) {
+    fluid_setSettleInterval(seconds);
+}
+
+void interface_setFluidEngine(int engine) {
+    fluid_setEngine(engine);
+}
+
+void interface_setFluidProperties(int type, double viscosity,
+        int r, int g, int b, double tint) {
+    fluid_setProperties(type, viscosity, r, g, b, tint);
+}
+
+double interface_getFluidVolume(int type) {
+    if (type < 0 || type >= FLUID_COUNT)
+        return 0;
+    return fluid_getVolume(type);
+}
+
+void interface_setFluidThreads(int threads) {
+    fluid_setThreadCount(threads);
+}
+
+void interface_setFluidResolution(double reduce_factor) {
+    fluid_setResolution(reduce_factor);
+}
+
+void interface_setFluidLOD(int enabled) {
+    fluid_setLOD(enabled);
+}
+
+void interface_setFluidInterpolation(int enabled) {
+    fluid_setInterpolation(enabled);
+}
+
+void interface_setDepthHoleFilling(int enabled) {
+    pthread_mutex_lock(&depth_filter_access);
+    depth_fill_enabled = (enabled != 0);
+    pthread_mutex_unlock(&depth_filter_access);
+}
+
+int interface_getDepthValidMask(uint8_t *mask, int max_pixels) {
+    pthread_mutex_lock(&depth_filter_access);
+    int size = depth_valid_size;
+    int count = (size < max_pixels ? size : max_pixels);
+    if (count > 0)
+        memcpy(mask, depth_valid_copy, count);
+    pthread_mutex_unlock(&depth_filter_access);
+    return size;
+}
+
+void interface_setDepthMedianFrames(int frames) {
+    pthread_mutex_lock(&depth_filter_access);
+    depth_median_frames = frames;
+    pthread_mutex_unlock(&depth_filter_access);
+}
+
+void interface_setDepthSmoothing(double smoothing, double hysteresis) {
+    pthread_mutex_lock(&depth_filter_access);
+    depth_smoothing = smoothing;
+    depth_hysteresis = hysteresis;
+    pthread_mutex_unlock(&depth_filter_access);
+}
+
+void interface_setDepthBlur(int radius) {
+    pthread_mutex_lock(&depth_filter_access);
+    depth_blur_radius = radius;
+    pthread_mutex_unlock(&depth_filter_access);
+}
+
+void interface_setDepthChangeThreshold(int threshold) {
+    topology_setChangeThreshold(threshold);
+}
+
+double interface_getWaterVolume() {
+    return fluid_getVolume(FLUID_WATER);
+}
+
+double interface_getWaterCoverage() {
+    return fluid_getCoverage(FLUID_WATER);
+}
+
+void interface_getFluidTileGrid(int *tiles_x, int *tiles_y) {
+    fluid_getTileGrid(tiles_x, tiles_y);
+}
+
+int interface_getWaterTileStats(double *volumes, int *wet_cells,
+        int max_tiles) {
+    return fluid_getTileStats(FLUID_WATER, volumes, wet_cells, max_tiles);
+}
+
+void interface_setRandomSeed(uint64_t seed) {
+    random_seed(seed);
+}
+
+void interface_setVirtualTime(int enabled) {
+    simclock_setVirtual(enabled);
+}
+
+void interface_fastForward(double seconds) {
+    // Only returns once the fluid simulation has caught up:
+    simclock_advance((int64_t)(seconds * 1000000000.0));
+    simclock_waitForVirtual();
+}
+
+void interface_saveSnapshot(const char *path) {
+    pthread_mutex_lock(&snapshot_request_access);
+    free(snapshot_save_path);
+    snapshot_save_path = interface_copyString(path);
+    pthread_mutex_unlock(&snapshot_request_access);
+}
+
+void interface_loadSnapshot(const char *path) {
+    pthread_mutex_lock(&snapshot_request_access);
+    free(snapshot_restore_path);
+    snapshot_restore_path = interface_copyString(path);
+    pthread_mutex_unlock(&snapshot_request_access);
+}
+
+void interface_setAutosave(const char *path, double interval_seconds) {
+    pthread_mutex_lock(&snapshot_request_access);
+    free(autosave_path);
+    autosave_path = NULL;
+    autosave_interval_ms = 0;
+    if (path && interval_seconds > 0) {
+        autosave_path = interface_copyString(path);
+        autosave_interval_ms = (uint64_t)(interval_seconds * 1000.0);
+        autosave_ts = simclock_ms();
+    }
+    pthread_mutex_unlock(&snapshot_request_access);
+}
+
 void interface_setInputAmount(int size) {
     if (size == 0) {
         free(inputs);
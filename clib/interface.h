@@ -2,11 +2,98 @@
 #ifndef CLIB_INTERFACE_H_
 #define CLIB_INTERFACE_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 void interface_run(const void *depth_array_v, void *output_colors_v);
 
+// The screen shows part of a world which may be larger, starting at the
+// viewport. Screen and world size have to be set before the first
+// interface_run(), a world size of 0 (the default) is the screen size.
+// Only the parts of the world in use take up memory:
+void interface_setScreenSize(int width, int height);
+void interface_setWorldSize(int width, int height);
+// Clamped so the screen stays inside the world:
+void interface_setViewport(int x, int y);
+void interface_getViewport(int *x, int *y);
+size_t interface_getMemoryUsage();
+
 void interface_mapOffset(double x, double y);
 
 void interface_resetWater();
+// Move all fluid to where it comes to rest right away, once or every
+// few seconds (0 turns that off):
+void interface_settleFluids();
+void interface_setFluidSettleInterval(double seconds);
+
+// Fluid sources (positive rate) and sinks (negative rate) in amount per
+// second, per cell for area and height emitters. Positions are in world
+// pixels, except for spawning water which is on screen. min_height is a
+// share of the highest possible ground. All of the add functions return
+// an id for interface_removeEmitter(), or -1 on error:
+void interface_spawnWater(double x, double y);
+int interface_addPointEmitter(int type, double x, double y, double rate);
+int interface_addAreaEmitter(int type, double x, double y, double w,
+    double h, double rate);
+int interface_addHeightEmitter(int type, double min_height, double rate);
+void interface_removeEmitter(int id);
+
+void interface_setFluidEngine(int engine);
+
+// Fluid types are FLUID_WATER (0), FLUID_LAVA (1) and FLUID_MUD (2).
+// viscosity and tint go from 0 to 1, see fluid_setProperties():
+void interface_setFluidProperties(int type, double viscosity,
+    int r, int g, int b, double tint);
+double interface_getFluidVolume(int type);
+
+void interface_setFluidThreads(int threads);
+
+// Screen pixels per fluid cell, the fluid is resampled keeping its volume.
+// Level of detail lets still water update less often (stencil engine).
+// Interpolation fades the drawn fluid between simulation steps:
+void interface_setFluidResolution(double reduce_factor);
+void interface_setFluidLOD(int enabled);
+void interface_setFluidInterpolation(int enabled);
+
+// Holes in the depth image (0 or 255, where the sensors saw nothing) are
+// filled from around them, on by default (see depthfill.h). Which pixels
+// of the last frame were valid (1) or filled (0) can be copied out, row
+// by row, up to max_pixels of them. Returns how many pixels the mask
+// has, 0 with filling off:
+void interface_setDepthHoleFilling(int enabled);
+int interface_getDepthValidMask(uint8_t *mask, int max_pixels);
+
+// Denoising of the depth image before the topology is drawn from it, all
+// off by default (see depthfilter.h). A median over 3 or 5 frames drops
+// spikes. smoothing (0 to below 1) averages over time and hysteresis is
+// how many depth steps it has to move before the ground follows. Both
+// trade smoothness for latency. The blur radius is in screen pixels:
+void interface_setDepthMedianFrames(int frames);
+void interface_setDepthSmoothing(double smoothing, double hysteresis);
+void interface_setDepthBlur(int radius);
+// Only screen tiles whose depth changed by more than threshold, summed
+// over the tile's 32 x 32 pixels, are drawn again. 0 redoes any change:
+void interface_setDepthChangeThreshold(int threshold);
+
+// Snapshots of the whole simulation state (see snapshot.h). They are
+// taken and restored by the compute thread at the start of its next
+// frame. An autosave interval of 0 turns autosaving off:
+void interface_saveSnapshot(const char *path);
+void interface_loadSnapshot(const char *path);
+void interface_setAutosave(const char *path, double interval_seconds);
+
+// Water totals, tracked per tile of the fluid grid (row by row):
+double interface_getWaterVolume();
+double interface_getWaterCoverage();
+void interface_getFluidTileGrid(int *tiles_x, int *tiles_y);
+int interface_getWaterTileStats(double *volumes, int *wet_cells,
+    int max_tiles);
+
+void interface_setRandomSeed(uint64_t seed);
+
+void interface_setVirtualTime(int enabled);
+
+void interface_fastForward(double seconds);
 
 void interface_stop();
 
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <SDL2/SDL.h>
 
@@ -91,6 +92,8 @@ void particle_wipeAll(int type) {
 struct particle_instance *particle_add(int type, double x, double y,
         double angle) {
     struct particle_instance *inst = malloc(sizeof(struct particle_instance));
+    if (!inst)
+        return NULL;
     memset(inst, 0, sizeof(*inst));
     inst->type = type;
     if (plist[type] != NULL) {
@@ -105,9 +108,9 @@ struct particle_instance *particle_add(int type, double x, double y,
 }
 
 struct particle_instance *particle_addRandom(int type) {
-    double x = rand0to1();
-    double y = rand0to1();
-    return particle_add(type, x, y, rand0to1() * 360.0); 
+    double x = random_double();
+    double y = random_double();
+    return particle_add(type, x, y, random_double() * 360.0);
 }
 
 void particle_addRandomCrowd(int type, int amount) {
@@ -116,15 +119,117 @@ void particle_addRandomCrowd(int type, int amount) {
     }
 }
 
+int particle_countAll(void) {
+    int count = 0;
+    for (int i = 0; i < PARTICLE_TYPE_COUNT; i++) {
+        for (struct particle_instance *inst = plist[i]; inst;
+                inst = inst->next) {
+            count++;
+        }
+    }
+    return count;
+}
+
+int particle_exportAll(struct particle_state *out, int max) {
+    int count = 0;
+    for (int i = 0; i < PARTICLE_TYPE_COUNT; i++) {
+        for (struct particle_instance *inst = plist[i]; inst &&
+                count < max; inst = inst->next) {
+            memset(&out[count], 0, sizeof(out[count]));
+            out[count].type = inst->type;
+            out[count].x = inst->x;
+            out[count].y = inst->y;
+            out[count].vx = inst->vx;
+            out[count].vy = inst->vy;
+            out[count].angle = inst->angle;
+            count++;
+        }
+    }
+    return count;
+}
+
+void particle_importAll(const struct particle_state *in, int count) {
+    for (int i = 0; i < PARTICLE_TYPE_COUNT; i++) {
+        particle_wipeAll(i);
+    }
+    // particle_add() puts new particles first, so go backwards to keep
+    // the exported order:
+    for (int i = count - 1; i >= 0; i--) {
+        if (in[i].type < 0 || in[i].type >= PARTICLE_TYPE_COUNT)
+            continue;
+        struct particle_instance *inst = particle_add(in[i].type,
+            in[i].x, in[i].y, in[i].angle);
+        if (!inst) {
+            // The count comes from the file, so it may be anything:
+            fprintf(stderr, "clib/particle.c: error: out of memory "
+                "after %d of %d particles\n", count - 1 - i, count);
+            return;
+        }
+        inst->vx = in[i].vx;
+        inst->vy = in[i].vy;
+    }
+}
+
 void particle_move(struct particle_instance *inst, double x, double y) {
     inst->x = x;
     inst->y = y;        
 }
 
+// Positions of the grass and the share of grass ground around each,
+// looked up for all of them at once:
+static int *particle_scan_x = NULL;
+static int *particle_scan_y = NULL;
+static double *particle_scan_result = NULL;
+static int particle_scan_alloc = 0;
+
+static int particle_scanGrass(int type,
+        const struct topology_snapshot *ground) {
+    int count = 0;
+    struct particle_instance *inst = plist[type];
+    while (inst) {
+        count++;
+        inst = inst->next;
+    }
+    if (count > particle_scan_alloc) {
+        int *xs = realloc(particle_scan_x, sizeof(int) * count);
+        if (xs) particle_scan_x = xs;
+        int *ys = realloc(particle_scan_y, sizeof(int) * count);
+        if (ys) particle_scan_y = ys;
+        double *result = realloc(particle_scan_result,
+            sizeof(double) * count);
+        if (result) particle_scan_result = result;
+        if (!xs || !ys || !result) {
+            fprintf(stderr, "clib/particle.c: error: "
+                "out of memory for the grass scan\n");
+            return 0;
+        }
+        particle_scan_alloc = count;
+    }
+    int i = 0;
+    inst = plist[type];
+    while (inst) {
+        particle_scan_x[i] = inst->x * ((double)ground->map_x);
+        particle_scan_y[i] = inst->y * ((double)ground->map_y);
+        i++;
+        inst = inst->next;
+    }
+    topology_snapshotScanTypes(ground, TOPOLOGY_GRASS,
+        particle_scan_x, particle_scan_y, count, 15, particle_scan_result);
+    return 1;
+}
+
 void particle_render(int type) {
     struct particle_instance* inst = plist[type];
     SDL_Rect dest = {0};
+    int view_x, view_y;
+    simulation_getViewport(&view_x, &view_y);
+    const struct topology_snapshot *ground = topology_acquireSnapshot();
+    int scanned = 0;
+    if (type == PARTICLE_GRASS)
+        scanned = particle_scanGrass(type, ground);
+    int index = -1;
     while (inst) {
+        index++;
         SDL_Texture *i = ptypes[type].image;
         assert(i != NULL);
         uint32_t format;
@@ -133,18 +238,29 @@ void particle_render(int type) {
         assert(SDL_QueryTexture(
             i, &format, &access,
             &w, &h) == 0);
-        double abs_pos_x = inst->x * ((double)images_simulation_image->w);
-        double abs_pos_y = inst->y * ((double)images_simulation_image->h);
+        // Particle positions are relative to the world, the screen shows
+        // it starting at the viewport:
+        double abs_pos_x = inst->x * ((double)ground->map_x);
+        double abs_pos_y = inst->y * ((double)ground->map_y);
         dest.x = abs_pos_x;
         dest.y = abs_pos_y;
         if (type == PARTICLE_GRASS) {
-            if (topology_scan_type(TOPOLOGY_GRASS, dest.x, dest.y, 15) < 0.5) {
+            double share = (scanned ? particle_scan_result[index] :
+                topology_snapshotScanType(ground, TOPOLOGY_GRASS,
+                    dest.x, dest.y, 15));
+            if (share < 0.5) {
                 inst = inst->next;
                 continue;
             }
         }
-        dest.x -= w / 2;
-        dest.y -= h / 2;
+        dest.x -= view_x + w / 2;
+        dest.y -= view_y + h / 2;
+        if (dest.x + w < 0 || dest.y + h < 0 ||
+                dest.x >= images_simulation_image->w ||
+                dest.y >= images_simulation_image->h) {
+            inst = inst->next;
+            continue;
+        }
         dest.w = w;
         dest.h = h;
         SDL_RenderCopyEx(simulation_getRenderer(),
@@ -152,18 +268,20 @@ void particle_render(int type) {
             inst->angle, NULL, SDL_FLIP_NONE);
         inst = inst->next;
     }
+    topology_releaseSnapshot(ground);
 }
 
-void particle_update(struct particle_instance *inst) {
+void particle_update(struct particle_instance *inst,
+        const struct topology_snapshot *ground) {
     if (inst->type == PARTICLE_CAR) {
-        double abs_pos_x = inst->x * ((double)topology_map_x);
-        double abs_pos_y = inst->y * ((double)topology_map_y);
+        double abs_pos_x = inst->x * ((double)ground->map_x);
+        double abs_pos_y = inst->y * ((double)ground->map_y);
         int pixel_pos_x = abs_pos_x;
         int pixel_pos_y = abs_pos_y;
 
         double drift_x = 0;
         double drift_y = 0;
-        topology_calculate_drift(pixel_pos_x, pixel_pos_y,
+        topology_snapshotDriftAt(ground, pixel_pos_x, pixel_pos_y,
             &drift_x, &drift_y);
  
         double move_x = 1.0 / ((double)topology_map_x);
@@ -194,14 +312,16 @@ void particle_update(struct particle_instance *inst) {
 }
 
 void particle_updateAll(void) {
+    const struct topology_snapshot *ground = topology_acquireSnapshot();
     for (int i = 0; i < PARTICLE_TYPE_COUNT; i++) {
         struct particle_instance *inst = plist[i];
         while (inst) {
             struct particle_instance *ninst = inst->next;
-            particle_update(inst);
+            particle_update(inst, ground);
             inst = ninst;
         }
     }
+    topology_releaseSnapshot(ground);
 }
 
 void particle_renderAll(int from_type, int to_type) {
@@ -2,6 +2,7 @@
 #ifndef _SANDBOX_PARTICLE_H_
 #define _SANDBOX_PARTICLE_H_
 
+#include <stdint.h>
 #include <SDL2/SDL.h>
 
 #define PARTICLE_GRASS 0
@@ -24,6 +25,20 @@ struct particle_instance* particle_add(int type, double x, double y,
     double angle);
 void particle_move(struct particle_instance* inst, double x, double y);
 
+// Plain copy of a particle instance, e.g. for saving:
+struct particle_state {
+    int32_t type;
+    int32_t reserved;
+    double x, y;
+    double vx, vy;
+    double angle;
+};
+int particle_countAll(void);
+// Fill out with up to max particles of all types, returns the amount:
+int particle_exportAll(struct particle_state *out, int max);
+// Replace all particles with the given ones:
+void particle_importAll(const struct particle_state *in, int count);
+
 // convenience functions for particle spawning:
 struct particle_instance *particle_addRandom(int type);
 void particle_addRandomCrowd(int type, int amount);
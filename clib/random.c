@@ -1,12 +1,135 @@
 
+#include <assert.h>
 #include <stdlib.h>
 #include <time.h>
 
+#include "random.h"
+
+// The seed is changed by one thread while others draw numbers, so it is
+// only accessed atomically:
+static uint64_t random_base_seed = 0;
+static unsigned int random_seed_generation = 1;
+static unsigned int random_thread_counter = 0;
+
+// Streams picked with random_seedStream() are kept apart from the ones
+// handed out to threads in order:
+#define RANDOM_PICKED_STREAM (1ULL << 63)
+
+static __thread uint64_t random_state[4];
+static __thread unsigned int random_state_generation = 0;
+
 __attribute__((constructor)) static void random_init() {
-    srand(time(NULL));
+    __atomic_store_n(&random_base_seed, (uint64_t)time(NULL),
+        __ATOMIC_RELAXED);
 }
 
-double rand0to1() {
-    return (double)rand() / (double)RAND_MAX;
+static uint64_t random_splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void random_seedState(uint64_t stream, unsigned int generation) {
+    uint64_t x = __atomic_load_n(&random_base_seed, __ATOMIC_RELAXED) ^
+        (stream * 0xd1b54a32d192ed03ULL);
+    for (int i = 0; i < 4; i++) {
+        random_state[i] = random_splitmix64(&x);
+    }
+    random_state_generation = generation;
+}
+
+static void random_seedThread() {
+    // A thread that didn't pick a stream gets the next one, in the order
+    // in which the threads ask for random numbers first:
+    unsigned int generation = __atomic_load_n(&random_seed_generation,
+        __ATOMIC_ACQUIRE);
+    uint64_t index = __atomic_fetch_add(&random_thread_counter, 1,
+        __ATOMIC_RELAXED);
+    random_seedState(index, generation);
+}
+
+void random_seed(uint64_t seed) {
+    __atomic_store_n(&random_base_seed, seed, __ATOMIC_RELAXED);
+    __atomic_store_n(&random_thread_counter, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&random_seed_generation, 1, __ATOMIC_RELEASE);
+    random_seedThread();
+}
+
+void random_seedStream(uint64_t stream) {
+    random_seedState(stream | RANDOM_PICKED_STREAM,
+        __atomic_load_n(&random_seed_generation, __ATOMIC_ACQUIRE));
+}
+
+static inline uint64_t random_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
 }
 
+uint64_t random_next() {
+    if (random_state_generation != __atomic_load_n(&random_seed_generation,
+            __ATOMIC_ACQUIRE))
+        random_seedThread();
+    uint64_t *s = random_state;
+    uint64_t result = random_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = random_rotl(s[3], 45);
+    return result;
+}
+
+double random_double() {
+    return (double)(random_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+float random_float() {
+    return (float)(random_next() >> 40) * (1.0f / 16777216.0f);
+}
+
+void random_fillFloats(float *values, int count) {
+    // Every 64bit number yields two floats:
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        uint64_t r = random_next();
+        values[i] = (float)(r >> 40) * (1.0f / 16777216.0f);
+        values[i + 1] = (float)((r >> 8) & 0xffffff) * (1.0f / 16777216.0f);
+    }
+    if (i < count)
+        values[i] = random_float();
+}
+
+struct random_jittertable *random_createJitterTable(int size,
+        int min, int max) {
+    assert(min <= max && min >= -128 && max <= 127);
+    int rounded_size = 1;
+    while (rounded_size < size)
+        rounded_size *= 2;
+    struct random_jittertable *table = malloc(sizeof(*table));
+    if (!table)
+        return NULL;
+    table->offsets = malloc(rounded_size);
+    if (!table->offsets) {
+        free(table);
+        return NULL;
+    }
+    table->mask = rounded_size - 1;
+    int range = max - min + 1;
+    for (int i = 0; i < rounded_size; i++) {
+        table->offsets[i] = min + (int)(random_next() % range);
+    }
+    return table;
+}
+
+void random_destroyJitterTable(struct random_jittertable *table) {
+    if (!table)
+        return;
+    free(table->offsets);
+    free(table);
+}
+
+double rand0to1() {
+    return random_double();
+}
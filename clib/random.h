@@ -1,3 +1,47 @@
 
+#ifndef _SANDBOX_RANDOM_H_
+#define _SANDBOX_RANDOM_H_
+
+#include <stdint.h>
+
+// Fast random numbers (xoshiro256**). Every thread has its own generator
+// state, so there is no locking involved. All thread states are derived
+// from one global seed, which is picked from the time at startup unless
+// random_seed() is used. The thread calling random_seed() gets the first
+// stream, other threads the next ones in the order they draw a number
+// first:
+void random_seed(uint64_t seed);
+
+// Restart the calling thread on a stream of its own choice, derived from
+// the same seed. Tasks of a worker pool pick it from the work they do
+// (e.g. tile and step), so what they draw doesn't depend on the thread
+// that runs them:
+void random_seedStream(uint64_t stream);
+
+uint64_t random_next();
+double random_double();  // 0 <= x < 1
+float random_float();  // 0 <= x < 1
+
+// Fill an array with floats in 0 <= x < 1:
+void random_fillFloats(float *values, int count);
+
+// Precomputed table of random integer offsets in min..max, for cheap
+// per-pixel jitter. The size is rounded up to a power of two, so any
+// running index can be wrapped with the mask:
+struct random_jittertable {
+    int mask;
+    int8_t *offsets;
+};
+struct random_jittertable *random_createJitterTable(int size,
+    int min, int max);
+void random_destroyJitterTable(struct random_jittertable *table);
+
+static inline int random_jitter(const struct random_jittertable *table,
+        unsigned int index) {
+    return table->offsets[index & table->mask];
+}
+
+// Old interface, same as random_double():
 double rand0to1();
 
+#endif  // _SANDBOX_RANDOM_H_
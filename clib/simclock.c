@@ -0,0 +1,150 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "simclock.h"
+
+#define SIMCLOCK_NS_PER_SECOND 1000000000LL
+
+static pthread_mutex_t simclock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t simclock_changed = PTHREAD_COND_INITIALIZER;
+
+// In real-time mode, simulation time is the monotonic time plus offset:
+static int64_t simclock_offset = 0;
+static int simclock_virtual = 0;
+static int64_t simclock_virtual_now = 0;
+static int64_t simclock_virtual_limit = 0;
+
+static int64_t simclock_realNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * SIMCLOCK_NS_PER_SECOND + ts.tv_nsec;
+}
+
+__attribute__((constructor)) static void simclock_init() {
+    simclock_offset = -simclock_realNow();
+}
+
+int64_t simclock_now() {
+    pthread_mutex_lock(&simclock_lock);
+    int64_t t = simclock_virtual_now;
+    if (!simclock_virtual)
+        t = simclock_realNow() + simclock_offset;
+    pthread_mutex_unlock(&simclock_lock);
+    return t;
+}
+
+uint64_t simclock_ms() {
+    return (uint64_t)(simclock_now() / 1000000);
+}
+
+void simclock_setVirtual(int enabled) {
+    pthread_mutex_lock(&simclock_lock);
+    if (enabled && !simclock_virtual) {
+        // Freeze the time where it is until advanced:
+        simclock_virtual_now = simclock_realNow() + simclock_offset;
+        simclock_virtual_limit = simclock_virtual_now;
+    } else if (!enabled && simclock_virtual) {
+        // Continue in real time from where virtual time got to:
+        simclock_offset = simclock_virtual_now - simclock_realNow();
+    }
+    simclock_virtual = (enabled != 0);
+    pthread_cond_broadcast(&simclock_changed);
+    pthread_mutex_unlock(&simclock_lock);
+}
+
+int simclock_isVirtual() {
+    pthread_mutex_lock(&simclock_lock);
+    int result = simclock_virtual;
+    pthread_mutex_unlock(&simclock_lock);
+    return result;
+}
+
+void simclock_advance(int64_t ns) {
+    pthread_mutex_lock(&simclock_lock);
+    if (simclock_virtual && ns > 0) {
+        simclock_virtual_limit += ns;
+        pthread_cond_broadcast(&simclock_changed);
+    }
+    pthread_mutex_unlock(&simclock_lock);
+}
+
+void simclock_waitForVirtual() {
+    pthread_mutex_lock(&simclock_lock);
+    while (simclock_virtual &&
+            simclock_virtual_now < simclock_virtual_limit)
+        pthread_cond_wait(&simclock_changed, &simclock_lock);
+    pthread_mutex_unlock(&simclock_lock);
+}
+
+void simclock_sleepUntil(int64_t t) {
+    pthread_mutex_lock(&simclock_lock);
+    while (simclock_virtual) {
+        if (t <= simclock_virtual_limit) {
+            // Nothing to wait for, time simply jumps ahead:
+            if (t > simclock_virtual_now) {
+                simclock_virtual_now = t;
+                pthread_cond_broadcast(&simclock_changed);
+            }
+            pthread_mutex_unlock(&simclock_lock);
+            return;
+        }
+
+        // Go as far as allowed, then wait for more time:
+        if (simclock_virtual_now < simclock_virtual_limit) {
+            simclock_virtual_now = simclock_virtual_limit;
+            pthread_cond_broadcast(&simclock_changed);
+        }
+        pthread_cond_wait(&simclock_changed, &simclock_lock);
+    }
+    int64_t real_t = t - simclock_offset;
+    pthread_mutex_unlock(&simclock_lock);
+
+    struct timespec ts;
+    ts.tv_sec = real_t / SIMCLOCK_NS_PER_SECOND;
+    ts.tv_nsec = real_t % SIMCLOCK_NS_PER_SECOND;
+    if (real_t <= 0)
+        return;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+        &ts, NULL) == EINTR) { }
+}
+
+void simclock_initStepper(struct simclock_stepper *s,
+        double steps_per_second, int max_steps) {
+    s->interval = (int64_t)(SIMCLOCK_NS_PER_SECOND / steps_per_second);
+    if (s->interval < 1)
+        s->interval = 1;
+    s->next = -1;
+    s->max_steps = max_steps;
+}
+
+int simclock_dueSteps(struct simclock_stepper *s) {
+    int64_t now = simclock_now();
+    if (s->next < 0) {
+        s->next = now + s->interval;
+        return 0;
+    }
+    if (now < s->next)
+        return 0;
+    int64_t count = (now - s->next) / s->interval + 1;
+    if (count > s->max_steps) {
+        if (!simclock_isVirtual()) {
+            // Too far behind, drop the backlog:
+            s->next += count * s->interval;
+        } else {
+            s->next += s->max_steps * s->interval;
+        }
+        return s->max_steps;
+    }
+    s->next += count * s->interval;
+    return (int)count;
+}
+
+void simclock_sleepUntilDue(struct simclock_stepper *s) {
+    if (s->next < 0)
+        simclock_dueSteps(s);
+    simclock_sleepUntil(s->next);
+}
@@ -0,0 +1,42 @@
+
+#ifndef _SANDBOX_SIMCLOCK_H_
+#define _SANDBOX_SIMCLOCK_H_
+
+#include <stdint.h>
+
+// Simulation clock in nanoseconds since startup. Normally it follows
+// CLOCK_MONOTONIC. In virtual mode it only moves forward when a thread
+// sleeps until a later time, and never beyond a limit that is raised with
+// simclock_advance(). That way the simulation runs as fast as it can
+// compute, e.g. to fast-forward hours of sandbox time in a headless run.
+int64_t simclock_now();
+uint64_t simclock_ms();
+
+void simclock_setVirtual(int enabled);
+int simclock_isVirtual();
+
+// Allow virtual time to run ahead by the given amount. Does nothing in
+// real-time mode:
+void simclock_advance(int64_t ns);
+
+// Wait until virtual time has caught up with the limit, i.e. the
+// simulation has been computed up to there:
+void simclock_waitForVirtual();
+
+void simclock_sleepUntil(int64_t t);
+
+// Fixed-step scheduling: tells how many steps of the given rate are due.
+// In real-time mode, a backlog of more than max_steps is dropped so a
+// stalled simulation doesn't try to catch up forever. In virtual mode
+// nothing is dropped, but at most max_steps are handed out per call:
+struct simclock_stepper {
+    int64_t interval;
+    int64_t next;
+    int max_steps;
+};
+void simclock_initStepper(struct simclock_stepper *s,
+    double steps_per_second, int max_steps);
+int simclock_dueSteps(struct simclock_stepper *s);
+void simclock_sleepUntilDue(struct simclock_stepper *s);
+
+#endif  // _SANDBOX_SIMCLOCK_H_
@@ -11,6 +11,7 @@
 #include "fluid.h"
 #include "images.h"
 #include "particle.h"
+#include "simclock.h"
 #include "simulation.h"
 #include "topology.h"
 #include "transform.h"
@@ -122,31 +123,30 @@ int simulation_isSurfaceLocked() {
     return simulation_surface_locked;
 }
 
-static int64_t lastMovingObjectsUpdate = -1;
+// Moving objects update at 10 steps per second, fluids at 15. If the
+// simulation stalls, at most a second of moving object updates and a
+// few fluid updates are caught up on:
+static struct simclock_stepper movingObjectsStepper = { 0, 0, 0 };
+static struct simclock_stepper fluidStepper = { 0, 0, 0 };
+
 void simulation_updateMovingObjects() {
-    if (lastMovingObjectsUpdate < 0) {
-        lastMovingObjectsUpdate = SDL_GetTicks();
-    }
-    int timestep = (1000.0 / 10.0);
-    while (lastMovingObjectsUpdate + timestep < SDL_GetTicks()) {
+    if (movingObjectsStepper.interval == 0)
+        simclock_initStepper(&movingObjectsStepper, 10.0, 10);
+    int count = simclock_dueSteps(&movingObjectsStepper);
+    for (int i = 0; i < count; i++) {
         particle_updateAll();
-        lastMovingObjectsUpdate += timestep;
     }
 }
 
-static int64_t lastFluidUpdate = -1;
 int simulation_getFluidUpdateCount() {
-    if (lastFluidUpdate < 0) {
-        lastFluidUpdate = SDL_GetTicks();
-    }
-    int timestep = (1000.0 / 15.0);
-    int count = 0;
-    while (lastFluidUpdate + timestep < SDL_GetTicks()) {
-        count += 1;
-        lastFluidUpdate += timestep;
-    }
+    if (fluidStepper.interval == 0)
+        simclock_initStepper(&fluidStepper,
+            SIMULATION_FLUID_STEPS_PER_SECOND, 4);
+    int count = simclock_dueSteps(&fluidStepper);
     if (count == 0) {
-        SDL_Delay(timestep);
+        // Wait for the next step, since the caller runs in a loop:
+        simclock_sleepUntilDue(&fluidStepper);
+        count = simclock_dueSteps(&fluidStepper);
     }
     return count;
 }
@@ -253,6 +253,36 @@ void simulation_setMapZoom(double zoom) {
     transform_setRenderScale(renderTransformGrid, zoom);
 }
 
+void simulation_getMapTransform(double *x, double *y, double *zoom) {
+    if (!renderTransformGrid)
+        renderTransformGrid = transform_createNewGrid(
+            renderTransformGridX, renderTransformGridY);
+    transform_getRenderTransform(renderTransformGrid, x, y, zoom);
+}
+
+void simulation_setMapTransform(double x, double y, double zoom) {
+    if (!renderTransformGrid)
+        renderTransformGrid = transform_createNewGrid(
+            renderTransformGridX, renderTransformGridY);
+    transform_setRenderOffset(renderTransformGrid, x, y);
+    transform_setRenderScale(renderTransformGrid, zoom);
+}
+
+// Top left corner of the screen in the simulated world, in pixels. Set
+// from any thread, read while drawing:
+static int simulation_viewport_x = 0;
+static int simulation_viewport_y = 0;
+
+void simulation_setViewport(int x, int y) {
+    __atomic_store_n(&simulation_viewport_x, x, __ATOMIC_RELAXED);
+    __atomic_store_n(&simulation_viewport_y, y, __ATOMIC_RELAXED);
+}
+
+void simulation_getViewport(int *x, int *y) {
+    *x = __atomic_load_n(&simulation_viewport_x, __ATOMIC_RELAXED);
+    *y = __atomic_load_n(&simulation_viewport_y, __ATOMIC_RELAXED);
+}
+
 void simulation_unlockSurface() {
     assert(simulation_surface_locked == 1);
     SDL_UnlockSurface(images_simulation_image);
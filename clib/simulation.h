@@ -23,10 +23,18 @@ void simulation_lockSurface();
 void simulation_unlockSurface();
 int simulation_isSurfaceLocked();
 void simulation_updateMovingObjects();
+#define SIMULATION_FLUID_STEPS_PER_SECOND 15.0
 int simulation_getFluidUpdateCount();
 void simulation_addMapOffset();
 void simulation_resetMapOffset();
 void simulation_setMapZoom(double z);
+// Map offset and zoom all at once, e.g. for saving and restoring:
+void simulation_getMapTransform(double *x, double *y, double *zoom);
+void simulation_setMapTransform(double x, double y, double zoom);
+// The simulated world may be larger than the screen, which then shows
+// the part of it starting at the viewport (in world pixels):
+void simulation_setViewport(int x, int y);
+void simulation_getViewport(int *x, int *y);
 
 #endif  // _SANDBOX_SIMULATION_H_
 
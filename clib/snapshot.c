@@ -0,0 +1,409 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fluid.h"
+#include "particle.h"
+#include "simulation.h"
+#include "snapshot.h"
+#include "topology.h"
+
+// File layout: the header, a table of sections, then the contents of the
+// sections, each starting at a multiple of 8 bytes. Everything is stored
+// in the byte order of the machine, which is checked when restoring.
+// Sections with an unknown id are skipped, so new ones can be added
+// without a new version.
+#define SNAPSHOT_MAGIC "SBOXSNAP"
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_MAX_SECTIONS 16
+
+#define SNAPSHOT_FLUID 1
+#define SNAPSHOT_HEIGHTS 2
+#define SNAPSHOT_PARTICLES 3
+#define SNAPSHOT_TRANSFORM 4
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t section_count;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t checksum;  // of everything after the header
+};
+
+struct snapshot_section {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t offset;  // from the start of the file
+    uint64_t size;
+};
+
+// Followed by map_x * map_y * types amounts of amount_size bytes:
+struct snapshot_fluid {
+    int32_t map_x, map_y;
+    int32_t types;
+    int32_t amount_size;
+    double reduce_factor;
+};
+
+// Followed by w * h doubles:
+struct snapshot_heights {
+    int32_t w, h;
+};
+
+// Followed by count struct particle_state:
+struct snapshot_particles {
+    int32_t count;
+    int32_t reserved;
+};
+
+struct snapshot_transform {
+    double x, y, zoom;
+};
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static int snapshot_saving = 0;
+
+struct snapshot_job {
+    char *path;
+    uint8_t *data;
+    size_t size;
+};
+
+static uint64_t snapshot_checksum(const uint8_t *data, size_t size) {
+    // FNV-1a over 64 bit words, all sections are padded to a multiple of
+    // 8 bytes:
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t snapshot_align(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+static int snapshot_writeFile(const char *path, const uint8_t *data,
+        size_t size) {
+    size_t tmp_len = strlen(path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    if (!tmp_path)
+        return 0;
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "clib/snapshot.c: error: "
+            "can't create %s\n", tmp_path);
+        free(tmp_path);
+        return 0;
+    }
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = write(fd, data + written, size - written);
+        if (result <= 0)
+            break;
+        written += result;
+    }
+
+    // Only replace the old snapshot once the new one is on the disk:
+    int ok = (written == size && fsync(fd) == 0);
+    if (close(fd) != 0)
+        ok = 0;
+    if (ok && rename(tmp_path, path) != 0)
+        ok = 0;
+    if (!ok) {
+        fprintf(stderr, "clib/snapshot.c: error: "
+            "writing %s failed\n", path);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return ok;
+}
+
+static void *snapshot_writerThread(void *userdata) {
+    struct snapshot_job *job = userdata;
+    snapshot_writeFile(job->path, job->data, job->size);
+    free(job->path);
+    free(job->data);
+    free(job);
+    pthread_mutex_lock(&snapshot_lock);
+    snapshot_saving = 0;
+    pthread_mutex_unlock(&snapshot_lock);
+    return NULL;
+}
+
+static uint8_t *snapshot_addSection(uint8_t *data, int *count,
+        size_t *offset, uint32_t id, size_t size) {
+    // Reserve the next section, returns where its contents go:
+    struct snapshot_section *table = (struct snapshot_section *)(
+        data + sizeof(struct snapshot_header));
+    table[*count].id = id;
+    table[*count].reserved = 0;
+    table[*count].offset = *offset;
+    table[*count].size = size;
+    uint8_t *start = data + *offset;
+    *offset += snapshot_align(size);
+    (*count)++;
+    return start;
+}
+
+int snapshot_save(const char *path) {
+    pthread_mutex_lock(&snapshot_lock);
+    if (snapshot_saving) {
+        pthread_mutex_unlock(&snapshot_lock);
+        return 0;
+    }
+    snapshot_saving = 1;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    // Take copies of everything first, so the file can be put together
+    // without holding any of the locks:
+    int fluid_x = 0, fluid_y = 0;
+    double reduce_factor = 0;
+    fluid_amount *fluid = fluid_copyState(&fluid_x, &fluid_y,
+        &reduce_factor);
+    int heights_w = 0, heights_h = 0;
+    double *heights = topology_copyHeights(&heights_w, &heights_h);
+    int particle_count = particle_countAll();
+    struct snapshot_transform transform;
+    simulation_getMapTransform(&transform.x, &transform.y, &transform.zoom);
+
+    size_t fluid_size = sizeof(struct snapshot_fluid) +
+        sizeof(fluid_amount) * FLUID_COUNT * fluid_x * fluid_y;
+    size_t heights_size = sizeof(struct snapshot_heights) +
+        sizeof(double) * heights_w * heights_h;
+    size_t particles_size = sizeof(struct snapshot_particles) +
+        sizeof(struct particle_state) * particle_count;
+    size_t size = sizeof(struct snapshot_header) +
+        sizeof(struct snapshot_section) * SNAPSHOT_MAX_SECTIONS +
+        snapshot_align(fluid_size) + snapshot_align(heights_size) +
+        snapshot_align(particles_size) +
+        snapshot_align(sizeof(transform));
+    uint8_t *data = calloc(1, size);
+    struct snapshot_job *job = malloc(sizeof(*job));
+    char *job_path = strdup(path);
+    if (!data || !job || !job_path) {
+        fprintf(stderr, "clib/snapshot.c: error: "
+            "out of memory, can't save %s\n", path);
+        free(fluid);
+        free(heights);
+        free(data);
+        free(job);
+        free(job_path);
+        pthread_mutex_lock(&snapshot_lock);
+        snapshot_saving = 0;
+        pthread_mutex_unlock(&snapshot_lock);
+        return 0;
+    }
+
+    int count = 0;
+    size_t offset = sizeof(struct snapshot_header) +
+        sizeof(struct snapshot_section) * SNAPSHOT_MAX_SECTIONS;
+    if (fluid) {
+        struct snapshot_fluid *s = (struct snapshot_fluid *)
+            snapshot_addSection(data, &count, &offset, SNAPSHOT_FLUID,
+            fluid_size);
+        s->map_x = fluid_x;
+        s->map_y = fluid_y;
+        s->types = FLUID_COUNT;
+        s->amount_size = sizeof(fluid_amount);
+        s->reduce_factor = reduce_factor;
+        memcpy(s + 1, fluid, fluid_size - sizeof(*s));
+    }
+    if (heights) {
+        struct snapshot_heights *s = (struct snapshot_heights *)
+            snapshot_addSection(data, &count, &offset, SNAPSHOT_HEIGHTS,
+            heights_size);
+        s->w = heights_w;
+        s->h = heights_h;
+        memcpy(s + 1, heights, heights_size - sizeof(*s));
+    }
+    struct snapshot_particles *p = (struct snapshot_particles *)
+        snapshot_addSection(data, &count, &offset, SNAPSHOT_PARTICLES,
+        particles_size);
+    p->count = particle_exportAll((struct particle_state *)(p + 1),
+        particle_count);
+    memcpy(snapshot_addSection(data, &count, &offset, SNAPSHOT_TRANSFORM,
+        sizeof(transform)), &transform, sizeof(transform));
+    free(fluid);
+    free(heights);
+
+    struct snapshot_header *header = (struct snapshot_header *)data;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->byte_order = SNAPSHOT_BYTE_ORDER;
+    header->section_count = count;
+    header->file_size = offset;
+    header->checksum = snapshot_checksum(data + sizeof(*header),
+        offset - sizeof(*header));
+
+    // Writing can take a while on slow SD cards, don't hold up the frame:
+    job->path = job_path;
+    job->data = data;
+    job->size = offset;
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, snapshot_writerThread, job) != 0) {
+        snapshot_writerThread(job);
+    }
+    pthread_attr_destroy(&attr);
+    return 1;
+}
+
+int snapshot_isSaving() {
+    pthread_mutex_lock(&snapshot_lock);
+    int saving = snapshot_saving;
+    pthread_mutex_unlock(&snapshot_lock);
+    return saving;
+}
+
+static void snapshot_restoreFluid(const uint8_t *data, size_t size) {
+    const struct snapshot_fluid *s = (const struct snapshot_fluid *)data;
+    if (size < sizeof(*s) || s->types != FLUID_COUNT || s->map_x <= 0 ||
+            s->map_y <= 0 || (s->amount_size != sizeof(float) &&
+            s->amount_size != sizeof(double)) ||
+            size < sizeof(*s) + (size_t)s->amount_size * FLUID_COUNT *
+            s->map_x * s->map_y) {
+        fprintf(stderr, "clib/snapshot.c: warning: "
+            "skipping fluid section that doesn't fit\n");
+        return;
+    }
+    if (s->amount_size == sizeof(fluid_amount)) {
+        fluid_restoreState((const fluid_amount *)(s + 1), s->map_x,
+            s->map_y, s->reduce_factor);
+        return;
+    }
+
+    // Saved by a build with the other precision:
+    size_t count = (size_t)FLUID_COUNT * s->map_x * s->map_y;
+    fluid_amount *map = malloc(sizeof(fluid_amount) * count);
+    if (!map)
+        return;
+    for (size_t i = 0; i < count; i++) {
+        if (s->amount_size == sizeof(float)) {
+            map[i] = ((const float *)(s + 1))[i];
+        } else {
+            map[i] = ((const double *)(s + 1))[i];
+        }
+    }
+    fluid_restoreState(map, s->map_x, s->map_y, s->reduce_factor);
+    free(map);
+}
+
+static void snapshot_restoreHeights(const uint8_t *data, size_t size) {
+    const struct snapshot_heights *s = (const struct snapshot_heights *)data;
+    if (size < sizeof(*s) || s->w <= 0 || s->h <= 0 ||
+            size < sizeof(*s) + sizeof(double) * s->w * s->h ||
+            !topology_restoreHeights((const double *)(s + 1), s->w, s->h)) {
+        fprintf(stderr, "clib/snapshot.c: warning: "
+            "skipping height map that doesn't fit\n");
+    }
+}
+
+static void snapshot_restoreParticles(const uint8_t *data, size_t size) {
+    const struct snapshot_particles *s =
+        (const struct snapshot_particles *)data;
+    if (size < sizeof(*s) || s->count < 0 || size < sizeof(*s) +
+            sizeof(struct particle_state) * s->count) {
+        fprintf(stderr, "clib/snapshot.c: warning: "
+            "skipping damaged particle section\n");
+        return;
+    }
+    particle_importAll((const struct particle_state *)(s + 1), s->count);
+}
+
+static void snapshot_restoreTransform(const uint8_t *data, size_t size) {
+    const struct snapshot_transform *s =
+        (const struct snapshot_transform *)data;
+    if (size < sizeof(*s))
+        return;
+    simulation_setMapTransform(s->x, s->y, s->zoom);
+}
+
+int snapshot_restore(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat info;
+    if (fstat(fd, &info) != 0 ||
+            (size_t)info.st_size < sizeof(struct snapshot_header)) {
+        close(fd);
+        return 0;
+    }
+    size_t size = info.st_size;
+    const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "clib/snapshot.c: error: "
+            "can't map %s\n", path);
+        return 0;
+    }
+
+    const struct snapshot_header *header =
+        (const struct snapshot_header *)data;
+    const struct snapshot_section *table =
+        (const struct snapshot_section *)(data + sizeof(*header));
+    const char *problem = NULL;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+            header->byte_order != SNAPSHOT_BYTE_ORDER) {
+        problem = "not a snapshot of this machine";
+    } else if (header->version != SNAPSHOT_VERSION) {
+        problem = "unsupported version";
+    } else if (header->file_size != size ||
+            header->section_count > SNAPSHOT_MAX_SECTIONS ||
+            size < sizeof(*header) + sizeof(struct snapshot_section) *
+            SNAPSHOT_MAX_SECTIONS) {
+        problem = "truncated";
+    } else if (snapshot_checksum(data + sizeof(*header),
+            size - sizeof(*header)) != header->checksum) {
+        problem = "checksum mismatch";
+    }
+    for (uint32_t i = 0; !problem && i < header->section_count; i++) {
+        if (table[i].offset % 8 != 0 || table[i].offset > size ||
+                table[i].size > size - table[i].offset)
+            problem = "section out of bounds";
+    }
+    if (problem) {
+        fprintf(stderr, "clib/snapshot.c: error: "
+            "can't restore %s: %s\n", path, problem);
+        munmap((void *)data, size);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < header->section_count; i++) {
+        const uint8_t *section = data + table[i].offset;
+        switch (table[i].id) {
+        case SNAPSHOT_FLUID:
+            snapshot_restoreFluid(section, table[i].size);
+            break;
+        case SNAPSHOT_HEIGHTS:
+            snapshot_restoreHeights(section, table[i].size);
+            break;
+        case SNAPSHOT_PARTICLES:
+            snapshot_restoreParticles(section, table[i].size);
+            break;
+        case SNAPSHOT_TRANSFORM:
+            snapshot_restoreTransform(section, table[i].size);
+            break;
+        default:
+            break;
+        }
+    }
+    munmap((void *)data, size);
+    return 1;
+}
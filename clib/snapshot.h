@@ -0,0 +1,29 @@
+
+#ifndef _SANDBOX_SNAPSHOT_H_
+#define _SANDBOX_SNAPSHOT_H_
+
+// Binary snapshot of the simulation state: fluid amounts, height map,
+// particles and the map offset and zoom, so a restarted sandbox picks up
+// where the last one stopped.
+//
+// Saving copies the state right away and writes it in the background to
+// path plus ".tmp", which is then renamed over path. A crash while saving
+// therefore leaves the previous snapshot intact. Restoring maps the file
+// into memory and copies the state straight out of it.
+//
+// Both have to be called from the thread updating the particles.
+
+// Current version of the file format. Files of other versions are
+// rejected when restoring:
+#define SNAPSHOT_VERSION 1
+
+// Returns 1 if the snapshot is being written, 0 if another save is still
+// in progress or the state couldn't be copied:
+int snapshot_save(const char *path);
+// Returns 1 if the state was restored, 0 if the file is missing, of
+// another version or damaged. Sections that don't fit the current state
+// (e.g. a height map of another size) are skipped:
+int snapshot_restore(const char *path);
+int snapshot_isSaving();
+
+#endif  // _SANDBOX_SNAPSHOT_H_
@@ -0,0 +1,81 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "sparsegrid.h"
+
+static size_t sparsegrid_pageSize() {
+    static size_t page_size = 0;
+    if (page_size == 0) {
+        long size = sysconf(_SC_PAGESIZE);
+        page_size = (size > 0 ? (size_t)size : 4096);
+    }
+    return page_size;
+}
+
+void *sparsegrid_alloc(size_t size) {
+    if (size == 0)
+        size = 1;
+    // Anonymous memory reads as zeros until written. Nothing is reserved
+    // up front, so the grid may be larger than the available memory as
+    // long as most of it stays untouched:
+    void *grid = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (grid == MAP_FAILED) {
+        fprintf(stderr, "clib/sparsegrid.c: error: "
+            "failed to reserve %zu bytes\n", size);
+        return NULL;
+    }
+    return grid;
+}
+
+void sparsegrid_free(void *grid, size_t size) {
+    if (!grid)
+        return;
+    munmap(grid, (size > 0 ? size : 1));
+}
+
+void sparsegrid_clear(void *grid, size_t offset, size_t size) {
+    if (!grid || size == 0)
+        return;
+    size_t page_size = sparsegrid_pageSize();
+    uintptr_t start = (uintptr_t)grid + offset;
+    uintptr_t end = start + size;
+    uintptr_t first_page = (start + page_size - 1) & ~(page_size - 1);
+    uintptr_t last_page = end & ~(page_size - 1);
+    if (first_page >= last_page) {
+        memset((void *)start, 0, size);
+        return;
+    }
+
+    // Partial pages at both ends are zeroed by hand, whole ones dropped.
+    // They come back as zeros the next time they are touched:
+    memset((void *)start, 0, first_page - start);
+    memset((void *)last_page, 0, end - last_page);
+    if (madvise((void *)first_page, last_page - first_page,
+            MADV_DONTNEED) != 0)
+        memset((void *)first_page, 0, last_page - first_page);
+}
+
+size_t sparsegrid_residentSize(void *grid, size_t size) {
+    if (!grid || size == 0)
+        return 0;
+    size_t page_size = sparsegrid_pageSize();
+    size_t pages = (size + page_size - 1) / page_size;
+    unsigned char *resident = malloc(pages);
+    if (!resident || mincore(grid, size, resident) != 0) {
+        free(resident);
+        return size;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < pages; i++) {
+        count += (resident[i] & 1);
+    }
+    free(resident);
+    return count * page_size;
+}
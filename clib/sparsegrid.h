@@ -0,0 +1,24 @@
+
+#ifndef _SANDBOX_SPARSEGRID_H_
+#define _SANDBOX_SPARSEGRID_H_
+
+#include <stddef.h>
+
+// Large grids that only take up memory where they hold something, so the
+// simulated world can be much larger than the parts of it in use. A grid
+// is reserved as address space only. Its pages are backed by memory the
+// first time they are written to, and given back when cleared. Reading
+// parts that were never written costs nothing and yields zeros.
+
+// Returns a zero-filled grid of size bytes, or NULL on error:
+void *sparsegrid_alloc(size_t size);
+void sparsegrid_free(void *grid, size_t size);
+
+// Zero size bytes starting at offset, giving the whole pages among them
+// back to the system:
+void sparsegrid_clear(void *grid, size_t offset, size_t size);
+
+// Bytes of the grid that are currently backed by memory:
+size_t sparsegrid_residentSize(void *grid, size_t size);
+
+#endif  // _SANDBOX_SPARSEGRID_H_
@@ -1,27 +1,41 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "images.h"
 #include "particle.h"
 #include "simulation.h"
+#include "sparsegrid.h"
 #include "topology.h"
+#include "topologydrift.h"
+#include "workerpool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOPOLOGY_X86_SIMD
+#endif
 
 pthread_mutex_t *topology_lock = NULL;
 
 double config_heightShift = 0;
 double config_heightScale = 1.0;
+static void topology_markChanged(int x0, int y0, int x1, int y1);
+static void topology_publish(int x0, int y0, int x1, int y1);
 void topology_setHeightConfig(double heightShift, double heightScale) {
     pthread_mutex_lock(topology_lock);
     config_heightShift = heightShift;
     config_heightScale = heightScale;
+    // Every height is scaled differently now:
+    topology_markChanged(0, 0, topology_map_x, topology_map_y);
+    topology_publish(0, 0, 0, 0);
     pthread_mutex_unlock(topology_lock);
 }
 
-double *topology_drift_cache_height = NULL;
-double *topology_drift_cache_value_x = NULL;
-double *topology_drift_cache_value_y = NULL;
+// Drift field, updated along with the heights:
+static struct topologydrift *topology_drift = NULL;
 
 __attribute__((constructor)) static void topology_mutex_acquire() {
     topology_lock = malloc(sizeof(*topology_lock));
@@ -33,6 +47,268 @@ double *height_map = NULL;
 int topology_map_x = 0;
 int topology_map_y = 0;
 int require_topology_rebuild = 1;
+// Bumped whenever any height changes, so users can cache derived data.
+// The regions the last few generations changed (x1, y1 exclusive) are
+// kept, so users can catch up on only those:
+static unsigned int topology_generation = 0;
+#define TOPOLOGY_CHANGE_HISTORY 32
+static int topology_changes[TOPOLOGY_CHANGE_HISTORY][4];
+// Part of the world the sensors have seen so far (x1, y1 exclusive).
+// Outside of it the height map holds nothing but zeros:
+static int topology_seen_x0 = 0;
+static int topology_seen_y0 = 0;
+static int topology_seen_x1 = 0;
+static int topology_seen_y1 = 0;
+// Part of the world types were ever drawn to, and a counter bumped
+// whenever types within it change, so snapshots know when to rebuild
+// their summed-area tables:
+static int topology_typed_x0 = 0;
+static int topology_typed_y0 = 0;
+static int topology_typed_x1 = 0;
+static int topology_typed_y1 = 0;
+static unsigned int topology_types_generation = 1;
+// Set when the maps changed other than by drawing, so all of the screen
+// gets drawn again instead of only the tiles whose depth changed:
+static int topology_redraw = 1;
+// The last accepted depth frame (in the layout it comes in) and the
+// colours drawn from it. Each frame only tiles whose depth changed by
+// more than topology_change_threshold in sum are drawn again, the rest
+// of the screen is copied over from the colours:
+static uint8_t *topology_accepted_depth = NULL;
+static uint32_t *topology_colors = NULL;
+static uint8_t *topology_dirty_tiles = NULL;
+static int topology_screen_x = 0;
+static int topology_screen_y = 0;
+
+// Snapshots handed out to readers. The maps above are only used by the
+// writer, under topology_lock. Each frame it brings a snapshot nobody
+// holds up to date and makes it the current one. A snapshot can be
+// reused once no reader holds it and no reader is in the middle of
+// taking one, since that reader might still be about to take it:
+struct topology_snapshotcopy {
+    struct topology_snapshot s;  // first, readers only get to see this
+    int readers;
+    // Of a former map size, freed once unused:
+    int retired;
+    // Region that changed since the copy was brought up to date
+    // (x1, y1 exclusive):
+    int stale_x0, stale_y0, stale_x1, stale_y1;
+    double *heights;
+    char *types;
+    float *drift_x;
+    float *drift_y;
+    // Summed-area tables, with the number of counts allocated for each
+    // and the types generation they were built for:
+    uint32_t *type_sums[TOPOLOGY_TYPE_COUNT];
+    size_t type_sums_alloc;
+    unsigned int type_sums_generation;
+};
+static struct topology_snapshotcopy *topology_snapshots[
+    TOPOLOGY_SNAPSHOT_MAX] = { NULL };
+static struct topology_snapshotcopy *topology_current = NULL;
+static int topology_acquiring = 0;
+static const struct topology_snapshot topology_empty_snapshot = { 0 };
+
+static void topology_freeSnapshot(struct topology_snapshotcopy *c) {
+    size_t cells = (size_t)c->s.map_x * c->s.map_y;
+    sparsegrid_free(c->heights, cells * sizeof(double));
+    sparsegrid_free(c->types, cells);
+    sparsegrid_free(c->drift_x, cells * sizeof(float));
+    sparsegrid_free(c->drift_y, cells * sizeof(float));
+    for (int k = 0; k < TOPOLOGY_TYPE_COUNT; k++)
+        free(c->type_sums[k]);
+    free(c);
+}
+
+static struct topology_snapshotcopy *topology_newSnapshot() {
+    struct topology_snapshotcopy *c = malloc(sizeof(*c));
+    if (!c)
+        return NULL;
+    memset(c, 0, sizeof(*c));
+    size_t cells = (size_t)topology_map_x * topology_map_y;
+    c->s.map_x = topology_map_x;
+    c->s.map_y = topology_map_y;
+    c->heights = sparsegrid_alloc(cells * sizeof(double));
+    c->types = sparsegrid_alloc(cells);
+    c->drift_x = sparsegrid_alloc(cells * sizeof(float));
+    c->drift_y = sparsegrid_alloc(cells * sizeof(float));
+    if (!c->heights || !c->types || !c->drift_x || !c->drift_y) {
+        topology_freeSnapshot(c);
+        return NULL;
+    }
+    c->s.heights = c->heights;
+    c->s.types = c->types;
+    c->s.drift_x = c->drift_x;
+    c->s.drift_y = c->drift_y;
+
+    // Starts out all zero, so only what was seen (and drifts) is missing:
+    c->stale_x0 = topology_seen_x0 - TOPOLOGYDRIFT_REACH;
+    c->stale_y0 = topology_seen_y0 - TOPOLOGYDRIFT_REACH;
+    c->stale_x1 = topology_seen_x1 + TOPOLOGYDRIFT_REACH;
+    c->stale_y1 = topology_seen_y1 + TOPOLOGYDRIFT_REACH;
+    if (topology_seen_x0 >= topology_seen_x1)
+        c->stale_x0 = c->stale_x1 = 0;
+    return c;
+}
+
+static int topology_isUnused(const struct topology_snapshotcopy *c) {
+    return (c != __atomic_load_n(&topology_current, __ATOMIC_SEQ_CST) &&
+        __atomic_load_n(&c->readers, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&topology_acquiring, __ATOMIC_SEQ_CST) == 0);
+}
+
+static void topology_refreshSnapshot(struct topology_snapshotcopy *c) {
+    int x0 = (c->stale_x0 > 0 ? c->stale_x0 : 0);
+    int y0 = (c->stale_y0 > 0 ? c->stale_y0 : 0);
+    int x1 = (c->stale_x1 < topology_map_x ? c->stale_x1 : topology_map_x);
+    int y1 = (c->stale_y1 < topology_map_y ? c->stale_y1 : topology_map_y);
+    if (x0 < x1 && y0 < y1) {
+        for (int y = y0; y < y1; y++) {
+            size_t i = x0 + (size_t)y * topology_map_x;
+            memcpy(c->heights + i, height_map + i,
+                sizeof(double) * (x1 - x0));
+            memcpy(c->types + i, topology_map + i, x1 - x0);
+        }
+        if (topology_drift)
+            topologydrift_copyRegion(topology_drift, c->drift_x, c->drift_y,
+                x0, y0, x1, y1);
+    }
+    c->stale_x0 = c->stale_y0 = c->stale_x1 = c->stale_y1 = 0;
+}
+
+static void topology_buildTypeSums(struct topology_snapshotcopy *c) {
+    // Called after the types of the copy were brought up to date. The
+    // tables only cover what was drawn, since every count depends on all
+    // cells above and left of it and would take up memory everywhere:
+    if (c->type_sums_generation == topology_types_generation)
+        return;
+    int x0 = topology_typed_x0;
+    int y0 = topology_typed_y0;
+    int w = topology_typed_x1 - topology_typed_x0;
+    int h = topology_typed_y1 - topology_typed_y0;
+    if (w < 0 || h < 0)
+        w = h = 0;
+    size_t stride = (size_t)w + 1;
+    size_t needed = stride * (h + 1);
+    if (needed > c->type_sums_alloc) {
+        for (int k = 1; k < TOPOLOGY_TYPE_COUNT; k++) {
+            free(c->type_sums[k]);
+            c->type_sums[k] = malloc(sizeof(uint32_t) * needed);
+            if (!c->type_sums[k]) {
+                fprintf(stderr, "clib/topology.c: error: "
+                    "out of memory for the type tables\n");
+                // Without them, scans find TOPOLOGY_NONE everywhere:
+                for (k = 1; k < TOPOLOGY_TYPE_COUNT; k++) {
+                    free(c->type_sums[k]);
+                    c->type_sums[k] = NULL;
+                    c->s.type_sums[k] = NULL;
+                }
+                c->type_sums_alloc = 0;
+                c->s.typed_x0 = c->s.typed_y0 = 0;
+                c->s.typed_x1 = c->s.typed_y1 = 0;
+                return;
+            }
+        }
+        c->type_sums_alloc = needed;
+    }
+    for (int k = 1; k < TOPOLOGY_TYPE_COUNT; k++) {
+        uint32_t *sums = c->type_sums[k];
+        memset(sums, 0, sizeof(uint32_t) * stride);
+        for (int y = 0; y < h; y++) {
+            const char *types = c->types + x0 +
+                (size_t)(y0 + y) * topology_map_x;
+            const uint32_t *above = sums + (size_t)y * stride;
+            uint32_t *row = sums + (size_t)(y + 1) * stride;
+            uint32_t row_sum = 0;
+            row[0] = 0;
+            for (int x = 0; x < w; x++) {
+                row_sum += (types[x] == k);
+                row[x + 1] = above[x + 1] + row_sum;
+            }
+        }
+        c->s.type_sums[k] = sums;
+    }
+    c->s.typed_x0 = x0;
+    c->s.typed_y0 = y0;
+    c->s.typed_x1 = x0 + w;
+    c->s.typed_y1 = y0 + h;
+    c->type_sums_generation = topology_types_generation;
+}
+
+static void topology_publish(int x0, int y0, int x1, int y1) {
+    // Called with topology_lock held after the region x0..x1-1, y0..y1-1
+    // of the maps changed. All copies but the current one catch up on it
+    // once they are reused:
+    struct topology_snapshotcopy *fresh = NULL;
+    for (int i = 0; i < TOPOLOGY_SNAPSHOT_MAX; i++) {
+        struct topology_snapshotcopy *c = topology_snapshots[i];
+        if (!c)
+            continue;
+        if (c->s.map_x != topology_map_x || c->s.map_y != topology_map_y)
+            c->retired = 1;
+        if (c->retired) {
+            if (topology_isUnused(c)) {
+                topology_freeSnapshot(c);
+                topology_snapshots[i] = NULL;
+            }
+            continue;
+        }
+        if (x0 < x1 && y0 < y1) {
+            if (c->stale_x0 >= c->stale_x1) {
+                c->stale_x0 = x0; c->stale_y0 = y0;
+                c->stale_x1 = x1; c->stale_y1 = y1;
+            } else {
+                if (x0 < c->stale_x0) c->stale_x0 = x0;
+                if (y0 < c->stale_y0) c->stale_y0 = y0;
+                if (x1 > c->stale_x1) c->stale_x1 = x1;
+                if (y1 > c->stale_y1) c->stale_y1 = y1;
+            }
+        }
+        if (!fresh && topology_isUnused(c))
+            fresh = c;
+    }
+    if (!fresh) {
+        // Readers hold all copies, so make another:
+        for (int i = 0; i < TOPOLOGY_SNAPSHOT_MAX; i++) {
+            if (!topology_snapshots[i]) {
+                fresh = topology_snapshots[i] = topology_newSnapshot();
+                break;
+            }
+        }
+        if (!fresh)
+            return;  // tried again next frame
+    }
+    topology_refreshSnapshot(fresh);
+    topology_buildTypeSums(fresh);
+    fresh->s.generation = topology_generation;
+    fresh->s.height_shift = config_heightShift;
+    fresh->s.height_scale = config_heightScale;
+    fresh->s.seen_x0 = topology_seen_x0;
+    fresh->s.seen_y0 = topology_seen_y0;
+    fresh->s.seen_x1 = topology_seen_x1;
+    fresh->s.seen_y1 = topology_seen_y1;
+    __atomic_store_n(&topology_current, fresh, __ATOMIC_SEQ_CST);
+}
+
+const struct topology_snapshot *topology_acquireSnapshot() {
+    // Announce taking one first, so the writer won't reuse the current
+    // copy between loading and holding it:
+    __atomic_add_fetch(&topology_acquiring, 1, __ATOMIC_SEQ_CST);
+    struct topology_snapshotcopy *c = __atomic_load_n(&topology_current,
+        __ATOMIC_SEQ_CST);
+    if (c)
+        __atomic_add_fetch(&c->readers, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&topology_acquiring, 1, __ATOMIC_SEQ_CST);
+    return (c ? &c->s : &topology_empty_snapshot);
+}
+
+void topology_releaseSnapshot(const struct topology_snapshot *s) {
+    if (s == &topology_empty_snapshot)
+        return;
+    struct topology_snapshotcopy *c = (struct topology_snapshotcopy *)s;
+    __atomic_sub_fetch(&c->readers, 1, __ATOMIC_SEQ_CST);
+}
+
 void topology_init(int size_x, int size_y) {
     pthread_mutex_lock(topology_lock);
     if (topology_map) {
@@ -41,153 +317,260 @@ void topology_init(int size_x, int size_y) {
             pthread_mutex_unlock(topology_lock);
             return;
         }
-        free(topology_map);
-        free(height_map);
+        size_t cells = (size_t)topology_map_x * topology_map_y;
+        sparsegrid_free(topology_map, cells);
+        sparsegrid_free(height_map, cells * sizeof(double));
+        topologydrift_destroy(topology_drift);
         particle_wipeAll(PARTICLE_GRASS);
     }
     require_topology_rebuild = 1;
     topology_map_x = size_x;
     topology_map_y = size_y;
-    topology_map = malloc(size_x * size_y);
-    height_map = (double*)malloc(size_x * size_y * sizeof(double));
-    free(topology_drift_cache_height);
-    topology_drift_cache_height = NULL;
-    free(topology_drift_cache_value_x);
-    topology_drift_cache_value_x = NULL;
-    free(topology_drift_cache_value_y);
-    topology_drift_cache_value_y = NULL;
+    topology_markChanged(0, 0, size_x, size_y);
+    topology_seen_x0 = topology_seen_y0 = 0;
+    topology_seen_x1 = topology_seen_y1 = 0;
+    topology_typed_x0 = topology_typed_y0 = 0;
+    topology_typed_x1 = topology_typed_y1 = 0;
+    topology_types_generation++;
+    topology_redraw = 1;
+    // The world may be much larger than what the sensors cover, so the
+    // maps only take up memory where they were written:
+    size_t cells = (size_t)size_x * size_y;
+    topology_map = sparsegrid_alloc(cells);
+    height_map = (double*)sparsegrid_alloc(cells * sizeof(double));
+    topology_drift = topologydrift_create(size_x, size_y,
+        workerpool_shared());
+    if (!topology_drift) {
+        fprintf(stderr, "clib/topology.c: error: "
+            "out of memory for the drift field\n");
+    }
+    topology_publish(0, 0, 0, 0);
     pthread_mutex_unlock(topology_lock);
 }
 
-static double _heightAt(int x, int y) {
-    if (x < 0 || x >= topology_map_x || y < 0 || y >= topology_map_y) {
-        pthread_mutex_unlock(topology_lock);
-        return 0;
-    }
-    double result = height_map[x + y * topology_map_x];
-    return result;
+static double _transformHeight(double value) {
+    double height = ((double)(255 - value) * config_heightScale + config_heightShift);
+    if (height < 0.0) height = 0.0;
+    if (height > 255.0) height = 255.0;
+    return height;
+}
+
+static int _isSeen(int x, int y) {
+    return (x >= topology_seen_x0 && x < topology_seen_x1 &&
+        y >= topology_seen_y0 && y < topology_seen_y1);
 }
 
 double topology_heightAt(int x, int y) {
-    pthread_mutex_lock(topology_lock);
-    double height = ((double)(255 - _heightAt(x, y)) * config_heightScale + config_heightShift);
-    pthread_mutex_unlock(topology_lock);
-    if (height < 0.0) height = 0.0;
-    if (height > 255.0) height = 255.0;
+    const struct topology_snapshot *s = topology_acquireSnapshot();
+    double height = topology_snapshotHeightAt(s, x, y);
+    topology_releaseSnapshot(s);
     return height;
 }
 
-void topology_calculate_drift(int x, int y, double *vx, double *vy) {
+void topology_sampleHeights(double *out, int w, int h, double step,
+        int x0, int y0, int x1, int y1) {
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > w) x1 = w;
+    if (y1 > h) y1 = h;
     pthread_mutex_lock(topology_lock);
-
-    // Don't allow invalid values:
-    if (x < 0 || x >= topology_map_x || y < 0 || y >= topology_map_y) {
-        *vx = 0; *vy = 0;
-        pthread_mutex_unlock(topology_lock);
-        return;
+    for (int y = y0; y < y1; y++) {
+        int sy = (int)((y + 0.5) * step);
+        if (sy >= topology_map_y) sy = topology_map_y - 1;
+        for (int x = x0; x < x1; x++) {
+            int sx = (int)((x + 0.5) * step);
+            if (sx >= topology_map_x) sx = topology_map_x - 1;
+            // Ground that was never seen counts as the lowest possible:
+            if (!_isSeen(sx, sy)) {
+                out[x + y * w] = _transformHeight(255);
+                continue;
+            }
+            out[x + y * w] = _transformHeight(
+                height_map[sx + sy * topology_map_x]);
+        }
     }
+    pthread_mutex_unlock(topology_lock);
+}
 
-    // Ensure cache:
-    if (topology_drift_cache_height == NULL) {
-        topology_drift_cache_height = (double*)malloc(topology_map_x *
-            topology_map_y * sizeof(double));
-        memset(topology_drift_cache_height, 0,
-            topology_map_x *
-            topology_map_y * sizeof(double));
-        topology_drift_cache_value_x = (double*)malloc(topology_map_x *
-            topology_map_y * sizeof(double));
-        topology_drift_cache_value_y = (double*)malloc(topology_map_x *
-            topology_map_y * sizeof(double));   
-    }
+unsigned int topology_getGeneration() {
+    pthread_mutex_lock(topology_lock);
+    unsigned int generation = topology_generation;
+    pthread_mutex_unlock(topology_lock);
+    return generation;
+}
 
-    // Prepare stuff for cache access:
-    int currentindex = x + y * topology_map_x;
-    double cache_match_height = 1000.0f + _heightAt(x, y);
+static void topology_markChanged(int x0, int y0, int x1, int y1) {
+    // Called with topology_lock held:
+    topology_generation++;
+    int *change = topology_changes[
+        topology_generation % TOPOLOGY_CHANGE_HISTORY];
+    change[0] = x0;
+    change[1] = y0;
+    change[2] = x1;
+    change[3] = y1;
+}
 
-    // See if we have a cached value:
-    if (fabs(topology_drift_cache_height[currentindex] - cache_match_height) <
-            3.0f) {
-        // We do!
-        *vx = topology_drift_cache_value_x[currentindex];
-        *vy = topology_drift_cache_value_y[currentindex];
-        pthread_mutex_unlock(topology_lock);
-        return;
-    }
-    topology_drift_cache_height[currentindex] = cache_match_height;
-
-    // No cached value if we arrive here. Calculate one:
-    int radius = 30;
-    int scan_start_x = x + 0.5 - (radius / 2.0);
-    int scan_start_y = y + 0.5 - (radius / 2.0);
-    const int scan_step = 2;
-    double vec_x = 0;
-    double vec_y = 0;
-    double center_height = _heightAt(x, y);
-    for (int px = scan_start_x; px < scan_start_x + radius; px += scan_step) {
-        if (px < 0 || px >= topology_map_x) continue;
-        for (int py = scan_start_y; py < scan_start_y + radius; py += scan_step) {
-            if (py < 0 || py >= topology_map_y) continue;
-            double height_diff = center_height -
-                _heightAt(px, py);
-            double height_diff_fac = height_diff / 20.0;
-            if (height_diff_fac > 1.0) {
-                height_diff_fac = 1.0;
-            }
-            if (height_diff_fac < -1.0) {
-                height_diff_fac = -1.0;
-            }
-            if (height_diff_fac > 0) {
-                height_diff_fac *= height_diff_fac;
-            } else {
-                height_diff_fac *= height_diff_fac;
-                height_diff_fac = -height_diff_fac;
-            }
-            vec_x += (px - x) * height_diff_fac * 10;
-            vec_y += (py - y) * height_diff_fac * 10;
+int topology_getChangedRegion(unsigned int since, unsigned int *generation,
+        int *x0, int *y0, int *x1, int *y1) {
+    pthread_mutex_lock(topology_lock);
+    *generation = topology_generation;
+    unsigned int behind = topology_generation - since;
+    *x0 = topology_map_x;
+    *y0 = topology_map_y;
+    *x1 = 0;
+    *y1 = 0;
+    if (behind >= TOPOLOGY_CHANGE_HISTORY) {
+        // Too far behind to tell, so all of it:
+        *x0 = 0;
+        *y0 = 0;
+        *x1 = topology_map_x;
+        *y1 = topology_map_y;
+    } else {
+        for (unsigned int i = 1; i <= behind; i++) {
+            const int *change = topology_changes[
+                (since + i) % TOPOLOGY_CHANGE_HISTORY];
+            if (change[0] < *x0) *x0 = change[0];
+            if (change[1] < *y0) *y0 = change[1];
+            if (change[2] > *x1) *x1 = change[2];
+            if (change[3] > *y1) *y1 = change[3];
         }
     }
-    double max = 25.0f;
-    if (vec_x > max) {
-        vec_x = max;
+    pthread_mutex_unlock(topology_lock);
+    return (behind > 0);
+}
+
+double *topology_copyHeights(int *w, int *h) {
+    pthread_mutex_lock(topology_lock);
+    double *copy = NULL;
+    if (height_map) {
+        copy = malloc(sizeof(double) * topology_map_x * topology_map_y);
+    }
+    if (copy) {
+        memcpy(copy, height_map,
+            sizeof(double) * topology_map_x * topology_map_y);
+        *w = topology_map_x;
+        *h = topology_map_y;
     }
-    if (vec_y > max) {
-        vec_y = max;
+    pthread_mutex_unlock(topology_lock);
+    return copy;
+}
+
+int topology_restoreHeights(const double *heights, int w, int h) {
+    pthread_mutex_lock(topology_lock);
+    if (!height_map || w != topology_map_x || h != topology_map_y) {
+        pthread_mutex_unlock(topology_lock);
+        return 0;
     }
-    if (vec_x < -max) {
-        vec_x = -max;
+    // Only write what differs, so parts of the world that were never
+    // seen stay without memory:
+    size_t cells = (size_t)w * h;
+    for (size_t i = 0; i < cells; i++) {
+        if (height_map[i] != heights[i])
+            height_map[i] = heights[i];
     }
-    if (vec_y < -max) {
-        vec_y = -max;
+    topology_seen_x0 = topology_seen_y0 = 0;
+    topology_seen_x1 = topology_map_x;
+    topology_seen_y1 = topology_map_y;
+    topology_markChanged(0, 0, w, h);
+    if (topology_drift) {
+        topologydrift_setSeen(topology_drift, 0, 0, w, h);
+        topologydrift_update(topology_drift, height_map, 0, 0, w, h);
     }
-    *vx = vec_x;
-    *vy = vec_y;
-    topology_drift_cache_value_x[currentindex] = vec_x;
-    topology_drift_cache_value_y[currentindex] = vec_y;
+    topology_redraw = 1;
+    topology_publish(0, 0, w, h);
     pthread_mutex_unlock(topology_lock);
+    return 1;
+}
+
+void topology_calculate_drift(int x, int y, double *vx, double *vy) {
+    const struct topology_snapshot *s = topology_acquireSnapshot();
+    topology_snapshotDriftAt(s, x, y, vx, vy);
+    topology_releaseSnapshot(s);
+}
+
+static uint32_t topology_countType(const struct topology_snapshot *s,
+        int type, int x0, int y0, int x1, int y1) {
+    // Cells of type in x0..x1-1, y0..y1-1, which lies inside the world.
+    // Four lookups in the table, clamped to the part that was drawn:
+    if (x0 < s->typed_x0) x0 = s->typed_x0;
+    if (y0 < s->typed_y0) y0 = s->typed_y0;
+    if (x1 > s->typed_x1) x1 = s->typed_x1;
+    if (y1 > s->typed_y1) y1 = s->typed_y1;
+    const uint32_t *sums = s->type_sums[type];
+    if (x0 >= x1 || y0 >= y1 || !sums)
+        return 0;
+    size_t stride = (size_t)(s->typed_x1 - s->typed_x0) + 1;
+    x0 -= s->typed_x0; x1 -= s->typed_x0;
+    y0 -= s->typed_y0; y1 -= s->typed_y0;
+    return sums[x1 + y1 * stride] - sums[x0 + y1 * stride] -
+        sums[x1 + y0 * stride] + sums[x0 + y0 * stride];
+}
+
+double topology_snapshotScanType(const struct topology_snapshot *s,
+        int type, int x, int y, int size) {
+    if (type < 0 || type >= TOPOLOGY_TYPE_COUNT)
+        return 0;
+    int x0 = x - (size / 2.0);
+    int y0 = y - (size / 2.0);
+    int x1 = x0 + size;
+    int y1 = y0 + size;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > s->map_x) x1 = s->map_x;
+    if (y1 > s->map_y) y1 = s->map_y;
+    if (x0 >= x1 || y0 >= y1)
+        return 0;
+    uint32_t total = (uint32_t)(x1 - x0) * (uint32_t)(y1 - y0);
+    uint32_t positive;
+    if (type == TOPOLOGY_NONE) {
+        positive = total;
+        for (int k = 1; k < TOPOLOGY_TYPE_COUNT; k++)
+            positive -= topology_countType(s, k, x0, y0, x1, y1);
+    } else {
+        positive = topology_countType(s, type, x0, y0, x1, y1);
+    }
+    return (double)positive / (double)total;
+}
+
+void topology_snapshotScanTypes(const struct topology_snapshot *s,
+        int type, const int *xs, const int *ys, int count, int size,
+        double *out) {
+    for (int i = 0; i < count; i++)
+        out[i] = topology_snapshotScanType(s, type, xs[i], ys[i], size);
 }
 
 double topology_scan_type(int type, int x, int y, int size) {
+    const struct topology_snapshot *s = topology_acquireSnapshot();
+    double result = topology_snapshotScanType(s, type, x, y, size);
+    topology_releaseSnapshot(s);
+    return result;
+}
+
+size_t topology_getMemoryUsage() {
     pthread_mutex_lock(topology_lock);
-    int scan_start_x = x - (size / 2.0);
-    int scan_start_y = y - (size / 2.0);
-    double positive = 0;
-    double negative = 0;
-    double total = 0;
-    for (int x = scan_start_x; x < scan_start_x + size; x++) {
-        if (x < 0 || x >= topology_map_x) continue;
-        for (int y = scan_start_y; y < scan_start_y + size; y++) {
-            if (y < 0 || y >= topology_map_y) continue;
-            int index = x + y * topology_map_x;
-            total += 1.0;
-            if (topology_map[index] == type) {
-                positive += 1.0;
-            } else {
-                negative += 1.0;
-            }
-        }
+    size_t cells = (size_t)topology_map_x * topology_map_y;
+    size_t usage = sparsegrid_residentSize(topology_map, cells) +
+        sparsegrid_residentSize(height_map, cells * sizeof(double));
+    if (topology_drift)
+        usage += topologydrift_getMemoryUsage(topology_drift);
+    if (topology_colors) {
+        usage += (size_t)topology_screen_x * topology_screen_y *
+            (sizeof(uint32_t) + 1);
+    }
+    for (int i = 0; i < TOPOLOGY_SNAPSHOT_MAX; i++) {
+        const struct topology_snapshotcopy *c = topology_snapshots[i];
+        if (!c)
+            continue;
+        size_t copy_cells = (size_t)c->s.map_x * c->s.map_y;
+        usage += sparsegrid_residentSize(c->heights,
+            copy_cells * sizeof(double)) +
+            sparsegrid_residentSize(c->types, copy_cells) +
+            sparsegrid_residentSize(c->drift_x, copy_cells * sizeof(float)) +
+            sparsegrid_residentSize(c->drift_y, copy_cells * sizeof(float)) +
+            c->type_sums_alloc * sizeof(uint32_t) * (TOPOLOGY_TYPE_COUNT - 1);
     }
     pthread_mutex_unlock(topology_lock);
-    return positive / total;
+    return usage;
 }
 
 double topology_getMaxPossibleHeight() {
@@ -205,40 +588,52 @@ double topology_getMinPossibleHeight() {
 }
 
 int get_topology(int x, int y) {
-    pthread_mutex_lock(topology_lock);
-    if (x < 0 || x >= topology_map_x || y < 0 || y >= topology_map_y) {
-        pthread_mutex_unlock(topology_lock);
-        return TOPOLOGY_NONE;
-    }
-    int result = topology_map[x + y * topology_map_x];
-    pthread_mutex_unlock(topology_lock);
+    const struct topology_snapshot *s = topology_acquireSnapshot();
+    int result = topology_snapshotTypeAt(s, x, y);
+    topology_releaseSnapshot(s);
     return result;
 }
 
-void topology_drawToSimImage(const uint8_t* depth_array, int xsize, int ysize) {
-    pthread_mutex_lock(topology_lock);
-    assert(simulation_isSurfaceLocked());
+// Colour, height and type for each depth value, rebuilt every frame
+// from the gradient and height config:
+struct topology_shade {
+    uint32_t color[256];  // alpha, then the gradient's three channels
+    double height[256];
+    char type[256];
+};
 
-	// Draw topology gradient:
-    int x = 0;
-    int y = 0;
-    int depth_source_x = -1;
-    int depth_source_y = 0;
-    for (int i = 0; i < xsize * ysize; ++i) {
-        int offset = i * 4;
-        depth_source_x += 1;
-        if (depth_source_x >= xsize) {
-            depth_source_y++;
-            depth_source_x -= xsize;
-        }
-        int depth_offset = (depth_source_y +
-            depth_source_x * ysize);
+// Screen and colours the last frame was drawn with. Depth tiles are
+// transposed on the stack to walk the screen row by row:
+static int topology_drawn_view_x = 0;
+static int topology_drawn_view_y = 0;
+static struct topology_shade topology_drawn_shades;
+static unsigned int topology_change_threshold = 0;
+
+struct topology_drawjob {
+    const uint8_t *depth_array;
+    int xsize, ysize;
+    int view_x, view_y;
+    const struct topology_shade *shades;
+    uint32_t *pixels;
+    // Without the colours and accepted depth (out of memory), everything
+    // is drawn straight to the pixels:
+    uint32_t *colors;
+    uint8_t *accepted;
+    uint8_t *dirty;
+    int tiles_x;
+    int redraw;
+    // Per band of rows, regions of the world whose heights and types
+    // changed (x1, y1 exclusive):
+    int *changed;
+};
 
-        // Set height:
-        int height = ((double)(255 - depth_array[depth_offset]) * config_heightScale + config_heightShift);
+static void topology_buildShades(struct topology_shade *shades) {
+    memset(shades, 0, sizeof(*shades));
+    for (int depth = 0; depth < 256; depth++) {
+        int height = ((double)(255 - depth) * config_heightScale +
+            config_heightShift);
         if (height < 0) height = 0;
         if (height > 255) height = 255;
-        height_map[x + y * xsize] = height;
 
         // Calculate gradient offset:
         int height_color_range_min = 60;
@@ -262,28 +657,336 @@ void topology_drawToSimImage(const uint8_t* depth_array, int xsize, int ysize) {
         // Get gradient color:
         int baseindex = 3 * (gradient_abs_x_pos +
             gradient_abs_y_pos * gradient_x);
-        int gradient_c0 = raw_gradient_data[baseindex];
-        int gradient_c1 = raw_gradient_data[baseindex + 1];
-        int gradient_c2 = raw_gradient_data[baseindex + 2];
-
-        // Offset+0: blue, offset+1: green, offset+2: red
-		((char*)images_simulation_image->pixels)[offset+1] = gradient_c0;
-        ((char*)images_simulation_image->pixels)[offset+2] = gradient_c1;
-        ((char*)images_simulation_image->pixels)[offset+3] = gradient_c2;
-        ((char*)images_simulation_image->pixels)[offset+0] = 255; // alpha
-
-        // Update topology map:
-        topology_map[i] = TOPOLOGY_NONE;
+        uint8_t color[4] = { 255, raw_gradient_data[baseindex],
+            raw_gradient_data[baseindex + 1],
+            raw_gradient_data[baseindex + 2] };
+        memcpy(&shades->color[depth], color, 4);
+        shades->height[depth] = height;
+        shades->type[depth] = TOPOLOGY_NONE;
         if (gradient_abs_x_pos < 140 && gradient_abs_x_pos > 65) {
-            topology_map[i] = TOPOLOGY_GRASS;
+            shades->type[depth] = TOPOLOGY_GRASS;
         }
+    }
+}
 
-        // Advance coordinates:
-        x++;
-        if (x >= xsize) {
-            x -= xsize;
-            y++;
+void topology_setChangeThreshold(int threshold) {
+    pthread_mutex_lock(topology_lock);
+    topology_change_threshold = (threshold > 0 ? threshold : 0);
+    pthread_mutex_unlock(topology_lock);
+}
+
+int topology_getDirtyTiles(uint8_t *mask, int max_tiles,
+        int *tiles_x, int *tiles_y) {
+    pthread_mutex_lock(topology_lock);
+    *tiles_x = (topology_screen_x + TOPOLOGY_TILE - 1) / TOPOLOGY_TILE;
+    *tiles_y = (topology_screen_y + TOPOLOGY_TILE - 1) / TOPOLOGY_TILE;
+    int count = *tiles_x * *tiles_y;
+    if (count > max_tiles) count = max_tiles;
+    if (!topology_dirty_tiles) count = 0;
+    if (count > 0)
+        memcpy(mask, topology_dirty_tiles, count);
+    pthread_mutex_unlock(topology_lock);
+    return count;
+}
+
+static int topology_tileChanged(const struct topology_drawjob *job,
+        int x0, int y0, int x1, int y1) {
+    // Sum of absolute differences to the accepted frame, a column of the
+    // tile at a time as the depth image is laid out:
+    unsigned int sum = 0;
+    int rows = y1 - y0;
+    for (int x = x0; x < x1; x++) {
+        size_t offset = y0 + (size_t)x * job->ysize;
+        const uint8_t *depth = job->depth_array + offset;
+        const uint8_t *accepted = job->accepted + offset;
+        int y = 0;
+#ifdef TOPOLOGY_X86_SIMD
+        __m128i sad = _mm_setzero_si128();
+        for (; y + 16 <= rows; y += 16) {
+            sad = _mm_add_epi64(sad, _mm_sad_epu8(
+                _mm_loadu_si128((const __m128i *)(depth + y)),
+                _mm_loadu_si128((const __m128i *)(accepted + y))));
+        }
+        sum += _mm_cvtsi128_si32(sad) +
+            _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+#endif
+        for (; y < rows; y++) {
+            sum += abs(depth[y] - accepted[y]);
+        }
+        if (sum > topology_change_threshold)
+            return 1;
+    }
+    return 0;
+}
+
+static void topology_drawBand(int task, void *userdata) {
+    const struct topology_drawjob *job = userdata;
+    const struct topology_shade *shades = job->shades;
+    int ysize = job->ysize;
+    int y0 = task * TOPOLOGY_TILE;
+    int y1 = y0 + TOPOLOGY_TILE;
+    if (y1 > ysize) y1 = ysize;
+    int *changed = job->changed + task * 8;
+    int changed_x0 = topology_map_x, changed_y0 = topology_map_y;
+    int changed_x1 = 0, changed_y1 = 0;
+    int types_x0 = topology_map_x, types_y0 = topology_map_y;
+    int types_x1 = 0, types_y1 = 0;
+
+    uint32_t *colors = (job->colors ? job->colors : job->pixels);
+    uint8_t tile[TOPOLOGY_TILE][TOPOLOGY_TILE];
+    for (int x0 = 0; x0 < job->xsize; x0 += TOPOLOGY_TILE) {
+        int x1 = x0 + TOPOLOGY_TILE;
+        if (x1 > job->xsize) x1 = job->xsize;
+        int dirty = (job->redraw || !job->accepted ||
+            topology_tileChanged(job, x0, y0, x1, y1));
+        job->dirty[task * job->tiles_x + x0 / TOPOLOGY_TILE] = dirty;
+        if (!dirty)
+            continue;
+        for (int x = x0; x < x1; x++) {
+            const uint8_t *column = job->depth_array + y0 +
+                (size_t)x * ysize;
+            for (int y = y0; y < y1; y++)
+                tile[y - y0][x - x0] = column[y - y0];
+            if (job->accepted) {
+                memcpy(job->accepted + y0 + (size_t)x * ysize, column,
+                    y1 - y0);
+            }
+        }
+        // Part of the tile inside the world:
+        int inside_x0 = -job->view_x;
+        int inside_x1 = topology_map_x - job->view_x;
+        if (inside_x0 < x0) inside_x0 = x0;
+        if (inside_x1 > x1) inside_x1 = x1;
+        for (int y = y0; y < y1; y++) {
+            const uint8_t *depths = tile[y - y0] - x0;
+            uint32_t *row_colors = colors + (size_t)y * job->xsize;
+            for (int x = x0; x < x1; x++)
+                row_colors[x] = shades->color[depths[x]];
+
+            int world_y = y + job->view_y;
+            if (world_y < 0 || world_y >= topology_map_y)
+                continue;
+            ptrdiff_t row = (ptrdiff_t)world_y * topology_map_x +
+                job->view_x;
+            for (int x = inside_x0; x < inside_x1; x++) {
+                int depth = depths[x];
+                double *height = &height_map[row + x];
+                char *type = &topology_map[row + x];
+                if (*height != shades->height[depth]) {
+                    *height = shades->height[depth];
+                    int world_x = x + job->view_x;
+                    if (world_x < changed_x0) changed_x0 = world_x;
+                    if (world_y < changed_y0) changed_y0 = world_y;
+                    if (world_x >= changed_x1) changed_x1 = world_x + 1;
+                    if (world_y >= changed_y1) changed_y1 = world_y + 1;
+                }
+                if (*type != shades->type[depth]) {
+                    *type = shades->type[depth];
+                    int world_x = x + job->view_x;
+                    if (world_x < types_x0) types_x0 = world_x;
+                    if (world_y < types_y0) types_y0 = world_y;
+                    if (world_x >= types_x1) types_x1 = world_x + 1;
+                    if (world_y >= types_y1) types_y1 = world_y + 1;
+                }
+            }
+        }
+    }
+    if (job->colors) {
+        memcpy(job->pixels + (size_t)y0 * job->xsize,
+            job->colors + (size_t)y0 * job->xsize,
+            sizeof(uint32_t) * job->xsize * (y1 - y0));
+    }
+    changed[0] = changed_x0; changed[1] = changed_y0;
+    changed[2] = changed_x1; changed[3] = changed_y1;
+    changed[4] = types_x0; changed[5] = types_y0;
+    changed[6] = types_x1; changed[7] = types_y1;
+}
+
+void topology_drawToSimImage(const uint8_t* depth_array, int xsize, int ysize) {
+    pthread_mutex_lock(topology_lock);
+    assert(simulation_isSurfaceLocked());
+
+    // The depth image covers the screen, which shows the world starting
+    // at the viewport:
+    int view_x, view_y;
+    simulation_getViewport(&view_x, &view_y);
+
+    // Draw topology gradient, updating the maps along the way. Spread
+    // over threads by bands of rows:
+    struct topology_shade shades;
+    topology_buildShades(&shades);
+    int bands = (ysize + TOPOLOGY_TILE - 1) / TOPOLOGY_TILE;
+    int tiles_x = (xsize + TOPOLOGY_TILE - 1) / TOPOLOGY_TILE;
+    int changed_bands[8 * bands + 1];
+    if (xsize != topology_screen_x || ysize != topology_screen_y) {
+        size_t pixels = (size_t)xsize * ysize;
+        free(topology_accepted_depth);
+        free(topology_colors);
+        free(topology_dirty_tiles);
+        topology_accepted_depth = malloc(pixels);
+        topology_colors = malloc(sizeof(uint32_t) * pixels);
+        topology_dirty_tiles = malloc((size_t)tiles_x * bands + 1);
+        if (!topology_accepted_depth || !topology_colors) {
+            fprintf(stderr, "clib/topology.c: error: "
+                "out of memory for the tile cache, drawing everything\n");
+            free(topology_accepted_depth);
+            free(topology_colors);
+            topology_accepted_depth = NULL;
+            topology_colors = NULL;
+        }
+        topology_screen_x = xsize;
+        topology_screen_y = ysize;
+        topology_redraw = 1;
+    }
+    if (!topology_dirty_tiles) {
+        // Nowhere to put the mask, so nothing is drawn. Forgetting the
+        // screen size makes the next frame try again:
+        fprintf(stderr, "clib/topology.c: error: "
+            "out of memory for the dirty tiles\n");
+        topology_screen_x = 0;
+        topology_screen_y = 0;
+        pthread_mutex_unlock(topology_lock);
+        return;
+    }
+    // Everything was drawn differently if the screen moved over the
+    // world or the colours changed:
+    if (view_x != topology_drawn_view_x || view_y != topology_drawn_view_y ||
+            memcmp(&shades, &topology_drawn_shades, sizeof(shades)) != 0)
+        topology_redraw = 1;
+    struct topology_drawjob job;
+    job.depth_array = depth_array;
+    job.xsize = xsize;
+    job.ysize = ysize;
+    job.view_x = view_x;
+    job.view_y = view_y;
+    job.shades = &shades;
+    job.pixels = images_simulation_image->pixels;
+    job.colors = topology_colors;
+    job.accepted = topology_accepted_depth;
+    job.dirty = topology_dirty_tiles;
+    job.tiles_x = tiles_x;
+    job.redraw = topology_redraw;
+    job.changed = changed_bands;
+    workerpool_run(workerpool_shared(), bands, topology_drawBand, &job);
+    topology_redraw = 0;
+    topology_drawn_view_x = view_x;
+    topology_drawn_view_y = view_y;
+    topology_drawn_shades = shades;
+
+    // Region of the world whose heights or types changed (x1, y1
+    // exclusive):
+    int changed_x0 = topology_map_x, changed_y0 = topology_map_y;
+    int changed_x1 = 0, changed_y1 = 0;
+    int types_x0 = topology_map_x, types_y0 = topology_map_y;
+    int types_x1 = 0, types_y1 = 0;
+    for (int i = 0; i < bands; i++) {
+        const int *changed = changed_bands + i * 8;
+        if (changed[0] < changed_x0) changed_x0 = changed[0];
+        if (changed[1] < changed_y0) changed_y0 = changed[1];
+        if (changed[2] > changed_x1) changed_x1 = changed[2];
+        if (changed[3] > changed_y1) changed_y1 = changed[3];
+        if (changed[4] < types_x0) types_x0 = changed[4];
+        if (changed[5] < types_y0) types_y0 = changed[5];
+        if (changed[6] > types_x1) types_x1 = changed[6];
+        if (changed[7] > types_y1) types_y1 = changed[7];
+    }
+
+    // Grow the seen part of the world by what is on screen. Ground that
+    // was never seen counts as the lowest possible for emitters and as a
+    // wall for the fluid, so all of the grown part changed height:
+    int seen_grew = 0;
+    int seen_x0 = (view_x > 0 ? view_x : 0);
+    int seen_y0 = (view_y > 0 ? view_y : 0);
+    int seen_x1 = view_x + xsize;
+    int seen_y1 = view_y + ysize;
+    if (seen_x1 > topology_map_x) seen_x1 = topology_map_x;
+    if (seen_y1 > topology_map_y) seen_y1 = topology_map_y;
+    if (seen_x0 < seen_x1 && seen_y0 < seen_y1) {
+        if (topology_seen_x1 <= topology_seen_x0) {
+            topology_seen_x0 = seen_x0;
+            topology_seen_y0 = seen_y0;
+            topology_seen_x1 = seen_x1;
+            topology_seen_y1 = seen_y1;
+            seen_grew = 1;
+        } else if (seen_x0 < topology_seen_x0 || seen_y0 < topology_seen_y0 ||
+                seen_x1 > topology_seen_x1 || seen_y1 > topology_seen_y1) {
+            if (seen_x0 < topology_seen_x0) topology_seen_x0 = seen_x0;
+            if (seen_y0 < topology_seen_y0) topology_seen_y0 = seen_y0;
+            if (seen_x1 > topology_seen_x1) topology_seen_x1 = seen_x1;
+            if (seen_y1 > topology_seen_y1) topology_seen_y1 = seen_y1;
+            seen_grew = 1;
+        }
+        if (topology_typed_x1 <= topology_typed_x0) {
+            topology_typed_x0 = seen_x0;
+            topology_typed_y0 = seen_y0;
+            topology_typed_x1 = seen_x1;
+            topology_typed_y1 = seen_y1;
+            topology_types_generation++;
+        } else if (seen_x0 < topology_typed_x0 ||
+                seen_y0 < topology_typed_y0 ||
+                seen_x1 > topology_typed_x1 ||
+                seen_y1 > topology_typed_y1) {
+            if (seen_x0 < topology_typed_x0) topology_typed_x0 = seen_x0;
+            if (seen_y0 < topology_typed_y0) topology_typed_y0 = seen_y0;
+            if (seen_x1 > topology_typed_x1) topology_typed_x1 = seen_x1;
+            if (seen_y1 > topology_typed_y1) topology_typed_y1 = seen_y1;
+            topology_types_generation++;
+        }
+    }
+    if (seen_grew) {
+        if (topology_seen_x0 < changed_x0) changed_x0 = topology_seen_x0;
+        if (topology_seen_y0 < changed_y0) changed_y0 = topology_seen_y0;
+        if (topology_seen_x1 > changed_x1) changed_x1 = topology_seen_x1;
+        if (topology_seen_y1 > changed_y1) changed_y1 = topology_seen_y1;
+        if (topology_drift) {
+            topologydrift_setSeen(topology_drift, topology_seen_x0,
+                topology_seen_y0, topology_seen_x1, topology_seen_y1);
+        }
+    }
+    if (changed_x0 < changed_x1)
+        topology_markChanged(changed_x0, changed_y0, changed_x1, changed_y1);
+    if (types_x0 < types_x1)
+        topology_types_generation++;
+
+    // Once per depth frame, the drift field follows the new heights and
+    // everything is published to the readers. The drift is updated for
+    // each run of bands with changes, so it isn't computed again all the
+    // way between changes far apart. When the seen part grew, the drift
+    // next to its old edge changes as well, so all of it is updated:
+    if (seen_grew) {
+        if (topology_drift)
+            topologydrift_update(topology_drift, height_map,
+                changed_x0, changed_y0, changed_x1, changed_y1);
+    } else {
+        int run_x0 = topology_map_x, run_y0 = topology_map_y;
+        int run_x1 = 0, run_y1 = 0;
+        for (int i = 0; i <= bands; i++) {
+            const int *changed = (i < bands ? changed_bands + i * 8 : NULL);
+            if (changed && changed[0] < changed[2]) {
+                if (changed[0] < run_x0) run_x0 = changed[0];
+                if (changed[1] < run_y0) run_y0 = changed[1];
+                if (changed[2] > run_x1) run_x1 = changed[2];
+                if (changed[3] > run_y1) run_y1 = changed[3];
+                continue;
+            }
+            if (run_x0 < run_x1 && topology_drift)
+                topologydrift_update(topology_drift, height_map,
+                    run_x0, run_y0, run_x1, run_y1);
+            run_x0 = topology_map_x; run_y0 = topology_map_y;
+            run_x1 = 0; run_y1 = 0;
         }
-	}
+    }
+    if (changed_x0 < changed_x1) {
+        changed_x0 -= TOPOLOGYDRIFT_REACH;
+        changed_y0 -= TOPOLOGYDRIFT_REACH;
+        changed_x1 += TOPOLOGYDRIFT_REACH;
+        changed_y1 += TOPOLOGYDRIFT_REACH;
+    }
+    if (types_x0 < changed_x0) changed_x0 = types_x0;
+    if (types_y0 < changed_y0) changed_y0 = types_y0;
+    if (types_x1 > changed_x1) changed_x1 = types_x1;
+    if (types_y1 > changed_y1) changed_y1 = types_y1;
+    if (changed_x0 < changed_x1)
+        topology_publish(changed_x0, changed_y0, changed_x1, changed_y1);
     pthread_mutex_unlock(topology_lock);
 }
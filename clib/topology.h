@@ -1,20 +1,129 @@
 
+#include <stddef.h>
 #include <stdint.h>
 
 void topology_setHeightConfig(double heightShift, double heightScale);
 extern char *topology_map;
 extern int topology_map_x;
 extern int topology_map_y;
+// The maps cover the whole world, which may be larger than the screen.
+// Drawing writes the heights of the part shown at the viewport:
 void topology_init(int size_x, int size_y);
+// Single lookups in the latest snapshot (see below). Code doing many of
+// them should hold on to a snapshot instead:
 double topology_scan_type(int type, int x, int y, int size);
 int get_topology(int x, int y);
+// Ground that was never on screen acts as a wall: the drift field treats
+// it like the border of the map, and topology_heightAt() gives it
+// TOPOLOGY_WALL_HEIGHT, far above any ground the fluid could spill over:
+#define TOPOLOGY_WALL_HEIGHT 4096.0
+// Direction things slide downhill, see topologydrift.h:
 void topology_calculate_drift(int x, int y, double *vx, double *vy);
 double topology_heightAt(int x, int y);
+// Fill out (w * h values) with the heights at the centers of a grid with
+// cells of step pixels, taking the lock only once. Only the cells x0 ..
+// x1 - 1, y0 .. y1 - 1 are written. Parts of the world that were never on
+// screen have the lowest possible height, so emitters leave them be:
+void topology_sampleHeights(double *out, int w, int h, double step,
+    int x0, int y0, int x1, int y1);
+// Changes whenever any height of the map changed:
+unsigned int topology_getGeneration();
+// Region of the world (x1, y1 exclusive) whose heights changed after
+// generation since, up to the current one, which goes to generation.
+// Returns 0 if there were no changes. Is all of the world if since is
+// too long ago:
+int topology_getChangedRegion(unsigned int since, unsigned int *generation,
+    int *x0, int *y0, int *x1, int *y1);
+// Copy of the height map (w * h values, row by row) to be freed by the
+// caller, and putting one back. Restoring fails if the size differs:
+double *topology_copyHeights(int *w, int *h);
+int topology_restoreHeights(const double *heights, int w, int h);
 void topology_drawToSimImage(const uint8_t* depth_array, int xsize, int ysize);
+// Drawing only redoes tiles of TOPOLOGY_TILE x TOPOLOGY_TILE screen pixels
+// whose depth changed, by more than threshold summed up over the tile
+// (0, the default, redoes any change). Which tiles the last frame redid
+// can be copied out, row by row; returns how many were written to mask:
+#define TOPOLOGY_TILE 32
+void topology_setChangeThreshold(int threshold);
+int topology_getDirtyTiles(uint8_t *mask, int max_tiles,
+    int *tiles_x, int *tiles_y);
+// Bytes of memory the maps take up, only the parts written to count:
+size_t topology_getMemoryUsage();
 
 double topology_getMaxPossibleHeight();
 double topology_getMinPossibleHeight();
 
 #define TOPOLOGY_NONE 0
 #define TOPOLOGY_GRASS 1
+#define TOPOLOGY_TYPE_COUNT 2
 
+// Frozen copy of the maps, published once per depth frame by the thread
+// drawing the topology. Readers take the latest with
+// topology_acquireSnapshot() once per step, look things up without any
+// locking and give it back with topology_releaseSnapshot(). Its maps
+// never change while held. Before the first frame the maps are 0 x 0:
+struct topology_snapshot {
+    int map_x, map_y;
+    unsigned int generation;
+    double height_shift, height_scale;
+    // Part of the world that was seen (x1, y1 exclusive). Ground outside
+    // of it is a wall, see TOPOLOGY_WALL_HEIGHT:
+    int seen_x0, seen_y0, seen_x1, seen_y1;
+    const double *heights;
+    const char *types;
+    const float *drift_x;
+    const float *drift_y;
+    // Summed-area tables of the types over the part of the world drawn so
+    // far (x1, y1 exclusive), (w + 1) * (h + 1) counts each. Entry x, y
+    // counts the cells of a type left of and above it. The one for
+    // TOPOLOGY_NONE is NULL, it is what the others leave over:
+    int typed_x0, typed_y0, typed_x1, typed_y1;
+    const uint32_t *type_sums[TOPOLOGY_TYPE_COUNT];
+};
+
+// Copies kept at most. While readers hold all of them, frames aren't
+// published:
+#define TOPOLOGY_SNAPSHOT_MAX 8
+
+const struct topology_snapshot *topology_acquireSnapshot();
+void topology_releaseSnapshot(const struct topology_snapshot *s);
+
+static inline double topology_snapshotHeightAt(
+        const struct topology_snapshot *s, int x, int y) {
+    if (x < s->seen_x0 || x >= s->seen_x1 || y < s->seen_y0 ||
+            y >= s->seen_y1)
+        return TOPOLOGY_WALL_HEIGHT;
+    double value = s->heights[x + (size_t)y * s->map_x];
+    double height = (255 - value) * s->height_scale + s->height_shift;
+    if (height < 0.0) height = 0.0;
+    if (height > 255.0) height = 255.0;
+    return height;
+}
+
+static inline int topology_snapshotTypeAt(
+        const struct topology_snapshot *s, int x, int y) {
+    if (x < 0 || x >= s->map_x || y < 0 || y >= s->map_y)
+        return TOPOLOGY_NONE;
+    return s->types[x + (size_t)y * s->map_x];
+}
+
+static inline void topology_snapshotDriftAt(
+        const struct topology_snapshot *s, int x, int y,
+        double *vx, double *vy) {
+    if (x < s->seen_x0 || x >= s->seen_x1 || y < s->seen_y0 ||
+            y >= s->seen_y1) {
+        *vx = 0; *vy = 0;
+        return;
+    }
+    *vx = s->drift_x[x + (size_t)y * s->map_x];
+    *vy = s->drift_y[x + (size_t)y * s->map_x];
+}
+
+// Share of the size x size pixels around x, y inside the world that are of
+// type, 0 if none are inside. Costs the same for any size:
+double topology_snapshotScanType(const struct topology_snapshot *s,
+    int type, int x, int y, int size);
+// The same for count positions at once, results go to out:
+void topology_snapshotScanTypes(const struct topology_snapshot *s,
+    int type, const int *xs, const int *ys, int count, int size,
+    double *out);
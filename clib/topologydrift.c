@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sparsegrid.h"
+#include "topologydrift.h"
+#include "workerpool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOPOLOGYDRIFT_X86_SIMD
+#endif
+
+// Rows per task:
+#define TOPOLOGYDRIFT_BAND 8
+
+struct topologydrift {
+    int w, h;
+    struct workerpool *pool;
+    // Part of the map that was ever seen (x1, y1 exclusive), where the
+    // field is computed. Its edges count as the border of the map:
+    int seen_x0, seen_y0, seen_x1, seen_y1;
+    // Heights box filtered along x, then along both axes:
+    float *blur_x;
+    float *blur;
+    float *drift_x;
+    float *drift_y;
+};
+
+struct topologydrift_pass {
+    struct topologydrift *d;
+    const double *heights;
+    // Columns and rows the pass covers (x1, y1 exclusive):
+    int x0, y0, x1, y1;
+};
+
+static inline int topologydrift_clamp(int v, int min, int max) {
+    if (v < min) return min;
+    if (v > max) return max;
+    return v;
+}
+
+struct topologydrift *topologydrift_create(int w, int h,
+        struct workerpool *pool) {
+    struct topologydrift *d = malloc(sizeof(*d));
+    if (!d)
+        return NULL;
+    size_t size = sizeof(float) * (size_t)w * h;
+    d->w = w;
+    d->h = h;
+    d->seen_x0 = d->seen_y0 = d->seen_x1 = d->seen_y1 = 0;
+    d->pool = pool;
+    d->blur_x = sparsegrid_alloc(size);
+    d->blur = sparsegrid_alloc(size);
+    d->drift_x = sparsegrid_alloc(size);
+    d->drift_y = sparsegrid_alloc(size);
+    if (!d->blur_x || !d->blur || !d->drift_x || !d->drift_y) {
+        topologydrift_destroy(d);
+        return NULL;
+    }
+    return d;
+}
+
+void topologydrift_destroy(struct topologydrift *d) {
+    if (!d)
+        return;
+    size_t size = sizeof(float) * (size_t)d->w * d->h;
+    sparsegrid_free(d->blur_x, size);
+    sparsegrid_free(d->blur, size);
+    sparsegrid_free(d->drift_x, size);
+    sparsegrid_free(d->drift_y, size);
+    free(d);
+}
+
+void topologydrift_setSeen(struct topologydrift *d,
+        int x0, int y0, int x1, int y1) {
+    d->seen_x0 = (x0 > 0 ? x0 : 0);
+    d->seen_y0 = (y0 > 0 ? y0 : 0);
+    d->seen_x1 = (x1 < d->w ? x1 : d->w);
+    d->seen_y1 = (y1 < d->h ? y1 : d->h);
+}
+
+static void topologydrift_blurRowsX(int task, void *userdata) {
+    // Sliding sum along the row. Heights are whole numbers, so the sum
+    // doesn't pick up rounding errors on the way:
+    const struct topologydrift_pass *pass = userdata;
+    const struct topologydrift *d = pass->d;
+    const int r = TOPOLOGYDRIFT_BLUR_RADIUS;
+    const double scale = 1.0 / (2 * r + 1);
+    int y0 = pass->y0 + task * TOPOLOGYDRIFT_BAND;
+    int y1 = y0 + TOPOLOGYDRIFT_BAND;
+    if (y1 > pass->y1) y1 = pass->y1;
+    const int lo = d->seen_x0, hi = d->seen_x1 - 1;
+    for (int y = y0; y < y1; y++) {
+        const double *row = pass->heights + (size_t)y * d->w;
+        float *out = d->blur_x + (size_t)y * d->w;
+        double sum = 0;
+        for (int x = pass->x0 - r; x <= pass->x0 + r; x++) {
+            sum += row[topologydrift_clamp(x, lo, hi)];
+        }
+        for (int x = pass->x0; x < pass->x1; x++) {
+            out[x] = sum * scale;
+            sum += row[topologydrift_clamp(x + r + 1, lo, hi)] -
+                row[topologydrift_clamp(x - r, lo, hi)];
+        }
+    }
+}
+
+static void topologydrift_blurRowsY(int task, void *userdata) {
+    const struct topologydrift_pass *pass = userdata;
+    const struct topologydrift *d = pass->d;
+    const int r = TOPOLOGYDRIFT_BLUR_RADIUS;
+    const float scale = 1.0f / (2 * r + 1);
+    int y0 = pass->y0 + task * TOPOLOGYDRIFT_BAND;
+    int y1 = y0 + TOPOLOGYDRIFT_BAND;
+    if (y1 > pass->y1) y1 = pass->y1;
+    for (int y = y0; y < y1; y++) {
+        // Rows past the border repeat the border row:
+        const float *rows[2 * TOPOLOGYDRIFT_BLUR_RADIUS + 1];
+        for (int j = -r; j <= r; j++) {
+            rows[j + r] = d->blur_x + (size_t)topologydrift_clamp(y + j,
+                d->seen_y0, d->seen_y1 - 1) * d->w;
+        }
+        float *out = d->blur + (size_t)y * d->w;
+        int x = pass->x0;
+#ifdef TOPOLOGYDRIFT_X86_SIMD
+        __m128 vscale = _mm_set1_ps(scale);
+        for (; x + 4 <= pass->x1; x += 4) {
+            __m128 sum = _mm_loadu_ps(rows[0] + x);
+            for (int j = 1; j < 2 * r + 1; j++) {
+                sum = _mm_add_ps(sum, _mm_loadu_ps(rows[j] + x));
+            }
+            _mm_storeu_ps(out + x, _mm_mul_ps(sum, vscale));
+        }
+#endif
+        for (; x < pass->x1; x++) {
+            float sum = rows[0][x];
+            for (int j = 1; j < 2 * r + 1; j++) {
+                sum += rows[j][x];
+            }
+            out[x] = sum * scale;
+        }
+    }
+}
+
+static inline float topologydrift_fromSlope(float slope) {
+    float drift = -TOPOLOGYDRIFT_SCALE * slope;
+    if (drift > TOPOLOGYDRIFT_MAX) return TOPOLOGYDRIFT_MAX;
+    if (drift < -TOPOLOGYDRIFT_MAX) return -TOPOLOGYDRIFT_MAX;
+    return drift;
+}
+
+#ifdef TOPOLOGYDRIFT_X86_SIMD
+static inline __m128 topologydrift_fromSlope4(__m128 slope) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 max = _mm_set1_ps(TOPOLOGYDRIFT_MAX);
+    __m128 drift = _mm_mul_ps(_mm_set1_ps(-TOPOLOGYDRIFT_SCALE), slope);
+    drift = _mm_min_ps(drift, max);
+    return _mm_max_ps(drift, _mm_xor_ps(max, sign));
+}
+#endif
+
+static inline void topologydrift_gradientAt(const struct topologydrift *d,
+        const float *row, const float *row_up, const float *row_down,
+        float scale_y, int x, float *out_x, float *out_y) {
+    int left = topologydrift_clamp(x - TOPOLOGYDRIFT_DISTANCE,
+        d->seen_x0, d->seen_x1 - 1);
+    int right = topologydrift_clamp(x + TOPOLOGYDRIFT_DISTANCE,
+        d->seen_x0, d->seen_x1 - 1);
+    float slope_x = 0;
+    if (right > left)
+        slope_x = (row[right] - row[left]) / (right - left);
+    float slope_y = (row_down[x] - row_up[x]) * scale_y;
+    out_x[x] = topologydrift_fromSlope(slope_x);
+    out_y[x] = topologydrift_fromSlope(slope_y);
+}
+
+static void topologydrift_gradientRows(int task, void *userdata) {
+    const struct topologydrift_pass *pass = userdata;
+    const struct topologydrift *d = pass->d;
+    const int dist = TOPOLOGYDRIFT_DISTANCE;
+    int y0 = pass->y0 + task * TOPOLOGYDRIFT_BAND;
+    int y1 = y0 + TOPOLOGYDRIFT_BAND;
+    if (y1 > pass->y1) y1 = pass->y1;
+    for (int y = y0; y < y1; y++) {
+        // Closer to the border, the averages are compared closer together:
+        int up = topologydrift_clamp(y - dist, d->seen_y0, d->seen_y1 - 1);
+        int down = topologydrift_clamp(y + dist, d->seen_y0,
+            d->seen_y1 - 1);
+        float scale_y = (down > up ? 1.0f / (down - up) : 0);
+        const float *row = d->blur + (size_t)y * d->w;
+        const float *row_up = d->blur + (size_t)up * d->w;
+        const float *row_down = d->blur + (size_t)down * d->w;
+        float *out_x = d->drift_x + (size_t)y * d->w;
+        float *out_y = d->drift_y + (size_t)y * d->w;
+
+        // Columns near the border compare closer averages. All others
+        // have both neighbours inside the map and can go four at once:
+        int inner_x0 = d->seen_x0 + dist;
+        int inner_x1 = d->seen_x1 - dist;
+        int x = pass->x0;
+        for (; x < pass->x1 && x < inner_x0; x++) {
+            topologydrift_gradientAt(d, row, row_up, row_down, scale_y,
+                x, out_x, out_y);
+        }
+#ifdef TOPOLOGYDRIFT_X86_SIMD
+        __m128 vscale_x = _mm_set1_ps(1.0f / (2 * dist));
+        __m128 vscale_y = _mm_set1_ps(scale_y);
+        for (; x + 4 <= pass->x1 && x + 4 <= inner_x1; x += 4) {
+            __m128 slope_x = _mm_mul_ps(_mm_sub_ps(
+                _mm_loadu_ps(row + x + dist),
+                _mm_loadu_ps(row + x - dist)), vscale_x);
+            __m128 slope_y = _mm_mul_ps(_mm_sub_ps(
+                _mm_loadu_ps(row_down + x),
+                _mm_loadu_ps(row_up + x)), vscale_y);
+            _mm_storeu_ps(out_x + x, topologydrift_fromSlope4(slope_x));
+            _mm_storeu_ps(out_y + x, topologydrift_fromSlope4(slope_y));
+        }
+#endif
+        for (; x < pass->x1; x++) {
+            topologydrift_gradientAt(d, row, row_up, row_down, scale_y,
+                x, out_x, out_y);
+        }
+    }
+}
+
+static void topologydrift_runPass(struct topologydrift *d,
+        struct topologydrift_pass *pass,
+        void (*func)(int task, void *userdata)) {
+    if (pass->x0 < d->seen_x0) pass->x0 = d->seen_x0;
+    if (pass->y0 < d->seen_y0) pass->y0 = d->seen_y0;
+    if (pass->x1 > d->seen_x1) pass->x1 = d->seen_x1;
+    if (pass->y1 > d->seen_y1) pass->y1 = d->seen_y1;
+    if (pass->x0 >= pass->x1 || pass->y0 >= pass->y1)
+        return;
+    int tasks = (pass->y1 - pass->y0 + TOPOLOGYDRIFT_BAND - 1) /
+        TOPOLOGYDRIFT_BAND;
+    workerpool_run(d->pool, tasks, func, pass);
+}
+
+void topologydrift_update(struct topologydrift *d, const double *heights,
+        int x0, int y0, int x1, int y1) {
+    // Each pass covers what the next one reads, going outwards from the
+    // pixels whose drift changed:
+    const int dist = TOPOLOGYDRIFT_DISTANCE;
+    const int r = TOPOLOGYDRIFT_BLUR_RADIUS;
+    x0 -= TOPOLOGYDRIFT_REACH;
+    y0 -= TOPOLOGYDRIFT_REACH;
+    x1 += TOPOLOGYDRIFT_REACH;
+    y1 += TOPOLOGYDRIFT_REACH;
+    struct topologydrift_pass pass;
+    pass.d = d;
+    pass.heights = heights;
+
+    pass.x0 = x0 - dist; pass.x1 = x1 + dist;
+    pass.y0 = y0 - dist - r; pass.y1 = y1 + dist + r;
+    topologydrift_runPass(d, &pass, topologydrift_blurRowsX);
+
+    pass.x0 = x0 - dist; pass.x1 = x1 + dist;
+    pass.y0 = y0 - dist; pass.y1 = y1 + dist;
+    topologydrift_runPass(d, &pass, topologydrift_blurRowsY);
+
+    pass.x0 = x0; pass.x1 = x1;
+    pass.y0 = y0; pass.y1 = y1;
+    topologydrift_runPass(d, &pass, topologydrift_gradientRows);
+}
+
+void topologydrift_copyRegion(const struct topologydrift *d,
+        float *drift_x, float *drift_y, int x0, int y0, int x1, int y1) {
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > d->w) x1 = d->w;
+    if (y1 > d->h) y1 = d->h;
+    if (x0 >= x1)
+        return;
+    for (int y = y0; y < y1; y++) {
+        size_t i = x0 + (size_t)y * d->w;
+        memcpy(drift_x + i, d->drift_x + i, sizeof(float) * (x1 - x0));
+        memcpy(drift_y + i, d->drift_y + i, sizeof(float) * (x1 - x0));
+    }
+}
+
+size_t topologydrift_getMemoryUsage(const struct topologydrift *d) {
+    size_t size = sizeof(float) * (size_t)d->w * d->h;
+    return sparsegrid_residentSize(d->blur_x, size) +
+        sparsegrid_residentSize(d->blur, size) +
+        sparsegrid_residentSize(d->drift_x, size) +
+        sparsegrid_residentSize(d->drift_y, size);
+}
@@ -0,0 +1,59 @@
+
+#ifndef _SANDBOX_TOPOLOGYDRIFT_H_
+#define _SANDBOX_TOPOLOGYDRIFT_H_
+
+#include <stddef.h>
+
+// The drift field: for every pixel of the height map, the direction and
+// strength with which things on the ground slide downhill. It is the
+// gradient of the heights box filtered over about 30x30 pixels, scaled
+// and clamped to match the per pixel scan it replaces. Computed in bulk
+// whenever the heights change, so looking it up costs a load.
+
+// Heights are averaged over this many pixels to each side, and the
+// averages compared this far apart. Together they reach as far as
+// TOPOLOGYDRIFT_REACH:
+#define TOPOLOGYDRIFT_BLUR_RADIUS 7
+#define TOPOLOGYDRIFT_DISTANCE 8
+
+// Drift per height the ground falls per pixel. On the whole number heights
+// from the sensors, the former scan of 15x15 heights two pixels apart
+// added up to about this much until it reached TOPOLOGYDRIFT_MAX, so
+// things slide as fast as they used to:
+#define TOPOLOGYDRIFT_SCALE 426.0f
+
+// Pixels around a change whose drift changes with it:
+#define TOPOLOGYDRIFT_REACH 15
+
+// Largest drift along either axis:
+#define TOPOLOGYDRIFT_MAX 25.0f
+
+struct topologydrift;
+struct workerpool;
+
+// Returns NULL if out of memory. The field starts out all zero and only
+// takes up memory where it was computed. Updates run on the given pool,
+// which the field doesn't own (NULL runs them on the calling thread):
+struct topologydrift *topologydrift_create(int w, int h,
+    struct workerpool *pool);
+void topologydrift_destroy(struct topologydrift *d);
+
+// Part of the heights that was ever seen (x1, y1 exclusive). Its edges are
+// treated like the border of the map, and there is no drift outside of
+// it. Nothing is seen to start with:
+void topologydrift_setSeen(struct topologydrift *d,
+    int x0, int y0, int x1, int y1);
+
+// Recompute the field after the heights (w * h values) in the region
+// x0..x1-1, y0..y1-1 changed. Spread over threads by rows:
+void topologydrift_update(struct topologydrift *d, const double *heights,
+    int x0, int y0, int x1, int y1);
+
+// Copy the region x0..x1-1, y0..y1-1 of the field out into arrays of the
+// same w * h layout:
+void topologydrift_copyRegion(const struct topologydrift *d,
+    float *drift_x, float *drift_y, int x0, int y0, int x1, int y1);
+
+size_t topologydrift_getMemoryUsage(const struct topologydrift *d);
+
+#endif  // _SANDBOX_TOPOLOGYDRIFT_H_
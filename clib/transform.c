@@ -55,6 +55,13 @@ void transform_setRenderScale(struct rendergrid *g, double scale) {
     g->renderScale = scale;
 }
 
+void transform_getRenderTransform(struct rendergrid *g,
+        double *x, double *y, double *scale) {
+    *x = g->renderOffsetX;
+    *y = g->renderOffsetY;
+    *scale = g->renderScale;
+}
+
 struct rendergrid *transform_createNewGrid(int nodesX, int nodesY) {
     struct rendergrid *g = malloc(sizeof(*g));
     memset(g, 0, sizeof(*g));
@@ -40,6 +40,8 @@ void transform_setRenderOffset(struct rendergrid *g,
     double x, double y);
 void transform_resetRenderOffset(struct rendergrid *g);
 void transform_setRenderScale(struct rendergrid *g, double scale);
+void transform_getRenderTransform(struct rendergrid *g,
+    double *x, double *y, double *scale);
 
 #endif  // _SANDBOX_TRANSFORM_H_
 
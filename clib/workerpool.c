@@ -0,0 +1,171 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workerpool.h"
+
+struct workerpool {
+    int thread_count;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t job_start;
+    pthread_cond_t job_done;
+    int shutdown;
+    // Held for a whole job, so jobs from different threads take turns:
+    pthread_mutex_t run_lock;
+
+    // Current job. job_generation increases with every workerpool_run:
+    unsigned int job_generation;
+    void (*job_func)(int task, void *userdata);
+    void *job_userdata;
+    int job_tasks;
+    int job_next_task;
+    int job_joined_workers;
+    int job_busy_workers;
+};
+
+static void workerpool_work(struct workerpool *p) {
+    // Grab tasks until none are left:
+    while (1) {
+        int task = __sync_fetch_and_add(&p->job_next_task, 1);
+        if (task >= p->job_tasks)
+            return;
+        p->job_func(task, p->job_userdata);
+    }
+}
+
+static void *workerpool_thread(void *userdata) {
+    struct workerpool *p = userdata;
+    unsigned int seen_generation = 0;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!p->shutdown && seen_generation == p->job_generation)
+            pthread_cond_wait(&p->job_start, &p->lock);
+        if (p->shutdown)
+            break;
+        seen_generation = p->job_generation;
+        p->job_joined_workers++;
+        p->job_busy_workers++;
+        pthread_mutex_unlock(&p->lock);
+
+        workerpool_work(p);
+
+        pthread_mutex_lock(&p->lock);
+        p->job_busy_workers--;
+        pthread_cond_broadcast(&p->job_done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+struct workerpool *workerpool_create(int threads) {
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    struct workerpool *p = malloc(sizeof(*p));
+    if (!p)
+        return NULL;
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_mutex_init(&p->run_lock, NULL);
+    pthread_cond_init(&p->job_start, NULL);
+    pthread_cond_init(&p->job_done, NULL);
+
+    // The calling thread helps out, so spawn one thread less:
+    p->thread_count = 1;
+    if (threads > 1) {
+        p->threads = malloc(sizeof(*p->threads) * (threads - 1));
+        if (!p->threads)
+            return p;
+        for (int i = 0; i < threads - 1; i++) {
+            if (pthread_create(&p->threads[i], NULL,
+                    workerpool_thread, p) != 0)
+                break;
+            p->thread_count++;
+        }
+    }
+    return p;
+}
+
+void workerpool_destroy(struct workerpool *p) {
+    if (!p)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->job_start);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->thread_count - 1; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+    free(p->threads);
+    pthread_cond_destroy(&p->job_done);
+    pthread_cond_destroy(&p->job_start);
+    pthread_mutex_destroy(&p->run_lock);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+int workerpool_threadCount(struct workerpool *p) {
+    if (!p)
+        return 1;
+    return p->thread_count;
+}
+
+static struct workerpool *workerpool_shared_pool = NULL;
+static pthread_once_t workerpool_shared_once = PTHREAD_ONCE_INIT;
+
+static void workerpool_createShared() {
+    workerpool_shared_pool = workerpool_create(0);
+    if (!workerpool_shared_pool) {
+        fprintf(stderr, "clib/workerpool.c: error: "
+            "out of memory for the shared pool, running serially\n");
+    }
+}
+
+struct workerpool *workerpool_shared() {
+    pthread_once(&workerpool_shared_once, workerpool_createShared);
+    return workerpool_shared_pool;
+}
+
+void workerpool_run(struct workerpool *p, int tasks,
+        void (*func)(int task, void *userdata), void *userdata) {
+    if (tasks <= 0)
+        return;
+    if (!p || p->thread_count <= 1 || tasks == 1) {
+        // Not worth waking anyone up:
+        for (int i = 0; i < tasks; i++) {
+            func(i, userdata);
+        }
+        return;
+    }
+
+    // Publish the job and wake up the workers:
+    pthread_mutex_lock(&p->run_lock);
+    pthread_mutex_lock(&p->lock);
+    p->job_func = func;
+    p->job_userdata = userdata;
+    p->job_tasks = tasks;
+    p->job_next_task = 0;
+    p->job_joined_workers = 0;
+    p->job_generation++;
+    pthread_cond_broadcast(&p->job_start);
+    pthread_mutex_unlock(&p->lock);
+
+    workerpool_work(p);
+
+    // Wait until every worker has seen this job and finished its last
+    // task, so nobody can still be picking from the task counter when
+    // the next job resets it:
+    pthread_mutex_lock(&p->lock);
+    while (p->job_joined_workers < p->thread_count - 1 ||
+            p->job_busy_workers > 0)
+        pthread_cond_wait(&p->job_done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_unlock(&p->run_lock);
+}
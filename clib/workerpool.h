@@ -0,0 +1,25 @@
+
+#ifndef _SANDBOX_WORKERPOOL_H_
+#define _SANDBOX_WORKERPOOL_H_
+
+struct workerpool;
+
+// Create a pool running jobs on the given amount of threads (including
+// the calling thread). threads <= 0 picks the amount of online CPUs:
+struct workerpool *workerpool_create(int threads);
+void workerpool_destroy(struct workerpool *p);
+int workerpool_threadCount(struct workerpool *p);
+
+// The pool everything shares by default, with a thread per online CPU,
+// so the stages of a frame don't compete for the cores with a pool of
+// their own each. Created on first use, NULL if out of memory:
+struct workerpool *workerpool_shared();
+
+// Run func(task, userdata) for every task in 0..tasks-1 spread over all
+// threads of the pool, and return once all tasks are done. Jobs run from
+// several threads at once take turns, so a task must not run a job on the
+// pool it runs on. A NULL pool runs all tasks on the calling thread:
+void workerpool_run(struct workerpool *p, int tasks,
+    void (*func)(int task, void *userdata), void *userdata);
+
+#endif  // _SANDBOX_WORKERPOOL_H_
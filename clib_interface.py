@@ -3,6 +3,11 @@ import copy
 import ctypes
 import os
 
+# Fluid types, as in clib/fluid.h:
+FLUID_WATER = 0
+FLUID_LAVA = 1
+FLUID_MUD = 2
+
 class SandboxInputConfig(object):
     def __init__(self, size_x, size_y, height_shift=0.0, height_scale=1.0):
         self.w = size_x
@@ -118,6 +123,43 @@ class SandboxSimulation(object):
     def set_output_config(self, outputs):
         pass
 
+    def set_screen_size(self, width, height):
+        """ Size of the image simulated and drawn, defaults to 1024x768.
+            Has to be set before the simulation runs.
+        """
+        set_size = self.lib.interface_setScreenSize
+        set_size.argtypes = [ctypes.c_int, ctypes.c_int]
+        set_size.restype = None
+        set_size(width, height)
+
+    def set_world_size(self, width, height):
+        """ Size of the world the screen shows a part of, which may be
+            much larger. Has to be set before the simulation runs, 0
+            means the same as the screen.
+        """
+        set_size = self.lib.interface_setWorldSize
+        set_size.argtypes = [ctypes.c_int, ctypes.c_int]
+        set_size.restype = None
+        set_size(width, height)
+
+    def set_viewport(self, x, y):
+        """ Move the screen to show the world starting at x, y. Clamped
+            so it stays inside the world.
+        """
+        set_viewport = self.lib.interface_setViewport
+        set_viewport.argtypes = [ctypes.c_int, ctypes.c_int]
+        set_viewport.restype = None
+        set_viewport(x, y)
+
+    def get_memory_usage(self):
+        """ Bytes used by the fluid and height maps. Parts of the world
+            that were never in use don't count.
+        """
+        get_usage = self.lib.interface_getMemoryUsage
+        get_usage.argtypes = []
+        get_usage.restype = ctypes.c_size_t
+        return get_usage()
+
     def drag_map(self, x, y):
         interface_mapOffset = self.lib.interface_mapOffset
         interface_mapOffset.argtypes = [ctypes.c_double, ctypes.c_double]
@@ -135,6 +177,206 @@ class SandboxSimulation(object):
         interface_resetWater.restype = None
         interface_resetWater()
 
+    def settle_fluids(self):
+        """ Let all fluid flow to where it comes to rest right away, e.g.
+            to fill up lakes after the sand was reshaped.
+        """
+        settle = self.lib.interface_settleFluids
+        settle.argtypes = []
+        settle.restype = None
+        settle()
+
+    def set_fluid_settle_interval(self, seconds):
+        """ Settle all fluid every given amount of seconds, 0 turns it
+            off (the default).
+        """
+        set_interval = self.lib.interface_setFluidSettleInterval
+        set_interval.argtypes = [ctypes.c_double]
+        set_interval.restype = None
+        set_interval(seconds)
+
+    def set_fluid_engine(self, engine):
+        """ Select the fluid engine: 0 for the legacy random walk,
+            1 for the deterministic double-buffered stencil engine,
+            2 for the shallow-water (virtual pipes) solver.
+        """
+        set_engine = self.lib.interface_setFluidEngine
+        set_engine.argtypes = [ctypes.c_int]
+        set_engine.restype = None
+        set_engine(engine)
+
+    def set_fluid_threads(self, threads):
+        """ Set the amount of threads for the fluid simulation,
+            0 uses all CPUs.
+        """
+        set_threads = self.lib.interface_setFluidThreads
+        set_threads.argtypes = [ctypes.c_int]
+        set_threads.restype = None
+        set_threads(threads)
+
+    def set_fluid_resolution(self, reduce_factor):
+        """ Set the size of a fluid cell in screen pixels, from 2 to 20
+            (default 5). The fluid is resampled to the new grid, keeping
+            its volume.
+        """
+        set_resolution = self.lib.interface_setFluidResolution
+        set_resolution.argtypes = [ctypes.c_double]
+        set_resolution.restype = None
+        set_resolution(reduce_factor)
+
+    def set_fluid_lod(self, enabled):
+        """ Let fluid that has settled update less often, so the time is
+            spent where it is moving. Only used by the stencil engine.
+        """
+        set_lod = self.lib.interface_setFluidLOD
+        set_lod.argtypes = [ctypes.c_int]
+        set_lod.restype = None
+        set_lod(1 if enabled else 0)
+
+    def set_fluid_interpolation(self, enabled):
+        """ Fade the drawn fluid between simulation steps, so it moves
+            smoothly at any frame rate (on by default).
+        """
+        set_interpolation = self.lib.interface_setFluidInterpolation
+        set_interpolation.argtypes = [ctypes.c_int]
+        set_interpolation.restype = None
+        set_interpolation(1 if enabled else 0)
+
+    def set_depth_hole_filling(self, enabled):
+        """ Fill pixels the sensors saw nothing at (depth 0 or 255) from
+            around them, so they don't become pits and peaks (on by
+            default).
+        """
+        set_filling = self.lib.interface_setDepthHoleFilling
+        set_filling.argtypes = [ctypes.c_int]
+        set_filling.restype = None
+        set_filling(1 if enabled else 0)
+
+    def get_depth_valid_mask(self):
+        """ Which pixels of the last depth frame were valid (1) or filled
+            (0), row by row as bytes. Empty with hole filling off.
+        """
+        get_mask = self.lib.interface_getDepthValidMask
+        get_mask.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        get_mask.restype = ctypes.c_int
+        size = get_mask(None, 0)
+        mask = ctypes.create_string_buffer(max(size, 1))
+        size = min(get_mask(mask, size), size)
+        return mask.raw[:size]
+
+    def set_depth_filter(self, median_frames=1, smoothing=0.0,
+            hysteresis=0.0, blur_radius=0):
+        """ Calm down the depth image before the sand is colored from it:
+            median over 1 (off), 3 or 5 frames, averaging over time with
+            smoothing from 0 (off) to below 1, only following changes of
+            more than hysteresis depth steps, and a blur over blur_radius
+            pixels. The smoother, the later changes of the sand show up.
+        """
+        set_median = self.lib.interface_setDepthMedianFrames
+        set_median.argtypes = [ctypes.c_int]
+        set_median.restype = None
+        set_median(median_frames)
+        set_smoothing = self.lib.interface_setDepthSmoothing
+        set_smoothing.argtypes = [ctypes.c_double, ctypes.c_double]
+        set_smoothing.restype = None
+        set_smoothing(smoothing, hysteresis)
+        set_blur = self.lib.interface_setDepthBlur
+        set_blur.argtypes = [ctypes.c_int]
+        set_blur.restype = None
+        set_blur(blur_radius)
+
+    def set_depth_change_threshold(self, threshold):
+        """ Only redraw the sand in tiles of 32 x 32 pixels whose depth
+            changed by more than threshold, summed over the tile. 0 (the
+            default) redraws every change.
+        """
+        set_threshold = self.lib.interface_setDepthChangeThreshold
+        set_threshold.argtypes = [ctypes.c_int]
+        set_threshold.restype = None
+        set_threshold(threshold)
+
+    def set_fluid_properties(self, fluid, viscosity, color, tint):
+        """ Change how a fluid type behaves: viscosity from 0 (flows
+            like water) to 1 (doesn't flow at all), and how much it is
+            tinted towards the (r, g, b) color, from 0 to 1.
+        """
+        set_properties = self.lib.interface_setFluidProperties
+        set_properties.argtypes = [ctypes.c_int, ctypes.c_double,
+            ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_double]
+        set_properties.restype = None
+        set_properties(fluid, viscosity, color[0], color[1], color[2], tint)
+
+    def get_fluid_volume(self, fluid):
+        """ Total amount of the given fluid type in the sandbox. """
+        get_volume = self.lib.interface_getFluidVolume
+        get_volume.argtypes = [ctypes.c_int]
+        get_volume.restype = ctypes.c_double
+        return get_volume(fluid)
+
+    def get_water_volume(self):
+        """ Total amount of water in the sandbox. """
+        get_volume = self.lib.interface_getWaterVolume
+        get_volume.argtypes = []
+        get_volume.restype = ctypes.c_double
+        return get_volume()
+
+    def get_water_coverage(self):
+        """ Share of the sandbox that is covered in water, 0..1. """
+        get_coverage = self.lib.interface_getWaterCoverage
+        get_coverage.argtypes = []
+        get_coverage.restype = ctypes.c_double
+        return get_coverage()
+
+    def get_water_tiles(self):
+        """ Water per tile of the fluid grid. Returns (tiles_x, tiles_y,
+            volumes, wet_cells) with one list entry per tile, row by row.
+        """
+        get_grid = self.lib.interface_getFluidTileGrid
+        get_grid.argtypes = [ctypes.POINTER(ctypes.c_int),
+            ctypes.POINTER(ctypes.c_int)]
+        get_grid.restype = None
+        tiles_x = ctypes.c_int(0)
+        tiles_y = ctypes.c_int(0)
+        get_grid(ctypes.byref(tiles_x), ctypes.byref(tiles_y))
+        count = tiles_x.value * tiles_y.value
+        volumes = (ctypes.c_double * count)()
+        wet_cells = (ctypes.c_int * count)()
+        get_stats = self.lib.interface_getWaterTileStats
+        get_stats.argtypes = [ctypes.POINTER(ctypes.c_double),
+            ctypes.POINTER(ctypes.c_int), ctypes.c_int]
+        get_stats.restype = ctypes.c_int
+        count = get_stats(volumes, wet_cells, count)
+        return (tiles_x.value, tiles_y.value, list(volumes[:count]),
+            list(wet_cells[:count]))
+
+    def set_random_seed(self, seed):
+        """ Seed the random numbers of all simulation threads. The legacy
+            fluid draws per tile and step, so its steps come out the
+            same for the same seed, whatever thread runs them.
+        """
+        set_seed = self.lib.interface_setRandomSeed
+        set_seed.argtypes = [ctypes.c_uint64]
+        set_seed.restype = None
+        set_seed(seed)
+
+    def set_virtual_time(self, enabled):
+        """ In virtual time mode, the simulation doesn't follow the wall
+            clock but only advances through fast_forward().
+        """
+        set_virtual = self.lib.interface_setVirtualTime
+        set_virtual.argtypes = [ctypes.c_int]
+        set_virtual.restype = None
+        set_virtual(1 if enabled else 0)
+
+    def fast_forward(self, seconds):
+        """ Advance virtual time by the given amount of seconds, as fast
+            as the simulation can be computed. Blocks until done.
+        """
+        fast_forward = self.lib.interface_fastForward
+        fast_forward.argtypes = [ctypes.c_double]
+        fast_forward.restype = None
+        fast_forward(seconds)
+
     def set_map_zoom(self, zoom):
         interface_zoom = self.lib.interface_setMapZoom
         interface_zoom.argtypes = [ctypes.c_double]
@@ -153,6 +395,79 @@ class SandboxSimulation(object):
         spawn_water.restype = None
         spawn_water(pos_x, pos_y)
 
+    def add_point_emitter(self, pos_x, pos_y, rate, fluid=FLUID_WATER):
+        """ Continuously add fluid at a screen position, in amount per
+            second. Negative rates drain fluid instead. Returns an id
+            for remove_emitter().
+        """
+        add_emitter = self.lib.interface_addPointEmitter
+        add_emitter.argtypes = [ctypes.c_int, ctypes.c_double,
+            ctypes.c_double, ctypes.c_double]
+        add_emitter.restype = ctypes.c_int
+        return add_emitter(fluid, pos_x, pos_y, rate)
+
+    def add_area_emitter(self, pos_x, pos_y, width, height, rate,
+            fluid=FLUID_WATER):
+        """ Like add_point_emitter(), but for every fluid cell in the
+            given screen rectangle.
+        """
+        add_emitter = self.lib.interface_addAreaEmitter
+        add_emitter.argtypes = [ctypes.c_int, ctypes.c_double,
+            ctypes.c_double, ctypes.c_double, ctypes.c_double,
+            ctypes.c_double]
+        add_emitter.restype = ctypes.c_int
+        return add_emitter(fluid, pos_x, pos_y, width, height, rate)
+
+    def add_height_emitter(self, min_height, rate, fluid=FLUID_WATER):
+        """ Add fluid to every fluid cell where the ground is above
+            min_height (0..1 of the highest possible ground).
+        """
+        add_emitter = self.lib.interface_addHeightEmitter
+        add_emitter.argtypes = [ctypes.c_int, ctypes.c_double,
+            ctypes.c_double]
+        add_emitter.restype = ctypes.c_int
+        return add_emitter(fluid, min_height, rate)
+
+    def remove_emitter(self, emitter_id):
+        remove_emitter = self.lib.interface_removeEmitter
+        remove_emitter.argtypes = [ctypes.c_int]
+        remove_emitter.restype = None
+        remove_emitter(emitter_id)
+
+    def _c_path(self, path):
+        if not isinstance(path, bytes):
+            path = path.encode("utf-8")
+        return path
+
+    def save_snapshot(self, path):
+        """ Save the whole simulation state (fluids, height map, particles,
+            map offset and zoom) to a file. It is taken at the start of
+            the next frame and written in the background.
+        """
+        save = self.lib.interface_saveSnapshot
+        save.argtypes = [ctypes.c_char_p]
+        save.restype = None
+        save(self._c_path(path))
+
+    def load_snapshot(self, path):
+        """ Restore the simulation state from a file written by
+            save_snapshot(), at the start of the next frame. Nothing
+            happens if the file is missing or damaged.
+        """
+        load = self.lib.interface_loadSnapshot
+        load.argtypes = [ctypes.c_char_p]
+        load.restype = None
+        load(self._c_path(path))
+
+    def set_autosave(self, path, interval_seconds):
+        """ Save a snapshot to path every interval_seconds of simulation
+            time, or never if the interval is 0.
+        """
+        autosave = self.lib.interface_setAutosave
+        autosave.argtypes = [ctypes.c_char_p, ctypes.c_double]
+        autosave.restype = None
+        autosave(self._c_path(path), interval_seconds)
+
     def shutdown(self):
         stop = self.lib.interface_stop
         stop.restype = None
@@ -0,0 +1,1446 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <SDL2/SDL.h>
+
+#include "depthfill.h"
+#include "depthfilter.h"
+#include "fluid.h"
+#include "fluidemitter.h"
+#include "fluidpipes.h"
+#include "fluidsettle.h"
+#include "fluidstencil.h"
+#include "images.h"
+#include "random.h"
+#include "simulation.h"
+#include "snapshot.h"
+#include "topology.h"
+#include "topologydrift.h"
+#include "workerpool.h"
+
+// Unit tests of the parts of clib that work without a window. Run with
+// "make check", every failed check is printed and the exit code is 1:
+
+static int unittest_failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "clib_test/unittest.c:%d: %s: check failed: %s\n", \
+            __LINE__, __func__, #condition); \
+        unittest_failures++; \
+    } \
+} while (0)
+
+static unsigned int unittest_seed = 1;
+
+static double unittest_random() {
+    // Own generator, so the maps are the same on every run:
+    unittest_seed = unittest_seed * 1103515245u + 12345u;
+    return (double)((unittest_seed >> 8) & 0xffff) / 65536.0;
+}
+
+static void unittest_sleep(double seconds) {
+    struct timespec t;
+    t.tv_sec = (time_t)seconds;
+    t.tv_nsec = (long)((seconds - t.tv_sec) * 1e9);
+    nanosleep(&t, NULL);
+}
+
+// The world of the tests that need the whole simulation. Its fluid grid
+// is 128 x 96 cells at the default reduce factor of 5, a whole number of
+// tiles:
+#define UNITTEST_WORLD_X 640
+#define UNITTEST_WORLD_Y 480
+#define UNITTEST_MAP_X (UNITTEST_WORLD_X / 5)
+#define UNITTEST_MAP_Y (UNITTEST_WORLD_Y / 5)
+
+static void unittest_initWorld() {
+    // The fluid runs in its own thread from here on:
+    static int initialized = 0;
+    if (initialized)
+        return;
+    if (!images_simulation_image) {
+        images_simulation_image = SDL_CreateRGBSurface(0, UNITTEST_WORLD_X,
+            UNITTEST_WORLD_Y, 32, 0xff000000, 0x00ff0000, 0x0000ff00,
+            0x000000ff);
+    }
+    fluid_init(UNITTEST_WORLD_X, UNITTEST_WORLD_Y);
+    // Without a depth frame all ground is up high, so the emitter added by
+    // fluid_init() would flood everything. The tests add their own:
+    fluidemitter_clear();
+    initialized = 1;
+}
+
+static int unittest_waitForTypeVolume(int type, double min, double max) {
+    // Emitters are applied by the fluid thread, give it a few steps:
+    for (int i = 0; i < 100; i++) {
+        double volume = fluid_getVolume(type);
+        if (volume >= min && volume <= max)
+            return 1;
+        unittest_sleep(0.02);
+    }
+    return 0;
+}
+
+static int unittest_waitForVolume(double min, double max) {
+    return unittest_waitForTypeVolume(FLUID_WATER, min, max);
+}
+
+static int unittest_spawn(int kind, int type, double x, double y, double w,
+        double h, double amount) {
+    // Through a one-shot emitter, waiting for the fluid thread to apply
+    // it. Returns 0 if it didn't:
+    double volume = fluid_getVolume(type);
+    struct fluidemitter e;
+    memset(&e, 0, sizeof(e));
+    e.kind = kind;
+    e.type = type;
+    e.x = x;
+    e.y = y;
+    e.w = w;
+    e.h = h;
+    e.rate = amount;
+    e.once = 1;
+    return (fluidemitter_add(&e) >= 0 &&
+        unittest_waitForTypeVolume(type, volume + 0.5 * amount, 1e9));
+}
+
+static fluid_amount *unittest_copyWater() {
+    // The water rows of a copy of the interleaved map, or NULL if the map
+    // isn't at the default resolution:
+    int map_x = 0, map_y = 0;
+    double reduce_factor = 0;
+    fluid_amount *map = fluid_copyState(&map_x, &map_y, &reduce_factor);
+    if (map && (map_x != UNITTEST_MAP_X || map_y != UNITTEST_MAP_Y)) {
+        free(map);
+        return NULL;
+    }
+    for (int y = 0; map && y < UNITTEST_MAP_Y; y++) {
+        memmove(map + (size_t)y * UNITTEST_MAP_X, map +
+            ((size_t)y * FLUID_COUNT + FLUID_WATER) * UNITTEST_MAP_X,
+            sizeof(fluid_amount) * UNITTEST_MAP_X);
+    }
+    return map;
+}
+
+static double unittest_sum(const fluid_amount *map, size_t count) {
+    double sum = 0;
+    for (size_t i = 0; i < count; i++)
+        sum += map[i];
+    return sum;
+}
+
+static int unittest_isNegative(const fluid_amount *map, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (map[i] < 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void test_stencilVolume() {
+    // Odd sizes, so the rows end in the scalar tail of the SIMD loops.
+    // The map is done in four regions, which read each other as halo:
+    int w = 37, h = 23;
+    size_t cells = (size_t)w * h;
+    fluid_amount *front = malloc(sizeof(fluid_amount) * cells);
+    fluid_amount *back = malloc(sizeof(fluid_amount) * cells);
+    fluid_amount *terrain = malloc(sizeof(fluid_amount) * cells);
+    for (size_t i = 0; i < cells; i++) {
+        terrain[i] = 40.0 * unittest_random();
+        front[i] = (unittest_random() < 0.3 ? 10.0 * unittest_random() : 0);
+    }
+    double viscosity[1] = { 0 };
+    double volume = unittest_sum(front, cells);
+    for (int step = 0; step < 200; step++) {
+        int mid_x = w / 2, mid_y = h / 2;
+        fluidstencil_step(front, back, terrain, w, h, 1, 1, 0,
+            0, 0, mid_x, mid_y, 0.8, viscosity);
+        fluidstencil_step(front, back, terrain, w, h, 1, 1, 0,
+            mid_x, 0, w, mid_y, 0.8, viscosity);
+        fluidstencil_step(front, back, terrain, w, h, 1, 1, 0,
+            0, mid_y, mid_x, h, 0.8, viscosity);
+        fluidstencil_step(front, back, terrain, w, h, 1, 1, 0,
+            mid_x, mid_y, w, h, 0.8, viscosity);
+        fluid_amount *swap = front;
+        front = back;
+        back = swap;
+    }
+    CHECK(fabs(unittest_sum(front, cells) - volume) < 1e-4 * volume);
+    CHECK(!unittest_isNegative(front, cells));
+
+    // Walls between the regions keep the fluid on each side:
+    int mid_x = w / 2;
+    double left = 0;
+    for (int y = 0; y < h; y++)
+        left += unittest_sum(front + (size_t)y * w, mid_x);
+    volume = unittest_sum(front, cells);
+    for (int step = 0; step < 50; step++) {
+        fluidstencil_step(front, back, terrain, w, h, 1, 1,
+            FLUIDSTENCIL_WALL_RIGHT, 0, 0, mid_x, h, 0.8, viscosity);
+        fluidstencil_step(front, back, terrain, w, h, 1, 1,
+            FLUIDSTENCIL_WALL_LEFT, mid_x, 0, w, h, 0.8, viscosity);
+        fluid_amount *swap = front;
+        front = back;
+        back = swap;
+    }
+    double left_after = 0;
+    for (int y = 0; y < h; y++)
+        left_after += unittest_sum(front + (size_t)y * w, mid_x);
+    CHECK(fabs(left_after - left) < 1e-4 * volume);
+    CHECK(fabs(unittest_sum(front, cells) - volume) < 1e-4 * volume);
+    free(front);
+    free(back);
+    free(terrain);
+}
+
+static void test_pipesVolume() {
+    // A dam break over uneven ground, in two regions that exchange fluid
+    // through the fluxes at their border:
+    int w = 41, h = 19;
+    size_t cells = (size_t)w * h;
+    fluid_amount *depth = calloc(cells, sizeof(fluid_amount));
+    fluid_amount *terrain = malloc(sizeof(fluid_amount) * cells);
+    fluid_amount *flux = calloc(4 * cells, sizeof(fluid_amount));
+    fluid_amount *vx = calloc(cells, sizeof(fluid_amount));
+    fluid_amount *vy = calloc(cells, sizeof(fluid_amount));
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            terrain[x + y * w] = 2.0 * unittest_random() + 0.1 * x;
+            if (x < 10)
+                depth[x + y * w] = 8.0;
+        }
+    }
+    double viscosity[1] = { 0 };
+    double volume = unittest_sum(depth, cells);
+    double max_speed = 0;
+    int mid_y = h / 2;
+    for (int step = 0; step < 100; step++) {
+        double max_depth = 0;
+        for (size_t i = 0; i < cells; i++) {
+            if (depth[i] > max_depth)
+                max_depth = depth[i];
+        }
+        double dt = 0;
+        int substeps = fluidpipes_substeps(max_depth, max_speed, &dt);
+        CHECK(substeps >= 1 && dt > 0);
+        for (int s = 0; s < substeps; s++) {
+            fluidpipes_updateFlux(depth, terrain, flux, w, h, 1, 1,
+                0, 0, w, mid_y, dt, viscosity);
+            fluidpipes_updateFlux(depth, terrain, flux, w, h, 1, 1,
+                0, mid_y, w, h, dt, viscosity);
+            double speed_top = 0, speed_bottom = 0;
+            fluidpipes_updateDepth(depth, flux, vx, vy, w, h, 1, 1,
+                0, 0, w, mid_y, dt, &speed_top);
+            fluidpipes_updateDepth(depth, flux, vx, vy, w, h, 1, 1,
+                0, mid_y, w, h, dt, &speed_bottom);
+            max_speed = fmax(speed_top, speed_bottom);
+        }
+    }
+    CHECK(fabs(unittest_sum(depth, cells) - volume) < 1e-4 * volume);
+    CHECK(!unittest_isNegative(depth, cells));
+    // It did flow, across the border of the regions too:
+    CHECK(depth[w * 3 / 4 + mid_y * w] > 0);
+    CHECK(depth[w * 3 / 4 + (mid_y - 1) * w] > 0);
+    free(depth);
+    free(terrain);
+    free(flux);
+    free(vx);
+    free(vy);
+}
+
+static double unittest_typeSum(const fluid_amount *map, int w, int h,
+        int types, int type) {
+    double sum = 0;
+    for (int y = 0; y < h; y++)
+        sum += unittest_sum(map + ((size_t)y * types + type) * w, w);
+    return sum;
+}
+
+static void test_multiFluidVolume() {
+    // Three fluids of different viscosity interleaved by row, the last one
+    // only in the left half. Each keeps its own volume in both engines:
+    int w = 29, h = 17, types = 3;
+    size_t cells = (size_t)w * h;
+    size_t size = cells * types;
+    fluid_amount *front = calloc(size, sizeof(fluid_amount));
+    fluid_amount *back = calloc(size, sizeof(fluid_amount));
+    fluid_amount *terrain = malloc(sizeof(fluid_amount) * cells);
+    fluid_amount *flux = calloc(4 * size, sizeof(fluid_amount));
+    fluid_amount *vx = calloc(size, sizeof(fluid_amount));
+    fluid_amount *vy = calloc(size, sizeof(fluid_amount));
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            terrain[x + y * w] = 20.0 * unittest_random();
+            for (int k = 0; k < types; k++) {
+                if (k == 2 && x >= w / 2)
+                    continue;
+                front[((size_t)y * types + k) * w + x] =
+                    5.0 * unittest_random();
+            }
+        }
+    }
+    double viscosity[3] = { 0, 0.5, 0.9 };
+    double volumes[3];
+    for (int k = 0; k < types; k++)
+        volumes[k] = unittest_typeSum(front, w, h, types, k);
+    memcpy(back, front, sizeof(fluid_amount) * size);
+
+    for (int step = 0; step < 100; step++) {
+        fluidstencil_step(front, back, terrain, w, h, types, 7, 0,
+            0, 0, w, h, 0.8 / 3, viscosity);
+        fluid_amount *swap = front;
+        front = back;
+        back = swap;
+    }
+    for (int k = 0; k < types; k++) {
+        CHECK(fabs(unittest_typeSum(front, w, h, types, k) - volumes[k]) <
+            1e-4 * volumes[k]);
+    }
+    CHECK(!unittest_isNegative(front, size));
+
+    double max_speed = 0;
+    for (int step = 0; step < 50; step++) {
+        double max_depth = 0;
+        for (size_t i = 0; i < size; i++) {
+            if (front[i] > max_depth)
+                max_depth = front[i];
+        }
+        double dt = 0;
+        int substeps = fluidpipes_substeps(max_depth, max_speed, &dt);
+        for (int s = 0; s < substeps; s++) {
+            fluidpipes_updateFlux(front, terrain, flux, w, h, types, 7,
+                0, 0, w, h, dt, viscosity);
+            fluidpipes_updateDepth(front, flux, vx, vy, w, h, types, 7,
+                0, 0, w, h, dt, &max_speed);
+        }
+    }
+    for (int k = 0; k < types; k++) {
+        CHECK(fabs(unittest_typeSum(front, w, h, types, k) - volumes[k]) <
+            1e-4 * volumes[k]);
+    }
+    CHECK(!unittest_isNegative(front, size));
+    free(front);
+    free(back);
+    free(terrain);
+    free(flux);
+    free(vx);
+    free(vy);
+}
+
+static void test_settleVolume() {
+    // Random ground has many basins and spills between them:
+    int w = 45, h = 31, types = 3;
+    size_t cells = (size_t)w * h;
+    fluid_amount *terrain = malloc(sizeof(fluid_amount) * cells);
+    fluid_amount *depth = calloc(cells * types, sizeof(fluid_amount));
+    for (size_t i = 0; i < cells; i++)
+        terrain[i] = 30.0 * unittest_random();
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            fluid_amount *row = depth + (size_t)y * types * w;
+            row[FLUID_WATER * w + x] = 3.0 * unittest_random();
+            row[FLUID_LAVA * w + x] = 1.0;
+        }
+    }
+    double volume = unittest_typeSum(depth, w, h, types, FLUID_WATER);
+    double lava = unittest_typeSum(depth, w, h, types, FLUID_LAVA);
+    struct fluidsettle *settle = fluidsettle_create(w, h);
+    CHECK(settle != NULL);
+    if (!settle) {
+        free(terrain);
+        free(depth);
+        return;
+    }
+    fluidsettle_run(settle, terrain, depth, types, FLUID_WATER);
+    CHECK(fabs(unittest_typeSum(depth, w, h, types, FLUID_WATER) - volume) <
+        1e-4 * volume);
+    CHECK(unittest_typeSum(depth, w, h, types, FLUID_LAVA) == lava);
+    CHECK(!unittest_isNegative(depth, cells * types));
+
+    // Again after part of the ground changed, into a bowl that holds all
+    // of the water. Its surface has to come out level:
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            double dx = x - w / 2.0, dy = y - h / 2.0;
+            terrain[x + y * w] = 0.05 * (dx * dx + dy * dy);
+        }
+    }
+    fluidsettle_invalidate(settle, 0, 0, w, h);
+    fluidsettle_run(settle, terrain, depth, types, FLUID_WATER);
+    CHECK(fabs(unittest_typeSum(depth, w, h, types, FLUID_WATER) - volume) <
+        1e-4 * volume);
+    CHECK(!unittest_isNegative(depth, cells * types));
+    double lowest = 1e9, highest = -1e9;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            fluid_amount amount = depth[((size_t)y * types + FLUID_WATER) *
+                w + x];
+            if (amount <= 0)
+                continue;
+            double surface = terrain[x + y * w] + amount;
+            lowest = fmin(lowest, surface);
+            highest = fmax(highest, surface);
+        }
+    }
+    CHECK(highest - lowest < 1e-3 * (1.0 + highest));
+    fluidsettle_destroy(settle);
+    free(terrain);
+    free(depth);
+}
+
+static void test_skipDryTiles() {
+    // Only tiles with fluid and the ring around them are stepped. Water
+    // spreading from the corner of four tiles has to come out as if the
+    // whole map was stepped, save for the traces below
+    // FLUID_TILE_MIN_AMOUNT that are dropped from tiles running dry:
+    unittest_initWorld();
+    fluid_setEngine(FLUID_ENGINE_STENCIL);
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+    int start = 31 + 31 * UNITTEST_MAP_X;
+    CHECK(unittest_spawn(FLUIDEMITTER_POINT, FLUID_WATER, 31 * 5 + 2,
+        31 * 5 + 2, 0, 0, 1000));
+    unittest_sleep(2.0);
+
+    size_t cells = (size_t)UNITTEST_MAP_X * UNITTEST_MAP_Y;
+    fluid_amount *map = unittest_copyWater();
+    CHECK(map != NULL);
+    if (!map)
+        return;
+    CHECK(map[start + 1 + UNITTEST_MAP_X] > 0.01);
+    CHECK(fabs(unittest_sum(map, cells) - 1000) < 1.0);
+
+    // The fluid thread went through an unknown number of steps, so find
+    // the step of the full map that matches best:
+    fluid_amount *front = calloc(cells, sizeof(fluid_amount));
+    fluid_amount *back = calloc(cells, sizeof(fluid_amount));
+    fluid_amount *terrain = calloc(cells, sizeof(fluid_amount));
+    front[start] = 1000;
+    double viscosity[1] = { 0 };
+    double best = 1e9;
+    int best_step = 0;
+    for (int step = 1; step <= 300; step++) {
+        fluidstencil_step(front, back, terrain, UNITTEST_MAP_X,
+            UNITTEST_MAP_Y, 1, 1, 0, 0, 0, UNITTEST_MAP_X, UNITTEST_MAP_Y,
+            0.8, viscosity);
+        fluid_amount *swap = front;
+        front = back;
+        back = swap;
+        double difference = 0;
+        for (size_t i = 0; i < cells; i++)
+            difference = fmax(difference, fabs(front[i] - map[i]));
+        if (difference < best) {
+            best = difference;
+            best_step = step;
+        }
+    }
+    CHECK(best_step > 1 && best_step < 300);
+    CHECK(best < 2e-3);
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+    free(map);
+    free(front);
+    free(back);
+    free(terrain);
+}
+
+static int unittest_compareTileStats() {
+    // Tile totals against a scan of a copy of the map. The fluid thread
+    // may step in between, so the totals are taken before and after the
+    // copy and it is tried again if they differ. Returns the number of
+    // tiles that don't match:
+    int tiles_x, tiles_y;
+    fluid_getTileGrid(&tiles_x, &tiles_y);
+    int count = tiles_x * tiles_y;
+    double *volumes = malloc(sizeof(double) * 3 * count);
+    int *wet = malloc(sizeof(int) * 3 * count);
+    fluid_amount *map = NULL;
+    for (int attempt = 0; attempt < 50 && !map; attempt++) {
+        fluid_getTileStats(FLUID_WATER, volumes, wet, count);
+        map = unittest_copyWater();
+        fluid_getTileStats(FLUID_WATER, volumes + count, wet + count, count);
+        if (memcmp(volumes, volumes + count, sizeof(double) * count) != 0 ||
+                memcmp(wet, wet + count, sizeof(int) * count) != 0) {
+            free(map);
+            map = NULL;
+        }
+    }
+    if (!map) {
+        free(volumes);
+        free(wet);
+        return -1;
+    }
+    double *scan_volumes = volumes + 2 * count;
+    int *scan_wet = wet + 2 * count;
+    memset(scan_volumes, 0, sizeof(double) * count);
+    memset(scan_wet, 0, sizeof(int) * count);
+    int tile_size = UNITTEST_MAP_X / tiles_x;
+    for (int y = 0; y < UNITTEST_MAP_Y; y++) {
+        for (int x = 0; x < UNITTEST_MAP_X; x++) {
+            fluid_amount amount = map[x + y * UNITTEST_MAP_X];
+            int tile = x / tile_size + (y / tile_size) * tiles_x;
+            scan_volumes[tile] += amount;
+            // A cell counts as wet from an amount of 1:
+            scan_wet[tile] += (amount >= 1.0);
+        }
+    }
+    int mismatches = 0;
+    for (int tile = 0; tile < count; tile++) {
+        if (fabs(volumes[tile] - scan_volumes[tile]) >
+                1e-5 * (1.0 + scan_volumes[tile]) ||
+                wet[tile] != scan_wet[tile])
+            mismatches++;
+    }
+    free(map);
+    free(volumes);
+    free(wet);
+    return mismatches;
+}
+
+static void test_tileStats() {
+    // On every engine, right after spawning across tile borders and after
+    // the water flowed for a few steps:
+    unittest_initWorld();
+    int engines[3] = { FLUID_ENGINE_LEGACY, FLUID_ENGINE_STENCIL,
+        FLUID_ENGINE_PIPES };
+    for (int e = 0; e < 3; e++) {
+        fluid_setEngine(engines[e]);
+        fluid_resetAll();
+        CHECK(unittest_waitForVolume(0, 0));
+        CHECK(unittest_spawn(FLUIDEMITTER_AREA, FLUID_WATER,
+            100, 100, 150, 100, 3.0));
+        CHECK(unittest_spawn(FLUIDEMITTER_AREA, FLUID_WATER,
+            300, 140, 40, 40, 8.0));
+        CHECK(unittest_compareTileStats() == 0);
+        unittest_sleep(0.5);
+        CHECK(unittest_compareTileStats() == 0);
+    }
+
+    // Spawned by one-shot emitters, and while part of it drains away
+    // through a sink:
+    fluid_setEngine(FLUID_ENGINE_STENCIL);
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+    struct fluidemitter e;
+    memset(&e, 0, sizeof(e));
+    e.kind = FLUIDEMITTER_AREA;
+    e.type = FLUID_WATER;
+    e.x = 100;
+    e.y = 100;
+    e.w = 150;
+    e.h = 100;
+    e.rate = 3.0;
+    e.once = 1;
+    CHECK(fluidemitter_add(&e) >= 0);
+    CHECK(unittest_waitForVolume(1, 1e9));
+    CHECK(unittest_compareTileStats() == 0);
+    double volume = fluid_getVolume(FLUID_WATER);
+    e.x = 80;
+    e.y = 80;
+    e.w = 120;
+    e.h = 200;
+    e.rate = -20.0;
+    e.once = 0;
+    int drain = fluidemitter_add(&e);
+    CHECK(drain >= 0);
+    unittest_sleep(0.5);
+    CHECK(unittest_compareTileStats() == 0);
+    fluidemitter_remove(drain);
+    CHECK(fluid_getVolume(FLUID_WATER) < volume);
+
+    // Once more than 40% of the map is wet, the fullest tiles drain after
+    // each update, which doesn't go through the next step before the
+    // totals can be seen:
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+    CHECK(unittest_spawn(FLUIDEMITTER_AREA, FLUID_WATER, 0, 0,
+        UNITTEST_WORLD_X, UNITTEST_WORLD_Y * 0.6, 2.0));
+    unittest_sleep(0.1);
+    volume = fluid_getVolume(FLUID_WATER);
+    CHECK(fluid_getCoverage(FLUID_WATER) > 0.4);
+    for (int i = 0; i < 10; i++) {
+        unittest_sleep(0.1);
+        CHECK(unittest_compareTileStats() == 0);
+    }
+    CHECK(fluid_getVolume(FLUID_WATER) < volume);
+
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+    CHECK(unittest_compareTileStats() == 0);
+
+    // Types that aren't a fluid have no totals:
+    CHECK(fluid_getVolume(-1) == 0 && fluid_getVolume(FLUID_COUNT) == 0);
+    CHECK(fluid_getCoverage(FLUID_COUNT) == 0);
+}
+
+static int unittest_sameVolume(double volume, double expected) {
+    return fabs(volume - expected) < 1e-4 * expected;
+}
+
+static void test_resolutionVolume() {
+    // Water and lava keep their volume while the grid is resampled to
+    // coarser and finer cells and back, on both grid engines:
+    unittest_initWorld();
+    int engines[2] = { FLUID_ENGINE_STENCIL, FLUID_ENGINE_PIPES };
+    double factors[3] = { 8.0, 3.0, FLUID_DEFAULT_REDUCE_FACTOR };
+    for (int e = 0; e < 2; e++) {
+        fluid_setEngine(engines[e]);
+        fluid_resetAll();
+        CHECK(unittest_waitForVolume(0, 0));
+        CHECK(unittest_spawn(FLUIDEMITTER_AREA, FLUID_WATER,
+            100, 100, 150, 100, 3.0));
+        CHECK(unittest_spawn(FLUIDEMITTER_POINT, FLUID_LAVA,
+            401, 203, 0, 0, 500));
+        unittest_sleep(0.2);
+        double water = fluid_getVolume(FLUID_WATER);
+        double lava = fluid_getVolume(FLUID_LAVA);
+        CHECK(water > 0 && lava > 0);
+        for (int i = 0; i < 3; i++) {
+            fluid_setResolution(factors[i]);
+            CHECK(fluid_getResolution() == factors[i]);
+            CHECK(unittest_sameVolume(fluid_getVolume(FLUID_WATER), water));
+            CHECK(unittest_sameVolume(fluid_getVolume(FLUID_LAVA), lava));
+            // And while it flows on at the new resolution:
+            unittest_sleep(0.2);
+            CHECK(unittest_sameVolume(fluid_getVolume(FLUID_WATER), water));
+            CHECK(unittest_sameVolume(fluid_getVolume(FLUID_LAVA), lava));
+        }
+        // Back at the default grid, the tile totals are still right:
+        CHECK(unittest_compareTileStats() == 0);
+    }
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+}
+
+static int unittest_pixelSet(int x, int y) {
+    const uint8_t *pixel = (const uint8_t *)images_simulation_image->pixels +
+        y * images_simulation_image->pitch + 4 * x;
+    return (pixel[0] | pixel[1] | pixel[2] | pixel[3]) != 0;
+}
+
+static void unittest_drawFluid() {
+    // Onto a cleared image, with the fluid thread going on meanwhile:
+    memset(images_simulation_image->pixels, 0,
+        (size_t)images_simulation_image->pitch * UNITTEST_WORLD_Y);
+    simulation_lockSurface();
+    fluid_drawAll(UNITTEST_WORLD_X, UNITTEST_WORLD_Y);
+    simulation_unlockSurface();
+}
+
+static void test_frameHandoff() {
+    // Drawing picks up the frames the fluid thread hands over while it
+    // keeps stepping and changes its resolution, and always finds the
+    // fluid where a finished step had it:
+    unittest_initWorld();
+    if (!water) {
+        water = SDL_CreateRGBSurface(0, 64, 64, 32, 0xff000000, 0x00ff0000,
+            0x0000ff00, 0x000000ff);
+        memset(water->pixels, 0x80, (size_t)water->pitch * water->h);
+    }
+    fluid_setEngine(FLUID_ENGINE_STENCIL);
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+    CHECK(unittest_spawn(FLUIDEMITTER_AREA, FLUID_WATER,
+        200, 160, 120, 80, 5.0));
+    int drawn = 0, stray = 0;
+    for (int i = 0; i < 40; i++) {
+        if (i == 20)
+            fluid_setResolution(8.0);
+        unittest_drawFluid();
+        drawn += unittest_pixelSet(260, 200);
+        stray += unittest_pixelSet(600, 440);
+        unittest_sleep(0.01);
+    }
+    fluid_setResolution(FLUID_DEFAULT_REDUCE_FACTOR);
+    CHECK(drawn == 40);
+    CHECK(stray == 0);
+
+    // The frames after a reset have nothing left to draw:
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+    unittest_sleep(0.2);
+    unittest_drawFluid();
+    CHECK(!unittest_pixelSet(260, 200));
+}
+
+// Layout of a snapshot file holding a fluid section only, see snapshot.c:
+struct unittest_snapshotfile {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t section_count;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t checksum;
+    struct {
+        uint32_t id;
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t size;
+    } sections[16];
+    int32_t map_x, map_y;
+    int32_t types;
+    int32_t amount_size;
+    double reduce_factor;
+};
+
+static int unittest_writeFile(const char *path, const void *data,
+        size_t size) {
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return 0;
+    int ok = (fwrite(data, 1, size, f) == size);
+    if (fclose(f) != 0)
+        ok = 0;
+    return ok;
+}
+
+static void *unittest_readFile(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    void *data = malloc(*size);
+    if (data && fread(data, 1, *size, f) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static int unittest_writeOtherPrecision(const char *path, int map_x,
+        int map_y, double amount) {
+    // A snapshot of only fluid, with water of the given amount in the top
+    // left quarter, stored with the precision this build doesn't use:
+    int other_size = (sizeof(fluid_amount) == sizeof(float) ?
+        sizeof(double) : sizeof(float));
+    size_t count = (size_t)FLUID_COUNT * map_x * map_y;
+    size_t header_size = sizeof(struct unittest_snapshotfile);
+    size_t size = header_size + ((other_size * count + 7) & ~(size_t)7);
+    uint8_t *data = calloc(1, size);
+    if (!data)
+        return 0;
+    struct unittest_snapshotfile *file = (struct unittest_snapshotfile *)data;
+    memcpy(file->magic, "SBOXSNAP", 8);
+    file->version = SNAPSHOT_VERSION;
+    file->byte_order = 0x01020304u;
+    file->section_count = 1;
+    file->file_size = size;
+    file->sections[0].id = 1;
+    file->sections[0].offset = offsetof(struct unittest_snapshotfile, map_x);
+    file->sections[0].size = size - file->sections[0].offset;
+    file->map_x = map_x;
+    file->map_y = map_y;
+    file->types = FLUID_COUNT;
+    file->amount_size = other_size;
+    file->reduce_factor = FLUID_DEFAULT_REDUCE_FACTOR;
+    for (int y = 0; y < map_y / 2; y++) {
+        for (int x = 0; x < map_x / 2; x++) {
+            size_t i = ((size_t)y * FLUID_COUNT + FLUID_WATER) * map_x + x;
+            if (other_size == sizeof(double))
+                ((double *)(data + header_size))[i] = amount;
+            else
+                ((float *)(data + header_size))[i] = amount;
+        }
+    }
+    // FNV-1a over the 64 bit words after the fixed part of the header:
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = offsetof(struct unittest_snapshotfile, sections);
+            i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    file->checksum = hash;
+    int ok = unittest_writeFile(path, data, size);
+    free(data);
+    return ok;
+}
+
+static void test_snapshot() {
+    unittest_initWorld();
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+    struct fluidemitter e;
+    memset(&e, 0, sizeof(e));
+    e.kind = FLUIDEMITTER_AREA;
+    e.type = FLUID_WATER;
+    e.x = 200;
+    e.y = 150;
+    e.w = 100;
+    e.h = 80;
+    e.rate = 4.0;
+    e.once = 1;
+    CHECK(fluidemitter_add(&e) >= 0);
+    CHECK(unittest_waitForVolume(1, 1e9));
+    double volume = fluid_getVolume(FLUID_WATER);
+
+    // Round trip:
+    const char *path = "/tmp/clib_unittest.snapshot";
+    CHECK(snapshot_save(path));
+    while (snapshot_isSaving())
+        unittest_sleep(0.01);
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+    CHECK(snapshot_restore(path));
+    CHECK(fabs(fluid_getVolume(FLUID_WATER) - volume) < 1e-4 * volume);
+
+    // Damaged files are turned down and leave the fluid as it is:
+    size_t size = 0;
+    uint8_t *data = unittest_readFile(path, &size);
+    CHECK(data != NULL && size > 64);
+    if (data && size > 64) {
+        const char *damaged = "/tmp/clib_unittest_damaged.snapshot";
+        data[size / 2] ^= 0x10;
+        CHECK(unittest_writeFile(damaged, data, size));
+        CHECK(!snapshot_restore(damaged));
+        data[size / 2] ^= 0x10;
+        CHECK(unittest_writeFile(damaged, data, size - 8));
+        CHECK(!snapshot_restore(damaged));
+        CHECK(fabs(fluid_getVolume(FLUID_WATER) - volume) < 1e-4 * volume);
+        remove(damaged);
+    }
+    free(data);
+    CHECK(!snapshot_restore("/tmp/clib_unittest_missing.snapshot"));
+
+    // Saved by a build with the other precision:
+    int map_x = UNITTEST_WORLD_X / FLUID_DEFAULT_REDUCE_FACTOR;
+    int map_y = UNITTEST_WORLD_Y / FLUID_DEFAULT_REDUCE_FACTOR;
+    CHECK(unittest_writeOtherPrecision(path, map_x, map_y, 1.5));
+    CHECK(snapshot_restore(path));
+    volume = 1.5 * (map_x / 2) * (map_y / 2);
+    CHECK(fabs(fluid_getVolume(FLUID_WATER) - volume) < 1e-4 * volume);
+    remove(path);
+
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+}
+
+static void unittest_countTask(int task, void *userdata) {
+    __atomic_add_fetch(&((int *)userdata)[task], 1, __ATOMIC_RELAXED);
+}
+
+static void test_workerPool() {
+    // Every task runs exactly once, on the shared pool, on a pool of its
+    // own and on the calling thread without a pool:
+    struct workerpool *own = workerpool_create(3);
+    CHECK(own != NULL);
+    CHECK(workerpool_threadCount(NULL) == 1);
+    struct workerpool *pools[3] = { workerpool_shared(), own, NULL };
+    for (int p = 0; p < 3; p++) {
+        int counts[100] = { 0 };
+        workerpool_run(pools[p], 100, unittest_countTask, counts);
+        int wrong = 0;
+        for (int i = 0; i < 100; i++)
+            wrong += (counts[i] != 1);
+        CHECK(wrong == 0);
+    }
+    workerpool_destroy(own);
+}
+
+static void unittest_drawTask(int task, void *userdata) {
+    uint64_t *numbers = userdata;
+    random_seedStream(task);
+    for (int i = 0; i < 4; i++)
+        numbers[task * 4 + i] = random_next();
+}
+
+static void test_randomStreams() {
+    // Tasks picking their stream draw the same numbers on any thread, and
+    // the same seed gives the same numbers again:
+    uint64_t pooled[64 * 4], serial[64 * 4], again[64 * 4];
+    random_seed(42);
+    uint64_t first = random_next();
+    workerpool_run(workerpool_shared(), 64, unittest_drawTask, pooled);
+    workerpool_run(NULL, 64, unittest_drawTask, serial);
+    CHECK(memcmp(pooled, serial, sizeof(pooled)) == 0);
+    CHECK(pooled[0] != pooled[4] && pooled[0] != pooled[1]);
+    random_seed(42);
+    CHECK(random_next() == first);
+    random_seed(43);
+    workerpool_run(NULL, 64, unittest_drawTask, again);
+    CHECK(memcmp(pooled, again, sizeof(pooled)) != 0);
+}
+
+static void unittest_initTopology() {
+    // The maps cover the whole world, drawing needs a colour gradient:
+    topology_init(UNITTEST_WORLD_X, UNITTEST_WORLD_Y);
+    if (!raw_gradient_data) {
+        gradient_x = 256;
+        gradient_y = 20;
+        raw_gradient_data = calloc(3 * gradient_x * gradient_y, 1);
+    }
+}
+
+static void unittest_drawFlat(int depth, int screen_x, int screen_y) {
+    // Draw a depth frame of screen_x * screen_y pixels all at the same
+    // depth, at the top left of the world:
+    unittest_initTopology();
+    uint8_t *frame = malloc(screen_x * screen_y);
+    memset(frame, depth, screen_x * screen_y);
+    simulation_setViewport(0, 0);
+    simulation_lockSurface();
+    topology_drawToSimImage(frame, screen_x, screen_y);
+    simulation_unlockSurface();
+    free(frame);
+}
+
+static int unittest_outsideDry(const fluid_amount *map, int seen_x,
+        int seen_y) {
+    // Whether all cells outside of the first seen_x * seen_y are dry:
+    for (int y = 0; y < UNITTEST_MAP_Y; y++) {
+        for (int x = 0; x < UNITTEST_MAP_X; x++) {
+            if ((x >= seen_x || y >= seen_y) &&
+                    map[x + y * UNITTEST_MAP_X] != 0)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static void test_unseenWalls() {
+    // Only the top left quarter of the world is ever on screen. The rest
+    // is a wall to the fluid and the drift, and emitters skip it:
+    int screen_x = UNITTEST_WORLD_X / 2, screen_y = UNITTEST_WORLD_Y / 2;
+    unittest_initWorld();
+    unittest_drawFlat(150, screen_x, screen_y);
+
+    CHECK(topology_heightAt(100, 100) < TOPOLOGY_WALL_HEIGHT);
+    CHECK(topology_heightAt(screen_x, 100) == TOPOLOGY_WALL_HEIGHT);
+    CHECK(topology_heightAt(100, screen_y) == TOPOLOGY_WALL_HEIGHT);
+    // Flat ground next to a wall has no drift, just like at the border:
+    int points[][2] = { { screen_x - 4, 100 }, { 100, screen_y - 4 },
+        { screen_x + 20, 300 }, { 2, 2 } };
+    for (int i = 0; i < 4; i++) {
+        double vx = 1, vy = 1;
+        topology_calculate_drift(points[i][0], points[i][1], &vx, &vy);
+        CHECK(vx == 0 && vy == 0);
+    }
+
+    fluid_setEngine(FLUID_ENGINE_STENCIL);
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+    // A height emitter covering the whole map only fills the seen cells:
+    int seen_x = screen_x / 5, seen_y = screen_y / 5;
+    struct fluidemitter e;
+    memset(&e, 0, sizeof(e));
+    e.kind = FLUIDEMITTER_HEIGHT;
+    e.type = FLUID_WATER;
+    e.min_height = 0.5;
+    e.rate = 1;
+    e.once = 1;
+    CHECK(fluidemitter_add(&e) >= 0);
+    CHECK(unittest_waitForVolume(seen_x * seen_y - 1, seen_x * seen_y + 1));
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+
+    // Water poured against the walls stays in front of them, whichever
+    // engine moves it:
+    CHECK(unittest_spawn(FLUIDEMITTER_POINT, FLUID_WATER, screen_x - 3,
+        screen_y - 3, 0, 0, 500));
+    int engines[3] = { FLUID_ENGINE_STENCIL, FLUID_ENGINE_PIPES,
+        FLUID_ENGINE_LEGACY };
+    for (int i = 0; i < 3; i++) {
+        fluid_setEngine(engines[i]);
+        unittest_sleep(1.0);
+        fluid_amount *map = unittest_copyWater();
+        CHECK(map != NULL);
+        if (!map)
+            break;
+        size_t cells = (size_t)UNITTEST_MAP_X * UNITTEST_MAP_Y;
+        CHECK(unittest_sum(map, cells) > 400);
+        CHECK(map[seen_x - 2 + (seen_y - 1) * UNITTEST_MAP_X] > 0);
+        CHECK(unittest_outsideDry(map, seen_x, seen_y));
+        free(map);
+    }
+    fluid_setEngine(FLUID_ENGINE_STENCIL);
+    fluid_resetAll();
+    CHECK(unittest_waitForVolume(0, 0));
+}
+
+static double unittest_driftAt(const double *heights, int w,
+        const int seen[4], int x, int y, int axis) {
+    // What the drift field is meant to be, straight from its definition:
+    // the gradient of the heights box filtered over 15x15 pixels, with the
+    // edges of the seen part repeating past them like the border:
+    const int r = TOPOLOGYDRIFT_BLUR_RADIUS, dist = TOPOLOGYDRIFT_DISTANCE;
+    double box[2];
+    int lo = (axis == 0 ? seen[0] : seen[1]);
+    int hi = (axis == 0 ? seen[2] : seen[3]) - 1;
+    int at = (axis == 0 ? x : y);
+    int ends[2] = { at - dist, at + dist };
+    for (int k = 0; k < 2; k++) {
+        ends[k] = (ends[k] < lo ? lo : (ends[k] > hi ? hi : ends[k]));
+        int cx = (axis == 0 ? ends[k] : x);
+        int cy = (axis == 0 ? y : ends[k]);
+        double sum = 0;
+        for (int j = -r; j <= r; j++) {
+            for (int i = -r; i <= r; i++) {
+                int px = cx + i, py = cy + j;
+                px = (px < seen[0] ? seen[0] : (px >= seen[2] ?
+                    seen[2] - 1 : px));
+                py = (py < seen[1] ? seen[1] : (py >= seen[3] ?
+                    seen[3] - 1 : py));
+                sum += heights[px + py * w];
+            }
+        }
+        box[k] = sum / ((2 * r + 1) * (2 * r + 1));
+    }
+    if (ends[1] <= ends[0])
+        return 0;
+    double drift = -TOPOLOGYDRIFT_SCALE * (box[1] - box[0]) /
+        (ends[1] - ends[0]);
+    return fmax(-TOPOLOGYDRIFT_MAX, fmin(TOPOLOGYDRIFT_MAX, drift));
+}
+
+static double unittest_driftError(const struct topologydrift *d,
+        const double *heights, int w, int h, const int seen[4]) {
+    // Largest difference of the field to unittest_driftAt(), and nothing
+    // at all may drift outside of the seen part:
+    float *drift_x = calloc((size_t)w * h, sizeof(float));
+    float *drift_y = calloc((size_t)w * h, sizeof(float));
+    topologydrift_copyRegion(d, drift_x, drift_y, 0, 0, w, h);
+    double error = 0;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            double vx = drift_x[x + y * w], vy = drift_y[x + y * w];
+            if (x < seen[0] || x >= seen[2] || y < seen[1] || y >= seen[3]) {
+                if (vx != 0 || vy != 0)
+                    error = 1e9;
+                continue;
+            }
+            error = fmax(error, fabs(vx -
+                unittest_driftAt(heights, w, seen, x, y, 0)));
+            error = fmax(error, fabs(vy -
+                unittest_driftAt(heights, w, seen, x, y, 1)));
+        }
+    }
+    free(drift_x);
+    free(drift_y);
+    return error;
+}
+
+static void test_driftField() {
+    // The field computed in bulk against the direct gradient, on hills
+    // with noise like from the sensor, after the whole map is computed,
+    // after a local change and with only part of the map seen:
+    int w = 203, h = 151;
+    double *heights = malloc(sizeof(double) * w * h);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            heights[x + y * w] = floor(120 + 60 * sin(x / 17.0) +
+                50 * cos(y / 11.0) + 4 * unittest_random());
+        }
+    }
+    struct topologydrift *d = topologydrift_create(w, h,
+        workerpool_shared());
+    CHECK(d != NULL);
+    if (!d) {
+        free(heights);
+        return;
+    }
+    int whole[4] = { 0, 0, w, h };
+    topologydrift_setSeen(d, 0, 0, w, h);
+    topologydrift_update(d, heights, 0, 0, w, h);
+    CHECK(unittest_driftError(d, heights, w, h, whole) < 1e-2);
+
+    for (int y = 60; y < 75; y++) {
+        for (int x = 90; x < 120; x++)
+            heights[x + y * w] += 40;
+    }
+    topologydrift_update(d, heights, 90, 60, 120, 75);
+    CHECK(unittest_driftError(d, heights, w, h, whole) < 1e-2);
+    topologydrift_destroy(d);
+
+    d = topologydrift_create(w, h, NULL);
+    CHECK(d != NULL);
+    if (d) {
+        int seen[4] = { 31, 17, 150, 120 };
+        topologydrift_setSeen(d, seen[0], seen[1], seen[2], seen[3]);
+        topologydrift_update(d, heights, 0, 0, w, h);
+        CHECK(unittest_driftError(d, heights, w, h, seen) < 1e-2);
+        topologydrift_destroy(d);
+    }
+    free(heights);
+}
+
+static void test_heldSnapshot() {
+    // Snapshots held by readers never change, no matter how many frames
+    // are drawn meanwhile, and are only handed out again once released:
+    int screen_x = UNITTEST_WORLD_X / 2, screen_y = UNITTEST_WORLD_Y / 2;
+    unittest_initWorld();
+    unittest_drawFlat(150, screen_x, screen_y);
+    const struct topology_snapshot *held[TOPOLOGY_SNAPSHOT_MAX];
+    unsigned int generations[TOPOLOGY_SNAPSHOT_MAX];
+    int depths[TOPOLOGY_SNAPSHOT_MAX];
+    int count = 0;
+    held[count] = topology_acquireSnapshot();
+    generations[count] = held[count]->generation;
+    depths[count++] = 150;
+
+    int changed = 0, shared = 0;
+    for (int frame = 1; frame <= 3 * TOPOLOGY_SNAPSHOT_MAX; frame++) {
+        int depth = 150 + frame;
+        unittest_drawFlat(depth, screen_x, screen_y);
+        const struct topology_snapshot *s = topology_acquireSnapshot();
+        for (int i = 0; i < count; i++) {
+            if (held[i] == s)
+                shared++;
+            if (held[i]->generation != generations[i] ||
+                    topology_snapshotHeightAt(held[i], 10, 10) !=
+                    depths[i] ||
+                    topology_snapshotHeightAt(held[i], screen_x - 1,
+                    screen_y - 1) != depths[i])
+                changed++;
+        }
+        // While there are copies left, the latest frame is published.
+        // Once readers hold all of them, the held ones stay as they were:
+        if (count < TOPOLOGY_SNAPSHOT_MAX - 1)
+            CHECK(topology_snapshotHeightAt(s, 10, 10) == depth);
+        if (count < TOPOLOGY_SNAPSHOT_MAX - 1 && frame % 2 == 0) {
+            generations[count] = s->generation;
+            depths[count] = depth;
+            held[count++] = s;
+        } else {
+            topology_releaseSnapshot(s);
+        }
+    }
+    CHECK(changed == 0);
+    CHECK(shared == 0);
+    for (int i = 0; i < count; i++)
+        topology_releaseSnapshot(held[i]);
+
+    // With all of them back, drawing goes on as before:
+    unittest_drawFlat(120, screen_x, screen_y);
+    const struct topology_snapshot *s = topology_acquireSnapshot();
+    CHECK(topology_snapshotHeightAt(s, 10, 10) == 120);
+    CHECK(topology_snapshotHeightAt(s, screen_x, 10) == TOPOLOGY_WALL_HEIGHT);
+    topology_releaseSnapshot(s);
+}
+
+static double unittest_countType(const struct topology_snapshot *s,
+        int type, int x, int y, int size) {
+    // What topology_snapshotScanType() does, one pixel at a time:
+    int x0 = x - (size / 2.0);
+    int y0 = y - (size / 2.0);
+    int inside = 0, found = 0;
+    for (int sy = y0; sy < y0 + size; sy++) {
+        for (int sx = x0; sx < x0 + size; sx++) {
+            if (sx < 0 || sx >= s->map_x || sy < 0 || sy >= s->map_y)
+                continue;
+            inside++;
+            found += (s->types[sx + (size_t)sy * s->map_x] == type);
+        }
+    }
+    return (inside > 0 ? (double)found / inside : 0);
+}
+
+static void test_typeScan() {
+    // Frames drawn at several places of the world, partly outside of it,
+    // so the tables cover an area that grows between the scans:
+    unittest_initWorld();
+    unittest_initTopology();
+    int screen_x = 160, screen_y = 120;
+    SDL_Surface *image = SDL_CreateRGBSurface(0, screen_x, screen_y, 32,
+        0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff);
+    CHECK(image != NULL);
+    if (!image)
+        return;
+    SDL_Surface *old_image = images_simulation_image;
+    images_simulation_image = image;
+    uint8_t *depth = malloc(screen_x * screen_y);
+    int views[][2] = { { 0, 0 }, { 300, 200 }, { -40, -30 },
+        { 520, 400 }, { 100, 60 } };
+    int mismatches = 0;
+    for (int v = 0; v < 5; v++) {
+        simulation_setViewport(views[v][0], views[v][1]);
+        // Depths around 179 give grass, mixed with ground that isn't:
+        for (int i = 0; i < screen_x * screen_y; i++)
+            depth[i] = 150 + (int)(60 * unittest_random());
+        simulation_lockSurface();
+        topology_drawToSimImage(depth, screen_x, screen_y);
+        simulation_unlockSurface();
+
+        const struct topology_snapshot *s = topology_acquireSnapshot();
+        for (int type = 0; type < TOPOLOGY_TYPE_COUNT; type++) {
+            for (int size = 1; size <= 40; size += 13) {
+                for (int y = -20; y < s->map_y + 20; y += 7) {
+                    for (int x = -20; x < s->map_x + 20; x += 7) {
+                        if (topology_snapshotScanType(s, type, x, y, size) !=
+                                unittest_countType(s, type, x, y, size))
+                            mismatches++;
+                    }
+                }
+            }
+        }
+        int xs[3] = { 5, 320, 639 }, ys[3] = { 5, 240, 479 };
+        double out[3];
+        topology_snapshotScanTypes(s, TOPOLOGY_GRASS, xs, ys, 3, 15, out);
+        for (int i = 0; i < 3; i++) {
+            if (out[i] != unittest_countType(s, TOPOLOGY_GRASS, xs[i],
+                    ys[i], 15))
+                mismatches++;
+        }
+        topology_releaseSnapshot(s);
+    }
+    CHECK(mismatches == 0);
+    CHECK(topology_scan_type(TOPOLOGY_GRASS, 150, 110, 20) > 0);
+    simulation_setViewport(0, 0);
+    images_simulation_image = old_image;
+    SDL_FreeSurface(image);
+    free(depth);
+}
+
+static int unittest_countNot(const uint8_t *image, size_t count,
+        uint8_t value) {
+    int found = 0;
+    for (size_t i = 0; i < count; i++)
+        found += (image[i] != value);
+    return found;
+}
+
+static void test_depthFilter() {
+    // Rows of an odd width end in the scalar tail of the SIMD loops, and
+    // the rows are split into several tasks:
+    int w = 19, h = 37;
+    size_t cells = (size_t)w * h;
+    size_t spike = 7 + 20 * w;
+    uint8_t *depth = malloc(cells);
+    uint8_t *valid = malloc(cells);
+    struct depthfilter *f = depthfilter_create(w, h, workerpool_shared());
+    CHECK(f != NULL);
+    if (!f) {
+        free(depth);
+        free(valid);
+        return;
+    }
+
+    // All off passes frames on as they are:
+    for (size_t i = 0; i < cells; i++)
+        depth[i] = i % 251;
+    depthfilter_run(f, depth, NULL);
+    for (size_t i = 0; i < cells; i++)
+        CHECK(depth[i] == i % 251);
+
+    // A median of three drops a spike of a single frame, but passes on a
+    // change that stays:
+    depthfilter_reset(f);
+    depthfilter_setMedianFrames(f, 3);
+    int frames[7] = { 100, 100, 200, 100, 100, 150, 150 };
+    int expected[7] = { 100, 100, 100, 100, 100, 100, 150 };
+    for (int k = 0; k < 7; k++) {
+        memset(depth, 100, cells);
+        depth[spike] = frames[k];
+        depthfilter_run(f, depth, NULL);
+        CHECK(depth[spike] == expected[k]);
+        depth[spike] = 100;
+        CHECK(unittest_countNot(depth, cells, 100) == 0);
+    }
+
+    // Changes within the hysteresis are held back, pixels that aren't
+    // valid keep what was shown:
+    depthfilter_reset(f);
+    depthfilter_setMedianFrames(f, 1);
+    depthfilter_setSmoothing(f, 0, 2);
+    memset(depth, 100, cells);
+    depthfilter_run(f, depth, NULL);
+    memset(depth, 101, cells);
+    depthfilter_run(f, depth, NULL);
+    CHECK(unittest_countNot(depth, cells, 100) == 0);
+    memset(depth, 104, cells);
+    memset(valid, 1, cells);
+    valid[spike] = 0;
+    depthfilter_run(f, depth, valid);
+    CHECK(depth[spike] == 100);
+    depth[spike] = 104;
+    CHECK(unittest_countNot(depth, cells, 104) == 0);
+
+    // The blur spreads a single pixel over its 3 x 3 neighbours and
+    // leaves even ground as it is:
+    depthfilter_reset(f);
+    depthfilter_setSmoothing(f, 0, 0);
+    depthfilter_setBlurRadius(f, 1);
+    memset(depth, 0, cells);
+    depth[spike] = 90;
+    depthfilter_run(f, depth, NULL);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int near = (abs(x - 7) <= 1 && abs(y - 20) <= 1);
+            CHECK(depth[x + y * w] == (near ? 10 : 0));
+        }
+    }
+    depthfilter_reset(f);
+    memset(depth, 77, cells);
+    depthfilter_run(f, depth, NULL);
+    CHECK(unittest_countNot(depth, cells, 77) == 0);
+    depthfilter_destroy(f);
+    free(depth);
+    free(valid);
+}
+
+static void test_dirtyTiles() {
+    // A frame with a local change only redraws the tiles it touches, and
+    // comes out the same as drawing all of the screen again:
+    int screen_x = 160, screen_y = 120;
+    int tiles_x = (screen_x + TOPOLOGY_TILE - 1) / TOPOLOGY_TILE;
+    int tiles_y = (screen_y + TOPOLOGY_TILE - 1) / TOPOLOGY_TILE;
+    unittest_initWorld();
+    unittest_initTopology();
+    SDL_Surface *image = SDL_CreateRGBSurface(0, screen_x, screen_y, 32,
+        0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff);
+    CHECK(image != NULL);
+    if (!image)
+        return;
+    SDL_Surface *old_image = images_simulation_image;
+    images_simulation_image = image;
+    size_t pixels = (size_t)screen_x * screen_y;
+    uint8_t *depth = malloc(pixels);
+    for (size_t i = 0; i < pixels; i++)
+        depth[i] = 140 + (int)(80 * unittest_random());
+    simulation_setViewport(0, 0);
+    simulation_lockSurface();
+    topology_drawToSimImage(depth, screen_x, screen_y);
+    simulation_unlockSurface();
+
+    // The depth image comes column by column:
+    for (int x = 40; x < 50; x++) {
+        for (int y = 70; y < 76; y++)
+            depth[y + x * screen_y] ^= 0x10;
+    }
+    // Fluid and particles were drawn over the last frame:
+    memset(image->pixels, 0, sizeof(uint32_t) * pixels);
+    simulation_lockSurface();
+    topology_drawToSimImage(depth, screen_x, screen_y);
+    simulation_unlockSurface();
+    uint8_t mask[64];
+    int mask_x = 0, mask_y = 0;
+    int count = topology_getDirtyTiles(mask, 64, &mask_x, &mask_y);
+    CHECK(mask_x == tiles_x && mask_y == tiles_y);
+    CHECK(count == tiles_x * tiles_y);
+    for (int i = 0; i < count; i++)
+        CHECK((mask[i] != 0) == (i == 1 + 2 * tiles_x));
+    uint32_t *drawn = malloc(sizeof(uint32_t) * pixels);
+    memcpy(drawn, image->pixels, sizeof(uint32_t) * pixels);
+    int w = 0, h = 0;
+    double *heights = topology_copyHeights(&w, &h);
+
+    // Putting the heights back makes the next frame draw everything:
+    memset(image->pixels, 0, sizeof(uint32_t) * pixels);
+    CHECK(heights && topology_restoreHeights(heights, w, h));
+    simulation_lockSurface();
+    topology_drawToSimImage(depth, screen_x, screen_y);
+    simulation_unlockSurface();
+    count = topology_getDirtyTiles(mask, 64, &mask_x, &mask_y);
+    CHECK(count == tiles_x * tiles_y);
+    CHECK(unittest_countNot(mask, count, 1) == 0);
+    CHECK(memcmp(drawn, image->pixels, sizeof(uint32_t) * pixels) == 0);
+    double *redrawn = topology_copyHeights(&w, &h);
+    CHECK(heights && redrawn && memcmp(heights, redrawn,
+        sizeof(double) * w * h) == 0);
+
+    images_simulation_image = old_image;
+    SDL_FreeSurface(image);
+    free(depth);
+    free(drawn);
+    free(heights);
+    free(redrawn);
+}
+
+static void test_depthFill() {
+    int w = 37, h = 29;
+    size_t cells = (size_t)w * h;
+    uint8_t *depth = malloc(cells);
+    struct depthfill *f = depthfill_create(w, h, workerpool_shared());
+    CHECK(f != NULL);
+    if (!f) {
+        free(depth);
+        return;
+    }
+
+    // Without holes nothing changes:
+    for (size_t i = 0; i < cells; i++)
+        depth[i] = 1 + i % 253;
+    CHECK(depthfill_run(f, depth) == 0);
+    for (size_t i = 0; i < cells; i++) {
+        CHECK(depth[i] == 1 + i % 253);
+        CHECK(depthfill_getValid(f)[i] == 1);
+    }
+
+    // Holes in even ground, given as 0 and as 255, fill up to its level:
+    memset(depth, 123, cells);
+    depth[5 + 5 * w] = 0;
+    for (int y = 10; y < 25; y++) {
+        for (int x = 10; x < 30; x++)
+            depth[x + y * w] = 255;
+    }
+    CHECK(depthfill_run(f, depth) == 1 + 15 * 20);
+    CHECK(unittest_countNot(depth, cells, 123) == 0);
+    CHECK(depthfill_getValid(f)[5 + 5 * w] == 0);
+    CHECK(depthfill_getValid(f)[20 + 20 * w] == 0);
+    CHECK(depthfill_getValid(f)[6 + 5 * w] == 1);
+
+    // Holes in a slope take values from the slope around them, and the
+    // valid pixels are left as they are:
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++)
+            depth[x + y * w] = 40 + 4 * x;
+    }
+    for (int y = 8; y < 14; y++) {
+        for (int x = 12; x < 17; x++)
+            depth[x + y * w] = 0;
+    }
+    CHECK(depthfill_run(f, depth) == 6 * 5);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int slope = 40 + 4 * x;
+            if (y >= 8 && y < 14 && x >= 12 && x < 17)
+                CHECK(abs(depth[x + y * w] - slope) <= 2);
+            else
+                CHECK(depth[x + y * w] == slope);
+        }
+    }
+
+    // Nothing valid to fill from leaves the frame as it is:
+    memset(depth, 0, cells);
+    CHECK(depthfill_run(f, depth) == (int)cells);
+    CHECK(unittest_countNot(depth, cells, 0) == 0);
+    depthfill_destroy(f);
+    free(depth);
+}
+
+int main(int args, const char **argsv) {
+    test_workerPool();
+    test_randomStreams();
+    test_stencilVolume();
+    test_pipesVolume();
+    test_multiFluidVolume();
+    test_settleVolume();
+    test_skipDryTiles();
+    test_tileStats();
+    test_resolutionVolume();
+    test_frameHandoff();
+    test_snapshot();
+    test_unseenWalls();
+    test_driftField();
+    test_heldSnapshot();
+    test_typeScan();
+    test_depthFilter();
+    test_dirtyTiles();
+    test_depthFill();
+    if (unittest_failures > 0) {
+        printf("%d checks failed\n", unittest_failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
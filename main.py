@@ -28,9 +28,19 @@ import server
 import os
 import pickle
 import threading
+import argparse
 from PIL import Image
 from Queue import Queue
 
+parser = argparse.ArgumentParser()
+parser.add_argument("--snapshot", metavar="PATH",
+    help="resume with the water and map saved at PATH, if there")
+parser.add_argument("--autosave", metavar="SECONDS", type=float, default=0,
+    help="save a snapshot to the --snapshot path every SECONDS")
+args = parser.parse_args()
+if args.autosave > 0 and not args.snapshot:
+    parser.error("--autosave needs a --snapshot path")
+
 enable_http=True
 
 pqueue=Queue(maxsize=1)
@@ -53,6 +63,12 @@ sandbox_sim = clib_interface.SandboxSimulation()
 sandbox_sim.set_height_config(height_shift, height_scale)
 sandbox_sim.reset_map_drag()
 sandbox_sim.drag_map(map_offset_x, map_offset_y)
+# Resume with the same water and map after a restart or update, only
+# if asked for:
+if args.snapshot:
+    sandbox_sim.load_snapshot(args.snapshot)
+    if args.autosave > 0:
+        sandbox_sim.set_autosave(args.snapshot, args.autosave)
 
 def get_depth():
     """ This function obtains the depth image from the kinect, if any is